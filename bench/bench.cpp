@@ -0,0 +1,744 @@
+// Emulator benchmark suite. Runs the shipped sample programs and a set of
+// synthetic microbenchmarks on every engine, plus the reference core with
+// tracing attached, and prints the results as JSON.
+//
+// Usage: bench [--min-time=SECONDS] [--output=results.json] [--filter=name]
+//
+// Program paths are relative to the repository root (make bench runs from
+// there). Each measurement restores a snapshot taken right after loading,
+// so only guest execution is timed, never assembly or program loading.
+// Each workload is also run assembled with -O, to track what the peephole
+// optimizer saves. A workload whose guest faults is reported in its "error"
+// field and makes bench exit with status 1, since its timings are then of
+// whatever the guest ran into.
+// Assembly is measured separately: the "assembler" section times the
+// assembler itself on a generated multi-megabyte source. The "lockstep"
+// section times an input sweep of many jobs on one thread, one fast-engine
+// CPU per job against LockstepEngine batches.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../src/assembler/assembler.hpp"
+#include "../src/emulator/batch_runner.hpp"
+#include "../src/emulator/cpu.hpp"
+#include "../src/emulator/lockstep.hpp"
+#include "../src/emulator/trace_recorder.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Guards against a workload that never halts
+constexpr uint64_t RUN_BUDGET = 50000000;
+const char *const TRACE_DIR = "build/bench";
+
+struct Workload {
+  std::string name;
+  std::string kind; // "program" or "micro"
+  std::string source;
+};
+
+struct Measurement {
+  uint64_t runs = 0;
+  uint64_t instructions_per_run = 0;
+  double seconds = 0.0;
+
+  double ns_per_instruction() const {
+    uint64_t total = runs * instructions_per_run;
+    return total ? seconds * 1e9 / static_cast<double>(total) : 0.0;
+  }
+  double mips() const {
+    double ns = ns_per_instruction();
+    return ns > 0 ? 1000.0 / ns : 0.0;
+  }
+  // Wall time per run, for comparing workloads that do the same job with
+  // different instruction counts
+  double us_per_run() const {
+    return runs ? seconds * 1e6 / static_cast<double>(runs) : 0.0;
+  }
+};
+
+// ALU-only loop: register and immediate arithmetic, no memory traffic
+const char *const ALU_LOOP = R"(
+.org 0x8000
+start:
+    MOV R0, #0
+    MOV R1, #3
+    MOV R2, #20000
+loop:
+    ADD R0, R1
+    XOR R0, #0x5A5A
+    ADD R1, R0
+    AND R1, #0x00FF
+    OR R0, R1
+    SUB R2, #1
+    JNZ loop
+    HALT
+)";
+
+// Read-modify-write over a 4 KiB region of data RAM
+const char *const LOAD_STORE_LOOP = R"(
+.org 0x8000
+start:
+    MOV R3, #0x0200
+    MOV R2, #20000
+loop:
+    LOAD R0, [R3]
+    ADD R0, #1
+    STORE R0, [R3]
+    ADD R3, #2
+    AND R3, #0x0FFE
+    SUB R2, #1
+    JNZ loop
+    HALT
+)";
+
+// Recursion 64 frames deep, repeated; exercises CALL/RET and the stack
+const char *const CALL_RET_RECURSION = R"(
+.org 0x8000
+start:
+    MOV R2, #200
+outer:
+    MOV R0, #64
+    CALL recurse
+    SUB R2, #1
+    JNZ outer
+    HALT
+recurse:
+    CMP R0, #0
+    JZ base
+    PUSH R0
+    SUB R0, #1
+    CALL recurse
+    POP R0
+base:
+    RET
+)";
+
+// Stores to the memory-mapped output port
+const char *const MMIO_OUTPUT = R"(
+.org 0x8000
+start:
+    MOV R1, #0xF000
+    MOV R2, #20000
+    MOV R0, #0x41
+loop:
+    STORE R0, [R1]
+    SUB R2, #1
+    JNZ loop
+    HALT
+)";
+
+// Busy-waits on the timer counter; fast and JIT engines fast-forward it
+const char *const TIMER_SPIN = R"(
+.org 0x8000
+start:
+    MOV R0, #0xF010
+    MOV R1, #0xF011
+    MOV R2, #1
+    STORE R2, [R1]
+wait:
+    LOAD R3, [R0]
+    CMP R3, #60000
+    JC wait
+    MOV R2, #0
+    STORE R2, [R1]
+    HALT
+)";
+
+// String copied to RAM 200 times, 128 bytes at a time: a word-at-a-time
+// software loop (how guest string code copies today) versus one DMA
+// transfer per copy
+const char *const STRING_COPY_LOOP = R"(
+.org 0x8000
+start:
+    MOV R2, #200
+outer:
+    MOV R0, msg
+    MOV R1, #0x0200
+copy:
+    LOAD R3, [R0]
+    STORE R3, [R1]
+    ADD R0, #2
+    ADD R1, #2
+    CMP R1, #0x0280
+    JNZ copy
+    SUB R2, #1
+    JNZ outer
+    HALT
+msg:
+    .string "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs. Sphinx of black quartz, judge my vow...."
+)";
+
+const char *const STRING_COPY_DMA = R"(
+.org 0x8000
+start:
+    MOV R2, #200
+    MOV R0, #0x0200
+    MOV R1, msg
+    MOV R3, #128
+outer:
+    DMACOPY R0, R1, R3
+    DMAWAIT R3
+    MOV R3, #128
+    SUB R2, #1
+    JNZ outer
+    HALT
+msg:
+    .string "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs. Sphinx of black quartz, judge my vow...."
+)";
+
+// Recursive factorial in the style of naive compiler output: values
+// shuffled through the stack, identity arithmetic and "if" lowered to
+// jumps to jumps. The peephole optimizer's target.
+const char *const COMPILED_FACTORIAL = R"(
+    MOV R3, #200
+outer:
+    MOV R0, #7
+    CALL factorial
+    SUB R3, #1
+    JNZ outer
+    HALT
+factorial:
+    MOV R0, R0
+    CMP R0, #1
+    JZ factorial_base
+    JC factorial_base
+    JMP factorial_recurse
+factorial_recurse:
+    PUSH R0
+    POP R1              ; t1 = n
+    PUSH R1
+    SUB R0, #1
+    ADD R0, #0
+    CALL factorial      ; t0 = factorial(n - 1)
+    POP R1
+    PUSH R1
+    POP R1
+    CALL multiply       ; return t0 * t1
+    JMP factorial_exit
+factorial_base:
+    MOV R0, #1
+    JMP factorial_exit
+factorial_exit:
+    JMP factorial_ret
+factorial_ret:
+    RET
+multiply:               ; R0 = R0 * R1, shift and add
+    MOV R2, #0
+multiply_loop:
+    CMP R1, #0
+    JZ multiply_done
+    PUSH R1
+    AND R1, #1
+    JZ multiply_skip
+    ADD R2, R0
+multiply_skip:
+    POP R1
+    SHL R0, #1
+    SHR R1, #1
+    JMP multiply_loop
+multiply_done:
+    MOV R0, R2
+    RET
+)";
+
+// Input sweep for the lockstep section: every job runs this on its own two
+// input bytes. The shift-and-add multiply branches on the data and the
+// final loop runs a data-dependent number of times, so lanes diverge and
+// rejoin.
+const char *const INPUT_SWEEP = R"(
+.org 0x8000
+start:
+    IN R0, #1
+    IN R1, #1
+    STORE R0, [#0x1000]
+    STORE R1, [#0x1002]
+    MOV R3, #20
+    STORE R3, [#0x1004]
+round:
+    LOAD R0, [#0x1000]
+    LOAD R1, [#0x1002]
+    MOV R2, #0
+    MOV R3, #8
+multiply:
+    PUSH R3
+    MOV R3, R1
+    AND R3, #1
+    JZ skip
+    ADD R2, R0
+skip:
+    SHL R0, #1
+    SHR R1, #1
+    POP R3
+    SUB R3, #1
+    JNZ multiply
+    AND R2, #0x3F
+    MOV R1, #0
+sum:
+    CMP R2, #0
+    JZ summed
+    ADD R1, R2
+    SUB R2, #1
+    JMP sum
+summed:
+    LOAD R3, [#0x1004]
+    SUB R3, #1
+    STORE R3, [#0x1004]
+    JNZ round
+    OUT R1, #0
+    HALT
+)";
+constexpr size_t SWEEP_JOBS = 1024;
+
+// math.asm is a library with no entry point; this is prepended to it so
+// the benchmark calls multiply instead of running off its final RET
+const char *const MATH_DRIVER = R"(
+.org 0x8000
+start:
+    MOV R3, #2000
+drive:
+    PUSH R3
+    MOV R0, R3
+    MOV R1, #0x5A
+    CALL multiply
+    POP R3
+    SUB R3, #1
+    JNZ drive
+    HALT
+)";
+
+std::string read_text(const std::string &path) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("Cannot open " + path);
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+std::vector<Workload> make_workloads() {
+  std::vector<Workload> workloads;
+  // Name, path and the driver prepended to the file, if any
+  const char *const programs[][3] = {
+      {"fibonacci", "src/programs/fibonacci.asm", ""},
+      {"factorial", "src/programs/factorial.asm", ""},
+      {"math", "src/programs/math.asm", MATH_DRIVER},
+      {"test_multiply", "tests/assembly/test_multiply.asm", ""},
+  };
+  for (const auto &p : programs)
+    workloads.push_back({p[0], "program", p[2] + read_text(p[1])});
+  workloads.push_back({"alu_loop", "micro", ALU_LOOP});
+  workloads.push_back({"load_store_loop", "micro", LOAD_STORE_LOOP});
+  workloads.push_back({"call_ret_recursion", "micro", CALL_RET_RECURSION});
+  workloads.push_back({"mmio_output", "micro", MMIO_OUTPUT});
+  workloads.push_back({"timer_spin", "micro", TIMER_SPIN});
+  workloads.push_back({"string_copy_loop", "micro", STRING_COPY_LOOP});
+  workloads.push_back({"string_copy_dma", "micro", STRING_COPY_DMA});
+  workloads.push_back({"compiled_factorial", "micro", COMPILED_FACTORIAL});
+  return workloads;
+}
+
+// Assembler input: ASSEMBLER_BLOCKS copies of a block with unique labels,
+// forward and backward references, a .word and a .string, so the lexer,
+// symbol table and both passes all see realistic work
+constexpr int ASSEMBLER_BLOCKS = 20000;
+
+std::string make_assembler_source(int blocks) {
+  std::string out;
+  char buf[512];
+  for (int i = 0; i < blocks; ++i) {
+    std::snprintf(buf, sizeof(buf),
+                  "block_%d:\n"
+                  "    MOV R0, #%d        ; load counter\n"
+                  "    MOV R1, #0x%04X\n"
+                  "loop_%d:\n"
+                  "    ADD R0, R1\n"
+                  "    SUB R1, #1\n"
+                  "    CMP R1, #0\n"
+                  "    JNZ loop_%d\n"
+                  "    STORE R0, [data_%d]\n"
+                  "    LOAD R2, [R3]\n"
+                  "    CALL helper\n"
+                  "    PUSH R2\n"
+                  "    POP R3\n"
+                  "data_%d:\n"
+                  "    .word block_%d\n"
+                  "    .string \"Block %d done\\n\"\n",
+                  i, i % 1000, i % 65536, i, i, i, i, i, i);
+    out += buf;
+  }
+  out += "helper:\n    RET\n    HALT\n";
+  return out;
+}
+
+// Runs `jobs` on one thread until at least min_time seconds have passed;
+// lanes == 0 runs one CPU per job, otherwise LockstepEngine batches
+Measurement measure_batch(const std::vector<BatchJob> &jobs,
+                          CPU::Engine engine, size_t lanes, double min_time) {
+  BatchRunner runner(1, engine);
+  runner.set_lockstep_lanes(lanes);
+  Measurement m;
+  m.instructions_per_run = runner.run(jobs).total_instructions; // Warm-up
+  while (m.seconds < min_time || m.runs == 0) {
+    m.seconds += runner.run(jobs).wall_seconds;
+    ++m.runs;
+  }
+  return m;
+}
+
+struct AssemblerMeasurement {
+  uint64_t runs = 0;
+  double seconds = 0.0;
+  size_t output_bytes = 0;
+};
+
+// Repeats assembly of `source` until at least min_time seconds have passed
+AssemblerMeasurement measure_assembler(const std::string &source,
+                                       bool with_map, double min_time) {
+  AssemblerMeasurement m;
+  std::vector<SourceMapEntry> map;
+  m.output_bytes = assemble(source).size(); // Warm-up
+  while (m.seconds < min_time || m.runs == 0) {
+    auto start = Clock::now();
+    std::vector<uint8_t> code = assemble(source, with_map ? &map : nullptr);
+    m.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+    ++m.runs;
+  }
+  return m;
+}
+
+// Keeps a faulting workload from printing its CPU error once per timed run;
+// measure() reports the error instead
+class SilenceStderr {
+public:
+  SilenceStderr() : saved_(std::cerr.rdbuf(null_.rdbuf())) {}
+  ~SilenceStderr() { std::cerr.rdbuf(saved_); }
+
+private:
+  std::ostringstream null_;
+  std::streambuf *saved_;
+};
+
+// Repeats the workload until at least min_time seconds of guest execution
+// have been measured. `error` gets the run's CPU error unless it already
+// holds one. A trace format means the reference core runs with a
+// fresh recorder per run; writing the trace out is part of the timed run.
+Measurement measure(const std::vector<uint8_t> &program, CPU::Engine engine,
+                    const TraceRecorder::Format *trace_format,
+                    double min_time, std::string &error) {
+  CPU cpu;
+  cpu.set_engine(trace_format ? CPU::Engine::Reference : engine);
+  cpu.set_output_callback([](uint8_t) {});
+  cpu.load_program(program);
+  CPU::Snapshot loaded = cpu.snapshot();
+
+  std::string trace_path;
+  if (trace_format)
+    trace_path = std::string(TRACE_DIR) +
+                 (*trace_format == TraceRecorder::Format::Json ? "/trace.json"
+                                                               : "/trace.bin");
+
+  auto run_once = [&]() {
+    cpu.restore(loaded);
+    std::shared_ptr<TraceRecorder> recorder;
+    auto start = Clock::now();
+    if (trace_format) {
+      recorder = std::make_shared<TraceRecorder>();
+      recorder->set_output_path(trace_path);
+      recorder->set_format(*trace_format);
+      cpu.set_trace_recorder(recorder);
+    }
+    cpu.run(RUN_BUDGET);
+    if (recorder) {
+      cpu.set_trace_recorder(nullptr);
+      recorder.reset(); // Flushes and closes the trace file
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  };
+
+  SilenceStderr quiet;
+  run_once(); // Warm-up: fills the decode cache and compiles JIT blocks
+
+  Measurement m;
+  m.instructions_per_run = cpu.get_cycle_count();
+  if (error.empty())
+    error = cpu.get_last_error();
+  while (m.seconds < min_time || m.runs == 0) {
+    m.seconds += run_once();
+    ++m.runs;
+  }
+  return m;
+}
+
+std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out + "\"";
+}
+
+std::string json_measurement(const Measurement &m) {
+  char buf[256];
+  std::snprintf(buf, sizeof(buf),
+                "{\"runs\": %llu, \"seconds\": %.6f, \"mips\": %.3f, "
+                "\"ns_per_instruction\": %.3f, \"us_per_run\": %.3f}",
+                static_cast<unsigned long long>(m.runs), m.seconds, m.mips(),
+                m.ns_per_instruction(), m.us_per_run());
+  return buf;
+}
+
+void print_usage(const char *name) {
+  std::cerr << "Usage: " << name
+            << " [--min-time=SECONDS] [--output=results.json] [--filter=name]"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  double min_time = 0.2;
+  std::string output_path;
+  std::string filter;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--min-time=", 0) == 0) {
+      min_time = std::stod(arg.substr(11));
+    } else if (arg.rfind("--output=", 0) == 0) {
+      output_path = arg.substr(9);
+    } else if (arg.rfind("--filter=", 0) == 0) {
+      filter = arg.substr(9);
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Workload> workloads;
+  try {
+    workloads = make_workloads();
+  } catch (const std::exception &ex) {
+    std::cerr << "bench: " << ex.what()
+              << " (run from the repository root)" << std::endl;
+    return 1;
+  }
+  std::filesystem::create_directories(TRACE_DIR);
+
+  const std::pair<const char *, CPU::Engine> engines[] = {
+      {"reference", CPU::Engine::Reference},
+      {"fast", CPU::Engine::Fast},
+      {"jit", CPU::Engine::Jit},
+  };
+  const TraceRecorder::Format json = TraceRecorder::Format::Json;
+  const TraceRecorder::Format binary = TraceRecorder::Format::Binary;
+
+  std::string out = "{\n";
+  char buf[256];
+  std::snprintf(buf, sizeof(buf), "  \"min_time_seconds\": %.3f,\n", min_time);
+  out += buf;
+  out += "  \"workloads\": [\n";
+  bool first = true;
+  uint64_t peephole_saved = 0; // Instructions -O saves across the suite
+  std::vector<std::string> failed; // Workloads whose guest faulted
+  for (const Workload &w : workloads) {
+    if (!filter.empty() && w.name.find(filter) == std::string::npos)
+      continue;
+    std::cerr << "bench: " << w.name << std::endl;
+
+    std::vector<uint8_t> program = assemble(w.source);
+    std::string error;
+    std::string engine_json;
+    Measurement reference;
+    for (const auto &e : engines) {
+      Measurement m = measure(program, e.second, nullptr, min_time, error);
+      if (e.second == CPU::Engine::Reference)
+        reference = m;
+      if (!engine_json.empty())
+        engine_json += ",\n";
+      engine_json += "        " + json_string(e.first) + ": " +
+                     json_measurement(m);
+    }
+
+    std::string traced_json;
+    for (const TraceRecorder::Format *format : {&binary, &json}) {
+      Measurement m = measure(program, CPU::Engine::Reference, format,
+                              min_time, error);
+      double overhead =
+          reference.ns_per_instruction() > 0
+              ? m.ns_per_instruction() / reference.ns_per_instruction()
+              : 0.0;
+      std::string m_json = json_measurement(m);
+      m_json.pop_back();
+      std::snprintf(buf, sizeof(buf), ", \"overhead_vs_untraced\": %.2f}",
+                    overhead);
+      if (!traced_json.empty())
+        traced_json += ",\n";
+      traced_json += std::string("        ") +
+                     (format == &json ? "\"json\"" : "\"binary\"") + ": " +
+                     m_json + buf;
+    }
+
+    // The same workload assembled with the peephole optimizer (-O)
+    PeepholeStats peephole;
+    AssemblerOptions options;
+    options.optimize = true;
+    options.stats = &peephole;
+    std::string optimized_error;
+    Measurement optimized =
+        measure(assemble(w.source, nullptr, options), CPU::Engine::Reference,
+                nullptr, min_time, optimized_error);
+    std::string optimized_json;
+    if (!error.empty() || !optimized_error.empty()) {
+      // A faulting run executes whatever it lands on, so the instruction
+      // counts of the two builds cannot be compared
+      optimized_json = "{\"error\": " +
+                       json_string(optimized_error.empty() ? error
+                                                           : optimized_error) +
+                       "}";
+    } else {
+      int64_t saved = static_cast<int64_t>(reference.instructions_per_run) -
+                      static_cast<int64_t>(optimized.instructions_per_run);
+      if (saved > 0)
+        peephole_saved += static_cast<uint64_t>(saved);
+      std::snprintf(
+          buf, sizeof(buf),
+          "{\"bytes_saved\": %zu, \"instructions_per_run\": %llu, "
+          "\"instructions_saved\": %lld, ",
+          peephole.bytes_saved,
+          static_cast<unsigned long long>(optimized.instructions_per_run),
+          static_cast<long long>(saved));
+      optimized_json = buf;
+      optimized_json += "\"error\": \"\", \"reference\": " +
+                        json_measurement(optimized) + "}";
+    }
+
+    out += first ? "" : ",\n";
+    first = false;
+    out += "    {\n      \"name\": " + json_string(w.name) + ",\n";
+    out += "      \"kind\": " + json_string(w.kind) + ",\n";
+    std::snprintf(buf, sizeof(buf), "      \"instructions_per_run\": %llu,\n",
+                  static_cast<unsigned long long>(reference.instructions_per_run));
+    out += buf;
+    out += "      \"error\": " + json_string(error) + ",\n";
+    out += "      \"engines\": {\n" + engine_json + "\n      },\n";
+    out += "      \"traced\": {\n" + traced_json + "\n      },\n";
+    out += "      \"optimized\": " + optimized_json + "\n    }";
+    if (!error.empty() || !optimized_error.empty()) {
+      std::cerr << "bench: " << w.name << " failed: "
+                << (error.empty() ? optimized_error + " (-O)" : error)
+                << std::endl;
+      failed.push_back(w.name);
+    }
+  }
+  out += "\n  ],\n";
+  std::snprintf(buf, sizeof(buf), "  \"peephole_instructions_saved\": %llu",
+                static_cast<unsigned long long>(peephole_saved));
+  out += buf;
+
+  if (filter.empty() ||
+      std::string("lockstep").find(filter) != std::string::npos) {
+    std::cerr << "bench: lockstep" << std::endl;
+    std::vector<BatchJob> jobs(SWEEP_JOBS);
+    std::vector<uint8_t> program = assemble(INPUT_SWEEP);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      jobs[i].name = "sweep" + std::to_string(i);
+      jobs[i].program = program;
+      jobs[i].input = {static_cast<char>(i & 0xFF), static_cast<char>(i >> 2)};
+    }
+    std::vector<const BatchJob *> lanes;
+    for (size_t i = 0; i < LockstepEngine::DEFAULT_LANES; ++i)
+      lanes.push_back(&jobs[i]);
+    LockstepEngine engine;
+    engine.run(lanes);
+    const LockstepEngine::Stats &stats = engine.stats();
+
+    Measurement scalar = measure_batch(jobs, CPU::Engine::Fast, 0, min_time);
+    Measurement lockstep = measure_batch(
+        jobs, CPU::Engine::Fast, LockstepEngine::DEFAULT_LANES, min_time);
+    out += ",\n  \"lockstep\": {\n";
+    std::snprintf(
+        buf, sizeof(buf),
+        "    \"jobs\": %zu,\n    \"lanes\": %zu,\n"
+        "    \"instructions_per_run\": %llu,\n"
+        "    \"lanes_per_dispatch\": %.2f,\n    \"handovers\": %llu,\n",
+        jobs.size(), LockstepEngine::DEFAULT_LANES,
+        static_cast<unsigned long long>(scalar.instructions_per_run),
+        stats.dispatches ? static_cast<double>(stats.instructions) /
+                               static_cast<double>(stats.dispatches)
+                         : 0.0,
+        static_cast<unsigned long long>(stats.handovers));
+    out += buf;
+    out += "    \"fast\": " + json_measurement(scalar) + ",\n";
+    out += "    \"lockstep\": " + json_measurement(lockstep) + ",\n";
+    std::snprintf(buf, sizeof(buf), "    \"speedup_vs_fast\": %.2f\n  }",
+                  lockstep.ns_per_instruction() > 0
+                      ? scalar.ns_per_instruction() /
+                            lockstep.ns_per_instruction()
+                      : 0.0);
+    out += buf;
+  }
+
+  if (filter.empty() ||
+      std::string("assembler").find(filter) != std::string::npos) {
+    std::cerr << "bench: assembler" << std::endl;
+    std::string source = make_assembler_source(ASSEMBLER_BLOCKS);
+    uint64_t lines = 0;
+    for (char c : source)
+      lines += c == '\n';
+    out += ",\n  \"assembler\": {\n";
+    std::snprintf(buf, sizeof(buf),
+                  "    \"source_bytes\": %zu,\n    \"source_lines\": %llu,\n",
+                  source.size(), static_cast<unsigned long long>(lines));
+    out += buf;
+    const std::pair<const char *, bool> variants[] = {{"assemble", false},
+                                                      {"with_source_map", true}};
+    bool first_variant = true;
+    for (const auto &v : variants) {
+      AssemblerMeasurement m = measure_assembler(source, v.second, min_time);
+      double per_run = m.seconds / static_cast<double>(m.runs);
+      std::snprintf(buf, sizeof(buf),
+                    "    \"%s\": {\"runs\": %llu, \"seconds\": %.6f, "
+                    "\"output_bytes\": %zu, \"mb_per_second\": %.3f, "
+                    "\"lines_per_second\": %.0f}",
+                    v.first, static_cast<unsigned long long>(m.runs), m.seconds,
+                    m.output_bytes,
+                    static_cast<double>(source.size()) / per_run / 1e6,
+                    static_cast<double>(lines) / per_run);
+      out += first_variant ? "" : ",\n";
+      first_variant = false;
+      out += buf;
+    }
+    out += "\n  }";
+  }
+  out += "\n}\n";
+
+  std::cout << out;
+  if (!output_path.empty()) {
+    std::ofstream file(output_path);
+    if (!file) {
+      std::cerr << "bench: cannot write " << output_path << std::endl;
+      return 1;
+    }
+    file << out;
+  }
+  // Timings of a guest that faulted measure whatever it ran into
+  if (!failed.empty()) {
+    std::cerr << "bench: " << failed.size() << " workload(s) failed"
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
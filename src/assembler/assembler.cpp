@@ -1,20 +1,56 @@
 #include "assembler.hpp"
 
-#include <cctype>
+#include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
-#include <sstream>
+#include <cstring>
+#include <deque>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 
 namespace {
 
+// ASCII-only case folding; mnemonics, registers and labels are
+// case-insensitive and labels are reported in upper case.
+constexpr char to_upper(char c) {
+  return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+}
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+bool is_alnum(char c) { return is_alpha(c) || is_digit(c); }
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+std::string upper(std::string_view s) {
+  std::string out(s);
+  for (char &c : out)
+    c = to_upper(c);
+  return out;
+}
+
+// Case-insensitive string compare (ASCII only), used for mnemonics.
+bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size())
+    return false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (to_upper(a[i]) != to_upper(b[i]))
+      return false;
+  }
+  return true;
+}
+
 // A very small token type for this scratch assembler. We only care about
 // identifiers (mnemonics, directives, labels), numbers, registers, and a
-// few punctuation tokens.
+// few punctuation tokens. Token text points into the source.
 struct Token {
   enum class Type {
     Identifier,
@@ -26,69 +62,47 @@ struct Token {
     LBracket,
     RBracket,
   } type;
-  std::string text;
+  std::string_view text;
 };
 
-// Trim leading and trailing whitespace from a string.
-std::string trim(const std::string &s) {
-  std::size_t start = s.find_first_not_of(" \t\r\n");
-  if (start == std::string::npos)
-    return "";
-  std::size_t end = s.find_last_not_of(" \t\r\n");
-  return s.substr(start, end - start + 1);
-}
-
-// Case-insensitive string compare (ASCII only), used for mnemonics.
-bool iequals(const std::string &a, const std::string &b) {
-  if (a.size() != b.size())
-    return false;
-  for (std::size_t i = 0; i < a.size(); ++i) {
-    if (std::toupper(static_cast<unsigned char>(a[i])) !=
-        std::toupper(static_cast<unsigned char>(b[i]))) {
-      return false;
-    }
-  }
-  return true;
-}
-
-// Turn one source line into a sequence of tokens.
+// Turn one source line into a sequence of tokens, reusing `tokens`.
 // Comments starting with ';' are stripped before tokenizing.
-std::vector<Token> tokenize_line(const std::string &line) {
-  std::vector<Token> tokens;
-
+void tokenize_line(std::string_view line, std::vector<Token> &tokens) {
+  tokens.clear();
   std::size_t comment_pos = line.find(';');
-  std::string work =
-      (comment_pos == std::string::npos) ? line : line.substr(0, comment_pos);
+  std::string_view work = line.substr(0, comment_pos);
 
   std::size_t i = 0;
   while (i < work.size()) {
     char c = work[i];
-    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-      ++i;
-      continue;
-    }
-    if (c == ',') {
-      tokens.push_back({Token::Type::Comma, ","});
-      ++i;
-      continue;
-    }
-    if (c == ':') {
-      tokens.push_back({Token::Type::Colon, ":"});
-      ++i;
-      continue;
-    }
-    if (c == '#') {
-      tokens.push_back({Token::Type::Hash, "#"});
+    if (is_space(c)) {
       ++i;
       continue;
     }
-    if (c == '[') {
-      tokens.push_back({Token::Type::LBracket, "["});
-      ++i;
-      continue;
+    Token::Type punct;
+    bool is_punct = true;
+    switch (c) {
+    case ',':
+      punct = Token::Type::Comma;
+      break;
+    case ':':
+      punct = Token::Type::Colon;
+      break;
+    case '#':
+      punct = Token::Type::Hash;
+      break;
+    case '[':
+      punct = Token::Type::LBracket;
+      break;
+    case ']':
+      punct = Token::Type::RBracket;
+      break;
+    default:
+      is_punct = false;
+      break;
     }
-    if (c == ']') {
-      tokens.push_back({Token::Type::RBracket, "]"});
+    if (is_punct) {
+      tokens.push_back({punct, work.substr(i, 1)});
       ++i;
       continue;
     }
@@ -108,8 +122,7 @@ std::vector<Token> tokenize_line(const std::string &line) {
         throw std::runtime_error("Unterminated string literal");
       }
       ++i; // Include closing quote
-      tokens.push_back(
-          {Token::Type::Identifier, work.substr(start, i - start)});
+      tokens.push_back({Token::Type::Identifier, work.substr(start, i - start)});
       continue;
     }
 
@@ -133,67 +146,209 @@ std::vector<Token> tokenize_line(const std::string &line) {
     }
 
     // Numeric literal: decimal, hex (0x...), or binary (0b...)
-    if (std::isdigit(static_cast<unsigned char>(c))) {
+    if (is_digit(c)) {
       std::size_t start = i;
       ++i;
-      while (i < work.size() &&
-             (std::isalnum(static_cast<unsigned char>(work[i])) ||
-              work[i] == 'x' || work[i] == 'X')) {
+      while (i < work.size() && is_alnum(work[i]))
         ++i;
-      }
       tokens.push_back({Token::Type::Number, work.substr(start, i - start)});
       continue;
     }
     // Identifiers / directives (allow leading '.' for directives like .org)
-    if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '.') {
+    if (is_alpha(c) || c == '_' || c == '.') {
       std::size_t start = i;
       ++i;
       while (i < work.size() &&
-             (std::isalnum(static_cast<unsigned char>(work[i])) ||
-              work[i] == '_' || work[i] == '.')) {
+             (is_alnum(work[i]) || work[i] == '_' || work[i] == '.')) {
         ++i;
       }
-      std::string ident = work.substr(start, i - start);
-      std::string upper;
-      upper.reserve(ident.size());
-      for (char ch : ident)
-        upper.push_back(
-            static_cast<char>(std::toupper(static_cast<unsigned char>(ch))));
-      if (upper == "R0" || upper == "R1" || upper == "R2" || upper == "R3") {
-        tokens.push_back({Token::Type::Register, upper});
-      } else {
-        tokens.push_back({Token::Type::Identifier, upper});
-      }
+      std::string_view ident = work.substr(start, i - start);
+      bool is_register = ident.size() == 2 && to_upper(ident[0]) == 'R' &&
+                         ident[1] >= '0' && ident[1] <= '3';
+      tokens.push_back(
+          {is_register ? Token::Type::Register : Token::Type::Identifier, ident});
       continue;
     }
     throw std::runtime_error("Unexpected character in source line");
   }
-  return tokens;
 }
 
+// Mnemonics, built-in macros and directives. Instruction entries have their
+// opcode as value.
+enum class Op : std::uint8_t {
+  NOP, HALT, MOV, LOAD, STORE, ADD, SUB, AND, OR, XOR, CMP, SHL, SHR,
+  JMP, JZ, JNZ, JC, JNC, JN, CALL, RET, PUSH, POP, IN, OUT,
+  DMACOPY, DMAFILL, DMAWAIT,
+  ORG, WORD, STRING, GLOBAL,
+  NONE
+};
+
+struct Mnemonic {
+  std::string_view name;
+  Op op;
+};
+
+constexpr Mnemonic MNEMONICS[] = {
+    {"NOP", Op::NOP},         {"HALT", Op::HALT},       {"MOV", Op::MOV},
+    {"LOAD", Op::LOAD},       {"STORE", Op::STORE},     {"ADD", Op::ADD},
+    {"SUB", Op::SUB},         {"AND", Op::AND},         {"OR", Op::OR},
+    {"XOR", Op::XOR},         {"CMP", Op::CMP},         {"SHL", Op::SHL},
+    {"SHR", Op::SHR},         {"JMP", Op::JMP},         {"JZ", Op::JZ},
+    {"JNZ", Op::JNZ},         {"JC", Op::JC},           {"JNC", Op::JNC},
+    {"JN", Op::JN},           {"CALL", Op::CALL},       {"RET", Op::RET},
+    {"PUSH", Op::PUSH},       {"POP", Op::POP},         {"IN", Op::IN},
+    {"OUT", Op::OUT},         {"DMACOPY", Op::DMACOPY}, {"DMAFILL", Op::DMAFILL},
+    {"DMAWAIT", Op::DMAWAIT}, {".ORG", Op::ORG},        {".WORD", Op::WORD},
+    {".STRING", Op::STRING},  {".GLOBAL", Op::GLOBAL},
+};
+
+// Perfect hash over the names above: the static_assert below fails the
+// build if a new name collides, in which case adjust the multipliers.
+constexpr std::size_t MNEMONIC_SLOTS = 64;
+constexpr std::size_t mnemonic_hash(std::string_view name) {
+  return (name.size() * 2 + static_cast<unsigned char>(to_upper(name[0])) * 42 +
+          static_cast<unsigned char>(to_upper(name[1])) * 23 +
+          static_cast<unsigned char>(to_upper(name[name.size() - 1]))) %
+         MNEMONIC_SLOTS;
+}
+
+struct MnemonicTable {
+  std::array<std::int8_t, MNEMONIC_SLOTS> slots{};
+  bool perfect = true;
+};
+
+constexpr MnemonicTable build_mnemonic_table() {
+  MnemonicTable table;
+  for (std::size_t i = 0; i < MNEMONIC_SLOTS; ++i)
+    table.slots[i] = -1;
+  for (std::size_t i = 0; i < sizeof(MNEMONICS) / sizeof(MNEMONICS[0]); ++i) {
+    std::size_t h = mnemonic_hash(MNEMONICS[i].name);
+    if (table.slots[h] >= 0)
+      table.perfect = false;
+    table.slots[h] = static_cast<std::int8_t>(i);
+  }
+  return table;
+}
+
+constexpr MnemonicTable MNEMONIC_TABLE = build_mnemonic_table();
+static_assert(MNEMONIC_TABLE.perfect, "mnemonic hash has collisions");
+
+Op lookup_mnemonic(std::string_view name) {
+  if (name.size() < 2)
+    return Op::NONE;
+  std::int8_t slot = MNEMONIC_TABLE.slots[mnemonic_hash(name)];
+  if (slot < 0 || !iequals(MNEMONICS[slot].name, name))
+    return Op::NONE;
+  return MNEMONICS[slot].op;
+}
+
+bool is_instruction(Op op) { return op <= Op::OUT; }
+bool is_macro(Op op) { return op >= Op::DMACOPY && op <= Op::DMAWAIT; }
+
+// Labels, interned once per distinct (upper-cased) name; lines and operands
+// refer to them by index.
+class SymbolTable {
+public:
+  static constexpr std::uint32_t NONE = ~0u;
+
+  std::uint32_t intern(std::string_view name) {
+    auto it = index_.find(name);
+    if (it != index_.end())
+      return it->second;
+    std::uint32_t id = static_cast<std::uint32_t>(entries_.size());
+    entries_.push_back({upper(name), 0, false});
+    index_.emplace(entries_.back().name, id);
+    return id;
+  }
+
+  const std::string &name(std::uint32_t id) const { return entries_[id].name; }
+  bool defined(std::uint32_t id) const { return entries_[id].defined; }
+  std::uint16_t value(std::uint32_t id) const { return entries_[id].value; }
+  void define(std::uint32_t id, std::uint16_t value) {
+    entries_[id].value = value;
+    entries_[id].defined = true;
+  }
+  // Value and defined flag in one word, for spotting changes between builds
+  std::uint32_t state(std::uint32_t id) const {
+    return entries_[id].defined ? 0x10000u | entries_[id].value : 0;
+  }
+  std::size_t size() const { return entries_.size(); }
+  void undefine_all() {
+    for (Entry &e : entries_)
+      e.defined = false;
+  }
+
+private:
+  struct Entry {
+    std::string name;
+    std::uint16_t value;
+    bool defined;
+  };
+  // Hashes and compares case-insensitively, so source text is looked up
+  // without folding it first
+  struct FoldedHash {
+    std::size_t operator()(std::string_view s) const {
+      std::size_t h = 14695981039346656037ull; // FNV-1a
+      for (char c : s)
+        h = (h ^ static_cast<unsigned char>(to_upper(c))) * 1099511628211ull;
+      return h;
+    }
+  };
+  struct FoldedEqual {
+    bool operator()(std::string_view a, std::string_view b) const {
+      return iequals(a, b);
+    }
+  };
+  std::deque<Entry> entries_; // Stable addresses back the index's keys
+  std::unordered_map<std::string_view, std::uint32_t, FoldedHash, FoldedEqual>
+      index_;
+};
+
 // Operand in a parsed line: register, immediate (#num), label reference,
-// or plain number (for .word / absolute addresses).
+// or plain number (for .word / absolute addresses). String literals are
+// Label operands with no symbol.
 struct Operand {
   enum class Kind { Reg, Imm, Label, Number, IndirectReg, Direct } kind;
-  std::string text;
+  std::string_view text;
+  std::uint32_t symbol = SymbolTable::NONE; // Label / [label] operands
 };
 
-// Parsed representation of a source line after tokenization.
+// Parsed representation of a source line after tokenization. Operands live
+// in one arena shared by all lines.
 // Example:
 //   start: ADD R0, #1
 // becomes
-//   label = "START", op = "ADD", operands = [Reg R0, Imm 1]
+//   label = START, op = ADD, operands = [Reg R0, Imm 1]
 struct Line {
-  std::string label; // empty if none
-  std::string op;    // uppercased mnemonic or directive (e.g. "ADD", ".ORG")
+  std::uint32_t label = SymbolTable::NONE;
+  Op op = Op::NONE;
+  std::string_view op_text; // Empty for label-only lines
   bool is_directive = false;
+  std::uint32_t first_operand = 0;
+  std::uint32_t operand_count = 0;
+  int line_number = 0;      // Source line number for error reporting
+  std::string_view source;  // Raw source line, for the source map
+  std::uint32_t source_offset = 0; // Where the raw line starts in the source
+};
+
+struct Program {
+  std::vector<Line> lines;
   std::vector<Operand> operands;
-  int line_number = 0; // Source line number for error reporting
+  SymbolTable symbols;
+  std::uint32_t internal_labels = 0; // Names handed out by expand_macro
+
+  const Operand &operand(const Line &l, std::size_t i) const {
+    return operands[l.first_operand + i];
+  }
+  // Mnemonic as written, upper-cased unless it is a string literal
+  std::string op_name(const Line &l) const {
+    return l.op_text[0] == '"' ? std::string(l.op_text) : upper(l.op_text);
+  }
 };
 
 // Parse a numeric literal into a 16-bit value.
 // Supports: decimal (123), hex (0x1F), binary (0b1010), character ('A')
-std::uint16_t parse_number16(const std::string &text) {
+std::uint16_t parse_number16(std::string_view text) {
   if (text.empty()) {
     throw std::runtime_error("Empty numeric literal");
   }
@@ -224,74 +379,70 @@ std::uint16_t parse_number16(const std::string &text) {
                                  std::string(1, c));
       }
     } else {
-      throw std::runtime_error("Invalid character literal: " + text);
+      throw std::runtime_error("Invalid character literal: " + std::string(text));
     }
   }
 
+  std::uint32_t val = 0;
   // Binary literal: 0b1010
   if (text.size() > 2 && text[0] == '0' && (text[1] == 'b' || text[1] == 'B')) {
-    std::uint16_t val = 0;
     for (std::size_t i = 2; i < text.size(); ++i) {
       if (text[i] != '0' && text[i] != '1') {
-        throw std::runtime_error("Invalid binary literal: " + text);
+        throw std::runtime_error("Invalid binary literal: " + std::string(text));
       }
-      val = (val << 1) | (text[i] - '0');
+      val = (val << 1) | static_cast<std::uint32_t>(text[i] - '0');
       if (val > 0xFFFF) {
-        throw std::runtime_error("Binary literal out of 16-bit range: " + text);
+        throw std::runtime_error("Binary literal out of 16-bit range: " +
+                                 std::string(text));
       }
     }
-    return val;
+    return static_cast<std::uint16_t>(val);
   }
 
   // Hexadecimal: 0x1F
   if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
-    try {
-      unsigned long val = std::stoul(text, nullptr, 16);
+    for (std::size_t i = 2; i < text.size(); ++i) {
+      char c = to_upper(text[i]);
+      std::uint32_t digit;
+      if (is_digit(c))
+        digit = static_cast<std::uint32_t>(c - '0');
+      else if (c >= 'A' && c <= 'F')
+        digit = static_cast<std::uint32_t>(c - 'A' + 10);
+      else
+        throw std::runtime_error("Invalid hexadecimal literal: " + std::string(text));
+      val = val * 16 + digit;
       if (val > 0xFFFF) {
         throw std::runtime_error("Hexadecimal value out of 16-bit range: " +
-                                 text);
+                                 std::string(text));
       }
-      return static_cast<std::uint16_t>(val);
-    } catch (const std::exception &e) {
-      throw std::runtime_error("Invalid hexadecimal literal: " + text);
     }
+    return static_cast<std::uint16_t>(val);
   }
 
   // Decimal: 123
-  try {
-    int val = std::stoi(text, nullptr, 10);
-    if (val < 0) {
-      throw std::runtime_error("Negative values not supported: " + text);
-    }
+  for (char c : text) {
+    if (!is_digit(c))
+      throw std::runtime_error("Invalid numeric literal: " + std::string(text));
+    val = val * 10 + static_cast<std::uint32_t>(c - '0');
     if (val > 0xFFFF) {
-      throw std::runtime_error("Decimal value out of 16-bit range: " + text);
+      throw std::runtime_error("Decimal value out of 16-bit range: " + std::string(text));
     }
-    return static_cast<std::uint16_t>(val);
-  } catch (const std::invalid_argument &) {
-    throw std::runtime_error("Invalid numeric literal: " + text);
-  } catch (const std::out_of_range &) {
-    throw std::runtime_error("Numeric literal out of range: " + text);
   }
+  return static_cast<std::uint16_t>(val);
 }
 
-// Map register name (R0..R3) to its numeric index.
-std::uint8_t reg_id_from_name(const std::string &name) {
-  if (iequals(name, "R0"))
-    return 0;
-  if (iequals(name, "R1"))
-    return 1;
-  if (iequals(name, "R2"))
-    return 2;
-  if (iequals(name, "R3"))
-    return 3;
-  throw std::runtime_error("Unknown register: " + name);
+// Map register name (R0..R3) to its numeric index; the lexer only produces
+// Register tokens for these four names.
+std::uint8_t reg_id_from_name(std::string_view name) {
+  return static_cast<std::uint8_t>(name[1] - '0');
 }
 
-// Convert a token stream for one line into a Line struct.
-// Handles an optional leading label (IDENT ':'), then an opcode/directive
-// and a comma-separated operand list.
-Line parse_line_tokens(const std::vector<Token> &tokens) {
+// Convert a token stream for one line into a Line, appending its operands
+// to the program's arena. Handles an optional leading label (IDENT ':'),
+// then an opcode/directive and a comma-separated operand list.
+Line parse_line_tokens(const std::vector<Token> &tokens, Program &program) {
   Line line;
+  line.first_operand = static_cast<std::uint32_t>(program.operands.size());
   std::size_t idx = 0;
   if (tokens.empty())
     return line;
@@ -299,7 +450,7 @@ Line parse_line_tokens(const std::vector<Token> &tokens) {
   // label?
   if (idx + 1 < tokens.size() && tokens[idx].type == Token::Type::Identifier &&
       tokens[idx + 1].type == Token::Type::Colon) {
-    line.label = tokens[idx].text;
+    line.label = program.symbols.intern(tokens[idx].text);
     idx += 2;
   }
   if (idx >= tokens.size())
@@ -308,8 +459,9 @@ Line parse_line_tokens(const std::vector<Token> &tokens) {
   if (tokens[idx].type != Token::Type::Identifier) {
     throw std::runtime_error("Expected mnemonic or directive");
   }
-  line.op = tokens[idx].text;
-  line.is_directive = !line.op.empty() && line.op[0] == '.';
+  line.op_text = tokens[idx].text;
+  line.op = lookup_mnemonic(line.op_text);
+  line.is_directive = line.op_text[0] == '.';
   ++idx;
 
   while (idx < tokens.size()) {
@@ -337,6 +489,8 @@ Line parse_line_tokens(const std::vector<Token> &tokens) {
     } else if (tokens[idx].type == Token::Type::Identifier) {
       opnd.kind = Operand::Kind::Label;
       opnd.text = tokens[idx].text;
+      if (opnd.text[0] != '"')
+        opnd.symbol = program.symbols.intern(opnd.text);
       ++idx;
     } else if (tokens[idx].type == Token::Type::LBracket) {
       // Indirect addressing: [Reg] or [Addr]
@@ -362,6 +516,7 @@ Line parse_line_tokens(const std::vector<Token> &tokens) {
         // [Label] -> Direct
         opnd.kind = Operand::Kind::Direct; // Treat label as direct address
         opnd.text = tokens[idx].text;
+        opnd.symbol = program.symbols.intern(opnd.text);
         ++idx;
       } else {
         throw std::runtime_error("Unsupported indirect addressing mode");
@@ -374,7 +529,8 @@ Line parse_line_tokens(const std::vector<Token> &tokens) {
     } else {
       throw std::runtime_error("Unsupported operand token");
     }
-    line.operands.push_back(opnd);
+    program.operands.push_back(opnd);
+    ++line.operand_count;
   }
 
   return line;
@@ -393,15 +549,22 @@ std::uint16_t make_instr_word(std::uint8_t opcode, std::uint8_t mode,
   return w;
 }
 
-// Parse a string literal and return the bytes (including null terminator)
+// Append a little-endian word
+void emit_word(std::vector<std::uint8_t> &bytes, std::uint16_t w) {
+  bytes.push_back(static_cast<std::uint8_t>(w & 0xFF));
+  bytes.push_back(static_cast<std::uint8_t>((w >> 8) & 0xFF));
+}
+
+// Parse a string literal and append its bytes (including null terminator)
 // Input: "Hello\n" (with quotes)
-// Output: vector of bytes: H e l l o \n \0
-std::vector<std::uint8_t> parse_string_literal(const std::string &text) {
+// Output: bytes H e l l o \n \0
+void parse_string_literal(std::string_view text,
+                          std::vector<std::uint8_t> &bytes) {
   if (text.size() < 2 || text[0] != '"' || text[text.size() - 1] != '"') {
-    throw std::runtime_error("Invalid string literal format: " + text);
+    throw std::runtime_error("Invalid string literal format: " +
+                             std::string(text));
   }
 
-  std::vector<std::uint8_t> bytes;
   for (std::size_t i = 1; i < text.size() - 1; ++i) {
     if (text[i] == '\\' && i + 1 < text.size() - 1) {
       // Escape sequence
@@ -435,92 +598,42 @@ std::vector<std::uint8_t> parse_string_literal(const std::string &text) {
     }
   }
   bytes.push_back('\0'); // Null terminator
-  return bytes;
 }
 
-// Map instruction mnemonic to opcode
-std::uint8_t get_opcode(const std::string &mnemonic) {
-  // Opcodes from ISA.md
-  if (iequals(mnemonic, "NOP"))
-    return 0;
-  if (iequals(mnemonic, "HALT"))
-    return 1;
-  if (iequals(mnemonic, "MOV"))
-    return 2;
-  if (iequals(mnemonic, "LOAD"))
-    return 3;
-  if (iequals(mnemonic, "STORE"))
-    return 4;
-  if (iequals(mnemonic, "ADD"))
-    return 5;
-  if (iequals(mnemonic, "SUB"))
-    return 6;
-  if (iequals(mnemonic, "AND"))
-    return 7;
-  if (iequals(mnemonic, "OR"))
-    return 8;
-  if (iequals(mnemonic, "XOR"))
-    return 9;
-  if (iequals(mnemonic, "CMP"))
-    return 10;
-  if (iequals(mnemonic, "SHL"))
-    return 11;
-  if (iequals(mnemonic, "SHR"))
-    return 12;
-  if (iequals(mnemonic, "JMP"))
-    return 13;
-  if (iequals(mnemonic, "JZ"))
-    return 14;
-  if (iequals(mnemonic, "JNZ"))
-    return 15;
-  if (iequals(mnemonic, "JC"))
-    return 16;
-  if (iequals(mnemonic, "JNC"))
-    return 17;
-  if (iequals(mnemonic, "JN"))
-    return 18;
-  if (iequals(mnemonic, "CALL"))
-    return 19;
-  if (iequals(mnemonic, "RET"))
-    return 20;
-  if (iequals(mnemonic, "PUSH"))
-    return 21;
-  if (iequals(mnemonic, "POP"))
-    return 22;
-  if (iequals(mnemonic, "IN"))
-    return 23;
-  if (iequals(mnemonic, "OUT"))
-    return 24;
-
-  throw std::runtime_error("Unknown instruction: " + mnemonic);
+// Length of a string literal's bytes, validating it the same way
+std::size_t string_literal_size(std::string_view text) {
+  thread_local std::vector<std::uint8_t> scratch;
+  scratch.clear();
+  parse_string_literal(text, scratch);
+  return scratch.size();
 }
 
 // Calculate instruction size in bytes
-std::uint16_t get_instruction_size(const std::string &mnemonic, const Line &l) {
-  std::uint8_t opcode = get_opcode(mnemonic);
+std::uint16_t get_instruction_size(const Program &program, const Line &l) {
+  Op op = l.op;
 
   // NOP, HALT, RET - no operands, 2 bytes
-  if (opcode == 0 || opcode == 1 || opcode == 20) {
+  if (op == Op::NOP || op == Op::HALT || op == Op::RET) {
     return 2;
   }
 
   // PUSH, POP - single register operand, 2 bytes
-  if (opcode == 21 || opcode == 22) {
+  if (op == Op::PUSH || op == Op::POP) {
     return 2;
   }
 
   // Jumps and CALL - typically PC-relative with offset, 4 bytes (instr +
   // offset)
-  if (opcode >= 13 && opcode <= 19) {
+  if (op >= Op::JMP && op <= Op::CALL) {
     return 4;
   }
 
   // Arithmetic/logic/data movement instructions
   // Size depends on addressing mode
-  if (l.operands.size() >= 2) {
-    if (l.operands[1].kind == Operand::Kind::Imm ||
-        l.operands[1].kind == Operand::Kind::Label ||
-        l.operands[1].kind == Operand::Kind::Direct) {
+  if (l.operand_count >= 2) {
+    Operand::Kind kind = program.operand(l, 1).kind;
+    if (kind == Operand::Kind::Imm || kind == Operand::Kind::Label ||
+        kind == Operand::Kind::Direct) {
       return 4; // 2 bytes instruction + 2 bytes immediate/address
     }
   }
@@ -537,285 +650,1043 @@ std::string error_at_line(int line_num, const std::string &message) {
   return message;
 }
 
-} // namespace
+// Built-in macros for the DMA engine at 0xF020 (src/emulator/dma.hpp),
+// expanded into plain instructions before addresses are assigned:
+//   DMACOPY Rdst, Rsrc, Rlen   copy Rlen bytes from Rsrc to Rdst
+//   DMAFILL Rdst, Rval, Rlen   fill Rlen bytes with the low byte of Rval
+//   DMAWAIT Rtmp               wait until the engine is idle
+// DMACOPY and DMAFILL preserve every register and the flags; DMAWAIT
+// clobbers Rtmp and the flags.
+// Labels the assembler makes up contain '@', which source labels cannot
+bool is_internal_label(const std::string &label) {
+  return label.find('@') != std::string::npos;
+}
 
-std::vector<std::uint8_t> assemble(const std::string &source,
-                                   std::vector<SourceMapEntry> *out_map) {
-  std::istringstream iss(source);
-  std::string raw_line;
+void expand_macro(const Line &macro, Program &program) {
+  // Copy the macro's operands out first: emitting lines grows the arena
+  std::vector<Operand> args(program.operands.begin() + macro.first_operand,
+                            program.operands.begin() + macro.first_operand +
+                                macro.operand_count);
+  program.operands.resize(macro.first_operand);
 
-  std::vector<std::string> raw_source_lines;
-  {
-    std::istringstream tmp_iss(source);
-    std::string s;
-    while (std::getline(tmp_iss, s))
-      raw_source_lines.push_back(s);
+  auto reg = [](std::string_view name) {
+    return Operand{Operand::Kind::Reg, name};
+  };
+  auto direct = [](std::string_view address) {
+    return Operand{Operand::Kind::Direct, address};
+  };
+  auto emit = [&](Op op, std::string_view name,
+                  std::initializer_list<Operand> operands,
+                  std::uint32_t label = SymbolTable::NONE) {
+    Line l;
+    l.label = label;
+    l.op = op;
+    l.op_text = name;
+    l.first_operand = static_cast<std::uint32_t>(program.operands.size());
+    l.operand_count = static_cast<std::uint32_t>(operands.size());
+    program.operands.insert(program.operands.end(), operands);
+    l.line_number = macro.line_number;
+    l.source = macro.source;
+    l.source_offset = macro.source_offset;
+    program.lines.push_back(l);
+  };
+  std::string name = program.op_name(macro);
+  std::size_t arity = macro.op == Op::DMAWAIT ? 1 : 3;
+  if (args.size() != arity)
+    throw std::runtime_error(error_at_line(
+        macro.line_number, name + " expects " + std::to_string(arity) +
+                               (arity == 1 ? " register" : " registers")));
+  for (const Operand &o : args) {
+    if (o.kind != Operand::Kind::Reg)
+      throw std::runtime_error(error_at_line(
+          macro.line_number, name + " operands must be registers"));
+  }
+  if (macro.label != SymbolTable::NONE) {
+    Line label_only;
+    label_only.label = macro.label;
+    label_only.first_operand = static_cast<std::uint32_t>(program.operands.size());
+    label_only.line_number = macro.line_number;
+    label_only.source = macro.source;
+    label_only.source_offset = macro.source_offset;
+    program.lines.push_back(label_only);
   }
 
-  std::vector<Line> lines;
-  int line_num = 0;
-  while (std::getline(iss, raw_line)) {
+  if (macro.op == Op::DMAWAIT) {
+    std::string_view tmp = args[0].text;
+    std::uint32_t loop = program.symbols.intern(
+        "DMAWAIT@" + std::to_string(program.internal_labels++));
+    Operand target{Operand::Kind::Label, "", loop};
+    emit(Op::LOAD, "LOAD", {reg(tmp), direct("0xF026")}, loop); // Status
+    emit(Op::AND, "AND", {reg(tmp), Operand{Operand::Kind::Imm, "1"}}); // Busy bit
+    emit(Op::JNZ, "JNZ", {target});
+    return;
+  }
+
+  bool copy = macro.op == Op::DMACOPY;
+  std::string_view dst = args[0].text;
+  std::string_view len = args[2].text;
+  emit(Op::STORE, "STORE", {reg(args[1].text),
+                            direct(copy ? "0xF020" : "0xF028")}); // Source or fill byte
+  emit(Op::STORE, "STORE", {reg(dst), direct("0xF022")});
+  emit(Op::STORE, "STORE", {reg(len), direct("0xF024")});
+  emit(Op::PUSH, "PUSH", {reg(len)});
+  emit(Op::MOV, "MOV", {reg(len), Operand{Operand::Kind::Imm, copy ? "1" : "2"}});
+  emit(Op::STORE, "STORE", {reg(len), direct("0xF026")}); // Start
+  emit(Op::POP, "POP", {reg(len)});
+}
+
+// Split the source into lines in one pass and parse each of them; the
+// lines, tokens and operands all point back into `source`. `source` may be
+// a run of whole lines from a larger text that starts at `base_offset`, on
+// line `first_line`.
+void parse_source(std::string_view source, Program &program,
+                  std::uint32_t base_offset = 0, int first_line = 1) {
+  if (program.lines.empty())
+    program.lines.reserve(source.size() / 32);
+  if (program.operands.empty())
+    program.operands.reserve(source.size() / 24);
+  std::vector<Token> tokens;
+  int line_num = first_line - 1;
+  std::size_t pos = 0;
+  while (pos < source.size()) {
+    std::size_t end = source.find('\n', pos);
+    if (end == std::string_view::npos)
+      end = source.size();
+    std::string_view raw = source.substr(pos, end - pos);
+    pos = end + 1;
     ++line_num;
-    std::string t = trim(raw_line);
-    if (t.empty())
+
+    tokenize_line(raw, tokens);
+    if (tokens.empty())
       continue;
-    auto tokens = tokenize_line(t);
-    Line parsed = parse_line_tokens(tokens);
+    Line parsed = parse_line_tokens(tokens, program);
     parsed.line_number = line_num;
-    lines.push_back(parsed);
+    parsed.source = raw;
+    parsed.source_offset =
+        base_offset + static_cast<std::uint32_t>(raw.data() - source.data());
+    if (is_macro(parsed.op))
+      expand_macro(parsed, program);
+    else
+      program.lines.push_back(parsed);
   }
+}
+
+// First source label defined at each address, for the source map
+using LabelIndex = std::unordered_map<std::uint16_t, std::uint32_t>;
+// .global names with the line that exported them
+using ExportList = std::vector<std::pair<std::uint32_t, int>>;
 
-  // Pass 1: symbol table and addresses (word addresses)
-  std::unordered_map<std::string, std::uint16_t> symbols;
-  std::vector<std::uint16_t> line_addr(lines.size());
-  std::uint16_t addr = 0x8000; // default org
+// Pass 1: symbol table and addresses (word addresses). With `object` set,
+// code starts at offset 0 and .org is an error.
+void assign_addresses(Program &program, std::vector<std::uint16_t> &line_addr,
+                      bool object, LabelIndex *label_at, ExportList *exports) {
+  const std::vector<Line> &lines = program.lines;
+  SymbolTable &symbols = program.symbols;
+  line_addr.resize(lines.size());
+  std::uint16_t addr = object ? 0 : 0x8000; // default org
 
   for (std::size_t i = 0; i < lines.size(); ++i) {
     line_addr[i] = addr;
-    Line &l = lines[i];
-    if (!l.label.empty()) {
-      if (symbols.count(l.label))
-        throw std::runtime_error(
-            error_at_line(l.line_number, "Duplicate label: " + l.label));
-      symbols[l.label] = addr;
+    const Line &l = lines[i];
+    if (l.label != SymbolTable::NONE) {
+      if (symbols.defined(l.label))
+        throw std::runtime_error(error_at_line(
+            l.line_number, "Duplicate label: " + symbols.name(l.label)));
+      symbols.define(l.label, addr);
+      if (label_at && !is_internal_label(symbols.name(l.label)))
+        label_at->emplace(addr, l.label);
     }
     // If line has only a label and no op, it doesn't emit code
-    if (l.op.empty()) {
+    if (l.op_text.empty()) {
       continue;
     }
 
     if (l.is_directive) {
-      if (iequals(l.op, ".ORG")) {
-        if (l.operands.size() != 1 ||
-            (l.operands[0].kind != Operand::Kind::Number &&
-             l.operands[0].kind != Operand::Kind::Label)) {
+      if (l.op == Op::ORG) {
+        if (object)
+          throw std::runtime_error(error_at_line(
+              l.line_number, ".org is not allowed in relocatable objects"));
+        if (l.operand_count != 1 ||
+            (program.operand(l, 0).kind != Operand::Kind::Number &&
+             program.operand(l, 0).kind != Operand::Kind::Label)) {
           throw std::runtime_error(".org expects one numeric or label operand");
         }
-        std::uint16_t v;
-        if (l.operands[0].kind == Operand::Kind::Number)
-          v = parse_number16(l.operands[0].text);
-        else
-          v = symbols.at(l.operands[0].text);
-        addr = v;
-      } else if (iequals(l.op, ".WORD")) {
-        if (l.operands.size() != 1) {
+        const Operand &o = program.operand(l, 0);
+        if (o.kind == Operand::Kind::Number) {
+          addr = parse_number16(o.text);
+        } else {
+          if (o.symbol == SymbolTable::NONE || !symbols.defined(o.symbol))
+            throw std::runtime_error(error_at_line(
+                l.line_number, "Undefined label: " + upper(o.text)));
+          addr = symbols.value(o.symbol);
+        }
+      } else if (l.op == Op::GLOBAL) {
+        // Exports a label to other objects; no effect on flat programs
+        if (l.operand_count == 0)
+          throw std::runtime_error(
+              error_at_line(l.line_number, ".global expects label names"));
+        for (std::size_t k = 0; k < l.operand_count; ++k) {
+          const Operand &o = program.operand(l, k);
+          if (o.kind != Operand::Kind::Label || o.symbol == SymbolTable::NONE)
+            throw std::runtime_error(
+                error_at_line(l.line_number, ".global expects label names"));
+          if (exports)
+            exports->emplace_back(o.symbol, l.line_number);
+        }
+      } else if (l.op == Op::WORD) {
+        if (l.operand_count != 1) {
           throw std::runtime_error(".word expects exactly one operand");
         }
         addr = static_cast<std::uint16_t>(addr + 2); // One word = 2 bytes
-      } else if (iequals(l.op, ".STRING")) {
-        if (l.operands.size() != 1) {
+      } else if (l.op == Op::STRING) {
+        if (l.operand_count != 1) {
           throw std::runtime_error(
               ".string expects exactly one string operand");
         }
-        if (l.operands[0].kind != Operand::Kind::Label) {
+        if (program.operand(l, 0).kind != Operand::Kind::Label) {
           throw std::runtime_error(".string operand must be a string literal");
         }
-        // Calculate string length (including null terminator)
-        auto bytes = parse_string_literal(l.operands[0].text);
-        // Round up to word boundary
-        std::uint16_t byte_count = static_cast<std::uint16_t>(bytes.size());
-        std::uint16_t word_count = (byte_count + 1) / 2; // Round up
+        // String length (including null terminator), rounded up to a word
+        std::size_t byte_count = string_literal_size(program.operand(l, 0).text);
+        std::uint16_t word_count = static_cast<std::uint16_t>((byte_count + 1) / 2);
         addr = static_cast<std::uint16_t>(addr + word_count * 2);
       } else {
-        throw std::runtime_error(
-            error_at_line(l.line_number, "Unknown directive: " + l.op));
+        throw std::runtime_error(error_at_line(
+            l.line_number, "Unknown directive: " + program.op_name(l)));
       }
+    } else if (is_instruction(l.op)) {
+      addr = static_cast<std::uint16_t>(addr + get_instruction_size(program, l));
     } else {
-      // All instructions - use helper function to calculate size
-      try {
-        std::uint16_t instr_size = get_instruction_size(l.op, l);
-        addr = static_cast<std::uint16_t>(addr + instr_size);
-      } catch (const std::exception &e) {
-        throw std::runtime_error(error_at_line(l.line_number, e.what()));
-      }
+      throw std::runtime_error(error_at_line(
+          l.line_number, "Unknown instruction: " + program.op_name(l)));
     }
   }
+}
 
-  // Pass 2: encode
-  std::vector<std::uint8_t> bytes;
-  for (std::size_t i = 0; i < lines.size(); ++i) {
-    std::size_t start_size = bytes.size();
-    const Line &l = lines[i];
-    std::uint16_t cur_addr = line_addr[i];
-
-    if (l.op.empty()) {
-      // No code
-    } else if (l.is_directive) {
-      if (iequals(l.op, ".ORG")) {
-        // No code
-      } else if (iequals(l.op, ".WORD")) {
-        if (l.operands.size() != 1)
-          throw std::runtime_error(".word expects one operand");
-        std::uint16_t v;
-        if (l.operands[0].kind == Operand::Kind::Number)
-          v = parse_number16(l.operands[0].text);
-        else if (l.operands[0].kind == Operand::Kind::Label)
-          v = symbols.at(l.operands[0].text);
-        else
-          throw std::runtime_error("Unsupported .word operand");
-        // Emit word as little-endian bytes
-        bytes.push_back(static_cast<std::uint8_t>(v & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>((v >> 8) & 0xFF));
-      } else if (iequals(l.op, ".STRING")) {
-        // Emit string bytes
-        auto str_bytes = parse_string_literal(l.operands[0].text);
-        for (auto b : str_bytes) {
-          bytes.push_back(b);
-        }
-        // Pad to word boundary if needed
-        if (str_bytes.size() % 2 != 0) {
-          bytes.push_back(0);
-        }
-      }
+// Value for a label operand whose 16-bit field starts at byte `field`
+std::uint16_t absolute(const Program &program, std::uint32_t symbol,
+                       std::size_t field, int line_number, ObjectFile *object) {
+  const SymbolTable &symbols = program.symbols;
+  bool defined = symbols.defined(symbol);
+  if (object) {
+    object->relocations.push_back(
+        {static_cast<std::uint16_t>(field), Relocation::Kind::Absolute,
+         defined ? "" : symbols.name(symbol)});
+    return defined ? symbols.value(symbol) : 0;
+  }
+  if (!defined)
+    throw std::runtime_error(
+        error_at_line(line_number, "Undefined label: " + symbols.name(symbol)));
+  return symbols.value(symbol);
+}
+
+// Offset from the next instruction to a jump target. Jumps between labels
+// of the same object need no relocation.
+std::uint16_t relative(const Program &program, const Operand &target,
+                       std::uint16_t cur_addr, std::size_t field,
+                       int line_number, ObjectFile *object) {
+  const SymbolTable &symbols = program.symbols;
+  std::int32_t next_pc = static_cast<std::int32_t>(cur_addr) + 4;
+  std::int32_t value;
+  if (target.kind == Operand::Kind::Label &&
+      target.symbol != SymbolTable::NONE) {
+    if (symbols.defined(target.symbol)) {
+      value = static_cast<std::int32_t>(symbols.value(target.symbol)) - next_pc;
+    } else if (object) {
+      object->relocations.push_back({static_cast<std::uint16_t>(field),
+                                     Relocation::Kind::Relative,
+                                     symbols.name(target.symbol)});
+      value = 0;
     } else {
-      // Get opcode
-      std::uint8_t opcode;
-      try {
-        opcode = get_opcode(l.op);
-      } catch (const std::exception &e) {
-        throw std::runtime_error(error_at_line(l.line_number, e.what()));
+      throw std::runtime_error(error_at_line(
+          line_number, "Undefined label: " + symbols.name(target.symbol)));
+    }
+  } else if (target.kind == Operand::Kind::Number) {
+    value = parse_number16(target.text);
+    if (object) // Absolute target: the linker makes it relative
+      object->relocations.push_back({static_cast<std::uint16_t>(field),
+                                     Relocation::Kind::Relative, ""});
+    else
+      value -= next_pc;
+  } else {
+    throw std::runtime_error(error_at_line(
+        line_number, "Jump operand must be label or number"));
+  }
+  return static_cast<std::uint16_t>(value & 0xFFFF);
+}
+
+bool is_jump(Op op) { return op >= Op::JMP && op <= Op::CALL; }
+
+// Pass 2 for one line at `cur_addr`: appends its encoding to `bytes`, which
+// holds everything emitted before it (relocation offsets are positions in
+// `bytes`).
+void encode_line(const Program &program, const Line &l, std::uint16_t cur_addr,
+                 std::vector<std::uint8_t> &bytes, ObjectFile *object) {
+  std::size_t start_size = bytes.size();
+
+  if (l.op_text.empty()) {
+    // No code
+  } else if (l.is_directive) {
+    if (l.op == Op::WORD) {
+      const Operand &o = program.operand(l, 0);
+      std::uint16_t v;
+      if (o.kind == Operand::Kind::Number)
+        v = parse_number16(o.text);
+      else if (o.kind == Operand::Kind::Label && o.symbol != SymbolTable::NONE)
+        v = absolute(program, o.symbol, bytes.size(), l.line_number, object);
+      else
+        throw std::runtime_error("Unsupported .word operand");
+      emit_word(bytes, v);
+    } else if (l.op == Op::STRING) {
+      // Emit string bytes, padded to a word boundary
+      parse_string_literal(program.operand(l, 0).text, bytes);
+      if ((bytes.size() - start_size) % 2 != 0) {
+        bytes.push_back(0);
       }
+    }
+    // .org and .global emit no code
+  } else {
+    std::uint8_t opcode = static_cast<std::uint8_t>(l.op);
+    std::uint8_t mode = 0;
+    std::uint8_t rd = 0;
+    std::uint8_t rs = 0;
 
-      std::uint8_t mode = 0;
-      std::uint8_t rd = 0;
-      std::uint8_t rs = 0;
+    // NOP, HALT, RET - no operands
+    if (l.op == Op::NOP || l.op == Op::HALT || l.op == Op::RET) {
+      emit_word(bytes, make_instr_word(opcode, 0, 0, 0));
+    }
+    // PUSH, POP - single register operand
+    else if (l.op == Op::PUSH || l.op == Op::POP) {
+      if (l.operand_count != 1 ||
+          program.operand(l, 0).kind != Operand::Kind::Reg) {
+        throw std::runtime_error(error_at_line(
+            l.line_number, program.op_name(l) + " expects one register operand"));
+      }
+      rd = reg_id_from_name(program.operand(l, 0).text);
+      emit_word(bytes, make_instr_word(opcode, 0, rd, 0));
+    }
+    // Jumps and CALL - PC-relative with offset
+    else if (is_jump(l.op)) {
+      if (l.operand_count != 1) {
+        throw std::runtime_error(error_at_line(
+            l.line_number, program.op_name(l) + " expects one operand"));
+      }
+      mode = 5; // PC-relative
+      std::uint16_t off16 = relative(program, program.operand(l, 0), cur_addr,
+                                     bytes.size() + 2, l.line_number, object);
+      emit_word(bytes, make_instr_word(opcode, mode, 0, 0));
+      emit_word(bytes, off16);
+    }
+    // Two-operand instructions
+    else {
+      if (l.operand_count != 2) {
+        throw std::runtime_error(error_at_line(
+            l.line_number, program.op_name(l) + " expects two operands"));
+      }
+      const Operand &dst = program.operand(l, 0);
+      const Operand &src = program.operand(l, 1);
+      if (dst.kind != Operand::Kind::Reg) {
+        throw std::runtime_error(error_at_line(
+            l.line_number,
+            program.op_name(l) + " first operand must be a register"));
+      }
+      rd = reg_id_from_name(dst.text);
 
-      // NOP, HALT, RET - no operands
-      if (opcode == 0 || opcode == 1 || opcode == 20) {
-        std::uint16_t instr = make_instr_word(opcode, 0, 0, 0);
-        bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
+      // Determine addressing mode and encode
+      if (src.kind == Operand::Kind::Reg) {
+        // Register mode
+        mode = 0;
+        rs = reg_id_from_name(src.text);
+        emit_word(bytes, make_instr_word(opcode, mode, rd, rs));
+      } else if (src.kind == Operand::Kind::Imm) {
+        // Immediate mode
+        mode = 1;
+        std::uint16_t imm = parse_number16(src.text);
+        emit_word(bytes, make_instr_word(opcode, mode, rd, 0));
+        emit_word(bytes, imm);
+      } else if (src.kind == Operand::Kind::Label &&
+                 src.symbol != SymbolTable::NONE) {
+        // Label - treat as immediate address
+        mode = 1;
+        std::uint16_t imm = absolute(program, src.symbol, bytes.size() + 2,
+                                     l.line_number, object);
+        emit_word(bytes, make_instr_word(opcode, mode, rd, 0));
+        emit_word(bytes, imm);
+      } else if (src.kind == Operand::Kind::IndirectReg) {
+        // Register Indirect mode: [Reg]
+        mode = 3; // Mode 3 = Register Indirect
+        rs = reg_id_from_name(src.text);
+        emit_word(bytes, make_instr_word(opcode, mode, rd, rs));
+      } else if (src.kind == Operand::Kind::Direct) {
+        // Direct mode: [#Addr] or [Label]
+        mode = 2; // Mode 2 = Direct
+        std::uint16_t address =
+            src.symbol == SymbolTable::NONE
+                ? parse_number16(src.text)
+                : absolute(program, src.symbol, bytes.size() + 2,
+                           l.line_number, object);
+        emit_word(bytes, make_instr_word(opcode, mode, rd, 0));
+        emit_word(bytes, address);
+      } else {
+        throw std::runtime_error(error_at_line(
+            l.line_number, "Unsupported operand type for " + program.op_name(l)));
       }
-      // PUSH, POP - single register operand
-      else if (opcode == 21 || opcode == 22) {
-        if (l.operands.size() != 1 ||
-            l.operands[0].kind != Operand::Kind::Reg) {
-          throw std::runtime_error(error_at_line(
-              l.line_number, l.op + " expects one register operand"));
+    }
+  }
+}
+
+const std::string &label_name(const Program &program,
+                              const LabelIndex &label_at, std::uint16_t addr) {
+  static const std::string none;
+  auto label = label_at.find(addr);
+  return label != label_at.end() ? program.symbols.name(label->second) : none;
+}
+
+// -O: peephole rewrites on the parsed program. They run after a first
+// pass 1 (so duplicate labels and bad directives are reported as usual and
+// the original layout is known) and before the real one, which lays the
+// shrunken code out again. Each keeps every register and memory result,
+// and keeps the flags wherever a later instruction can read them:
+//   MOV Rx, Rx                        removed
+//   PUSH Rx / POP Rx                  removed (the slot below SP is left
+//                                     unwritten)
+//   PUSH Rx / POP Ry                  MOV Ry, Rx
+//   ADD/SUB/OR/XOR/SHL/SHR/CMP Rx, #0 and AND Rx, #0xFFFF
+//                                     OR Rx, Rx (identical flags), or
+//                                     removed if the flags are dead
+//   MOV Rx, #0                        XOR Rx, Rx if the flags are dead
+//   Jcc/JMP to the next instruction   removed
+//   Jcc/JMP/CALL to a JMP             retargeted past the JMP
+//   JMP to a RET                      RET
+// Rewritten lines keep their source line, so the source map stays exact.
+// Code that a numeric operand may point into is left alone, since moving
+// it would break the reference.
+class Peephole {
+public:
+  Peephole(Program &program, const std::vector<std::uint16_t> &line_addr,
+           bool object)
+      : program_(program), lines_(program.lines), line_addr_(line_addr),
+        object_(object) {}
+
+  void run(PeepholeStats &stats) {
+    std::size_t before = code_size();
+    if (!layout_is_free())
+      return;
+    label_line_.assign(program_.symbols.size(), NONE);
+    for (std::size_t i = 0; i < lines_.size(); ++i)
+      if (lines_[i].label != SymbolTable::NONE)
+        label_line_[lines_[i].label] = static_cast<std::uint32_t>(i);
+
+    // Each rewrite can expose another (a removed line makes a jump point
+    // at its next instruction), so repeat until nothing changes
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (std::size_t i = 0; i < lines_.size(); ++i)
+        changed |= rewrite(i, stats);
+    }
+    stats.bytes_saved += before - code_size();
+  }
+
+private:
+  static constexpr std::uint32_t NONE = ~0u;
+  static constexpr int MAX_SCAN = 64; // Lines followed by flags_live_after
+
+  static bool emits_code(const Line &l) {
+    return !l.op_text.empty() && l.op != Op::GLOBAL;
+  }
+  static bool is_alu(Op op) { return op >= Op::ADD && op <= Op::SHR; }
+  static bool is_number(const Operand &o, std::uint16_t value) {
+    try {
+      return parse_number16(o.text) == value;
+    } catch (const std::runtime_error &) {
+      return false; // Reported by pass 2 as usual
+    }
+  }
+
+  const Operand &operand(const Line &l, std::size_t i) const {
+    return program_.operand(l, i);
+  }
+
+  std::size_t code_size() const {
+    std::size_t size = 0;
+    for (const Line &l : lines_)
+      if (is_instruction(l.op) && !l.op_text.empty())
+        size += get_instruction_size(program_, l);
+    return size;
+  }
+
+  // False if a numeric operand (a jump target, address or immediate that
+  // could be a pointer) falls inside the code of a flat program
+  bool layout_is_free() const {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> code;
+    for (std::size_t i = 0; i < lines_.size(); ++i) {
+      const Line &l = lines_[i];
+      if (is_instruction(l.op) && !l.op_text.empty())
+        code.emplace_back(line_addr_[i],
+                          line_addr_[i] + get_instruction_size(program_, l));
+    }
+    std::sort(code.begin(), code.end());
+    for (const Line &l : lines_) {
+      if (l.op == Op::ORG)
+        continue;
+      for (std::size_t k = 0; k < l.operand_count; ++k) {
+        const Operand &o = operand(l, k);
+        bool numeric = o.kind == Operand::Kind::Number ||
+                       o.kind == Operand::Kind::Imm ||
+                       (o.kind == Operand::Kind::Direct &&
+                        o.symbol == SymbolTable::NONE);
+        if (!numeric)
+          continue;
+        if (is_jump(l.op) && object_)
+          return false; // Absolute target the linker will resolve
+        std::uint32_t value;
+        try {
+          value = parse_number16(o.text);
+        } catch (const std::runtime_error &) {
+          continue;
         }
-        rd = reg_id_from_name(l.operands[0].text);
-        std::uint16_t instr = make_instr_word(opcode, 0, rd, 0);
-        bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
+        if (object_)
+          continue; // Load address unknown: numbers cannot point at it
+        auto it = std::upper_bound(
+            code.begin(), code.end(),
+            std::make_pair(value, std::numeric_limits<std::uint32_t>::max()));
+        if (it != code.begin() && value < std::prev(it)->second)
+          return false;
       }
-      // Jumps and CALL - PC-relative with offset
-      else if (opcode >= 13 && opcode <= 19) {
-        if (l.operands.size() != 1) {
-          throw std::runtime_error(
-              error_at_line(l.line_number, l.op + " expects one operand"));
-        }
-        mode = 5; // PC-relative
-        std::uint16_t target;
-        if (l.operands[0].kind == Operand::Kind::Label) {
-          auto it = symbols.find(l.operands[0].text);
-          if (it == symbols.end()) {
-            throw std::runtime_error(error_at_line(
-                l.line_number, "Undefined label: " + l.operands[0].text));
-          }
-          target = it->second;
-        } else if (l.operands[0].kind == Operand::Kind::Number) {
-          target = parse_number16(l.operands[0].text);
-        } else {
-          throw std::runtime_error(error_at_line(
-              l.line_number, "Jump operand must be label or number"));
+    }
+    return true;
+  }
+
+  // Next line from `i` on that emits code, or NONE past the end or at a
+  // .org (execution does not follow the source across one)
+  std::uint32_t next_code(std::size_t i) const {
+    for (; i < lines_.size(); ++i) {
+      if (lines_[i].op == Op::ORG)
+        return NONE;
+      if (emits_code(lines_[i]))
+        return static_cast<std::uint32_t>(i);
+    }
+    return NONE;
+  }
+
+  // First instruction a jump to `target` executes, or NONE if unknown
+  std::uint32_t jump_destination(const Operand &target) const {
+    if (target.kind != Operand::Kind::Label ||
+        target.symbol == SymbolTable::NONE ||
+        label_line_[target.symbol] == NONE)
+      return NONE;
+    return next_code(label_line_[target.symbol]);
+  }
+
+  // Last JMP in the chain of JMPs that `target` starts, or NONE if it
+  // does not start at a JMP or the chain loops
+  std::uint32_t final_jump(const Operand &target) const {
+    std::uint32_t last = NONE;
+    std::uint32_t j = jump_destination(target);
+    for (int hops = 0; j != NONE && lines_[j].op == Op::JMP; ++hops) {
+      if (hops == MAX_SCAN)
+        return NONE;
+      last = j;
+      j = jump_destination(operand(lines_[j], 0));
+      if (j == last)
+        return NONE;
+    }
+    return last;
+  }
+
+  // Whether an instruction executed after line `i` can read the flags
+  // before something overwrites them. CALL, RET and HALT count as reads.
+  bool flags_live_after(std::size_t i) const {
+    std::uint32_t j = next_code(i + 1);
+    for (int steps = 0; steps < MAX_SCAN && j != NONE; ++steps) {
+      const Line &l = lines_[j];
+      if (!is_instruction(l.op))
+        return true; // Falls into data
+      if (is_alu(l.op))
+        return false; // Sets all four flags
+      if (l.op == Op::JMP)
+        j = jump_destination(operand(l, 0));
+      else if (is_jump(l.op) || l.op == Op::RET || l.op == Op::HALT)
+        return true;
+      else
+        j = next_code(j + 1);
+    }
+    return true;
+  }
+
+  void remove(Line &l) {
+    l.op = Op::NONE;
+    l.op_text = {};
+    l.operand_count = 0;
+  }
+
+  void set_registers(Line &l, Op op, std::string_view name,
+                     std::string_view rd, std::string_view rs) {
+    l.op = op;
+    l.op_text = name;
+    l.first_operand = static_cast<std::uint32_t>(program_.operands.size());
+    l.operand_count = 2;
+    program_.operands.push_back({Operand::Kind::Reg, rd});
+    program_.operands.push_back({Operand::Kind::Reg, rs});
+  }
+
+  bool same_register(std::string_view a, std::string_view b) const {
+    return reg_id_from_name(a) == reg_id_from_name(b);
+  }
+
+  bool rewrite(std::size_t i, PeepholeStats &stats) {
+    Line &l = lines_[i];
+    if (!is_instruction(l.op) || l.op_text.empty())
+      return false;
+
+    if (is_jump(l.op) && l.operand_count == 1) {
+      // Falls through to the target anyway
+      if (l.op != Op::CALL) {
+        std::uint32_t next = next_code(i + 1);
+        if (next != NONE && jump_destination(operand(l, 0)) == next) {
+          remove(l);
+          ++stats.removed;
+          return true;
         }
-        std::int32_t next_pc = static_cast<std::int32_t>(cur_addr) + 4;
-        std::int32_t offset = static_cast<std::int32_t>(target) - next_pc;
-        std::uint16_t off16 = static_cast<std::uint16_t>(offset & 0xFFFF);
-        std::uint16_t instr = make_instr_word(opcode, mode, 0, 0);
-        bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>(off16 & 0xFF));
-        bytes.push_back(static_cast<std::uint8_t>((off16 >> 8) & 0xFF));
       }
-      // Two-operand instructions
-      else {
-        if (l.operands.size() != 2) {
-          throw std::runtime_error(
-              error_at_line(l.line_number, l.op + " expects two operands"));
-        }
-        if (l.operands[0].kind != Operand::Kind::Reg) {
-          throw std::runtime_error(error_at_line(
-              l.line_number, l.op + " first operand must be a register"));
-        }
-        rd = reg_id_from_name(l.operands[0].text);
-
-        // Determine addressing mode and encode
-        if (l.operands[1].kind == Operand::Kind::Reg) {
-          // Register mode
-          mode = 0;
-          rs = reg_id_from_name(l.operands[1].text);
-          std::uint16_t instr = make_instr_word(opcode, mode, rd, rs);
-          bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-        } else if (l.operands[1].kind == Operand::Kind::Imm) {
-          // Immediate mode
-          mode = 1;
-          std::uint16_t imm = parse_number16(l.operands[1].text);
-          std::uint16_t instr = make_instr_word(opcode, mode, rd, 0);
-          bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>(imm & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((imm >> 8) & 0xFF));
-        } else if (l.operands[1].kind == Operand::Kind::Label) {
-          // Label - treat as immediate address
-          auto it = symbols.find(l.operands[1].text);
-          if (it == symbols.end()) {
-            throw std::runtime_error(error_at_line(
-                l.line_number, "Undefined label: " + l.operands[1].text));
-          }
-          mode = 1;
-          std::uint16_t imm = it->second;
-          std::uint16_t instr = make_instr_word(opcode, mode, rd, 0);
-          bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>(imm & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((imm >> 8) & 0xFF));
-        } else if (l.operands[1].kind == Operand::Kind::IndirectReg) {
-          // Register Indirect mode: [Reg]
-          mode = 3; // Mode 3 = Register Indirect
-          rs = reg_id_from_name(l.operands[1].text);
-          std::uint16_t instr = make_instr_word(opcode, mode, rd, rs);
-          bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-        } else if (l.operands[1].kind == Operand::Kind::Direct) {
-          // Direct mode: [#Addr] or [Label]
-          mode = 2; // Mode 2 = Direct
-          std::uint16_t addr;
-          if (std::isdigit(l.operands[1].text[0])) {
-            addr = parse_number16(l.operands[1].text);
-          } else {
-            auto it = symbols.find(l.operands[1].text);
-            if (it == symbols.end()) {
-              throw std::runtime_error(error_at_line(
-                  l.line_number, "Undefined label: " + l.operands[1].text));
-            }
-            addr = it->second;
-          }
-          std::uint16_t instr = make_instr_word(opcode, mode, rd, 0);
-          bytes.push_back(static_cast<std::uint8_t>(instr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((instr >> 8) & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>(addr & 0xFF));
-          bytes.push_back(static_cast<std::uint8_t>((addr >> 8) & 0xFF));
+      std::uint32_t dest = jump_destination(operand(l, 0));
+      if (l.op == Op::JMP && dest != NONE && lines_[dest].op == Op::RET) {
+        l.op = Op::RET;
+        l.op_text = "RET";
+        l.operand_count = 0;
+        ++stats.shortened;
+        return true;
+      }
+      std::uint32_t last = final_jump(operand(l, 0));
+      if (last == NONE || lines_[last].first_operand == l.first_operand)
+        return false;
+      l.first_operand = lines_[last].first_operand;
+      ++stats.retargeted;
+      return true;
+    }
+
+    if (l.operand_count == 2 && operand(l, 0).kind == Operand::Kind::Reg) {
+      const Operand &dst = operand(l, 0);
+      const Operand &src = operand(l, 1);
+      if (l.op == Op::MOV && src.kind == Operand::Kind::Reg &&
+          same_register(dst.text, src.text)) {
+        remove(l);
+        ++stats.removed;
+        return true;
+      }
+      if ((l.op == Op::OR || l.op == Op::AND) &&
+          src.kind == Operand::Kind::Reg && same_register(dst.text, src.text) &&
+          !flags_live_after(i)) {
+        remove(l);
+        ++stats.removed;
+        return true;
+      }
+      bool identity =
+          src.kind == Operand::Kind::Imm &&
+          (((is_alu(l.op) && l.op != Op::AND) && is_number(src, 0)) ||
+           (l.op == Op::AND && is_number(src, 0xFFFF)));
+      if (identity) {
+        if (!flags_live_after(i)) {
+          remove(l);
+          ++stats.removed;
         } else {
-          throw std::runtime_error(error_at_line(
-              l.line_number, "Unsupported operand type for " + l.op));
+          set_registers(l, Op::OR, "OR", dst.text, dst.text);
+          ++stats.shortened;
         }
+        return true;
+      }
+      if (l.op == Op::MOV && src.kind == Operand::Kind::Imm &&
+          is_number(src, 0) && !flags_live_after(i)) {
+        set_registers(l, Op::XOR, "XOR", dst.text, dst.text);
+        ++stats.shortened;
+        return true;
       }
+      return false;
+    }
+
+    if (l.op == Op::PUSH && l.operand_count == 1 && i + 1 < lines_.size()) {
+      Line &next = lines_[i + 1];
+      if (next.op != Op::POP || next.label != SymbolTable::NONE ||
+          next.operand_count != 1 ||
+          operand(next, 0).kind != Operand::Kind::Reg ||
+          operand(l, 0).kind != Operand::Kind::Reg)
+        return false;
+      std::string_view pushed = operand(l, 0).text;
+      std::string_view popped = operand(next, 0).text;
+      if (same_register(pushed, popped)) {
+        remove(l);
+        stats.removed += 2;
+      } else {
+        set_registers(l, Op::MOV, "MOV", popped, pushed);
+        ++stats.removed;
+      }
+      remove(next);
+      return true;
     }
+    return false;
+  }
 
+  Program &program_;
+  std::vector<Line> &lines_;
+  const std::vector<std::uint16_t> &line_addr_;
+  bool object_;
+  std::vector<std::uint32_t> label_line_; // Line defining each symbol
+};
+
+// Both entry points share this: with `object` set, code is assembled at
+// offset 0 and every field that depends on load addresses or on labels
+// defined elsewhere is recorded as a relocation instead of being an error.
+std::vector<std::uint8_t> assemble_source(const std::string &source,
+                                          std::vector<SourceMapEntry> *out_map,
+                                          ObjectFile *object,
+                                          const AssemblerOptions &options) {
+  Program program;
+  parse_source(source, program);
+  const std::vector<Line> &lines = program.lines;
+  const SymbolTable &symbols = program.symbols;
+
+  if (options.optimize) {
+    std::vector<std::uint16_t> layout;
+    assign_addresses(program, layout, object != nullptr, nullptr, nullptr);
+    PeepholeStats stats;
+    Peephole(program, layout, object != nullptr).run(stats);
+    program.symbols.undefine_all();
+    if (options.stats)
+      *options.stats = stats;
+  }
+
+  LabelIndex label_at;
+  std::vector<std::uint16_t> line_addr;
+  ExportList exports;
+  assign_addresses(program, line_addr, object != nullptr,
+                   out_map ? &label_at : nullptr, &exports);
+
+  std::vector<std::uint8_t> bytes;
+  bytes.reserve(static_cast<std::size_t>(lines.size()) * 4);
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    std::size_t start_size = bytes.size();
+    const Line &l = lines[i];
+    encode_line(program, l, line_addr[i], bytes, object);
     if (out_map && bytes.size() > start_size) {
-      std::vector<std::uint8_t> instr_bytes;
-      for (size_t k = start_size; k < bytes.size(); ++k)
-        instr_bytes.push_back(bytes[k]);
+      out_map->push_back(
+          {line_addr[i], l.line_number, std::string(l.source),
+           std::vector<std::uint8_t>(bytes.begin() + start_size, bytes.end()),
+           label_name(program, label_at, line_addr[i])});
+    }
+  }
+
+  if (object) {
+    for (const auto &e : exports) {
+      if (!symbols.defined(e.first))
+        throw std::runtime_error(error_at_line(
+            e.second, "Undefined global label: " + symbols.name(e.first)));
+      bool seen = false;
+      for (const ObjectSymbol &sym : object->symbols)
+        seen = seen || sym.name == symbols.name(e.first);
+      if (!seen)
+        object->symbols.push_back({symbols.name(e.first), symbols.value(e.first)});
+    }
+  }
+  return bytes;
+}
+
+// Range of lines whose source starts in [begin, end)
+std::pair<std::size_t, std::size_t> lines_between(const std::vector<Line> &lines,
+                                                  std::size_t begin,
+                                                  std::size_t end) {
+  auto by_offset = [](const Line &l, std::size_t offset) {
+    return l.source_offset < offset;
+  };
+  auto first = std::lower_bound(lines.begin(), lines.end(), begin, by_offset);
+  auto last = std::lower_bound(first, lines.end(), end, by_offset);
+  return {static_cast<std::size_t>(first - lines.begin()),
+          static_cast<std::size_t>(last - lines.begin())};
+}
 
-      std::string src_line = "";
-      if (l.line_number > 0 && l.line_number <= (int)raw_source_lines.size()) {
-        src_line = raw_source_lines[l.line_number - 1];
+// Length of the common run of a and b, reading forwards (step 1) or
+// backwards (step -1) from the given bytes; compares in blocks first
+std::size_t common_run(const char *a, const char *b, std::size_t limit,
+                       int step) {
+  constexpr std::size_t BLOCK = 64;
+  std::size_t n = 0;
+  while (n + BLOCK <= limit) {
+    const char *pa = step > 0 ? a + n : a - n - (BLOCK - 1);
+    const char *pb = step > 0 ? b + n : b - n - (BLOCK - 1);
+    if (std::memcmp(pa, pb, BLOCK) != 0)
+      break;
+    n += BLOCK;
+  }
+  while (n < limit && a[step * static_cast<std::ptrdiff_t>(n)] ==
+                          b[step * static_cast<std::ptrdiff_t>(n)])
+    ++n;
+  return n;
+}
+
+} // namespace
+
+std::vector<std::uint8_t> assemble(const std::string &source,
+                                   std::vector<SourceMapEntry> *out_map,
+                                   const AssemblerOptions &options) {
+  return assemble_source(source, out_map, nullptr, options);
+}
+
+ObjectFile assemble_object(const std::string &source,
+                           std::vector<SourceMapEntry> *out_map,
+                           const AssemblerOptions &options) {
+  ObjectFile object;
+  object.code = assemble_source(source, out_map, &object, options);
+  return object;
+}
+
+// Everything kept from the previous build. Lines and operands point into
+// `text`, which holds the first source and then only the runs of lines
+// reparsed since; unlike `source` it is never rewritten, so views into it
+// stay valid while the lines around them are shuffled.
+struct IncrementalAssembler::State {
+  std::string source; // Last source assembled, to diff the next one against
+  std::deque<std::string> text;
+  std::size_t text_bytes = 0;
+  Program program;
+  std::vector<std::uint16_t> line_addr;
+  std::vector<std::uint32_t> line_offset; // Each line's bytes; one extra entry
+};
+
+IncrementalAssembler::IncrementalAssembler(bool keep_source_map)
+    : keep_source_map_(keep_source_map) {}
+
+IncrementalAssembler::~IncrementalAssembler() = default;
+
+void IncrementalAssembler::reset() {
+  state_.reset();
+  bytes_.clear();
+  map_.clear();
+}
+
+const std::vector<std::uint8_t> &
+IncrementalAssembler::update(const std::string &source) {
+  stats_ = Stats{};
+  try {
+    // Rebuild from scratch when retained text is mostly dead lines
+    if (!state_ || state_->text_bytes > 2 * source.size() + 4096)
+      rebuild(source);
+    else if (source != state_->source)
+      patch(source);
+    stats_.lines = state_->program.lines.size();
+  } catch (...) {
+    reset(); // The partial state matches neither source
+    throw;
+  }
+  return bytes_;
+}
+
+void IncrementalAssembler::rebuild(const std::string &source) {
+  state_ = std::make_unique<State>();
+  State &s = *state_;
+  s.source = source;
+  s.text.push_back(source);
+  s.text_bytes = source.size();
+  parse_source(s.text.back(), s.program);
+
+  LabelIndex label_at;
+  assign_addresses(s.program, s.line_addr, false,
+                   keep_source_map_ ? &label_at : nullptr, nullptr);
+  const std::vector<Line> &lines = s.program.lines;
+  s.line_offset.resize(lines.size() + 1);
+  bytes_.clear();
+  map_.clear();
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    s.line_offset[i] = static_cast<std::uint32_t>(bytes_.size());
+    encode_line(s.program, lines[i], s.line_addr[i], bytes_, nullptr);
+    if (keep_source_map_ && bytes_.size() > s.line_offset[i])
+      map_.push_back({s.line_addr[i], lines[i].line_number,
+                      std::string(lines[i].source),
+                      std::vector<std::uint8_t>(
+                          bytes_.begin() + s.line_offset[i], bytes_.end()),
+                      label_name(s.program, label_at, s.line_addr[i])});
+  }
+  s.line_offset[lines.size()] = static_cast<std::uint32_t>(bytes_.size());
+  stats_.full = true;
+  stats_.reparsed = stats_.reencoded = lines.size();
+}
+
+void IncrementalAssembler::patch(const std::string &source) {
+  State &s = *state_;
+  const std::string &old = s.source;
+  constexpr std::uint32_t FRESH = ~0u;
+
+  // The edit is new[begin, new_end) in place of old[begin, old_end), both
+  // runs of whole lines: the longest common prefix and suffix ending and
+  // starting on line boundaries
+  std::size_t limit = std::min(old.size(), source.size());
+  std::size_t begin = common_run(old.data(), source.data(), limit, 1);
+  while (begin > 0 && old[begin - 1] != '\n')
+    --begin;
+  std::size_t suffix = common_run(old.data() + old.size() - 1,
+                                  source.data() + source.size() - 1,
+                                  limit - begin, -1);
+  // Both ends of the edit must fall on a line start in both texts
+  auto starts_line = [](const std::string &text, std::size_t pos) {
+    return pos == 0 || text[pos - 1] == '\n';
+  };
+  auto line_start = [&](std::size_t old_pos) {
+    return old_pos == old.size() || // Empty suffix
+           (starts_line(old, old_pos) &&
+            starts_line(source, old_pos - old.size() + source.size()));
+  };
+  std::size_t old_end = old.size() - suffix;
+  while (!line_start(old_end))
+    ++old_end;
+  std::size_t new_end = old_end - old.size() + source.size();
+
+  std::vector<Line> &lines = s.program.lines;
+  std::pair<std::size_t, std::size_t> cut = lines_between(lines, begin, old_end);
+
+  // Reparse the edited run on its own, then splice it between the lines
+  // before and after it
+  int first_line = 1;
+  std::size_t counted_from = 0;
+  if (cut.first > 0) {
+    first_line = lines[cut.first - 1].line_number;
+    counted_from = lines[cut.first - 1].source_offset;
+  }
+  first_line += static_cast<int>(std::count(source.begin() + counted_from,
+                                            source.begin() + begin, '\n'));
+  int line_shift =
+      static_cast<int>(std::count(source.begin() + begin,
+                                  source.begin() + new_end, '\n')) -
+      static_cast<int>(std::count(old.begin() + begin, old.begin() + old_end,
+                                  '\n'));
+  std::int64_t offset_shift = static_cast<std::int64_t>(new_end) -
+                              static_cast<std::int64_t>(old_end);
+
+  std::vector<Line> edited;
+  if (new_end > begin) {
+    s.text.push_back(source.substr(begin, new_end - begin));
+    s.text_bytes += new_end - begin;
+    edited.swap(lines);
+    parse_source(s.text.back(), s.program,
+                 static_cast<std::uint32_t>(begin), first_line);
+    edited.swap(lines); // `edited` now holds the new lines
+  }
+  stats_.reparsed = edited.size();
+
+  // Index of each line in the previous build, FRESH for reparsed ones
+  std::vector<std::uint32_t> prev;
+  prev.reserve(lines.size() - (cut.second - cut.first) + edited.size());
+  for (std::size_t i = 0; i < cut.first; ++i)
+    prev.push_back(static_cast<std::uint32_t>(i));
+  prev.insert(prev.end(), edited.size(), FRESH);
+  for (std::size_t i = cut.second; i < lines.size(); ++i) {
+    prev.push_back(static_cast<std::uint32_t>(i));
+    lines[i].line_number += line_shift;
+    lines[i].source_offset =
+        static_cast<std::uint32_t>(lines[i].source_offset + offset_shift);
+  }
+  lines.erase(lines.begin() + static_cast<std::ptrdiff_t>(cut.first),
+              lines.begin() + static_cast<std::ptrdiff_t>(cut.second));
+  lines.insert(lines.begin() + static_cast<std::ptrdiff_t>(cut.first),
+               edited.begin(), edited.end());
+
+  // Pass 1 over everything; then a kept line needs encoding again only if
+  // a symbol it names changed value, or it is a jump that moved
+  SymbolTable &symbols = s.program.symbols;
+  std::vector<std::uint32_t> before(symbols.size());
+  for (std::uint32_t id = 0; id < before.size(); ++id)
+    before[id] = symbols.state(id);
+  symbols.undefine_all();
+  LabelIndex label_at;
+  std::vector<std::uint16_t> line_addr;
+  assign_addresses(s.program, line_addr, false,
+                   keep_source_map_ ? &label_at : nullptr, nullptr);
+  std::vector<bool> changed(symbols.size(), true);
+  for (std::uint32_t id = 0; id < before.size(); ++id)
+    changed[id] = symbols.state(id) != before[id];
+
+  auto needs_encoding = [&](std::size_t i) {
+    if (prev[i] == FRESH)
+      return true;
+    const Line &l = lines[i];
+    if (is_jump(l.op) && line_addr[i] != s.line_addr[prev[i]])
+      return true;
+    for (std::size_t k = 0; k < l.operand_count; ++k) {
+      std::uint32_t symbol = s.program.operand(l, k).symbol;
+      if (symbol != SymbolTable::NONE && changed[symbol])
+        return true;
+    }
+    return false;
+  };
+
+  // Previous build's map entry for each of its lines that emitted code
+  std::vector<std::uint32_t> entry_of;
+  if (keep_source_map_) {
+    entry_of.resize(s.line_addr.size());
+    std::uint32_t entry = 0;
+    for (std::size_t j = 0; j < entry_of.size(); ++j) {
+      entry_of[j] = entry;
+      entry += s.line_offset[j + 1] > s.line_offset[j];
+    }
+  }
+
+  // Pass 2: copy unchanged encodings across in runs, encode the rest. A
+  // kept line's map entry is moved over with only its fields refreshed.
+  std::vector<std::uint8_t> bytes;
+  bytes.reserve(bytes_.size() + (new_end - begin));
+  std::vector<std::uint32_t> line_offset(lines.size() + 1);
+  std::vector<SourceMapEntry> map;
+  map.reserve(map_.size() + stats_.reparsed);
+  std::size_t run_begin = 0, run_end = 0; // Pending copy from bytes_
+  auto flush_run = [&]() {
+    bytes.insert(bytes.end(), bytes_.begin() + run_begin,
+                 bytes_.begin() + run_end);
+    run_begin = run_end = 0;
+  };
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    const Line &l = lines[i];
+    bool encode = needs_encoding(i);
+    if (encode) {
+      flush_run();
+      line_offset[i] = static_cast<std::uint32_t>(bytes.size());
+      encode_line(s.program, l, line_addr[i], bytes, nullptr);
+      ++stats_.reencoded;
+    } else {
+      std::uint32_t from = s.line_offset[prev[i]];
+      if (run_end != from) {
+        flush_run();
+        run_begin = run_end = from;
       }
-      out_map->push_back({cur_addr, l.line_number, src_line, instr_bytes});
+      line_offset[i] =
+          static_cast<std::uint32_t>(bytes.size() + (run_end - run_begin));
+      run_end = s.line_offset[prev[i] + 1];
+    }
+    if (!keep_source_map_)
+      continue;
+    std::size_t size = encode ? bytes.size() - line_offset[i]
+                              : s.line_offset[prev[i] + 1] - s.line_offset[prev[i]];
+    if (size == 0)
+      continue;
+    if (prev[i] == FRESH) {
+      map.push_back({line_addr[i], l.line_number, std::string(l.source),
+                     std::vector<std::uint8_t>(bytes.begin() + line_offset[i],
+                                               bytes.end()),
+                     label_name(s.program, label_at, line_addr[i])});
+      continue;
     }
+    map.push_back(std::move(map_[entry_of[prev[i]]]));
+    SourceMapEntry &e = map.back();
+    e.address = line_addr[i];
+    e.line_number = l.line_number;
+    const std::string &label = label_name(s.program, label_at, line_addr[i]);
+    if (e.label != label)
+      e.label = label;
+    if (encode)
+      e.bytes.assign(bytes.begin() + line_offset[i], bytes.end());
   }
+  flush_run();
+  line_offset[lines.size()] = static_cast<std::uint32_t>(bytes.size());
 
-  return bytes;
+  bytes_.swap(bytes);
+  map_.swap(map);
+  s.line_addr.swap(line_addr);
+  s.line_offset.swap(line_offset);
+  s.source = source;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -10,6 +12,53 @@ struct SourceMapEntry {
   int line_number;
   std::string source_line;
   std::vector<std::uint8_t> bytes;
+  std::string label; // First label defined at this address, empty if none
+};
+
+// A 16-bit field in ObjectFile::code the linker patches once addresses are
+// known. Absolute fields (immediates, direct addresses, .word) receive the
+// symbol's address, or the object's load address when `symbol` is empty
+// (a reference to one of the object's own labels, stored as an offset).
+// Relative fields (jump and CALL offsets) receive target - (field + 2),
+// where the target is the symbol or, with no symbol, the absolute address
+// already in the field. The field's existing value is the addend.
+struct Relocation {
+  enum class Kind : std::uint8_t { Absolute = 0, Relative = 1 };
+  std::uint16_t offset; // Byte offset of the field in the code
+  Kind kind;
+  std::string symbol; // Empty: object-local, see above
+};
+
+// Symbol exported with .global, at a byte offset into the code
+struct ObjectSymbol {
+  std::string name;
+  std::uint16_t offset;
+};
+
+// Relocatable object: one section of code assembled at offset 0, placed by
+// link() (linker.hpp). Labels are local unless named by .global; any label
+// the source uses but does not define is an external reference.
+struct ObjectFile {
+  std::vector<std::uint8_t> code;
+  std::vector<ObjectSymbol> symbols;
+  std::vector<Relocation> relocations;
+};
+
+// What the peephole optimizer (AssemblerOptions::optimize) changed
+struct PeepholeStats {
+  std::size_t removed = 0;    // Instructions dropped
+  std::size_t shortened = 0;  // Immediate forms replaced by register forms
+  std::size_t retargeted = 0; // Jumps sent past a chain of JMPs
+  std::size_t bytes_saved = 0;
+};
+
+struct AssemblerOptions {
+  // -O: rewrite redundant instructions (MOV Rx, Rx, PUSH/POP pairs,
+  // ADD Rx, #0, jumps to the next instruction, jump chains) and lay the code
+  // out again. Registers, memory and any flags a later instruction reads
+  // are unchanged; the source map describes the optimized code.
+  bool optimize = false;
+  PeepholeStats *stats = nullptr; // Filled in when optimizing
 };
 
 // Assemble a small subset of the Phase 1 ISA.
@@ -17,4 +66,54 @@ struct SourceMapEntry {
 // If out_map is provided, it will be populated with source mapping info.
 std::vector<std::uint8_t>
 assemble(const std::string &source,
-         std::vector<SourceMapEntry> *out_map = nullptr);
+         std::vector<SourceMapEntry> *out_map = nullptr,
+         const AssemblerOptions &options = AssemblerOptions());
+
+// Assemble `source` into a relocatable object for separate compilation.
+// .org is rejected (the linker places objects); source map addresses are
+// offsets into the object's code.
+ObjectFile assemble_object(const std::string &source,
+                           std::vector<SourceMapEntry> *out_map = nullptr,
+                           const AssemblerOptions &options = AssemblerOptions());
+
+// Reassembles a source that changes a little between calls, such as a file
+// being edited. The parsed lines, their addresses and encodings and the
+// symbol table are kept between updates; only the lines whose text changed
+// are parsed again, and only those, lines naming a symbol whose value
+// changed and jumps that moved are encoded again. Every update returns
+// exactly what assemble() would, errors included; after an error the next
+// update starts from scratch. Flat programs only (no objects).
+class IncrementalAssembler {
+public:
+  struct Stats {
+    std::size_t lines = 0;     // Parsed lines (after macro expansion)
+    std::size_t reparsed = 0;  // Lines tokenized and parsed by this update
+    std::size_t reencoded = 0; // Lines encoded by this update
+    bool full = false;         // Nothing was reused
+  };
+
+  explicit IncrementalAssembler(bool keep_source_map = false);
+  ~IncrementalAssembler();
+  IncrementalAssembler(const IncrementalAssembler &) = delete;
+  IncrementalAssembler &operator=(const IncrementalAssembler &) = delete;
+
+  // Assembles `source`; the result stays valid until the next update
+  const std::vector<std::uint8_t> &update(const std::string &source);
+  // Source map of the last update, if keep_source_map was set
+  const std::vector<SourceMapEntry> &source_map() const { return map_; }
+  const Stats &stats() const { return stats_; }
+  // Forgets the previous build
+  void reset();
+
+private:
+  struct State;
+
+  void rebuild(const std::string &source);
+  void patch(const std::string &source);
+
+  bool keep_source_map_;
+  std::unique_ptr<State> state_;
+  std::vector<std::uint8_t> bytes_;
+  std::vector<SourceMapEntry> map_;
+  Stats stats_;
+};
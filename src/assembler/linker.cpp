@@ -0,0 +1,169 @@
+#include "linker.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+const char MAGIC[] = "SCPUOBJ1";
+constexpr std::size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+// Linked images must stay below the IO page
+constexpr std::uint32_t IMAGE_LIMIT = 0xF000;
+
+void put16(std::vector<std::uint8_t> &out, std::size_t value) {
+  out.push_back(static_cast<std::uint8_t>(value & 0xFF));
+  out.push_back(static_cast<std::uint8_t>((value >> 8) & 0xFF));
+}
+
+void put_name(std::vector<std::uint8_t> &out, const std::string &name) {
+  if (name.size() > 255)
+    throw std::runtime_error("Symbol name too long for object file: " + name);
+  out.push_back(static_cast<std::uint8_t>(name.size()));
+  out.insert(out.end(), name.begin(), name.end());
+}
+
+// Bounds-checked reader over a serialized object
+struct Reader {
+  const std::vector<std::uint8_t> &bytes;
+  std::size_t pos = 0;
+
+  void need(std::size_t n) const {
+    if (bytes.size() - pos < n)
+      throw std::runtime_error("Truncated object file");
+  }
+  std::uint8_t u8() {
+    need(1);
+    return bytes[pos++];
+  }
+  std::uint16_t u16() {
+    need(2);
+    std::uint16_t value =
+        static_cast<std::uint16_t>(bytes[pos] | (bytes[pos + 1] << 8));
+    pos += 2;
+    return value;
+  }
+  std::string name() {
+    std::size_t length = u8();
+    need(length);
+    std::string out(bytes.begin() + pos, bytes.begin() + pos + length);
+    pos += length;
+    return out;
+  }
+};
+
+} // namespace
+
+std::vector<std::uint8_t> write_object(const ObjectFile &object) {
+  if (object.code.size() > 0xFFFF || object.symbols.size() > 0xFFFF ||
+      object.relocations.size() > 0xFFFF)
+    throw std::runtime_error("Object too large");
+  std::vector<std::uint8_t> out(MAGIC, MAGIC + MAGIC_SIZE);
+  put16(out, object.code.size());
+  out.insert(out.end(), object.code.begin(), object.code.end());
+  put16(out, object.symbols.size());
+  for (const ObjectSymbol &sym : object.symbols) {
+    put16(out, sym.offset);
+    put_name(out, sym.name);
+  }
+  put16(out, object.relocations.size());
+  for (const Relocation &reloc : object.relocations) {
+    put16(out, reloc.offset);
+    out.push_back(static_cast<std::uint8_t>(reloc.kind));
+    put_name(out, reloc.symbol);
+  }
+  return out;
+}
+
+ObjectFile read_object(const std::vector<std::uint8_t> &bytes) {
+  if (bytes.size() < MAGIC_SIZE ||
+      !std::equal(MAGIC, MAGIC + MAGIC_SIZE, bytes.begin()))
+    throw std::runtime_error("Not an object file");
+  Reader in{bytes, MAGIC_SIZE};
+  ObjectFile object;
+  std::size_t code_size = in.u16();
+  in.need(code_size);
+  object.code.assign(bytes.begin() + in.pos,
+                     bytes.begin() + in.pos + code_size);
+  in.pos += code_size;
+
+  for (std::size_t n = in.u16(); n > 0; --n) {
+    ObjectSymbol sym;
+    sym.offset = in.u16();
+    sym.name = in.name();
+    if (sym.offset > object.code.size())
+      throw std::runtime_error("Object symbol out of range: " + sym.name);
+    object.symbols.push_back(std::move(sym));
+  }
+  for (std::size_t n = in.u16(); n > 0; --n) {
+    Relocation reloc;
+    reloc.offset = in.u16();
+    std::uint8_t kind = in.u8();
+    if (kind > static_cast<std::uint8_t>(Relocation::Kind::Relative))
+      throw std::runtime_error("Unknown relocation kind");
+    reloc.kind = static_cast<Relocation::Kind>(kind);
+    reloc.symbol = in.name();
+    if (reloc.offset + 2u > object.code.size())
+      throw std::runtime_error("Relocation out of range");
+    object.relocations.push_back(std::move(reloc));
+  }
+  if (in.pos != bytes.size())
+    throw std::runtime_error("Trailing bytes in object file");
+  return object;
+}
+
+std::vector<std::uint8_t> link(const std::vector<ObjectFile> &objects,
+                               std::uint16_t base,
+                               std::vector<LinkedSymbol> *out_symbols) {
+  // Layout: objects back to back, each starting on a word boundary
+  std::vector<std::uint32_t> origin(objects.size());
+  std::uint32_t end = base;
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    origin[i] = end;
+    end += static_cast<std::uint32_t>(objects[i].code.size());
+    end += end & 1;
+  }
+  if (end > IMAGE_LIMIT)
+    throw std::runtime_error("Linked image too large: " +
+                             std::to_string(end - base) + " bytes");
+
+  std::unordered_map<std::string, std::uint16_t> globals;
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    for (const ObjectSymbol &sym : objects[i].symbols) {
+      std::uint16_t address = static_cast<std::uint16_t>(origin[i] + sym.offset);
+      if (!globals.emplace(sym.name, address).second)
+        throw std::runtime_error("Duplicate symbol: " + sym.name);
+      if (out_symbols)
+        out_symbols->push_back({sym.name, address});
+    }
+  }
+
+  std::vector<std::uint8_t> image(end - base, 0);
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    const ObjectFile &object = objects[i];
+    std::uint8_t *code = image.data() + (origin[i] - base);
+    std::copy(object.code.begin(), object.code.end(), code);
+    for (const Relocation &reloc : object.relocations) {
+      if (reloc.offset + 2u > object.code.size())
+        throw std::runtime_error("Relocation out of range");
+      std::uint32_t target;
+      if (reloc.symbol.empty()) {
+        target = reloc.kind == Relocation::Kind::Absolute ? origin[i] : 0;
+      } else {
+        auto it = globals.find(reloc.symbol);
+        if (it == globals.end())
+          throw std::runtime_error("Undefined symbol: " + reloc.symbol);
+        target = it->second;
+      }
+      std::uint8_t *field = code + reloc.offset;
+      std::uint32_t value = static_cast<std::uint32_t>(field[0] | (field[1] << 8));
+      value += target;
+      if (reloc.kind == Relocation::Kind::Relative)
+        value -= origin[i] + reloc.offset + 2; // Relative to the next PC
+      field[0] = static_cast<std::uint8_t>(value & 0xFF);
+      field[1] = static_cast<std::uint8_t>((value >> 8) & 0xFF);
+    }
+  }
+  return image;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "assembler.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// On-disk object format, all integers little-endian:
+//   "SCPUOBJ1"
+//   u16 code size, code bytes
+//   u16 symbol count, per symbol: u16 offset, u8 name length, name
+//   u16 relocation count, per relocation: u16 offset, u8 kind,
+//       u8 symbol name length (0 = object-local), name
+std::vector<std::uint8_t> write_object(const ObjectFile &object);
+// Throws std::runtime_error on a malformed or truncated object
+ObjectFile read_object(const std::vector<std::uint8_t> &bytes);
+
+// Symbol placed by link(), for listings and debugging
+struct LinkedSymbol {
+  std::string name;
+  std::uint16_t address;
+};
+
+// Lays the objects out back to back from `base` (the first object's code
+// is the entry point) and resolves every relocation. Throws
+// std::runtime_error for duplicate or undefined global symbols and images
+// that do not fit below the IO region.
+std::vector<std::uint8_t> link(const std::vector<ObjectFile> &objects,
+                               std::uint16_t base = 0x8000,
+                               std::vector<LinkedSymbol> *out_symbols = nullptr);
@@ -12,56 +12,49 @@ uint16_t ALU::execute(Operation op, uint16_t operand_a, uint16_t operand_b,
   switch (op) {
   case Operation::ADD:
     result = add(operand_a, operand_b);
-    update_flags_arithmetic(result, operand_a, operand_b, false, registers);
+    registers.defer_flags(Registers::FlagOp::ADD, operand_a, operand_b, result);
     break;
 
   case Operation::SUB:
     result = subtract(operand_a, operand_b);
-    update_flags_arithmetic(result, operand_a, operand_b, true, registers);
+    registers.defer_flags(Registers::FlagOp::SUB, operand_a, operand_b, result);
     break;
 
   case Operation::CMP:
     result = subtract(operand_a, operand_b);
-    update_flags_arithmetic(result, operand_a, operand_b, true, registers);
+    registers.defer_flags(Registers::FlagOp::SUB, operand_a, operand_b, result);
     // For CMP, we return the original operand_a (result is discarded)
     return operand_a;
 
   case Operation::AND:
     result = bitwise_and(operand_a, operand_b);
-    update_flags_logical(result, registers);
+    registers.defer_flags(Registers::FlagOp::LOGIC, operand_a, operand_b,
+                          result);
     break;
 
   case Operation::OR:
     result = bitwise_or(operand_a, operand_b);
-    update_flags_logical(result, registers);
+    registers.defer_flags(Registers::FlagOp::LOGIC, operand_a, operand_b,
+                          result);
     break;
 
   case Operation::XOR:
     result = bitwise_xor(operand_a, operand_b);
-    update_flags_logical(result, registers);
+    registers.defer_flags(Registers::FlagOp::LOGIC, operand_a, operand_b,
+                          result);
     break;
 
-  case Operation::SHL: {
+  case Operation::SHL:
     // For shifts, operand_b is the shift amount
-    bool carry_out = false;
-    if (operand_b > 0 && operand_b <= 16) {
-      carry_out = (operand_a & (1 << (16 - operand_b))) != 0;
-    }
     result = shift_left(operand_a, operand_b);
-    update_flags_shift(result, carry_out, registers);
+    registers.defer_flags(Registers::FlagOp::SHL, operand_a, operand_b, result);
     break;
-  }
 
-  case Operation::SHR: {
-    bool carry_out = false;
-    if (operand_b > 0 && operand_b <= 16) {
-      carry_out = (operand_a & (1 << (operand_b - 1))) != 0;
-    }
+  case Operation::SHR:
     result = shift_right(operand_a, operand_b);
-    update_flags_shift(result, carry_out, registers);
+    registers.defer_flags(Registers::FlagOp::SHR, operand_a, operand_b, result);
     break;
   }
-  }
 
   return result;
 }
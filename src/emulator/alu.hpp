@@ -21,7 +21,8 @@ public:
     
     ALU();
     
-    // Main ALU operation - performs operation and updates flags
+    // Main ALU operation - performs operation and updates flags. The flags
+    // are recorded lazily (Registers::defer_flags) and read back the same.
     uint16_t execute(Operation op, uint16_t operand_a, uint16_t operand_b, Registers& registers);
     
     // Individual operations (without flag updates)
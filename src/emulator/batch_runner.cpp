@@ -0,0 +1,249 @@
+#include "batch_runner.hpp"
+#include "lockstep.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// Fixed set of workers, each with its own deque of task indices. Owners
+// pop from the back; idle workers steal from the front of a victim. Tasks
+// are all known up front, so a worker exits once a full pass over every
+// deque comes up empty.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned threads) : queues_(threads) {}
+
+  void run(size_t count, const std::function<void(size_t)> &task) {
+    size_t workers = queues_.size();
+    // Contiguous chunks keep neighbouring jobs on one worker until stolen
+    for (size_t w = 0; w < workers; ++w) {
+      size_t begin = count * w / workers;
+      size_t end = count * (w + 1) / workers;
+      for (size_t i = begin; i < end; ++i)
+        queues_[w].tasks.push_back(i);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; ++w)
+      threads.emplace_back([this, w, &task] { work(w, task); });
+    work(0, task); // The calling thread is worker 0
+    for (auto &t : threads)
+      t.join();
+  }
+
+private:
+  struct Queue {
+    std::mutex mu;
+    std::deque<size_t> tasks;
+  };
+  std::vector<Queue> queues_;
+
+  bool pop_own(size_t w, size_t &out) {
+    std::lock_guard<std::mutex> lock(queues_[w].mu);
+    if (queues_[w].tasks.empty())
+      return false;
+    out = queues_[w].tasks.back();
+    queues_[w].tasks.pop_back();
+    return true;
+  }
+
+  bool steal(size_t w, size_t &out) {
+    for (size_t k = 1; k < queues_.size(); ++k) {
+      Queue &victim = queues_[(w + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mu);
+      if (!victim.tasks.empty()) {
+        out = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(size_t w, const std::function<void(size_t)> &task) {
+    size_t index;
+    while (pop_own(w, index) || steal(w, index))
+      task(index);
+  }
+};
+
+std::string json_escape(const std::string &s) {
+  std::string out;
+  out.reserve(s.size());
+  for (unsigned char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += static_cast<char>(c);
+      }
+    }
+  }
+  return out;
+}
+
+} // namespace
+
+BatchRunner::BatchRunner(unsigned threads, CPU::Engine engine)
+    : threads_(threads), engine_(engine) {
+  if (threads_ == 0)
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+}
+
+BatchResult BatchRunner::run_job(const BatchJob &job) const {
+  BatchResult result;
+  result.name = job.name;
+
+  auto start = std::chrono::steady_clock::now();
+  CPU cpu;
+  cpu.set_engine(engine_);
+  cpu.set_output_callback(
+      [&result](uint8_t value) { result.output.push_back(static_cast<char>(value)); });
+  cpu.get_memory().console().set_input(job.input);
+
+  try {
+    if (job.image)
+      cpu.load_program(*job.image, Memory::PROGRAM_START, share_pages_);
+    else
+      cpu.load_program(job.program);
+    cpu.run(job.max_cycles);
+    result.error = cpu.get_last_error();
+  } catch (const std::exception &ex) {
+    result.error = ex.what(); // e.g. program too large
+  }
+
+  result.halted = cpu.is_halted();
+  result.cycles = cpu.get_cycle_count();
+  for (uint8_t i = 0; i < 4; ++i)
+    result.gpr[i] = cpu.get_registers().get_gpr(i);
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+std::vector<std::vector<size_t>>
+BatchRunner::lockstep_batches(const std::vector<BatchJob> &jobs) const {
+  // Jobs by program, in job order
+  std::vector<std::vector<size_t>> programs;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto same = std::find_if(
+        programs.begin(), programs.end(), [&](const std::vector<size_t> &p) {
+          return LockstepEngine::same_program(jobs[p.front()], jobs[i]);
+        });
+    if (same == programs.end())
+      programs.push_back({i});
+    else
+      same->push_back(i);
+  }
+  std::vector<std::vector<size_t>> batches;
+  for (const std::vector<size_t> &program : programs) {
+    for (size_t begin = 0; begin < program.size(); begin += lockstep_lanes_) {
+      size_t end = std::min(program.size(), begin + lockstep_lanes_);
+      batches.emplace_back(program.begin() + static_cast<ptrdiff_t>(begin),
+                           program.begin() + static_cast<ptrdiff_t>(end));
+    }
+  }
+  return batches;
+}
+
+BatchSummary BatchRunner::run(const std::vector<BatchJob> &jobs) const {
+  BatchSummary summary;
+  summary.results.resize(jobs.size());
+  std::vector<std::vector<size_t>> batches;
+  if (lockstep_lanes_ > 0)
+    batches = lockstep_batches(jobs);
+  size_t tasks = lockstep_lanes_ > 0 ? batches.size() : jobs.size();
+  summary.threads = static_cast<unsigned>(
+      std::min<size_t>(threads_, std::max<size_t>(tasks, 1)));
+
+  auto start = std::chrono::steady_clock::now();
+  WorkStealingPool pool(summary.threads);
+  if (lockstep_lanes_ > 0) {
+    pool.run(batches.size(), [&](size_t b) {
+      const std::vector<size_t> &batch = batches[b];
+      std::vector<const BatchJob *> lanes;
+      for (size_t i : batch)
+        lanes.push_back(&jobs[i]);
+      std::vector<BatchResult> results;
+      try {
+        results = LockstepEngine(engine_).run(lanes);
+      } catch (const std::exception &) {
+        // Program too large: each job reports that on its own CPU
+        for (size_t i : batch)
+          summary.results[i] = run_job(jobs[i]);
+        return;
+      }
+      for (size_t k = 0; k < batch.size(); ++k)
+        summary.results[batch[k]] = std::move(results[k]);
+    });
+  } else {
+    pool.run(jobs.size(),
+             [&](size_t i) { summary.results[i] = run_job(jobs[i]); });
+  }
+  summary.wall_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  for (const auto &r : summary.results)
+    summary.total_instructions += r.cycles;
+  if (summary.wall_seconds > 0)
+    summary.instructions_per_second =
+        static_cast<double>(summary.total_instructions) / summary.wall_seconds;
+  return summary;
+}
+
+std::string BatchRunner::to_json(const BatchSummary &summary) {
+  std::string out = "{\n";
+  char buf[256];
+  std::snprintf(buf, sizeof(buf),
+                "  \"threads\": %u,\n  \"jobs\": %zu,\n"
+                "  \"total_instructions\": %llu,\n"
+                "  \"wall_seconds\": %.6f,\n"
+                "  \"instructions_per_second\": %.0f,\n",
+                summary.threads, summary.results.size(),
+                static_cast<unsigned long long>(summary.total_instructions),
+                summary.wall_seconds, summary.instructions_per_second);
+  out += buf;
+  out += "  \"results\": [\n";
+  for (size_t i = 0; i < summary.results.size(); ++i) {
+    const BatchResult &r = summary.results[i];
+    out += "    {\n      \"name\": \"" + json_escape(r.name) + "\",\n";
+    std::snprintf(buf, sizeof(buf),
+                  "      \"halted\": %s,\n      \"cycles\": %llu,\n"
+                  "      \"seconds\": %.6f,\n"
+                  "      \"registers\": [%u, %u, %u, %u],\n",
+                  r.halted ? "true" : "false",
+                  static_cast<unsigned long long>(r.cycles), r.seconds,
+                  r.gpr[0], r.gpr[1], r.gpr[2], r.gpr[3]);
+    out += buf;
+    out += "      \"error\": \"" + json_escape(r.error) + "\",\n";
+    out += "      \"output\": \"" + json_escape(r.output) + "\"\n    }";
+    out += i + 1 < summary.results.size() ? ",\n" : "\n";
+  }
+  out += "  ]\n}\n";
+  return out;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One independent guest run
+struct BatchJob {
+  std::string name;             // Reported back in the result
+  std::vector<uint8_t> program; // Loaded at PROGRAM_START
+  // Loaded instead of `program` when set; jobs running the same binary can
+  // share one image
+  std::shared_ptr<const ProgramImage> image;
+  std::string input;            // Bytes returned by the input port, then 0
+  uint64_t max_cycles = CPU::DEFAULT_MAX_CYCLES;
+};
+
+struct BatchResult {
+  std::string name;
+  bool halted = false;
+  std::string error;  // CPU exception message, empty on a clean run
+  uint64_t cycles = 0;
+  std::string output; // Everything written to the output port
+  uint16_t gpr[4] = {0, 0, 0, 0};
+  double seconds = 0.0;
+};
+
+struct BatchSummary {
+  std::vector<BatchResult> results; // Same order as the jobs
+  unsigned threads = 0;
+  uint64_t total_instructions = 0;
+  double wall_seconds = 0.0;
+  double instructions_per_second = 0.0;
+};
+
+// Runs many programs concurrently, one CPU per job, on a work-stealing
+// thread pool. Jobs share nothing; guest output is captured per job
+// through the output callback instead of going to stdout.
+class BatchRunner {
+public:
+  // threads == 0 uses std::thread::hardware_concurrency()
+  explicit BatchRunner(unsigned threads = 0,
+                       CPU::Engine engine = CPU::Engine::Reference);
+
+  BatchSummary run(const std::vector<BatchJob> &jobs) const;
+
+  // Map file-backed job images copy-on-write instead of copying them, so
+  // concurrent jobs share the physical program pages (off by default).
+  // Only images opened with keep_descriptor can be mapped; others are
+  // copied.
+  void set_share_program_pages(bool enabled) { share_pages_ = enabled; }
+
+  // Run jobs that load the same program together on a LockstepEngine, up
+  // to `lanes` of them per batch, instead of one CPU per job; 0 (the
+  // default) turns this off. Lanes the lockstep engine hands over finish on
+  // the engine given to the constructor.
+  void set_lockstep_lanes(size_t lanes) { lockstep_lanes_ = lanes; }
+
+  static std::string to_json(const BatchSummary &summary);
+
+private:
+  unsigned threads_;
+  CPU::Engine engine_;
+  bool share_pages_ = false;
+  size_t lockstep_lanes_ = 0;
+
+  BatchResult run_job(const BatchJob &job) const;
+  // Job indices of the lockstep batches, at most lockstep_lanes_ each
+  std::vector<std::vector<size_t>>
+  lockstep_batches(const std::vector<BatchJob> &jobs) const;
+};
@@ -0,0 +1,125 @@
+#include "console.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <unistd.h>
+
+Console::Console() : line_buffered_(isatty(STDOUT_FILENO) != 0) {}
+
+Console::~Console() {
+  flush();
+  close_input();
+}
+
+uint8_t Console::read(uint16_t address) {
+  switch (address) {
+  case DATA_IN:
+    if (input_callback_)
+      return input_callback_();
+    if (!poll_input())
+      return 0;
+    return static_cast<uint8_t>(input_[input_pos_++]);
+  case STATUS:
+    if (input_callback_ || poll_input())
+      return STATUS_INPUT_READY;
+    return input_fd_ < 0 ? STATUS_INPUT_EOF : 0;
+  default:
+    return 0;
+  }
+}
+
+void Console::write(uint16_t address, uint8_t value) {
+  if (address != DATA_OUT)
+    return;
+  if (output_callback_) {
+    output_callback_(value);
+    return;
+  }
+  output_.push_back(static_cast<char>(value));
+  if (!buffered_ || output_.size() >= FLUSH_THRESHOLD ||
+      (line_buffered_ && value == '\n'))
+    flush();
+}
+
+void Console::flush() {
+  if (output_.empty())
+    return;
+  std::cout.write(output_.data(), static_cast<std::streamsize>(output_.size()));
+  std::cout.flush();
+  output_.clear();
+}
+
+void Console::set_output_callback(std::function<void(uint8_t)> callback) {
+  flush();
+  output_callback_ = std::move(callback);
+}
+
+void Console::set_buffered(bool buffered) {
+  buffered_ = buffered;
+  if (!buffered_)
+    flush();
+}
+
+void Console::set_input_callback(std::function<uint8_t()> callback) {
+  close_input();
+  input_callback_ = std::move(callback);
+}
+
+void Console::set_input(std::string data) {
+  close_input();
+  input_callback_ = nullptr;
+  input_ = std::move(data);
+}
+
+void Console::set_input_fd(int fd) {
+  close_input();
+  input_callback_ = nullptr;
+  input_fd_ = fd;
+}
+
+void Console::open_input(const std::string &path) {
+  // O_NONBLOCK so opening a FIFO does not wait for a writer either
+  int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open console input " + path + ": " +
+                             std::strerror(errno));
+  set_input_fd(fd);
+  owns_fd_ = true;
+}
+
+void Console::close_input() {
+  if (owns_fd_ && input_fd_ >= 0)
+    ::close(input_fd_);
+  owns_fd_ = false;
+  input_fd_ = -1;
+  input_.clear();
+  input_pos_ = 0;
+}
+
+bool Console::poll_input() {
+  if (input_pos_ < input_.size())
+    return true;
+  if (input_fd_ < 0)
+    return false;
+  pollfd p{input_fd_, POLLIN, 0};
+  if (::poll(&p, 1, 0) <= 0 || !(p.revents & (POLLIN | POLLHUP)))
+    return false;
+  char chunk[4096];
+  ssize_t n = ::read(input_fd_, chunk, sizeof(chunk));
+  if (n < 0)
+    return false; // EAGAIN/EINTR: nothing yet
+  if (n == 0) {
+    // End of file, or every writer of a pipe has gone
+    if (owns_fd_)
+      ::close(input_fd_);
+    owns_fd_ = false;
+    input_fd_ = -1;
+    return false;
+  }
+  input_.assign(chunk, static_cast<size_t>(n));
+  input_pos_ = 0;
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "device.hpp"
+#include <functional>
+#include <string>
+
+// Character console at 0xF000-0xF002. Neither side blocks the host thread:
+// output collects in a buffer written out in large chunks, and input comes
+// from a pre-read buffer or a file/pipe polled without waiting, so guests
+// can check the status port and do other work until a byte arrives.
+//
+//   0xF000 write: output byte
+//   0xF001 read:  next input byte, 0 if none is ready
+//   0xF002 read:  status, STATUS_INPUT_READY | STATUS_INPUT_EOF
+//
+// Buffered output is written to stdout when the buffer reaches
+// FLUSH_THRESHOLD, on newline when stdout is a terminal, and on flush()
+// (the CPU flushes when it halts and when run() returns).
+class Console : public Device {
+public:
+  static constexpr uint16_t DATA_OUT = 0xF000;
+  static constexpr uint16_t DATA_IN = 0xF001;
+  static constexpr uint16_t STATUS = 0xF002;
+  static constexpr uint8_t STATUS_INPUT_READY = 1 << 0;
+  static constexpr uint8_t STATUS_INPUT_EOF = 1 << 1; // Source exhausted
+  static constexpr size_t FLUSH_THRESHOLD = 16 * 1024;
+
+  Console();
+  ~Console() override;
+  Console(const Console &) = delete;
+  Console &operator=(const Console &) = delete;
+
+  uint8_t read(uint16_t address) override;
+  void write(uint16_t address, uint8_t value) override;
+  void flush() override;
+
+  // Output sink. A callback gets every byte as it is written and does its
+  // own buffering; an empty callback restores the buffered stdout sink.
+  void set_output_callback(std::function<void(uint8_t)> callback);
+  // Unbuffered mode writes each byte through at once, keeping guest output
+  // in order with other host output (e.g. debug tracing)
+  void set_buffered(bool buffered);
+
+  // Input source; each call replaces the previous one. The default source
+  // is stdin. A callback is always reported ready and never reaches EOF.
+  void set_input_callback(std::function<uint8_t()> callback);
+  void set_input(std::string data);
+  void set_input_fd(int fd); // Not closed by the console
+  // Opens a file or FIFO for non-blocking reads; throws std::runtime_error
+  void open_input(const std::string &path);
+
+private:
+  std::function<void(uint8_t)> output_callback_;
+  std::string output_;
+  bool buffered_ = true;
+  bool line_buffered_; // stdout is a terminal
+
+  std::function<uint8_t()> input_callback_;
+  std::string input_;
+  size_t input_pos_ = 0;
+  int input_fd_ = 0;    // -1 once the source is exhausted or replaced
+  bool owns_fd_ = false;
+
+  void close_input();
+  // Pulls whatever the source has without waiting; true if a byte is ready
+  bool poll_input();
+};
@@ -1,14 +1,34 @@
 #include "cpu.hpp"
 #include "memory.hpp"
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <stdexcept>
-
-CPU::CPU() : halted_(false), debug_mode_(false) { reset(); }
+#include <utility>
+
+CPU::CPU()
+    : halted_(false), debug_mode_(false), engine_(Engine::Reference),
+      cycle_count_(0),
+      decode_storage_(DECODE_CACHE_SLOTS * sizeof(CachedInstruction)),
+      decode_cache_(reinterpret_cast<CachedInstruction *>(decode_storage_.data())),
+      decode_cache_enabled_(true) {
+  memory_.set_code_write_callback(
+      [this](uint16_t address) { invalidate_decoded(address); });
+  memory_.set_page_restore_callback(
+      [this](uint8_t page) { invalidate_decoded_page(page); });
+  memory_.set_watch_callback(
+      [this](uint16_t address, bool write) { on_watch(address, write); });
+  select_core();
+  reset();
+}
 
 void CPU::reset() {
   registers_.reset();
   halted_ = false;
+  cycle_count_ = 0;
+  last_error_.clear();
+  if (perf_)
+    perf_->reset(registers_.get_sp());
 
   if (debug_mode_) {
     std::cout << "CPU Reset" << std::endl;
@@ -19,6 +39,8 @@ void CPU::load_program(const std::vector<uint8_t> &program,
                        uint16_t start_address) {
   memory_.load_program(program, start_address);
   registers_.set_pc(start_address);
+  // Program bytes were replaced behind the cache's back
+  invalidate_decoded_range(start_address, start_address + program.size());
 
   if (debug_mode_) {
     std::cout << "Program loaded at 0x" << std::hex << start_address
@@ -27,25 +49,50 @@ void CPU::load_program(const std::vector<uint8_t> &program,
   }
 }
 
-void CPU::run() {
+bool CPU::load_program(const ProgramImage &image, uint16_t start_address,
+                       bool share_pages) {
+  bool shared = memory_.load_program(image, start_address, share_pages);
+  registers_.set_pc(start_address);
+  // A shared mapping also zeroed the rest of its last host page
+  size_t end = start_address + image.size();
+  if (shared) {
+    size_t host_page = HostPages::host_page_size();
+    end = (end + host_page - 1) / host_page * host_page;
+  }
+  invalidate_decoded_range(start_address, static_cast<uint32_t>(end));
+
   if (debug_mode_) {
-    std::cout << "Starting CPU execution..." << std::endl;
+    std::cout << "Program loaded at 0x" << std::hex << start_address
+              << ", size: " << std::dec << image.size() << " bytes"
+              << (shared ? " (shared pages)" : "") << std::endl;
   }
+  return shared;
+}
 
-  const uint32_t MAX_CYCLES = 100000; // Prevent infinite loops
-  uint32_t cycle_count = 0;
+void CPU::run() { run(DEFAULT_MAX_CYCLES); }
 
-  while (!halted_ && step() && cycle_count < MAX_CYCLES) {
-    cycle_count++;
-    if (cycle_count % 10000 == 0 && debug_mode_) {
-      std::cout << "Executed " << cycle_count << " cycles..." << std::endl;
-    }
+void CPU::run(uint64_t max_cycles) {
+  if (debug_mode_) {
+    std::cout << "Starting CPU execution..." << std::endl;
+  }
+
+  uint64_t start = cycle_count_;
+  if (can_use_engine())
+    run_for(max_cycles);
+  else
+    (this->*core_.run)(max_cycles, true);
+  uint64_t executed = cycle_count_ - start;
+  memory_.flush_devices();
+
+  // Cycle-limit stop: HALT and errors already dumped from step()
+  if (!halted_ && tracer_) {
+    tracer_->on_stop();
   }
 
   if (debug_mode_) {
-    std::cout << "CPU execution stopped after " << cycle_count
+    std::cout << "CPU execution stopped after " << executed
               << " cycles. Halted: " << (halted_ ? "Yes" : "No") << std::endl;
-    if (cycle_count >= MAX_CYCLES) {
+    if (!halted_ && executed >= max_cycles) {
       std::cout << "Warning: Execution stopped due to cycle limit (possible "
                    "infinite loop)"
                 << std::endl;
@@ -53,20 +100,271 @@ void CPU::run() {
   }
 }
 
+uint64_t CPU::run_for(uint64_t n) {
+  uint64_t start = cycle_count_;
+  if (can_use_engine()) {
+    stop_ = StopInfo();
+    // Instructions the engines hand to step() are counted there as well;
+    // the engine's own total is authoritative.
+    uint64_t executed = engine_ == Engine::Jit && !has_stops()
+                            ? run_jit(n)
+                            : run_fast(n);
+    cycle_count_ = start + executed;
+    end_pause();
+  } else {
+    (this->*core_.run)(n, false);
+  }
+  memory_.flush_devices();
+  return cycle_count_ - start;
+}
+
+void CPU::set_engine(Engine engine) {
+  engine_ = engine;
+  if (engine_ == Engine::Jit && !jit_)
+    jit_.reset(new Jit(memory_));
+}
+
+uint64_t CPU::run_jit(uint64_t max_instructions) {
+  if (!jit_ || !jit_->available())
+    return run_fast(max_instructions);
+
+  JitContext &ctx = jit_->context();
+  auto load_context = [&]() {
+    for (uint8_t i = 0; i < 4; ++i)
+      ctx.gpr[i] = registers_.get_gpr(i);
+    ctx.pc = registers_.get_pc();
+    ctx.sp = registers_.get_sp();
+    ctx.flags = registers_.get_flags();
+  };
+  auto store_context = [&]() {
+    for (uint8_t i = 0; i < 4; ++i)
+      registers_.set_gpr(i, ctx.gpr[i]);
+    registers_.set_pc(ctx.pc);
+    registers_.set_sp(ctx.sp);
+    registers_.set_flags(ctx.flags);
+  };
+
+  Jit::Decoder decode = [this](uint16_t pc, JitInstruction &out) {
+    const CachedInstruction *entry = lookup_decoded(pc);
+    if (!entry || entry->instr.rd > 3 || entry->instr.rs > 3)
+      return false;
+    out.opcode = static_cast<uint8_t>(entry->instr.opcode);
+    out.mode = static_cast<uint8_t>(entry->instr.mode);
+    out.rd = entry->instr.rd;
+    out.rs = entry->instr.rs;
+    out.extra_word = entry->instr.extra_word;
+    out.length = entry->instr.has_extra_word ? 4 : 2;
+    return true;
+  };
+
+  uint64_t executed = 0;
+  load_context();
+  while (!halted_ && executed < max_instructions) {
+    const JitBlock *block = jit_->lookup(ctx.pc, decode);
+    if (block && block->instructions <= max_instructions - executed &&
+        block->instructions <= memory_.cycles_until_event()) {
+      ctx.halted = 0;
+      jit_->enter(*block);
+      executed += ctx.executed;
+      memory_.tick(ctx.executed);
+      if (ctx.halted)
+        halted_ = true;
+      if (ctx.executed > 0)
+        continue;
+    }
+
+    // Uncompilable instruction, MMIO access, a device event due inside the
+    // block or the tail of the budget
+    store_context();
+    if (uint64_t skipped =
+            fast_forward_timer_spin(max_instructions - executed)) {
+      executed += skipped;
+      load_context();
+      continue;
+    }
+    uint64_t before = cycle_count_;
+    step();
+    executed += cycle_count_ - before; // Zero if the instruction faulted
+    load_context();
+  }
+  store_context();
+  return executed;
+}
+
+void CPU::set_trace_recorder(std::shared_ptr<TraceRecorder> recorder) {
+  tracer_ = std::move(recorder);
+  select_core();
+  if (!tracer_) {
+    memory_.set_trace_callback(nullptr);
+    return;
+  }
+  TraceRecorder *tracer = tracer_.get();
+  memory_.set_trace_callback([tracer](uint16_t addr, uint8_t oldv,
+                                      uint8_t newv) {
+    tracer->record_mem_write(MemWriteEvent{addr, oldv, newv});
+  });
+}
+
 bool CPU::step() {
+  bool running = (this->*core_.step)();
+  end_pause();
+  return running;
+}
+
+template <class Policy> void CPU::run_reference(uint64_t n, bool progress) {
+  uint64_t start = cycle_count_;
+  stop_ = StopInfo();
+  while (!halted_ && cycle_count_ - start < n &&
+         !breakpoint_stops_run(start) && step_impl<Policy>()) {
+    if constexpr (Policy::debug) {
+      uint64_t executed = cycle_count_ - start;
+      if (progress && executed % 10000 == 0)
+        std::cout << "Executed " << executed << " cycles..." << std::endl;
+    }
+  }
+  end_pause();
+}
+
+template <size_t... Masks>
+std::array<CPU::Core, sizeof...(Masks)>
+CPU::core_table(std::index_sequence<Masks...>) {
+  return {{Core{&CPU::step_impl<CorePolicyFor<Masks>>,
+                &CPU::run_reference<CorePolicyFor<Masks>>}...}};
+}
+
+void CPU::select_core() {
+  static const std::array<Core, CORE_POLICY_COUNT> cores =
+      core_table(std::make_index_sequence<CORE_POLICY_COUNT>());
+  unsigned mask = (tracer_ ? 1u : 0u) | (debug_mode_ ? 2u : 0u) |
+                  (perf_ ? 4u : 0u) | (profiler_ ? 8u : 0u);
+  core_ = cores[mask];
+}
+
+void CPU::add_breakpoint(uint16_t pc) { add_breakpoint(pc, BreakCondition()); }
+
+void CPU::add_breakpoint(uint16_t pc, const BreakCondition &condition) {
+  breakpoints_[pc] = condition;
+  invalidate_breakpoint(pc);
+}
+
+bool CPU::remove_breakpoint(uint16_t pc) {
+  if (breakpoints_.erase(pc) == 0)
+    return false;
+  invalidate_breakpoint(pc);
+  return true;
+}
+
+void CPU::invalidate_breakpoint(uint16_t pc) {
+  // The entry at pc is patched, and the one or two before it may have fused
+  // over it
+  invalidate_decoded_range(pc >= 4 ? pc - 4u : 0u, pc + 1u);
+}
+
+bool CPU::BreakCondition::holds(const Registers &registers) const {
+  uint16_t actual = 0;
+  switch (operand) {
+  case Operand::Always:
+    return true;
+  case Operand::R0:
+  case Operand::R1:
+  case Operand::R2:
+  case Operand::R3:
+    actual = registers.get_gpr(static_cast<uint8_t>(operand) -
+                               static_cast<uint8_t>(Operand::R0));
+    break;
+  case Operand::Sp:
+    actual = registers.get_sp();
+    break;
+  case Operand::Pc:
+    actual = registers.get_pc();
+    break;
+  case Operand::Flags:
+    actual = registers.get_flags();
+    break;
+  case Operand::FlagZ:
+    actual = registers.get_flag(Registers::FLAG_Z);
+    break;
+  case Operand::FlagN:
+    actual = registers.get_flag(Registers::FLAG_N);
+    break;
+  case Operand::FlagC:
+    actual = registers.get_flag(Registers::FLAG_C);
+    break;
+  case Operand::FlagV:
+    actual = registers.get_flag(Registers::FLAG_V);
+    break;
+  }
+  switch (compare) {
+  case Compare::Eq:
+    return actual == value;
+  case Compare::Ne:
+    return actual != value;
+  case Compare::Lt:
+    return actual < value;
+  case Compare::Le:
+    return actual <= value;
+  case Compare::Gt:
+    return actual > value;
+  case Compare::Ge:
+    return actual >= value;
+  }
+  return false;
+}
+
+bool CPU::at_breakpoint() const {
+  auto it = breakpoints_.find(registers_.get_pc());
+  return it != breakpoints_.end() && it->second.holds(registers_);
+}
+
+bool CPU::stop_at_breakpoint() {
+  if (!stops_enabled_ || !at_breakpoint())
+    return false;
+  stop_.reason = StopReason::Breakpoint;
+  stop_.address = registers_.get_pc();
+  stop_.write = false;
+  return true;
+}
+
+void CPU::on_watch(uint16_t address, bool write) {
+  // The first watched access of an instruction is the one reported
+  if (!stops_enabled_ || paused_)
+    return;
+  stop_.reason = StopReason::Watchpoint;
+  stop_.address = address;
+  stop_.write = write;
+  paused_ = true;
+  halted_ = true;
+}
+
+void CPU::set_perf_counters_enabled(bool enabled) {
+  if (enabled && !perf_) {
+    perf_.reset(new PerfCounters());
+    perf_->reset(registers_.get_sp());
+  } else if (!enabled) {
+    perf_.reset();
+  }
+  memory_.set_perf_counters(perf_.get());
+  select_core();
+}
+
+template <class Policy> bool CPU::step_impl() {
   if (halted_)
     return false;
 
+  bool traced = false;
   try {
     // Fetch-Decode-Execute cycle
-    static uint32_t cycle_count = 0;
     uint16_t current_pc = registers_.get_pc();
-    fetch();
-    DecodedInstruction instr = decode();
+    DecodedInstruction instr =
+        fetch_and_decode<Policy::traced || Policy::debug>();
 
     // Start trace cycle
-    if (tracer_) {
-      tracer_->start_cycle(cycle_count, current_pc);
+    if constexpr (Policy::traced)
+      traced = tracer_->should_record();
+    if (traced) {
+      tracer_->start_cycle(cycle_count_, current_pc);
+      if (tracer_->wants_keyframe(cycle_count_))
+        tracer_->record_keyframe(memory_.snapshot());
       tracer_->record_registers(registers_);
       DecodedInstrView dv;
       dv.opcode = static_cast<uint8_t>(instr.opcode);
@@ -76,35 +374,67 @@ bool CPU::step() {
       dv.extra_word = instr.extra_word;
       dv.has_extra_word = instr.has_extra_word;
       tracer_->record_decoded(dv);
-
-      // attach memory trace callback for this cycle
-      memory_.set_trace_callback(
-          [this](uint16_t addr, uint8_t oldv, uint8_t newv) {
-            MemWriteEvent ev{addr, oldv, newv};
-            if (tracer_)
-              tracer_->record_mem_write(ev);
-          });
     }
 
-    if (debug_mode_) {
+    if constexpr (Policy::debug)
       print_instruction(instr);
+    if constexpr (Policy::profiled)
+      profiler_->on_instruction(current_pc);
+
+    bool taken = false;
+    if constexpr (Policy::counted) {
+      if (instr.opcode >= Opcode::JZ && instr.opcode <= Opcode::JN)
+        taken = check_condition(instr.opcode);
     }
 
     execute(instr);
 
+    if constexpr (Policy::counted) {
+      uint8_t op = static_cast<uint8_t>(instr.opcode) &
+                   (PerfCounters::OPCODE_COUNT - 1);
+      ++perf_->by_opcode[op];
+      ++perf_->by_mode[static_cast<uint8_t>(instr.mode) &
+                       (PerfCounters::MODE_COUNT - 1)];
+      perf_->reads[PerfCounters::region_of(current_pc)] +=
+          instr.has_extra_word ? 2 : 1;
+      if (instr.opcode >= Opcode::JZ && instr.opcode <= Opcode::JN)
+        ++(taken ? perf_->branches_taken : perf_->branches_not_taken)[op];
+      perf_->observe_sp(registers_.get_sp());
+    }
+
+    if constexpr (Policy::profiled) {
+      if (instr.opcode == Opcode::CALL)
+        profiler_->on_call(registers_.get_pc());
+      else if (instr.opcode == Opcode::RET)
+        profiler_->on_return();
+    }
+
     // Update timer
     memory_.tick();
 
     // finalize trace entry
-    if (tracer_) {
+    if (traced) {
       tracer_->end_cycle();
     }
+    if constexpr (Policy::traced) {
+      if (halted_ && !paused_)
+        tracer_->on_stop();
+    }
 
-    ++cycle_count;
+    ++cycle_count_;
     return !halted_;
   } catch (const std::exception &e) {
+    memory_.flush_devices(); // Guest output first, then the error
     std::cerr << "CPU Error: " << e.what() << std::endl;
+    last_error_ = e.what();
     halted_ = true;
+    paused_ = false;
+    // Keep the faulting cycle in the trace
+    if constexpr (Policy::traced) {
+      if (traced)
+        tracer_->end_cycle();
+      tracer_->on_stop();
+    }
     return false;
   }
 }
@@ -112,37 +442,167 @@ bool CPU::step() {
 void CPU::fetch() {
   // Fetch phase: MAR ← PC, MDR ← MEM[MAR], IR ← MDR, PC ← PC + 2
   registers_.set_mar(registers_.get_pc());
-  registers_.set_mdr(memory_.read_word(registers_.get_mar()));
+  registers_.set_mdr(memory_.fetch_word(registers_.get_mar()));
   registers_.set_ir(registers_.get_mdr());
   registers_.increment_pc(2);
 }
 
 CPU::DecodedInstruction CPU::decode() {
-  DecodedInstruction instr;
-  uint16_t ir = registers_.get_ir();
-
   // Extract fields from instruction word
-  instr.opcode = extract_opcode(ir);
-  instr.mode = extract_mode(ir);
-  instr.rd = extract_rd(ir);
-  instr.rs = extract_rs(ir);
-  instr.has_extra_word = false;
-  instr.extra_word = 0;
+  DecodedInstruction instr = decode_word(registers_.get_ir());
 
   // Check if instruction needs extra word
-  if (instr.mode == AddressingMode::IMMEDIATE ||
-      instr.mode == AddressingMode::DIRECT ||
-      instr.mode == AddressingMode::REGISTER_OFFSET ||
-      instr.mode == AddressingMode::PC_RELATIVE) {
-
-    instr.has_extra_word = true;
-    instr.extra_word = memory_.read_word(registers_.get_pc());
+  if (instr.has_extra_word) {
+    instr.extra_word = memory_.fetch_word(registers_.get_pc());
     registers_.increment_pc(2);
   }
 
   return instr;
 }
 
+bool CPU::mode_has_extra_word(AddressingMode mode) {
+  return mode == AddressingMode::IMMEDIATE || mode == AddressingMode::DIRECT ||
+         mode == AddressingMode::REGISTER_OFFSET ||
+         mode == AddressingMode::PC_RELATIVE;
+}
+
+template <bool Observed> CPU::DecodedInstruction CPU::fetch_and_decode() {
+  uint16_t pc = registers_.get_pc();
+  const CachedInstruction *entry = lookup_decoded(pc);
+  if (!entry) {
+    fetch();
+    return decode();
+  }
+
+  // Internal registers are only observable through the tracer or debug
+  // output, so skip reproducing the fetch phase otherwise.
+  if constexpr (Observed) {
+    registers_.set_mar(pc);
+    registers_.set_mdr(entry->ir);
+    registers_.set_ir(entry->ir);
+  }
+  registers_.increment_pc(entry->instr.has_extra_word ? 4 : 2);
+  return entry->instr;
+}
+
+CPU::CachedInstruction *CPU::lookup_decoded(uint16_t pc) {
+  // Only word-aligned instructions that fit entirely inside the program
+  // region are cached; anything else takes the regular fetch/decode path.
+  if (!decode_cache_enabled_ || (pc & 1) != 0 || pc < Memory::PROGRAM_START ||
+      pc > Memory::PROGRAM_END - 3) {
+    return nullptr;
+  }
+
+  CachedInstruction &entry = decode_cache_[(pc - Memory::PROGRAM_START) >> 1];
+  if (!entry.valid)
+    fill_decoded(entry, pc);
+  return &entry;
+}
+
+void CPU::fill_decoded(CachedInstruction &entry, uint16_t pc) {
+  uint16_t ir = memory_.fetch_word(pc);
+  DecodedInstruction &instr = entry.instr;
+  instr = decode_word(ir);
+  instr.extra_word = instr.has_extra_word ? memory_.fetch_word(pc + 2) : 0;
+  entry.ir = ir;
+  entry.single_handler = fast_handler_for(instr);
+  entry.handler = entry.single_handler;
+  // Pairs are fused on the next instruction's current bytes. Its slot is
+  // not filled here and may be rewritten later without invalidating this
+  // one, so the fused handler re-checks it before running both.
+  uint32_t next = pc + (instr.has_extra_word ? 4u : 2u);
+  if (next <= Memory::PROGRAM_END - 3) {
+    uint16_t next_ir = memory_.fetch_word(static_cast<uint16_t>(next));
+    entry.handler = fast_fused_handler_for(
+        entry.single_handler, fast_handler_for(decode_word(next_ir)));
+  }
+  // A breakpoint patches its own entry and keeps the one before it from
+  // fusing over it
+  if (!breakpoints_.empty()) {
+    if (breakpoints_.count(pc))
+      entry.handler = fast_breakpoint_handler();
+    else if (next <= Memory::PROGRAM_END && breakpoints_.count(next))
+      entry.handler = entry.single_handler;
+  }
+  entry.valid = true;
+  entry.not_timer_spin = false;
+}
+
+void CPU::set_decode_cache_enabled(bool enabled) {
+  decode_cache_enabled_ = enabled;
+  flush_decode_cache();
+}
+
+void CPU::invalidate_decoded(uint16_t address) {
+  // A written byte can belong to the instruction word at its own aligned
+  // address or to the extra word of the instruction one word earlier.
+  uint16_t aligned = address & ~static_cast<uint16_t>(1);
+  size_t slot = (aligned - Memory::PROGRAM_START) >> 1;
+  decode_cache_[slot].valid = false;
+  if (slot > 0)
+    decode_cache_[slot - 1].valid = false;
+  if (jit_)
+    jit_->invalidate(address);
+}
+
+void CPU::invalidate_decoded_page(uint8_t page) {
+  // Same rule as invalidate_decoded(): the slot just before the page may
+  // hold an instruction whose extra word lives in it.
+  uint32_t start = static_cast<uint32_t>(page) << 8;
+  invalidate_decoded_range(start, start + Memory::PAGE_SIZE);
+}
+
+void CPU::invalidate_decoded_range(uint32_t start, uint32_t end) {
+  // Slots covering program bytes in [start, end), plus the one just before
+  start = std::max<uint32_t>(start, Memory::PROGRAM_START);
+  end = std::min<uint32_t>(end, Memory::PROGRAM_END + 1);
+  if (start >= end)
+    return;
+  size_t first = (start - Memory::PROGRAM_START) >> 1;
+  if (first > 0)
+    --first;
+  size_t last = std::min<size_t>(
+      DECODE_CACHE_SLOTS, (end - Memory::PROGRAM_START + 1) >> 1);
+  for (size_t slot = first; slot < last; ++slot)
+    decode_cache_[slot].valid = false;
+  if (jit_)
+    jit_->invalidate_range(static_cast<uint16_t>(start), end);
+}
+
+CPU::Snapshot CPU::snapshot() {
+  Snapshot snap;
+  snap.memory = memory_.snapshot();
+  snap.registers = registers_;
+  snap.halted = halted_;
+  snap.cycle_count = cycle_count_;
+  snap.last_error = last_error_;
+  return snap;
+}
+
+void CPU::restore(const Snapshot &snapshot) {
+  memory_.restore(snapshot.memory);
+  registers_ = snapshot.registers;
+  halted_ = snapshot.halted;
+  cycle_count_ = snapshot.cycle_count;
+  last_error_ = snapshot.last_error;
+}
+
+std::unique_ptr<CPU> CPU::fork() {
+  std::unique_ptr<CPU> child(new CPU());
+  child->set_engine(engine_);
+  child->set_decode_cache_enabled(decode_cache_enabled_);
+  child->set_debug_mode(debug_mode_);
+  child->restore(snapshot());
+  return child;
+}
+
+void CPU::flush_decode_cache() {
+  for (size_t slot = 0; slot < DECODE_CACHE_SLOTS; ++slot)
+    decode_cache_[slot].valid = false;
+  if (jit_)
+    jit_->flush();
+}
+
 void CPU::execute(const DecodedInstruction &instr) {
   switch (instr.opcode) {
   case Opcode::NOP:
@@ -219,6 +679,17 @@ void CPU::execute(const DecodedInstruction &instr) {
 }
 
 // Instruction field extraction
+CPU::DecodedInstruction CPU::decode_word(uint16_t instruction_word) {
+  DecodedInstruction instr;
+  instr.opcode = extract_opcode(instruction_word);
+  instr.mode = extract_mode(instruction_word);
+  instr.rd = extract_rd(instruction_word);
+  instr.rs = extract_rs(instruction_word);
+  instr.has_extra_word = mode_has_extra_word(instr.mode);
+  instr.extra_word = 0;
+  return instr;
+}
+
 CPU::Opcode CPU::extract_opcode(uint16_t instruction_word) {
   return static_cast<Opcode>((instruction_word >> 11) & 0x1F);
 }
@@ -242,6 +713,7 @@ void CPU::execute_nop() {
 
 void CPU::execute_halt() {
   halted_ = true;
+  memory_.flush_devices();
   if (debug_mode_) {
     std::cout << "CPU HALTED" << std::endl;
   }
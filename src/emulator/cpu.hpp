@@ -1,11 +1,20 @@
 #pragma once
 
 #include "alu.hpp"
+#include "jit.hpp"
 #include "memory.hpp"
+#include "perf_counters.hpp"
+#include "profiler.hpp"
 #include "registers.hpp"
 #include "trace_recorder.hpp"
+#include <array>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 class CPU {
@@ -58,30 +67,168 @@ public:
     uint16_t extra_word; // For immediate/address/offset
     bool has_extra_word;
   };
+  // Fields of an instruction word. The extra word is left to the caller:
+  // has_extra_word says whether one follows, and extra_word is 0.
+  static DecodedInstruction decode_word(uint16_t instruction_word);
+
+  // Execution engines. Reference is the straightforward fetch/decode/execute
+  // implementation; Fast dispatches predecoded instructions through a
+  // combined (opcode, addressing mode) handler table; Jit translates basic
+  // blocks to host code (x86-64 only, otherwise it behaves like Fast). All
+  // of them must produce the same architectural state.
+  enum class Engine { Reference, Fast, Jit };
 
   CPU();
   ~CPU() = default;
+  CPU(const CPU &) = delete;
+  CPU &operator=(const CPU &) = delete;
 
   // Main execution interface
   void reset();
   void load_program(const std::vector<uint8_t> &program,
                     uint16_t start_address = 0x8000);
-  void run();  // Run until HALT
+  // Loads an image (see Memory::load_program) and returns true if its pages
+  // are shared with other CPUs loading the same file
+  bool load_program(const ProgramImage &image, uint16_t start_address = 0x8000,
+                    bool share_pages = false);
+  static constexpr uint64_t DEFAULT_MAX_CYCLES = 100000;
+  static constexpr uint64_t UNLIMITED_CYCLES = UINT64_MAX;
+  void run(); // Run until HALT or DEFAULT_MAX_CYCLES
+  // Run until HALT or max_cycles instructions (UNLIMITED_CYCLES: no limit)
+  void run(uint64_t max_cycles);
+  // Execute at most n instructions on the selected engine without debug
+  // banners; returns the number actually retired
+  uint64_t run_for(uint64_t n);
   bool step(); // Execute one instruction, return false if HALT
 
-  // Trace recorder integration
-  void set_trace_recorder(std::shared_ptr<TraceRecorder> recorder) {
-    tracer_ = recorder;
+  // Instructions retired by this CPU since construction or reset(). One
+  // instruction is one cycle in this model.
+  uint64_t get_cycle_count() const { return cycle_count_; }
+
+  // Trace recorder integration. The memory write hook is installed here once
+  // rather than per cycle; pass nullptr to detach.
+  void set_trace_recorder(std::shared_ptr<TraceRecorder> recorder);
+
+  // Performance counters (off by default). While enabled, run() uses the
+  // reference core; the uncounted core is a separate instantiation with no
+  // counting code. Counters are zeroed by enabling and by reset().
+  void set_perf_counters_enabled(bool enabled);
+  const PerfCounters *get_perf_counters() const { return perf_.get(); }
+
+  // Guest profiler integration; pass nullptr to detach. Like tracing, an
+  // attached profiler keeps run() on the reference core.
+  void set_profiler(std::shared_ptr<Profiler> profiler) {
+    profiler_ = std::move(profiler);
+    select_core();
+  }
+
+  // Engine selection. Non-reference engines are used by run() only when no
+  // tracer, profiler or debug output is attached; otherwise the reference
+  // core runs.
+  // step() always executes a single instruction on the reference core.
+  void set_engine(Engine engine);
+  Engine get_engine() const { return engine_; }
+
+  // Predecoded instruction cache (enabled by default)
+  void set_decode_cache_enabled(bool enabled);
+  bool is_decode_cache_enabled() const { return decode_cache_enabled_; }
+
+  // Saved execution state. Memory pages are shared copy-on-write, so a
+  // snapshot is cheap to keep and restoring it only copies pages that were
+  // written (or differ) since. Trace recorders and I/O hooks are not part
+  // of the state.
+  struct Snapshot {
+    std::shared_ptr<const Memory::Snapshot> memory;
+    Registers registers;
+    bool halted = false;
+    uint64_t cycle_count = 0;
+    std::string last_error;
+  };
+  Snapshot snapshot();
+  void restore(const Snapshot &snapshot);
+  // New CPU starting from this one's current state and engine settings
+  std::unique_ptr<CPU> fork();
+
+  // Guest I/O hooks, forwarded to Memory's output/input ports
+  void set_output_callback(std::function<void(uint8_t)> callback) {
+    memory_.set_output_callback(std::move(callback));
+  }
+  void set_input_callback(std::function<uint8_t()> callback) {
+    memory_.set_input_callback(std::move(callback));
+  }
+
+  // Memory-mapped peripherals, forwarded to Memory::attach_device()
+  void attach_device(Device *device, uint16_t first, uint16_t last) {
+    memory_.attach_device(device, first, last);
+  }
+
+  // Debug stops. A breakpoint patches the decode cache entry of its
+  // instruction and a watchpoint marks its pages in Memory, so a run with
+  // neither pays nothing for them. run() and run_for() stop before an
+  // instruction with a breakpoint whose condition holds, except the first
+  // one they execute so a stopped run can be resumed, and after an
+  // instruction whose data access hit a watchpoint. step() ignores
+  // breakpoints. The JIT engine runs as Fast while any stop is set.
+  enum class StopReason { None, Breakpoint, Watchpoint };
+  struct StopInfo {
+    StopReason reason = StopReason::None;
+    uint16_t address = 0; // PC of the breakpoint or watched byte accessed
+    bool write = false;   // Watchpoint hit by a write
+  };
+  // Register or flag predicate checked when a breakpoint is reached, such
+  // as R0 == 5 or C != 0; flags compare as 0 or 1. Always holds by default.
+  struct BreakCondition {
+    enum class Operand : uint8_t {
+      Always, R0, R1, R2, R3, Sp, Pc, Flags, FlagZ, FlagN, FlagC, FlagV
+    };
+    enum class Compare : uint8_t { Eq, Ne, Lt, Le, Gt, Ge };
+    Operand operand = Operand::Always;
+    Compare compare = Compare::Eq;
+    uint16_t value = 0;
+    bool holds(const Registers &registers) const;
+  };
+  // Adding a breakpoint that exists replaces its condition
+  void add_breakpoint(uint16_t pc);
+  void add_breakpoint(uint16_t pc, const BreakCondition &condition);
+  bool remove_breakpoint(uint16_t pc);
+  const std::map<uint16_t, BreakCondition> &breakpoints() const {
+    return breakpoints_;
+  }
+  // Memory::WATCH_* kinds over first..last, forwarded to Memory
+  void add_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    memory_.add_watchpoint(first, last, kind);
   }
+  bool remove_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    return memory_.remove_watchpoint(first, last, kind);
+  }
+  // True if the instruction at PC has a breakpoint whose condition holds
+  bool at_breakpoint() const;
+  // Why the last run() or run_for() returned early (reset by each call)
+  const StopInfo &get_stop() const { return stop_; }
+  // Stops are on by default; while off, breakpoints and watchpoints stay
+  // set but never stop a run (a replaying debugger re-executes past them)
+  void set_stops_enabled(bool enabled) { stops_enabled_ = enabled; }
+
+  // Message of the exception that halted the CPU, empty if none
+  const std::string &get_last_error() const { return last_error_; }
 
-  // CPU state access
+  // CPU state access. Registers written from outside take effect at the
+  // next instruction.
   const Registers &get_registers() const { return registers_; }
+  Registers &get_registers() { return registers_; }
   const Memory &get_memory() const { return memory_; }
+  Memory &get_memory() { return memory_; }
   bool is_halted() const { return halted_; }
 
   // Debug interface
   void dump_state() const;
-  void set_debug_mode(bool enabled) { debug_mode_ = enabled; }
+  // Debug output is interleaved with guest output, so the console writes
+  // through unbuffered while it is on
+  void set_debug_mode(bool enabled) {
+    debug_mode_ = enabled;
+    memory_.console().set_buffered(!enabled);
+    select_core();
+  }
 
 private:
   // CPU components
@@ -92,17 +239,105 @@ private:
   // CPU state
   bool halted_;
   bool debug_mode_;
+  Engine engine_;
+  uint64_t cycle_count_;
+  std::string last_error_;
+
+  // Debug stops. A watchpoint hit sets halted_ along with paused_ so the
+  // engines leave their loops through the usual halt check; the run then
+  // clears both.
+  std::map<uint16_t, BreakCondition> breakpoints_;
+  StopInfo stop_;
+  bool stops_enabled_ = true;
+  bool paused_ = false;
+  bool has_stops() const {
+    return !breakpoints_.empty() || !memory_.watchpoints().empty();
+  }
+  // Records a breakpoint stop if at_breakpoint()
+  bool stop_at_breakpoint();
+  // Reference loops: stop before any instruction but the run's first
+  bool breakpoint_stops_run(uint64_t run_start) {
+    return !breakpoints_.empty() && cycle_count_ != run_start &&
+           stop_at_breakpoint();
+  }
+  void on_watch(uint16_t address, bool write);
+  void end_pause() {
+    if (paused_) {
+      paused_ = false;
+      halted_ = false;
+    }
+  }
+  void invalidate_breakpoint(uint16_t pc);
+
+  // Predecoded instruction cache entry. One slot per word-aligned address
+  // in the program region; filled lazily on first fetch and invalidated by
+  // Memory when a byte covered by the instruction is overwritten.
+  struct CachedInstruction {
+    DecodedInstruction instr;
+    uint16_t ir; // Raw instruction word, replayed into IR/MDR when observed
+    // Fast core handler: either the one for this (opcode, mode) pair alone
+    // or a fused one that also executes the instruction after it
+    uint8_t handler;
+    uint8_t single_handler; // Handler for this instruction alone
+    bool valid;
+    bool not_timer_spin; // Shape rules out a timer spin loop starting here
+  };
+  static constexpr size_t DECODE_CACHE_SLOTS =
+      (Memory::PROGRAM_END - Memory::PROGRAM_START + 1) / 2;
+  // Backed by zero pages, which read as invalid entries, so a CPU only pays
+  // for the slots its program actually touches
+  static_assert(std::is_trivially_copyable<CachedInstruction>::value,
+                "decode cache entries live in raw zero-filled memory");
+  HostPages decode_storage_;
+  CachedInstruction *decode_cache_;
+  bool decode_cache_enabled_;
 
   // Fetch-Decode-Execute cycle
   void fetch();
   DecodedInstruction decode();
+  // Observed: internal registers are visible (tracer or debug output), so
+  // cached instructions also replay the fetch phase into IR/MAR/MDR
+  template <bool Observed> DecodedInstruction fetch_and_decode();
+  static bool mode_has_extra_word(AddressingMode mode);
+
+  // Decode cache maintenance
+  CachedInstruction *lookup_decoded(uint16_t pc);
+  void fill_decoded(CachedInstruction &entry, uint16_t pc);
+  void invalidate_decoded(uint16_t address);
+  void invalidate_decoded_page(uint8_t page);
+  void invalidate_decoded_range(uint32_t start, uint32_t end);
+  void flush_decode_cache();
   void execute(const DecodedInstruction &instr);
 
+  // Fast interpreter core (cpu_fast.cpp). Executes at most max_instructions
+  // and returns the number actually retired; cycle_count_ is left to the
+  // caller.
+  uint64_t run_fast(uint64_t max_instructions);
+  static uint8_t fast_handler_for(const DecodedInstruction &instr);
+  // Handler patched over instructions with a breakpoint
+  static uint8_t fast_breakpoint_handler();
+  // Fused handler for a pair of adjacent instructions with the given single
+  // handlers, or `first` if the pair is not fused
+  static uint8_t fast_fused_handler_for(uint8_t first, uint8_t second);
+
+  // Idle fast-forward for the fast and JIT engines. If PC is the head of
+  //   LOAD Rx, <timer counter>; CMP Rx, #imm|Ry; Jcc <head>
+  // retires every iteration that would branch back (at most `budget`
+  // instructions, whole iterations only) in one step: the timer, Rx and
+  // flags end up exactly as plain execution leaves them. Returns the
+  // number of instructions retired; cycle_count_ is left to the caller.
+  uint64_t fast_forward_timer_spin(uint64_t budget);
+
+  // Block JIT driver. Compiled blocks run until a branch or a bail-out;
+  // everything else is interpreted one step at a time.
+  std::unique_ptr<Jit> jit_;
+  uint64_t run_jit(uint64_t max_instructions);
+
   // Instruction decoding helpers
-  Opcode extract_opcode(uint16_t instruction_word);
-  AddressingMode extract_mode(uint16_t instruction_word);
-  uint8_t extract_rd(uint16_t instruction_word);
-  uint8_t extract_rs(uint16_t instruction_word);
+  static Opcode extract_opcode(uint16_t instruction_word);
+  static AddressingMode extract_mode(uint16_t instruction_word);
+  static uint8_t extract_rd(uint16_t instruction_word);
+  static uint8_t extract_rs(uint16_t instruction_word);
 
   // Addressing mode resolution
   uint16_t resolve_operand(const DecodedInstruction &instr,
@@ -134,4 +369,44 @@ private:
   std::string opcode_to_string(Opcode opcode) const;
   std::string mode_to_string(AddressingMode mode) const;
   std::shared_ptr<TraceRecorder> tracer_;
+  std::shared_ptr<Profiler> profiler_;
+  std::unique_ptr<PerfCounters> perf_;
+
+  // Reference core configurations. Every way of observing execution is a
+  // compile-time switch, so the instantiation for a CPU with nothing
+  // attached has no per-instruction checks for any of them. The attach and
+  // enable calls above pick the instantiation run() and step() use.
+  template <bool Traced, bool Debug, bool Counted, bool Profiled>
+  struct CorePolicy {
+    static constexpr bool traced = Traced;
+    static constexpr bool debug = Debug;
+    static constexpr bool counted = Counted;
+    static constexpr bool profiled = Profiled;
+  };
+  // Policy for a feature mask: bit 0 traced, 1 debug, 2 counted, 3 profiled
+  template <unsigned Mask>
+  using CorePolicyFor = CorePolicy<(Mask & 1) != 0, (Mask & 2) != 0,
+                                   (Mask & 4) != 0, (Mask & 8) != 0>;
+  static constexpr unsigned CORE_POLICY_COUNT = 16;
+  template <class Policy> bool step_impl();
+  // Reference loop for run() and run_for(); `progress` prints a line every
+  // 10000 cycles in debug mode
+  template <class Policy> void run_reference(uint64_t n, bool progress);
+  using StepFn = bool (CPU::*)();
+  using RunFn = void (CPU::*)(uint64_t, bool);
+  struct Core {
+    StepFn step;
+    RunFn run;
+  };
+  template <size_t... Masks>
+  static std::array<Core, sizeof...(Masks)>
+  core_table(std::index_sequence<Masks...>);
+  Core core_;
+  void select_core();
+
+  // True when run() may hand execution to the fast or JIT engine
+  bool can_use_engine() const {
+    return engine_ != Engine::Reference && !tracer_ && !profiler_ && !perf_ &&
+           !debug_mode_;
+  }
 };
\ No newline at end of file
@@ -0,0 +1,717 @@
+#include "cpu.hpp"
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <stdexcept>
+
+// Fast interpreter core.
+//
+// Every predecoded instruction carries a handler index chosen from its
+// (opcode, addressing mode) pair, so executing an instruction is a single
+// indirect jump into code specialised for both. Register state is kept in
+// locals for the duration of the run and written back on exit. Anything the
+// fast core does not model exactly (invalid modes, register indices above
+// R3, code outside the cached program region) is handed to CPU::step() so
+// the reference core stays the single source of truth for edge cases.
+//
+// Common adjacent pairs (compare or subtract followed by a conditional
+// branch, back-to-back pushes or pops) get fused handlers that run both
+// instructions under one dispatch. The second instruction still retires
+// separately: it is counted, the devices tick in between, and the pair is
+// split whenever the second one has changed or the budget ends after the
+// first, so state and cycle counts match stepping. The branch condition is
+// computed from the operands; the flags are still written as usual.
+
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+    !defined(CPU_FAST_NO_COMPUTED_GOTO)
+#define CPU_FAST_COMPUTED_GOTO 1
+#else
+#define CPU_FAST_COMPUTED_GOTO 0
+#endif
+
+namespace {
+
+// Handler list. Value operations take a source operand in any of the six
+// addressing modes; address operations need an effective address and so
+// only exist for the four memory modes.
+#define FAST_VALUE_MODES(X, OP)                                                \
+  X(OP##_REG) X(OP##_IMM) X(OP##_DIR) X(OP##_IND) X(OP##_OFF) X(OP##_REL)
+#define FAST_ADDRESS_MODES(X, OP)                                              \
+  X(OP##_DIR) X(OP##_IND) X(OP##_OFF) X(OP##_REL)
+
+// Fused pairs of a register or immediate compare/subtract and a direct or
+// PC-relative conditional branch, laid out in Jcc opcode order
+#define FAST_BRANCH_FUSIONS(X, OP)                                             \
+  X(OP##_JZ_DIR) X(OP##_JZ_REL) X(OP##_JNZ_DIR) X(OP##_JNZ_REL)                \
+  X(OP##_JC_DIR) X(OP##_JC_REL) X(OP##_JNC_DIR) X(OP##_JNC_REL)                \
+  X(OP##_JN_DIR) X(OP##_JN_REL)
+
+#define FAST_HANDLERS(X)                                                       \
+  X(FALLBACK) X(NOP) X(HALT) X(RET) X(PUSH) X(POP)                             \
+  FAST_VALUE_MODES(X, MOV) FAST_VALUE_MODES(X, ADD) FAST_VALUE_MODES(X, SUB)   \
+  FAST_VALUE_MODES(X, AND) FAST_VALUE_MODES(X, OR) FAST_VALUE_MODES(X, XOR)    \
+  FAST_VALUE_MODES(X, CMP) FAST_VALUE_MODES(X, SHL) FAST_VALUE_MODES(X, SHR)   \
+  FAST_VALUE_MODES(X, IN) FAST_VALUE_MODES(X, OUT)                             \
+  FAST_ADDRESS_MODES(X, LOAD) FAST_ADDRESS_MODES(X, STORE)                     \
+  FAST_ADDRESS_MODES(X, JMP) FAST_ADDRESS_MODES(X, JZ)                         \
+  FAST_ADDRESS_MODES(X, JNZ) FAST_ADDRESS_MODES(X, JC)                         \
+  FAST_ADDRESS_MODES(X, JNC) FAST_ADDRESS_MODES(X, JN)                         \
+  FAST_ADDRESS_MODES(X, CALL)                                                  \
+  FAST_BRANCH_FUSIONS(X, CMP_REG) FAST_BRANCH_FUSIONS(X, CMP_IMM)              \
+  FAST_BRANCH_FUSIONS(X, SUB_REG) FAST_BRANCH_FUSIONS(X, SUB_IMM)              \
+  X(PUSH_PUSH) X(POP_POP) X(BREAKPOINT)
+
+enum FastHandler : uint8_t {
+#define FAST_ENUM(name) H_##name,
+  FAST_HANDLERS(FAST_ENUM)
+#undef FAST_ENUM
+      H_COUNT
+};
+
+// Value handlers are laid out REG..REL, matching AddressingMode 0..5.
+constexpr uint8_t value_handler(uint8_t base, uint8_t mode) {
+  return mode <= 5 ? static_cast<uint8_t>(base + mode)
+                   : static_cast<uint8_t>(H_FALLBACK);
+}
+
+// Address handlers are laid out DIR..REL, matching AddressingMode 2..5.
+constexpr uint8_t address_handler(uint8_t base, uint8_t mode) {
+  return (mode >= 2 && mode <= 5) ? static_cast<uint8_t>(base + mode - 2)
+                                  : static_cast<uint8_t>(H_FALLBACK);
+}
+
+constexpr uint8_t handler_for(uint8_t opcode, uint8_t mode) {
+  switch (opcode) {
+  case 0:
+    return H_NOP;
+  case 1:
+    return H_HALT;
+  case 2:
+    return value_handler(H_MOV_REG, mode);
+  case 3:
+    return address_handler(H_LOAD_DIR, mode);
+  case 4:
+    return address_handler(H_STORE_DIR, mode);
+  case 5:
+    return value_handler(H_ADD_REG, mode);
+  case 6:
+    return value_handler(H_SUB_REG, mode);
+  case 7:
+    return value_handler(H_AND_REG, mode);
+  case 8:
+    return value_handler(H_OR_REG, mode);
+  case 9:
+    return value_handler(H_XOR_REG, mode);
+  case 10:
+    return value_handler(H_CMP_REG, mode);
+  case 11:
+    return value_handler(H_SHL_REG, mode);
+  case 12:
+    return value_handler(H_SHR_REG, mode);
+  case 13:
+    return address_handler(H_JMP_DIR, mode);
+  case 14:
+    return address_handler(H_JZ_DIR, mode);
+  case 15:
+    return address_handler(H_JNZ_DIR, mode);
+  case 16:
+    return address_handler(H_JC_DIR, mode);
+  case 17:
+    return address_handler(H_JNC_DIR, mode);
+  case 18:
+    return address_handler(H_JN_DIR, mode);
+  case 19:
+    return address_handler(H_CALL_DIR, mode);
+  case 20:
+    return H_RET;
+  case 21:
+    return H_PUSH;
+  case 22:
+    return H_POP;
+  case 23:
+    return value_handler(H_IN_REG, mode);
+  case 24:
+    return value_handler(H_OUT_REG, mode);
+  default:
+    return H_FALLBACK;
+  }
+}
+
+// Combined handler table indexed by (opcode << 3) | mode.
+constexpr std::array<uint8_t, 256> build_handler_table() {
+  std::array<uint8_t, 256> table{};
+  for (int key = 0; key < 256; ++key)
+    table[key] = handler_for(static_cast<uint8_t>(key >> 3),
+                             static_cast<uint8_t>(key & 0x07));
+  return table;
+}
+
+constexpr std::array<uint8_t, 256> HANDLER_TABLE = build_handler_table();
+
+// Single handlers of the Jcc family are laid out DIR..REL per opcode, JZ..JN
+constexpr uint8_t branch_fusion(uint8_t base, uint8_t second) {
+  return (second >= H_JZ_DIR && second <= H_JN_REL &&
+          ((second - H_JZ_DIR) % 4 == 0 || (second - H_JZ_DIR) % 4 == 3))
+             ? static_cast<uint8_t>(base + (second - H_JZ_DIR) / 4 * 2 +
+                                    ((second - H_JZ_DIR) % 4 == 3 ? 1 : 0))
+             : static_cast<uint8_t>(H_FALLBACK);
+}
+
+constexpr uint8_t fused_handler(uint8_t first, uint8_t second) {
+  switch (first) {
+  case H_CMP_REG:
+    return branch_fusion(H_CMP_REG_JZ_DIR, second);
+  case H_CMP_IMM:
+    return branch_fusion(H_CMP_IMM_JZ_DIR, second);
+  case H_SUB_REG:
+    return branch_fusion(H_SUB_REG_JZ_DIR, second);
+  case H_SUB_IMM:
+    return branch_fusion(H_SUB_IMM_JZ_DIR, second);
+  case H_PUSH:
+    return second == H_PUSH ? H_PUSH_PUSH : H_FALLBACK;
+  case H_POP:
+    return second == H_POP ? H_POP_POP : H_FALLBACK;
+  default:
+    return H_FALLBACK;
+  }
+}
+
+static_assert(fused_handler(H_CMP_IMM, H_JNC_REL) == H_CMP_IMM_JNC_REL &&
+                  fused_handler(H_SUB_REG, H_JN_DIR) == H_SUB_REG_JN_DIR &&
+                  fused_handler(H_CMP_REG, H_JZ_IND) == H_FALLBACK,
+              "fused handlers follow the Jcc handler layout");
+
+// Flag bits as laid out in the FLAGS register
+constexpr uint8_t F_Z = 1 << Registers::FLAG_Z;
+constexpr uint8_t F_N = 1 << Registers::FLAG_N;
+constexpr uint8_t F_C = 1 << Registers::FLAG_C;
+constexpr uint8_t F_V = 1 << Registers::FLAG_V;
+
+// ALU operations with the same results and flags as ALU::execute
+inline uint8_t flags_zn(uint16_t result) {
+  return static_cast<uint8_t>((result == 0 ? F_Z : 0) |
+                              ((result & 0x8000) ? F_N : 0));
+}
+
+inline uint16_t fast_add(uint16_t a, uint16_t b, uint8_t &flags) {
+  uint32_t wide = static_cast<uint32_t>(a) + static_cast<uint32_t>(b);
+  uint16_t result = static_cast<uint16_t>(wide);
+  flags = static_cast<uint8_t>(flags_zn(result) | (wide > 0xFFFF ? F_C : 0) |
+                               ((~(a ^ b) & (a ^ result) & 0x8000) ? F_V : 0));
+  return result;
+}
+
+inline uint16_t fast_sub(uint16_t a, uint16_t b, uint8_t &flags) {
+  uint16_t result = static_cast<uint16_t>(a - b);
+  flags = static_cast<uint8_t>(flags_zn(result) | (a < b ? F_C : 0) |
+                               (((a ^ b) & (a ^ result) & 0x8000) ? F_V : 0));
+  return result;
+}
+
+inline uint16_t fast_logic(uint16_t result, uint8_t &flags) {
+  flags = flags_zn(result);
+  return result;
+}
+
+inline uint16_t fast_shl(uint16_t a, uint16_t b, uint8_t &flags) {
+  bool carry = b > 0 && b <= 16 && (a & (1 << (16 - b))) != 0;
+  uint16_t result = b >= 16 ? 0 : static_cast<uint16_t>(a << b);
+  flags = static_cast<uint8_t>(flags_zn(result) | (carry ? F_C : 0));
+  return result;
+}
+
+inline uint16_t fast_shr(uint16_t a, uint16_t b, uint8_t &flags) {
+  bool carry = b > 0 && b <= 16 && (a & (1 << (b - 1))) != 0;
+  uint16_t result = b >= 16 ? 0 : static_cast<uint16_t>(a >> b);
+  flags = static_cast<uint8_t>(flags_zn(result) | (carry ? F_C : 0));
+  return result;
+}
+
+} // namespace
+
+uint8_t CPU::fast_handler_for(const DecodedInstruction &instr) {
+  // Out-of-range register fields raise errors in Registers; let the
+  // reference core produce them.
+  if (instr.rd > 3 || instr.rs > 3)
+    return H_FALLBACK;
+  return HANDLER_TABLE[(static_cast<uint8_t>(instr.opcode) << 3) |
+                       static_cast<uint8_t>(instr.mode)];
+}
+
+uint8_t CPU::fast_breakpoint_handler() { return H_BREAKPOINT; }
+
+uint8_t CPU::fast_fused_handler_for(uint8_t first, uint8_t second) {
+  uint8_t fused = fused_handler(first, second);
+  return fused == H_FALLBACK ? first : fused;
+}
+
+uint64_t CPU::fast_forward_timer_spin(uint64_t budget) {
+  uint16_t head = registers_.get_pc();
+  CachedInstruction *load = lookup_decoded(head);
+  // Device events must fire between the same instructions as when stepping
+  budget = std::min(budget, memory_.cycles_until_event());
+  // Skipped iterations would pass breakpoints and watched reads unseen
+  if (!load || load->not_timer_spin || budget < 3 || has_stops())
+    return 0;
+
+  // Static shape of the loop; a mismatch is remembered on the head entry.
+  // The branch and compare are re-checked every time since rewriting them
+  // does not invalidate the head.
+  const DecodedInstruction &ld = load->instr;
+  uint16_t cmp_pc = static_cast<uint16_t>(head + (ld.has_extra_word ? 4 : 2));
+  const CachedInstruction *cmp = lookup_decoded(cmp_pc);
+  uint16_t jcc_pc = 0;
+  const CachedInstruction *jcc = nullptr;
+  if (cmp) {
+    jcc_pc = static_cast<uint16_t>(cmp_pc + (cmp->instr.has_extra_word ? 4 : 2));
+    jcc = lookup_decoded(jcc_pc);
+  }
+  bool shape =
+      ld.opcode == Opcode::LOAD && ld.rd <= 3 && ld.rs <= 3 &&
+      (ld.mode == AddressingMode::DIRECT ||
+       (ld.mode == AddressingMode::REGISTER_INDIRECT && ld.rs != ld.rd)) &&
+      cmp && cmp->instr.opcode == Opcode::CMP && cmp->instr.rd == ld.rd &&
+      cmp->instr.rs <= 3 &&
+      (cmp->instr.mode == AddressingMode::IMMEDIATE ||
+       cmp->instr.mode == AddressingMode::REGISTER) &&
+      jcc && jcc->instr.opcode >= Opcode::JZ && jcc->instr.opcode <= Opcode::JN &&
+      ((jcc->instr.mode == AddressingMode::DIRECT &&
+        jcc->instr.extra_word == head) ||
+       (jcc->instr.mode == AddressingMode::PC_RELATIVE &&
+        static_cast<uint16_t>(jcc_pc + 4 +
+                              static_cast<int16_t>(jcc->instr.extra_word)) ==
+            head));
+  if (!shape) {
+    load->not_timer_spin = true;
+    return 0;
+  }
+
+  // Dynamic conditions: the load must actually hit the timer counter
+  uint16_t address = ld.mode == AddressingMode::DIRECT
+                         ? ld.extra_word
+                         : registers_.get_gpr(ld.rs);
+  if (address != Memory::IO_TIMER_BASE || !memory_.has_builtin_timer())
+    return 0;
+  bool compare_self = cmp->instr.mode == AddressingMode::REGISTER &&
+                      cmp->instr.rs == ld.rd;
+  uint16_t operand = cmp->instr.mode == AddressingMode::IMMEDIATE
+                         ? cmp->instr.extra_word
+                         : registers_.get_gpr(cmp->instr.rs);
+  Opcode cond = jcc->instr.opcode;
+  auto branches_back = [&](uint16_t value, uint8_t &flags) {
+    fast_sub(value, compare_self ? value : operand, flags);
+    switch (cond) {
+    case Opcode::JZ:
+      return (flags & F_Z) != 0;
+    case Opcode::JNZ:
+      return (flags & F_Z) == 0;
+    case Opcode::JC:
+      return (flags & F_C) != 0;
+    case Opcode::JNC:
+      return (flags & F_C) == 0;
+    default:
+      return (flags & F_N) != 0;
+    }
+  };
+
+  // Iteration k reads the counter 3k ticks after entry. A running counter
+  // cycles through all 65536 values (3 is odd), so a loop that has not
+  // exited after that many iterations never will; a stopped one never
+  // changes.
+  const uint64_t max_iterations = budget / 3;
+  const uint16_t start = memory_.get_timer_counter();
+  const bool running = memory_.is_timer_running();
+  uint64_t iterations = 0;
+  uint16_t last = start;
+  uint8_t flags = 0;
+  for (;;) {
+    if (iterations == max_iterations)
+      break;
+    if (iterations == (running ? 0x10000u : 1u)) {
+      iterations = max_iterations; // Spins until the budget runs out
+      break;
+    }
+    uint16_t value = static_cast<uint16_t>(
+        start + (running ? 3 * iterations : 0));
+    uint8_t f;
+    if (!branches_back(value, f))
+      break;
+    last = value;
+    flags = f;
+    ++iterations;
+  }
+  if (iterations == 0)
+    return 0;
+
+  if (running) {
+    last = static_cast<uint16_t>(start + 3 * (iterations - 1));
+    branches_back(last, flags);
+  }
+  registers_.set_gpr(ld.rd, last);
+  registers_.set_flags(flags);
+  memory_.tick(3 * iterations);
+  return 3 * iterations;
+}
+
+uint64_t CPU::run_fast(uint64_t max_instructions) {
+  uint16_t r[4];
+  for (uint8_t i = 0; i < 4; ++i)
+    r[i] = registers_.get_gpr(i);
+  uint16_t pc = registers_.get_pc();
+  uint16_t sp = registers_.get_sp();
+  uint8_t flags = registers_.get_flags();
+
+  uint64_t executed = 0;
+  uint16_t instr_pc = pc;
+  const CachedInstruction *e = nullptr;
+  uint8_t h = H_FALLBACK;
+
+  auto write_back = [&]() {
+    for (uint8_t i = 0; i < 4; ++i)
+      registers_.set_gpr(i, r[i]);
+    registers_.set_pc(pc);
+    registers_.set_sp(sp);
+    registers_.set_flags(flags);
+  };
+
+  auto reload = [&]() {
+    for (uint8_t i = 0; i < 4; ++i)
+      r[i] = registers_.get_gpr(i);
+    pc = registers_.get_pc();
+    sp = registers_.get_sp();
+    flags = registers_.get_flags();
+  };
+
+// Fetch the next predecoded instruction and advance PC past it
+#define FAST_FETCH()                                                           \
+  if (halted_ || executed >= max_instructions)                                 \
+    goto done;                                                                 \
+  instr_pc = pc;                                                               \
+  e = lookup_decoded(pc);                                                      \
+  h = H_FALLBACK;                                                              \
+  if (e) {                                                                     \
+    pc = static_cast<uint16_t>(pc + (e->instr.has_extra_word ? 4 : 2));        \
+    h = e->handler;                                                            \
+  }                                                                            \
+  ++executed;
+
+#if CPU_FAST_COMPUTED_GOTO
+  static const void *const labels[H_COUNT] = {
+#define FAST_LABEL(name) &&L_##name,
+      FAST_HANDLERS(FAST_LABEL)
+#undef FAST_LABEL
+  };
+#define HANDLER(name) L_##name:
+// Threaded dispatch: every handler ends with its own copy of fetch + jump
+#define NEXT()                                                                 \
+  do {                                                                         \
+    memory_.tick();                                                            \
+    FAST_FETCH();                                                              \
+    goto *labels[h];                                                           \
+  } while (0)
+#define NEXT_NO_TICK()                                                         \
+  do {                                                                         \
+    FAST_FETCH();                                                              \
+    goto *labels[h];                                                           \
+  } while (0)
+// Jump to handler h for the current instruction
+#define REDISPATCH() goto *labels[h]
+#define DISPATCH_BEGIN()                                                       \
+  FAST_FETCH();                                                                \
+  goto *labels[h];                                                             \
+  {
+#define DISPATCH_END() }
+#else
+#define HANDLER(name) case H_##name:
+#define NEXT() break
+#define NEXT_NO_TICK() continue
+#define REDISPATCH() goto dispatch
+#define DISPATCH_BEGIN()                                                       \
+  for (;;) {                                                                   \
+    FAST_FETCH();                                                              \
+  dispatch:                                                                    \
+    switch (h) {
+#define DISPATCH_END()                                                         \
+  }                                                                            \
+  memory_.tick();                                                              \
+  }
+#endif
+
+#define RD r[e->instr.rd]
+#define RS r[e->instr.rs]
+#define EXTRA e->instr.extra_word
+#define OFFSET_ADDR static_cast<uint16_t>(RS + EXTRA)
+#define RELATIVE_ADDR static_cast<uint16_t>(pc + static_cast<int16_t>(EXTRA))
+
+#define VALUE_OP(OP, BODY)                                                     \
+  HANDLER(OP##_REG) {                                                          \
+    uint16_t b = RS;                                                           \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_IMM) {                                                          \
+    uint16_t b = EXTRA;                                                        \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_DIR) {                                                          \
+    uint16_t b = memory_.read_word(EXTRA);                                     \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_IND) {                                                          \
+    uint16_t b = memory_.read_word(RS);                                        \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_OFF) {                                                          \
+    uint16_t b = memory_.read_word(OFFSET_ADDR);                               \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_REL) {                                                          \
+    uint16_t b = memory_.read_word(RELATIVE_ADDR);                             \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();
+
+// Second half of a fused handler: retire the first instruction and advance
+// to the one after it, or dispatch normally if that is no longer the
+// instruction the pair was fused with
+#define FUSE_NEXT(SECOND)                                                      \
+  memory_.tick();                                                              \
+  {                                                                            \
+    const CachedInstruction *next = e + (e->instr.has_extra_word ? 2 : 1);     \
+    if (halted_ || executed >= max_instructions || !next->valid ||             \
+        next->single_handler != (SECOND)) {                                    \
+      NEXT_NO_TICK();                                                          \
+    }                                                                          \
+    instr_pc = pc;                                                             \
+    e = next;                                                                  \
+    pc = static_cast<uint16_t>(pc + (e->instr.has_extra_word ? 4 : 2));        \
+    ++executed;                                                                \
+  }
+
+#define BRANCH_FUSION(OP, SRC, STORE_RESULT, JCC, TAKEN)                       \
+  HANDLER(OP##_##SRC##_##JCC##_DIR) {                                          \
+    uint16_t a = RD, b = SRC##_OPERAND;                                        \
+    uint16_t result = fast_sub(a, b, flags);                                   \
+    STORE_RESULT;                                                              \
+    FUSE_NEXT(H_##JCC##_DIR);                                                  \
+    if (TAKEN)                                                                 \
+      pc = EXTRA;                                                              \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_##SRC##_##JCC##_REL) {                                          \
+    uint16_t a = RD, b = SRC##_OPERAND;                                        \
+    uint16_t result = fast_sub(a, b, flags);                                   \
+    STORE_RESULT;                                                              \
+    FUSE_NEXT(H_##JCC##_REL);                                                  \
+    if (TAKEN)                                                                 \
+      pc = RELATIVE_ADDR;                                                      \
+  }                                                                            \
+  NEXT();
+
+#define BRANCH_FUSIONS(OP, SRC, STORE_RESULT)                                  \
+  BRANCH_FUSION(OP, SRC, STORE_RESULT, JZ, a == b)                             \
+  BRANCH_FUSION(OP, SRC, STORE_RESULT, JNZ, a != b)                            \
+  BRANCH_FUSION(OP, SRC, STORE_RESULT, JC, a < b)                              \
+  BRANCH_FUSION(OP, SRC, STORE_RESULT, JNC, a >= b)                            \
+  BRANCH_FUSION(OP, SRC, STORE_RESULT, JN, result & 0x8000)
+
+#define REG_OPERAND RS
+#define IMM_OPERAND EXTRA
+
+#define ADDRESS_OP(OP, BODY)                                                   \
+  HANDLER(OP##_DIR) {                                                          \
+    uint16_t ea = EXTRA;                                                       \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_IND) {                                                          \
+    uint16_t ea = RS;                                                          \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_OFF) {                                                          \
+    uint16_t ea = OFFSET_ADDR;                                                 \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();                                                                      \
+  HANDLER(OP##_REL) {                                                          \
+    uint16_t ea = RELATIVE_ADDR;                                               \
+    BODY;                                                                      \
+  }                                                                            \
+  NEXT();
+
+  try {
+    DISPATCH_BEGIN()
+
+    HANDLER(FALLBACK) {
+      // Let the reference core execute (and tick for) this instruction
+      pc = instr_pc;
+      write_back();
+      uint64_t before = cycle_count_;
+      if (executed > 1 && !breakpoints_.empty() && stop_at_breakpoint()) {
+        --executed;
+        e = nullptr;
+        goto done;
+      }
+      step();
+      if (cycle_count_ == before)
+        --executed; // Faulted, did not retire
+      reload();
+      e = nullptr;
+      if (stop_.reason == StopReason::Watchpoint)
+        goto done; // step() already ended the pause
+    }
+    NEXT_NO_TICK();
+
+    HANDLER(NOP) {}
+    NEXT();
+
+    HANDLER(HALT) { halted_ = true; }
+    NEXT();
+
+    HANDLER(RET) {
+      pc = memory_.read_word(sp);
+      sp = static_cast<uint16_t>(sp + 2);
+    }
+    NEXT();
+
+    HANDLER(PUSH) {
+      sp = static_cast<uint16_t>(sp - 2);
+      memory_.write_word(sp, RD);
+    }
+    NEXT();
+
+    HANDLER(POP) {
+      RD = memory_.read_word(sp);
+      sp = static_cast<uint16_t>(sp + 2);
+    }
+    NEXT();
+
+    VALUE_OP(MOV, RD = b)
+    VALUE_OP(ADD, RD = fast_add(RD, b, flags))
+    VALUE_OP(SUB, RD = fast_sub(RD, b, flags))
+    VALUE_OP(AND, RD = fast_logic(RD & b, flags))
+    VALUE_OP(OR, RD = fast_logic(RD | b, flags))
+    VALUE_OP(XOR, RD = fast_logic(RD ^ b, flags))
+    VALUE_OP(CMP, fast_sub(RD, b, flags))
+    VALUE_OP(SHL, RD = fast_shl(RD, b, flags))
+    VALUE_OP(SHR, RD = fast_shr(RD, b, flags))
+    VALUE_OP(IN, RD = memory_.read_byte(Memory::IO_START + (b & 0xFF)))
+    VALUE_OP(OUT, memory_.write_byte(Memory::IO_START + (b & 0xFF),
+                                     static_cast<uint8_t>(RD & 0xFF)))
+
+    ADDRESS_OP(LOAD, {
+      if (ea == Memory::IO_TIMER_BASE && !e->not_timer_spin) {
+        // Possible timer spin loop: PC and `executed` are rewound to the
+        // loop head since this LOAD is retired by the fast-forward
+        pc = instr_pc;
+        write_back();
+        if (uint64_t skipped =
+                fast_forward_timer_spin(max_instructions - executed + 1)) {
+          executed += skipped - 1;
+          reload();
+          NEXT_NO_TICK();
+        }
+        pc = static_cast<uint16_t>(instr_pc + (e->instr.has_extra_word ? 4 : 2));
+      }
+      RD = memory_.read_word(ea);
+    })
+    ADDRESS_OP(STORE, memory_.write_word(ea, RD))
+    ADDRESS_OP(JMP, pc = ea)
+    ADDRESS_OP(JZ, if (flags & F_Z) pc = ea)
+    ADDRESS_OP(JNZ, if (!(flags & F_Z)) pc = ea)
+    ADDRESS_OP(JC, if (flags & F_C) pc = ea)
+    ADDRESS_OP(JNC, if (!(flags & F_C)) pc = ea)
+    ADDRESS_OP(JN, if (flags & F_N) pc = ea)
+    ADDRESS_OP(CALL, {
+      sp = static_cast<uint16_t>(sp - 2);
+      memory_.write_word(sp, pc);
+      pc = ea;
+    })
+
+    BRANCH_FUSIONS(CMP, REG, (void)result)
+    BRANCH_FUSIONS(CMP, IMM, (void)result)
+    BRANCH_FUSIONS(SUB, REG, RD = result)
+    BRANCH_FUSIONS(SUB, IMM, RD = result)
+
+    HANDLER(PUSH_PUSH) {
+      sp = static_cast<uint16_t>(sp - 2);
+      memory_.write_word(sp, RD);
+      FUSE_NEXT(H_PUSH);
+      sp = static_cast<uint16_t>(sp - 2);
+      memory_.write_word(sp, RD);
+    }
+    NEXT();
+
+    HANDLER(POP_POP) {
+      RD = memory_.read_word(sp);
+      sp = static_cast<uint16_t>(sp + 2);
+      FUSE_NEXT(H_POP);
+      RD = memory_.read_word(sp);
+      sp = static_cast<uint16_t>(sp + 2);
+    }
+    NEXT();
+
+    HANDLER(BREAKPOINT) {
+      // Stop before this instruction unless it is the first of the run,
+      // which is how a stopped run resumes; otherwise run it as usual
+      if (executed > 1) {
+        uint16_t next_pc = pc;
+        pc = instr_pc;
+        write_back();
+        if (stop_at_breakpoint()) {
+          --executed;
+          e = nullptr;
+          goto done;
+        }
+        pc = next_pc;
+      }
+      h = e->single_handler;
+    }
+    REDISPATCH();
+
+    DISPATCH_END()
+
+  done:
+    write_back();
+    if (e) {
+      registers_.set_mar(instr_pc);
+      registers_.set_mdr(e->ir);
+      registers_.set_ir(e->ir);
+    }
+  } catch (const std::exception &ex) {
+    write_back();
+    memory_.flush_devices(); // Guest output first, then the error
+    std::cerr << "CPU Error: " << ex.what() << std::endl;
+    last_error_ = ex.what();
+    halted_ = true;
+    paused_ = false;
+    --executed; // The faulting instruction did not retire
+  }
+
+#undef ADDRESS_OP
+#undef IMM_OPERAND
+#undef REG_OPERAND
+#undef BRANCH_FUSIONS
+#undef BRANCH_FUSION
+#undef FUSE_NEXT
+#undef VALUE_OP
+#undef RELATIVE_ADDR
+#undef OFFSET_ADDR
+#undef EXTRA
+#undef RS
+#undef RD
+#undef DISPATCH_END
+#undef DISPATCH_BEGIN
+#undef REDISPATCH
+#undef NEXT_NO_TICK
+#undef NEXT
+#undef HANDLER
+#undef FAST_FETCH
+
+  return executed;
+}
@@ -0,0 +1,40 @@
+#include "device.hpp"
+#include <algorithm>
+
+void DeviceScheduler::schedule(Device *device, uint64_t cycle) {
+  remove(device);
+  heap_.push_back(Event{cycle, sequence_++, device});
+  std::push_heap(heap_.begin(), heap_.end(), Later());
+  update_next_event();
+}
+
+void DeviceScheduler::cancel(Device *device) {
+  remove(device);
+  update_next_event();
+}
+
+bool DeviceScheduler::is_scheduled(const Device *device) const {
+  return std::any_of(heap_.begin(), heap_.end(),
+                     [device](const Event &e) { return e.device == device; });
+}
+
+void DeviceScheduler::remove(const Device *device) {
+  // Only a handful of devices exist, so a linear scan beats an index
+  auto it = std::find_if(heap_.begin(), heap_.end(),
+                         [device](const Event &e) { return e.device == device; });
+  if (it == heap_.end())
+    return;
+  heap_.erase(it);
+  std::make_heap(heap_.begin(), heap_.end(), Later());
+}
+
+void DeviceScheduler::dispatch() {
+  while (!heap_.empty() && heap_.front().cycle <= now_) {
+    std::pop_heap(heap_.begin(), heap_.end(), Later());
+    Event event = heap_.back();
+    heap_.pop_back();
+    update_next_event();
+    event.device->on_event(event.cycle); // May post the device's next event
+  }
+  update_next_event();
+}
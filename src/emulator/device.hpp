@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A memory-mapped peripheral. Memory routes byte accesses to the IO ports a
+// device was attached to; addresses passed in are absolute (0xF0xx).
+class Device {
+public:
+  virtual ~Device() = default;
+
+  virtual uint8_t read(uint16_t address) = 0;
+  virtual void write(uint16_t address, uint8_t value) = 0;
+
+  // Called once the clock reaches a cycle posted with
+  // DeviceScheduler::schedule(); `cycle` is the cycle that was posted
+  virtual void on_event(uint64_t cycle) { (void)cycle; }
+
+  // Pushes out anything buffered for the host (called when the CPU halts
+  // and when a run returns)
+  virtual void flush() {}
+};
+
+// The device clock, one cycle per retired instruction, and a min-heap of
+// pending device events. The hot path is advance(): a single comparison
+// against the earliest pending cycle, so devices that post no events (or
+// post them far ahead) cost nothing per instruction.
+class DeviceScheduler {
+public:
+  static constexpr uint64_t NO_EVENT = ~uint64_t(0);
+
+  uint64_t now() const { return now_; }
+
+  void advance(uint64_t cycles) {
+    now_ += cycles;
+    if (now_ >= next_event_)
+      dispatch();
+  }
+
+  // Cycles the clock can advance before the next event is due; callers that
+  // batch instructions must not run past it. NO_EVENT if none is pending.
+  uint64_t cycles_until_event() const {
+    if (next_event_ == NO_EVENT)
+      return NO_EVENT;
+    return next_event_ > now_ ? next_event_ - now_ : 0;
+  }
+
+  // Posts (or moves) the device's single pending event. A cycle that has
+  // already been reached fires on the next advance().
+  void schedule(Device *device, uint64_t cycle);
+  void cancel(Device *device);
+  bool is_scheduled(const Device *device) const;
+
+private:
+  struct Event {
+    uint64_t cycle;
+    uint64_t sequence; // Ties fire in posting order
+    Device *device;
+  };
+  struct Later {
+    bool operator()(const Event &a, const Event &b) const {
+      return a.cycle != b.cycle ? a.cycle > b.cycle : a.sequence > b.sequence;
+    }
+  };
+
+  uint64_t now_ = 0;
+  uint64_t next_event_ = NO_EVENT;
+  uint64_t sequence_ = 0;
+  std::vector<Event> heap_;
+
+  void remove(const Device *device);
+  void update_next_event() {
+    next_event_ = heap_.empty() ? NO_EVENT : heap_.front().cycle;
+  }
+  void dispatch();
+};
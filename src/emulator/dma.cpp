@@ -0,0 +1,137 @@
+#include "dma.hpp"
+#include "memory.hpp"
+
+namespace {
+
+uint8_t low(uint16_t value) { return static_cast<uint8_t>(value & 0xFF); }
+uint8_t high(uint16_t value) { return static_cast<uint8_t>(value >> 8); }
+
+void set_byte(uint16_t &reg, bool high_byte, uint8_t value) {
+  reg = high_byte ? static_cast<uint16_t>((reg & 0x00FF) | (value << 8))
+                  : static_cast<uint16_t>((reg & 0xFF00) | value);
+}
+
+} // namespace
+
+uint8_t Dma::read(uint16_t address) {
+  bool high_byte = address & 1;
+  switch (address & ~1) {
+  case SRC:
+    return high_byte ? high(state_.src) : low(state_.src);
+  case DST:
+    return high_byte ? high(state_.dst) : low(state_.dst);
+  case LEN:
+    return high_byte ? high(state_.len) : low(state_.len);
+  case CONTROL:
+    return high_byte ? 0 : state_.status;
+  case FILL:
+    return high_byte ? 0 : state_.fill;
+  default:
+    return 0;
+  }
+}
+
+void Dma::write(uint16_t address, uint8_t value) {
+  bool high_byte = address & 1;
+  switch (address & ~1) {
+  case SRC:
+    set_byte(state_.src, high_byte, value);
+    break;
+  case DST:
+    set_byte(state_.dst, high_byte, value);
+    break;
+  case LEN:
+    set_byte(state_.len, high_byte, value);
+    break;
+  case CONTROL:
+    if (!high_byte) // A word store leaves the high byte free
+      start(value);
+    break;
+  case FILL:
+    if (!high_byte)
+      state_.fill = value;
+    break;
+  default:
+    break;
+  }
+}
+
+bool Dma::valid_range(uint16_t start, uint16_t length) const {
+  uint32_t last = static_cast<uint32_t>(start) + length - 1;
+  if (last > 0xFFFF)
+    return false;
+  // Regions are page aligned and contiguous, so equal first and last page
+  // attributes mean the whole range is in one region
+  constexpr uint8_t kind = Memory::PAGE_RAM | Memory::PAGE_PROGRAM |
+                           Memory::PAGE_IO | Memory::PAGE_RESERVED;
+  uint8_t first = memory_.page_attributes(start) & kind;
+  return first == (memory_.page_attributes(static_cast<uint16_t>(last)) & kind) &&
+         (first == Memory::PAGE_RAM || first == Memory::PAGE_PROGRAM);
+}
+
+void Dma::start(uint8_t command) {
+  if (state_.status & STATUS_BUSY) {
+    state_.status |= STATUS_ERROR;
+    return;
+  }
+  state_.status = 0;
+  if (command != COMMAND_COPY && command != COMMAND_FILL) {
+    state_.status = STATUS_ERROR;
+    return;
+  }
+  if (state_.len == 0)
+    return;
+  if (!valid_range(state_.dst, state_.len) ||
+      (command == COMMAND_COPY && !valid_range(state_.src, state_.len))) {
+    state_.status = STATUS_ERROR;
+    return;
+  }
+
+  state_.pending_command = command;
+  state_.pending_src = state_.src;
+  state_.pending_dst = state_.dst;
+  state_.pending_len = state_.len;
+  state_.pending_fill = state_.fill;
+  uint64_t cost = static_cast<uint64_t>((state_.len + 1u) / 2) * cycles_per_word_;
+  if (cost == 0) {
+    transfer();
+    return;
+  }
+  state_.status = STATUS_BUSY;
+  completes_at_ = memory_.scheduler().now() + cost;
+  memory_.scheduler().schedule(this, completes_at_);
+}
+
+void Dma::on_event(uint64_t) {
+  transfer();
+  state_.status &= static_cast<uint8_t>(~STATUS_BUSY);
+}
+
+void Dma::transfer() {
+  if (state_.pending_command == COMMAND_COPY)
+    memory_.copy_block(state_.pending_dst, state_.pending_src,
+                       state_.pending_len);
+  else
+    memory_.fill_block(state_.pending_dst, state_.pending_fill,
+                       state_.pending_len);
+  state_.pending_command = 0;
+}
+
+Dma::State Dma::state() const {
+  State saved = state_;
+  if (saved.status & STATUS_BUSY) {
+    uint64_t now = memory_.scheduler().now();
+    saved.cycles_left = completes_at_ > now ? completes_at_ - now : 0;
+  }
+  return saved;
+}
+
+void Dma::set_state(const State &state) {
+  state_ = state;
+  state_.cycles_left = 0;
+  memory_.scheduler().cancel(this);
+  if (state_.status & STATUS_BUSY) {
+    completes_at_ = memory_.scheduler().now() + state.cycles_left;
+    memory_.scheduler().schedule(this, completes_at_);
+  }
+}
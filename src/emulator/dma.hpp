@@ -0,0 +1,75 @@
+#pragma once
+
+#include "device.hpp"
+#include <cstdint>
+
+class Memory;
+
+// Block copy/fill engine at 0xF020-0xF02F. The guest programs source,
+// destination and length, then writes a command; the transfer runs on the
+// host over Memory's backing buffer instead of as a LOAD/STORE loop.
+//
+//   0xF020 SRC      source address (word)
+//   0xF022 DST      destination address (word)
+//   0xF024 LEN      length in bytes (word)
+//   0xF026 CONTROL  write COPY or FILL to start; reads return STATUS bits
+//   0xF028 FILL     fill byte
+//
+// Copies have memmove semantics. Each of the source and destination ranges
+// must lie inside a single RAM or program region; a transfer that would
+// touch IO, reserved memory or wrap around sets STATUS_ERROR and does
+// nothing. Writes are reported to the trace and code-write callbacks like
+// CPU stores.
+//
+// With a cycle cost configured the transfer completes that many cycles
+// later on the device scheduler, STATUS_BUSY reads as set until then and
+// commands issued while busy are rejected with STATUS_ERROR. The default
+// cost is zero: the transfer is done by the time the command store retires.
+class Dma : public Device {
+public:
+  static constexpr uint16_t BASE = 0xF020;
+  static constexpr uint16_t SRC = 0xF020;
+  static constexpr uint16_t DST = 0xF022;
+  static constexpr uint16_t LEN = 0xF024;
+  static constexpr uint16_t CONTROL = 0xF026;
+  static constexpr uint16_t FILL = 0xF028;
+  static constexpr uint16_t LAST = 0xF02F;
+
+  static constexpr uint8_t COMMAND_COPY = 1;
+  static constexpr uint8_t COMMAND_FILL = 2;
+  static constexpr uint8_t STATUS_BUSY = 1 << 0;
+  static constexpr uint8_t STATUS_ERROR = 1 << 1;
+
+  // Register file plus any transfer in flight, for snapshots
+  struct State {
+    uint16_t src = 0, dst = 0, len = 0;
+    uint8_t fill = 0;
+    uint8_t status = 0;
+    uint8_t pending_command = 0; // Latched command while busy
+    uint16_t pending_src = 0, pending_dst = 0, pending_len = 0;
+    uint8_t pending_fill = 0;
+    uint64_t cycles_left = 0; // Until the pending transfer completes
+  };
+
+  explicit Dma(Memory &memory) : memory_(memory) {}
+
+  uint8_t read(uint16_t address) override;
+  void write(uint16_t address, uint8_t value) override;
+  void on_event(uint64_t cycle) override;
+
+  // Modeled cost: cycles per transferred word (rounded up), 0 for instant
+  void set_cycles_per_word(uint32_t cycles) { cycles_per_word_ = cycles; }
+
+  State state() const;
+  void set_state(const State &state);
+
+private:
+  Memory &memory_;
+  State state_;
+  uint64_t completes_at_ = 0;
+  uint32_t cycles_per_word_ = 0;
+
+  bool valid_range(uint16_t start, uint16_t length) const;
+  void start(uint8_t command);
+  void transfer();
+};
@@ -0,0 +1,449 @@
+#include "gdb_stub.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// Register numbers as laid out in target.xml and the 'g' packet
+constexpr unsigned REGISTER_COUNT = 7;
+constexpr unsigned REG_SP = 4;
+constexpr unsigned REG_PC = 5;
+constexpr unsigned REG_FLAGS = 6;
+
+const char TARGET_XML[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+    "<target version=\"1.0\">\n"
+    "  <feature name=\"org.software-cpu.core\">\n"
+    "    <reg name=\"r0\" bitsize=\"16\" type=\"uint16\" regnum=\"0\"/>\n"
+    "    <reg name=\"r1\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "    <reg name=\"r2\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "    <reg name=\"r3\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "    <reg name=\"sp\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+    "    <reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"flags\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "  </feature>\n"
+    "</target>\n";
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+std::string hex_byte(uint8_t value) {
+  return {HEX_DIGITS[value >> 4], HEX_DIGITS[value & 0xF]};
+}
+
+// Registers travel in target byte order: little-endian
+std::string hex_word(uint16_t value) {
+  return hex_byte(static_cast<uint8_t>(value)) +
+         hex_byte(static_cast<uint8_t>(value >> 8));
+}
+
+int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool parse_hex_byte(const std::string &text, size_t at, uint8_t &value) {
+  if (at + 2 > text.size())
+    return false;
+  int high = hex_digit(text[at]);
+  int low = hex_digit(text[at + 1]);
+  if (high < 0 || low < 0)
+    return false;
+  value = static_cast<uint8_t>(high << 4 | low);
+  return true;
+}
+
+bool parse_hex_word(const std::string &text, size_t at, uint16_t &value) {
+  uint8_t low, high;
+  if (!parse_hex_byte(text, at, low) || !parse_hex_byte(text, at + 2, high))
+    return false;
+  value = static_cast<uint16_t>(low | high << 8);
+  return true;
+}
+
+// Big-endian hex number (addresses, lengths, register numbers)
+bool parse_number(const std::string &text, uint32_t &value) {
+  if (text.empty() || text.size() > 8)
+    return false;
+  value = 0;
+  for (char c : text) {
+    int digit = hex_digit(c);
+    if (digit < 0)
+      return false;
+    value = value << 4 | static_cast<uint32_t>(digit);
+  }
+  return true;
+}
+
+// "a,b" into two numbers
+bool parse_pair(const std::string &text, uint32_t &first, uint32_t &second) {
+  size_t comma = text.find(',');
+  return comma != std::string::npos &&
+         parse_number(text.substr(0, comma), first) &&
+         parse_number(text.substr(comma + 1), second);
+}
+
+void send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = ::send(fd, data.data() + sent, data.size() - sent,
+                       MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    sent += static_cast<size_t>(n);
+  }
+}
+
+} // namespace
+
+GdbStub::GdbStub(ReplayDebugger &debugger)
+    : debugger_(debugger), cpu_(debugger.cpu()) {}
+
+std::string GdbStub::frame(const std::string &payload) {
+  uint8_t checksum = 0;
+  for (char c : payload)
+    checksum = static_cast<uint8_t>(checksum + static_cast<uint8_t>(c));
+  return "$" + payload + "#" + hex_byte(checksum);
+}
+
+std::string GdbStub::handle_packet(const std::string &packet) {
+  if (packet.empty())
+    return "";
+  std::string args = packet.substr(1);
+  switch (packet[0]) {
+  case '?':
+    return cpu_.is_halted() ? exit_reply() : "S05";
+  case 'g':
+    return read_registers();
+  case 'G':
+    return write_registers(args);
+  case 'p':
+    return read_register(args);
+  case 'P':
+    return write_register(args);
+  case 'm':
+    return read_memory(args);
+  case 'M':
+    return write_memory(args);
+  case 'c':
+    return resume(args, false);
+  case 's':
+    return resume(args, true);
+  case 'b':
+    if (args == "c" || args == "s")
+      return reverse(args == "s");
+    return "";
+  case 'Z':
+    return set_stop(true, args);
+  case 'z':
+    return set_stop(false, args);
+  case 'H':
+  case 'T':
+    return "OK"; // Single thread
+  case 'D':
+    finished_ = true;
+    return "OK";
+  case 'k':
+    finished_ = true;
+    return "";
+  default:
+    break;
+  }
+
+  if (packet.rfind("qSupported", 0) == 0)
+    return "PacketSize=" + std::to_string(2 * MAX_MEMORY + 32) +
+           ";qXfer:features:read+;QStartNoAckMode+"
+           ";ReverseStep+;ReverseContinue+";
+  if (packet.rfind("qXfer:features:read:", 0) == 0)
+    return features(packet.substr(20));
+  if (packet == "QStartNoAckMode") {
+    no_ack_ = true;
+    return "OK";
+  }
+  if (packet == "qAttached")
+    return "1";
+  if (packet == "qC")
+    return "QC1";
+  if (packet == "qfThreadInfo")
+    return "m1";
+  if (packet == "qsThreadInfo")
+    return "l";
+  if (packet == "qSymbol::")
+    return "OK";
+  return "";
+}
+
+std::string GdbStub::read_registers() const {
+  const Registers &registers = cpu_.get_registers();
+  std::string reply;
+  for (uint8_t i = 0; i < 4; ++i)
+    reply += hex_word(registers.get_gpr(i));
+  reply += hex_word(registers.get_sp());
+  reply += hex_word(registers.get_pc());
+  reply += hex_word(registers.get_flags());
+  return reply;
+}
+
+std::string GdbStub::write_registers(const std::string &hex) {
+  uint16_t values[REGISTER_COUNT];
+  if (hex.size() != REGISTER_COUNT * 4)
+    return "E01";
+  for (unsigned i = 0; i < REGISTER_COUNT; ++i) {
+    if (!parse_hex_word(hex, i * 4, values[i]))
+      return "E01";
+  }
+  Registers &registers = cpu_.get_registers();
+  for (uint8_t i = 0; i < 4; ++i)
+    registers.set_gpr(i, values[i]);
+  registers.set_sp(values[REG_SP]);
+  registers.set_pc(values[REG_PC]);
+  registers.set_flags(static_cast<uint8_t>(values[REG_FLAGS]));
+  return "OK";
+}
+
+std::string GdbStub::read_register(const std::string &args) const {
+  uint32_t number;
+  if (!parse_number(args, number) || number >= REGISTER_COUNT)
+    return "E01";
+  return read_registers().substr(number * 4, 4);
+}
+
+std::string GdbStub::write_register(const std::string &args) {
+  size_t equals = args.find('=');
+  uint32_t number;
+  uint16_t value;
+  if (equals == std::string::npos ||
+      !parse_number(args.substr(0, equals), number) ||
+      number >= REGISTER_COUNT || args.size() != equals + 5 ||
+      !parse_hex_word(args, equals + 1, value))
+    return "E01";
+  Registers &registers = cpu_.get_registers();
+  if (number < 4)
+    registers.set_gpr(static_cast<uint8_t>(number), value);
+  else if (number == REG_SP)
+    registers.set_sp(value);
+  else if (number == REG_PC)
+    registers.set_pc(value);
+  else
+    registers.set_flags(static_cast<uint8_t>(value));
+  return "OK";
+}
+
+std::string GdbStub::read_memory(const std::string &args) const {
+  uint32_t address, length;
+  if (!parse_pair(args, address, length) || address > 0xFFFF)
+    return "E01";
+  // Stored bytes only: reading must not consume console input
+  std::string reply;
+  for (uint32_t i = 0; i < std::min<uint32_t>(length, MAX_MEMORY); ++i)
+    reply += hex_byte(cpu_.get_memory().peek(
+        static_cast<uint16_t>(address + i)));
+  return reply;
+}
+
+std::string GdbStub::write_memory(const std::string &args) {
+  size_t colon = args.find(':');
+  uint32_t address, length;
+  if (colon == std::string::npos ||
+      !parse_pair(args.substr(0, colon), address, length) ||
+      address > 0xFFFF || length > MAX_MEMORY ||
+      args.size() != colon + 1 + 2 * length)
+    return "E01";
+  std::string bytes;
+  for (uint32_t i = 0; i < length; ++i) {
+    uint8_t value;
+    if (!parse_hex_byte(args, colon + 1 + 2 * i, value))
+      return "E01";
+    bytes += static_cast<char>(value);
+  }
+  for (uint32_t i = 0; i < length; ++i)
+    cpu_.get_memory().poke(static_cast<uint16_t>(address + i),
+                           static_cast<uint8_t>(bytes[i]));
+  return "OK";
+}
+
+std::string GdbStub::set_stop(bool insert, const std::string &args) {
+  // type,address,kind; kind is the length for watchpoints
+  size_t comma = args.find(',');
+  uint32_t address, kind;
+  if (comma != 1 || !parse_pair(args.substr(2), address, kind) ||
+      address > 0xFFFF)
+    return "E01";
+  char type = args[0];
+  if (type == '0' || type == '1') {
+    if (insert)
+      debugger_.add_breakpoint(static_cast<uint16_t>(address));
+    else
+      debugger_.remove_breakpoint(static_cast<uint16_t>(address));
+    return "OK";
+  }
+  if (type < '2' || type > '4' || kind == 0 || address + kind > 0x10000)
+    return "";
+  uint8_t watch = type == '2'   ? Memory::WATCH_WRITE
+                  : type == '3' ? Memory::WATCH_READ
+                                : Memory::WATCH_ACCESS;
+  uint16_t last = static_cast<uint16_t>(address + kind - 1);
+  if (insert)
+    debugger_.add_watchpoint(static_cast<uint16_t>(address), last, watch);
+  else
+    debugger_.remove_watchpoint(static_cast<uint16_t>(address), last, watch);
+  return "OK";
+}
+
+std::string GdbStub::features(const std::string &args) const {
+  // target.xml:offset,length
+  const std::string annex = "target.xml:";
+  uint32_t offset, length;
+  if (args.rfind(annex, 0) != 0 ||
+      !parse_pair(args.substr(annex.size()), offset, length))
+    return "E00";
+  std::string xml = TARGET_XML;
+  if (offset >= xml.size())
+    return "l";
+  std::string part = xml.substr(offset, length);
+  return (offset + part.size() >= xml.size() ? "l" : "m") + part;
+}
+
+std::string GdbStub::resume(const std::string &args, bool step) {
+  uint32_t address;
+  if (!args.empty()) {
+    if (!parse_number(args, address) || address > 0xFFFF)
+      return "E01";
+    cpu_.get_registers().set_pc(static_cast<uint16_t>(address));
+  }
+  if (cpu_.is_halted())
+    return exit_reply();
+  if (step) {
+    debugger_.step();
+    return cpu_.is_halted() ? exit_reply() : "S05";
+  }
+
+  // Continue in slices so an interrupt can get in. Each slice resumes past
+  // a breakpoint at its first instruction, so that is checked here.
+  for (bool first = true;; first = false) {
+    if (!first && cpu_.at_breakpoint())
+      return "S05";
+    if (debugger_.continue_forward(POLL_CYCLES))
+      return stop_reply(debugger_.last_stop());
+    if (cpu_.is_halted())
+      return exit_reply();
+    if (interrupt_check_ && interrupt_check_())
+      return "S02";
+  }
+}
+
+std::string GdbStub::reverse(bool step) {
+  bool stopped = step ? debugger_.reverse_step() : debugger_.reverse_continue();
+  if (!stopped)
+    return "T05replaylog:begin;";
+  return step ? "S05" : stop_reply(debugger_.last_stop());
+}
+
+std::string GdbStub::stop_reply(const CPU::StopInfo &stop) const {
+  if (stop.reason != CPU::StopReason::Watchpoint)
+    return "S05";
+  const char *kind = stop.write ? "watch" : "rwatch";
+  for (const Memory::Watchpoint &watch : cpu_.get_memory().watchpoints()) {
+    if (stop.address >= watch.first && stop.address <= watch.last &&
+        watch.kind == Memory::WATCH_ACCESS)
+      kind = "awatch";
+  }
+  char address[8];
+  std::snprintf(address, sizeof(address), "%x", stop.address);
+  return std::string("T05") + kind + ":" + address + ";";
+}
+
+std::string GdbStub::exit_reply() const {
+  // An error leaves the CPU stopped where it faulted, for inspection
+  return cpu_.get_last_error().empty() ? "W00" : "S04";
+}
+
+void GdbStub::serve(uint16_t port) {
+  int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+    throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+  int yes = 1;
+  ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+          0 ||
+      ::listen(listener, 1) < 0) {
+    std::string reason = std::strerror(errno);
+    ::close(listener);
+    throw std::runtime_error("Cannot listen on 127.0.0.1:" +
+                             std::to_string(port) + ": " + reason);
+  }
+  int client;
+  do
+    client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+  while (client < 0 && errno == EINTR);
+  ::close(listener);
+  if (client < 0)
+    throw std::runtime_error(std::string("accept: ") + std::strerror(errno));
+
+  // The client sends a lone 0x03 to interrupt a running target
+  set_interrupt_check([client]() {
+    pollfd ready{client, POLLIN, 0};
+    char byte;
+    return ::poll(&ready, 1, 0) > 0 &&
+           ::recv(client, &byte, 1, MSG_PEEK) == 1 && byte == 0x03 &&
+           ::recv(client, &byte, 1, 0) == 1;
+  });
+
+  std::string input;
+  std::string last_reply;
+  char buffer[4096];
+  while (!finished_) {
+    ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+    if (n <= 0)
+      break;
+    input.append(buffer, static_cast<size_t>(n));
+
+    while (!input.empty() && !finished_) {
+      if (input[0] == '-') {
+        send_all(client, last_reply); // Retransmit
+        input.erase(0, 1);
+        continue;
+      }
+      if (input[0] != '$') {
+        input.erase(0, 1); // Acks and an interrupt while already stopped
+        continue;
+      }
+      size_t hash = input.find('#');
+      if (hash == std::string::npos || hash + 3 > input.size())
+        break; // Wait for the rest of the packet
+      std::string payload = input.substr(1, hash - 1);
+      uint8_t checksum = 0, expected;
+      for (char c : payload)
+        checksum = static_cast<uint8_t>(checksum + static_cast<uint8_t>(c));
+      bool valid = parse_hex_byte(input, hash + 1, expected) &&
+                   expected == checksum;
+      input.erase(0, hash + 3);
+      if (!no_ack_)
+        send_all(client, valid ? "+" : "-");
+      if (!valid)
+        continue;
+      last_reply = frame(handle_packet(payload));
+      if (!finished_ || payload != "k")
+        send_all(client, last_reply);
+    }
+  }
+  set_interrupt_check(nullptr);
+  ::close(client);
+}
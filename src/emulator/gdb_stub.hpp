@@ -0,0 +1,62 @@
+#pragma once
+
+#include "replay_debugger.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// GDB remote serial protocol stub over a ReplayDebugger, so gdb or any
+// other front end speaking the protocol can attach with
+//   target remote localhost:PORT
+// The registers are r0-r3, sp, pc and flags, 16 bits each and described to
+// the client by target.xml. Supported packets: ?, g/G, p/P, m/M, c/s,
+// bc/bs (reverse execution), Z0-Z4/z0-z4, qSupported, qXfer target.xml,
+// QStartNoAckMode, D and k; anything else gets the empty "unsupported"
+// reply. Registers and memory written by the client change the live state
+// only, so rewinding across such a write re-executes without it.
+class GdbStub {
+public:
+  // Cycles run between checks for the client's interrupt byte
+  static constexpr uint64_t POLL_CYCLES = 100000;
+  // Largest memory read or write one packet may ask for, in bytes
+  static constexpr size_t MAX_MEMORY = 2048;
+
+  explicit GdbStub(ReplayDebugger &debugger);
+
+  // Reply payload for one packet payload, both without the $...#xx framing
+  std::string handle_packet(const std::string &packet);
+  // True once the client has detached or killed the target
+  bool finished() const { return finished_; }
+  // Polled every POLL_CYCLES while continuing; true interrupts the run
+  void set_interrupt_check(std::function<bool()> check) {
+    interrupt_check_ = std::move(check);
+  }
+
+  // $payload#checksum
+  static std::string frame(const std::string &payload);
+
+  // Accept one client on 127.0.0.1:port and serve it until it detaches,
+  // kills the target or disconnects; throws std::runtime_error if the port
+  // cannot be bound
+  void serve(uint16_t port);
+
+private:
+  ReplayDebugger &debugger_;
+  CPU &cpu_;
+  std::function<bool()> interrupt_check_;
+  bool finished_ = false;
+  bool no_ack_ = false;
+
+  std::string read_registers() const;
+  std::string write_registers(const std::string &hex);
+  std::string read_register(const std::string &args) const;
+  std::string write_register(const std::string &args);
+  std::string read_memory(const std::string &args) const;
+  std::string write_memory(const std::string &args);
+  std::string set_stop(bool insert, const std::string &args);
+  std::string features(const std::string &args) const;
+  std::string resume(const std::string &args, bool step);
+  std::string reverse(bool step);
+  std::string stop_reply(const CPU::StopInfo &stop) const;
+  std::string exit_reply() const;
+};
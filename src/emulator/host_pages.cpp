@@ -0,0 +1,49 @@
+#include "host_pages.hpp"
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+size_t round_up(size_t value, size_t page) {
+  return (value + page - 1) / page * page;
+}
+
+} // namespace
+
+HostPages::HostPages(size_t bytes) : data_(nullptr), size_(bytes) {
+  void *p = mmap(nullptr, round_up(size_, host_page_size()),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error("Cannot allocate " + std::to_string(bytes) +
+                             " bytes of host memory");
+  data_ = static_cast<uint8_t *>(p);
+}
+
+HostPages::~HostPages() {
+  munmap(data_, round_up(size_, host_page_size()));
+}
+
+size_t HostPages::host_page_size() {
+  static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return page;
+}
+
+bool HostPages::map_file(size_t offset, int fd, size_t length) {
+  size_t page = host_page_size();
+  if (fd < 0 || length == 0 || offset % page != 0 ||
+      offset + round_up(length, page) > round_up(size_, page)) {
+    return false;
+  }
+  // MAP_FIXED atomically replaces the anonymous pages in the range; the
+  // kernel zero-fills the tail of the last page beyond the end of the file
+  void *p = mmap(data_ + offset, round_up(length, page), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, 0);
+  if (p != MAP_FAILED)
+    return true;
+  // A failed MAP_FIXED may already have dropped the old pages
+  mmap(data_ + offset, round_up(length, page), PROT_READ | PROT_WRITE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  return false;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Zero-filled host memory from an anonymous private mapping. The kernel
+// hands out zero pages on first touch, so a large buffer costs neither a
+// memset nor resident memory for the parts a run never uses (guest memory,
+// the decode cache).
+class HostPages {
+public:
+  // Throws std::runtime_error if the mapping cannot be created
+  explicit HostPages(size_t bytes);
+  ~HostPages();
+  HostPages(const HostPages &) = delete;
+  HostPages &operator=(const HostPages &) = delete;
+
+  uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Replaces [offset, offset + length) with a private copy-on-write mapping
+  // of the first `length` bytes of `fd`, so every buffer mapping the same
+  // file shares its physical pages until one of them writes. The range is
+  // widened to whole host pages; bytes past the end of the file read as
+  // zero. Returns false, leaving the buffer untouched, when `offset` is not
+  // host-page aligned, the range does not fit or the mapping fails.
+  bool map_file(size_t offset, int fd, size_t length);
+
+  static size_t host_page_size();
+
+private:
+  uint8_t *data_;
+  size_t size_;
+};
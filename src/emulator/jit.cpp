@@ -0,0 +1,744 @@
+#include "jit.hpp"
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define SOFTWARE_CPU_JIT_X86_64 1
+#include <sys/mman.h>
+#else
+#define SOFTWARE_CPU_JIT_X86_64 0
+#endif
+
+namespace {
+
+// Memory helper results. Values up to 0xFFFF are data words.
+constexpr uint32_t JIT_BAIL = 0x10000;         // Touches MMIO; not performed
+constexpr uint32_t JIT_CODE_WRITTEN = 0x20000; // Store overwrote compiled code
+
+bool touches_io(uint16_t address) {
+  // A word access at IO_START - 1 reaches into the I/O range
+  return address >= Memory::IO_START - 1 && address <= Memory::IO_END;
+}
+
+// Called from generated code (System V ABI): rdi = context, esi = address,
+// edx = value. Must not throw, there is no unwind info for JIT frames.
+uint32_t jit_read_word(JitContext *ctx, uint32_t address) noexcept {
+  uint16_t a = static_cast<uint16_t>(address);
+  if (touches_io(a))
+    return JIT_BAIL;
+  return ctx->memory->read_word(a);
+}
+
+uint32_t jit_write_word(JitContext *ctx, uint32_t address,
+                        uint32_t value) noexcept {
+  uint16_t a = static_cast<uint16_t>(address);
+  if (touches_io(a))
+    return JIT_BAIL;
+  ctx->code_written = 0;
+  ctx->memory->write_word(a, static_cast<uint16_t>(value));
+  return ctx->code_written ? JIT_CODE_WRITTEN : 0;
+}
+
+#if SOFTWARE_CPU_JIT_X86_64
+
+// Host registers (x86-64 encoding numbers)
+enum HostReg : uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R12 = 12,
+};
+
+// Guest R0-R3 live in r12-r15, SP in rbx, FLAGS in rbp
+constexpr uint8_t guest_reg(uint8_t r) { return static_cast<uint8_t>(R12 + r); }
+
+// Condition codes for Jcc rel32
+constexpr uint8_t CC_Z = 0x4;
+constexpr uint8_t CC_NZ = 0x5;
+
+constexpr uint8_t CTX_GPR = offsetof(JitContext, gpr);
+constexpr uint8_t CTX_PC = offsetof(JitContext, pc);
+constexpr uint8_t CTX_SP = offsetof(JitContext, sp);
+constexpr uint8_t CTX_FLAGS = offsetof(JitContext, flags);
+constexpr uint8_t CTX_HALTED = offsetof(JitContext, halted);
+constexpr uint8_t CTX_EXECUTED = offsetof(JitContext, executed);
+
+// Minimal x86-64 machine code emitter. Code is assembled into a vector and
+// copied to its final location, which must be known up front for rel32.
+class Emitter {
+public:
+  explicit Emitter(const uint8_t *origin) : origin_(origin) {}
+
+  const std::vector<uint8_t> &code() const { return code_; }
+  size_t size() const { return code_.size(); }
+  const uint8_t *here() const { return origin_ + code_.size(); }
+
+  void byte(uint8_t b) { code_.push_back(b); }
+  void bytes(std::initializer_list<uint8_t> bs) {
+    code_.insert(code_.end(), bs.begin(), bs.end());
+  }
+  void imm16(uint16_t v) { bytes({uint8_t(v), uint8_t(v >> 8)}); }
+  void imm32(uint32_t v) {
+    bytes({uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16), uint8_t(v >> 24)});
+  }
+  void imm64(uint64_t v) {
+    imm32(static_cast<uint32_t>(v));
+    imm32(static_cast<uint32_t>(v >> 32));
+  }
+
+  // REX prefix for a reg/rm pair; omitted when it would be a plain 0x40
+  void rex(uint8_t reg, uint8_t rm, bool force = false) {
+    uint8_t r = static_cast<uint8_t>(0x40 | ((reg & 8) ? 4 : 0) |
+                                     ((rm & 8) ? 1 : 0));
+    if (r != 0x40 || force)
+      byte(r);
+  }
+  void modrm(uint8_t reg, uint8_t rm) {
+    byte(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+  }
+  // [rdi + disp8] operand, used for all context accesses
+  void modrm_ctx(uint8_t reg, uint8_t disp) {
+    byte(static_cast<uint8_t>(0x40 | ((reg & 7) << 3) | RDI));
+    byte(disp);
+  }
+
+  // op r/m16, r16 (ADD 01, OR 09, AND 21, SUB 29, XOR 31, CMP 39, MOV 89)
+  void alu_rr16(uint8_t opcode, uint8_t dst, uint8_t src) {
+    byte(0x66);
+    rex(src, dst);
+    byte(opcode);
+    modrm(src, dst);
+  }
+  // op r/m16, imm16 (group 1 digit: ADD 0, OR 1, AND 4, SUB 5, XOR 6, CMP 7)
+  void alu_ri16(uint8_t digit, uint8_t dst, uint16_t imm) {
+    byte(0x66);
+    rex(0, dst);
+    byte(0x81);
+    modrm(digit, dst);
+    imm16(imm);
+  }
+  void mov_ri16(uint8_t dst, uint16_t imm) {
+    byte(0x66);
+    rex(0, dst);
+    byte(static_cast<uint8_t>(0xB8 + (dst & 7)));
+    imm16(imm);
+  }
+  // SHL (digit 4) / SHR (digit 5) r/m16, imm8
+  void shift_ri16(uint8_t digit, uint8_t dst, uint8_t count) {
+    byte(0x66);
+    rex(0, dst);
+    byte(0xC1);
+    modrm(digit, dst);
+    byte(count);
+  }
+  void test_rr16(uint8_t r) {
+    byte(0x66);
+    rex(r, r);
+    byte(0x85);
+    modrm(r, r);
+  }
+  void mov_rr32(uint8_t dst, uint8_t src) {
+    rex(src, dst);
+    byte(0x89);
+    modrm(src, dst);
+  }
+  void mov_ri32(uint8_t dst, uint32_t imm) {
+    rex(0, dst);
+    byte(static_cast<uint8_t>(0xB8 + (dst & 7)));
+    imm32(imm);
+  }
+  void add_ri32(uint8_t dst, uint32_t imm) {
+    rex(0, dst);
+    byte(0x81);
+    modrm(0, dst);
+    imm32(imm);
+  }
+  void movzx_r32_r16(uint8_t dst, uint8_t src) {
+    rex(dst, src);
+    bytes({0x0F, 0xB7});
+    modrm(dst, src);
+  }
+  void test_rr32(uint8_t r) {
+    rex(r, r);
+    byte(0x85);
+    modrm(r, r);
+  }
+  void test_ri32(uint8_t r, uint32_t imm) {
+    rex(0, r);
+    byte(0xF7);
+    modrm(0, r);
+    imm32(imm);
+  }
+
+  // Context accesses through rdi
+  void load_context() { bytes({0x48, 0x8B, 0x3C, 0x24}); } // mov rdi, [rsp]
+  void store_context() { bytes({0x48, 0x89, 0x3C, 0x24}); } // mov [rsp], rdi
+  void load16_ctx(uint8_t dst, uint8_t disp) {
+    rex(dst, RDI);
+    bytes({0x0F, 0xB7});
+    modrm_ctx(dst, disp);
+  }
+  void load8_ctx(uint8_t dst, uint8_t disp) {
+    rex(dst, RDI);
+    bytes({0x0F, 0xB6});
+    modrm_ctx(dst, disp);
+  }
+  void store16_ctx(uint8_t src, uint8_t disp) {
+    byte(0x66);
+    rex(src, RDI);
+    byte(0x89);
+    modrm_ctx(src, disp);
+  }
+  void store8_ctx(uint8_t src, uint8_t disp) {
+    rex(src, RDI, true); // REX selects bpl/sil rather than ch/dh
+    byte(0x88);
+    modrm_ctx(src, disp);
+  }
+  void store_ctx_imm8(uint8_t disp, uint8_t v) {
+    bytes({0xC6, 0x47, disp, v});
+  }
+  void store_ctx_imm16(uint8_t disp, uint16_t v) {
+    bytes({0x66, 0xC7, 0x47, disp});
+    imm16(v);
+  }
+  void store_ctx_imm32(uint8_t disp, uint32_t v) {
+    bytes({0xC7, 0x47, disp});
+    imm32(v);
+  }
+
+  void call(const void *fn) {
+    load_context();
+    bytes({0x48, 0xB8}); // mov rax, imm64
+    imm64(reinterpret_cast<uint64_t>(fn));
+    bytes({0xFF, 0xD0}); // call rax
+  }
+
+  // Forward branches: emit with a zero displacement, bind() later
+  size_t jcc32(uint8_t cc) {
+    bytes({0x0F, static_cast<uint8_t>(0x80 | cc)});
+    imm32(0);
+    return code_.size() - 4;
+  }
+  void bind(size_t at) {
+    int32_t rel = static_cast<int32_t>(code_.size() - (at + 4));
+    std::memcpy(&code_[at], &rel, sizeof(rel));
+  }
+  void jmp_to(const uint8_t *target) {
+    byte(0xE9);
+    int32_t rel = static_cast<int32_t>(target - (here() + 4));
+    imm32(static_cast<uint32_t>(rel));
+  }
+
+private:
+  const uint8_t *origin_;
+  std::vector<uint8_t> code_;
+};
+
+bool is_compilable(const JitInstruction &in) {
+  bool value_mode = in.mode <= 5;
+  bool address_mode = in.mode >= 2 && in.mode <= 5;
+  switch (in.opcode) {
+  case 0:  // NOP
+  case 1:  // HALT
+  case 20: // RET
+  case 21: // PUSH
+  case 22: // POP
+    return true;
+  case 2:  // MOV
+  case 5:  // ADD
+  case 6:  // SUB
+  case 7:  // AND
+  case 8:  // OR
+  case 9:  // XOR
+  case 10: // CMP
+    return value_mode;
+  case 11: // SHL
+  case 12: // SHR
+    // Only immediate counts below 16 map directly onto host shifts
+    return in.mode == 1 && in.extra_word < 16;
+  case 3:  // LOAD
+  case 4:  // STORE
+  case 13: // JMP
+  case 14: // JZ
+  case 15: // JNZ
+  case 16: // JC
+  case 17: // JNC
+  case 18: // JN
+  case 19: // CALL
+    return address_mode;
+  default: // IN, OUT and undefined opcodes stay in the interpreter
+    return false;
+  }
+}
+
+// Emits host code for one block, instruction by instruction. Guest flags
+// produced by an ALU op stay in host EFLAGS until something needs them or
+// is about to clobber them, then get folded into rbp.
+class BlockBuilder {
+public:
+  enum class Step { Continue, End };
+
+  BlockBuilder(Emitter &e, const uint8_t *exit) : e_(e), exit_(exit) {}
+
+  void materialize_flags() {
+    if (!flags_pending_)
+      return;
+    e_.bytes({0x0F, 0x94, 0xC0}); // setz al
+    e_.bytes({0x0F, 0x98, 0xC1}); // sets cl
+    e_.bytes({0x0F, 0x92, 0xC2}); // setb dl
+    if (pending_overflow_)
+      e_.bytes({0x41, 0x0F, 0x90, 0xC0}); // seto r8b
+    e_.bytes({0x0F, 0xB6, 0xE8});         // movzx ebp, al
+    e_.bytes({0x0F, 0xB6, 0xC9});         // movzx ecx, cl
+    e_.bytes({0x8D, 0x6C, 0x4D, 0x00});   // lea ebp, [rbp + rcx*2]
+    e_.bytes({0x0F, 0xB6, 0xD2});         // movzx edx, dl
+    e_.bytes({0x8D, 0x6C, 0x95, 0x00});   // lea ebp, [rbp + rdx*4]
+    if (pending_overflow_) {
+      e_.bytes({0x45, 0x0F, 0xB6, 0xC0});       // movzx r8d, r8b
+      e_.bytes({0x42, 0x8D, 0x6C, 0xC5, 0x00}); // lea ebp, [rbp + r8*8]
+    }
+    flags_pending_ = false;
+  }
+
+  void exit_static(uint16_t pc, uint32_t executed) {
+    e_.load_context();
+    e_.store_ctx_imm16(CTX_PC, pc);
+    e_.store_ctx_imm32(CTX_EXECUTED, executed);
+    e_.jmp_to(exit_);
+  }
+
+  void exit_dynamic(uint8_t pc_reg, uint32_t executed) {
+    e_.load_context();
+    e_.store16_ctx(pc_reg, CTX_PC);
+    e_.store_ctx_imm32(CTX_EXECUTED, executed);
+    e_.jmp_to(exit_);
+  }
+
+  Step compile(const JitInstruction &in, uint16_t pc, uint32_t n) {
+    uint16_t next = static_cast<uint16_t>(pc + in.length);
+    uint8_t rd = guest_reg(in.rd);
+
+    switch (in.opcode) {
+    case 0: // NOP
+      return Step::Continue;
+
+    case 1: // HALT
+      materialize_flags();
+      e_.load_context();
+      e_.store_ctx_imm8(CTX_HALTED, 1);
+      exit_static(next, n + 1);
+      return Step::End;
+
+    case 2: // MOV
+      if (in.mode == 0) {
+        e_.alu_rr16(0x89, rd, guest_reg(in.rs));
+      } else if (in.mode == 1) {
+        e_.mov_ri16(rd, in.extra_word);
+      } else {
+        read_operand(in, pc, next, n);
+        e_.mov_rr32(rd, RAX);
+      }
+      return Step::Continue;
+
+    case 5:  // ADD
+    case 6:  // SUB
+    case 7:  // AND
+    case 8:  // OR
+    case 9:  // XOR
+    case 10: // CMP
+      compile_alu(in, pc, next, n);
+      return Step::Continue;
+
+    case 11: // SHL
+    case 12: // SHR
+      if (in.extra_word == 0)
+        e_.test_rr16(rd); // Z/N from the value, C and V cleared
+      else
+        e_.shift_ri16(in.opcode == 11 ? 4 : 5, rd,
+                      static_cast<uint8_t>(in.extra_word));
+      flags_pending_ = true;
+      pending_overflow_ = false;
+      return Step::Continue;
+
+    case 3: // LOAD
+      read_operand(in, pc, next, n);
+      e_.mov_rr32(rd, RAX);
+      return Step::Continue;
+
+    case 4: { // STORE
+      materialize_flags();
+      effective_address(in, next);
+      e_.mov_rr32(RDX, rd);
+      WriteCheck w = write_word(pc, n);
+      e_.bind(w.written);
+      exit_static(next, n + 1);
+      e_.bind(w.ok);
+      return Step::Continue;
+    }
+
+    case 13: // JMP
+      materialize_flags();
+      exit_to_target(in, next, n + 1);
+      return Step::End;
+
+    case 14: // JZ
+    case 15: // JNZ
+    case 16: // JC
+    case 17: // JNC
+    case 18: { // JN
+      materialize_flags();
+      uint32_t mask = in.opcode <= 15   ? 1u << 0  // Z
+                      : in.opcode <= 17 ? 1u << 2  // C
+                                        : 1u << 1; // N
+      bool taken_when_set =
+          in.opcode == 14 || in.opcode == 16 || in.opcode == 18;
+      e_.test_ri32(RBP, mask);
+      size_t taken = e_.jcc32(taken_when_set ? CC_NZ : CC_Z);
+      exit_static(next, n + 1);
+      e_.bind(taken);
+      exit_to_target(in, next, n + 1);
+      return Step::End;
+    }
+
+    case 19: { // CALL
+      materialize_flags();
+      stack_slot_below_sp();
+      e_.mov_ri32(RDX, next);
+      WriteCheck w = write_word(pc, n);
+      e_.bind(w.written);
+      e_.bind(w.ok);
+      adjust_sp(static_cast<uint32_t>(-2));
+      exit_to_target(in, next, n + 1);
+      return Step::End;
+    }
+
+    case 20: // RET
+      materialize_flags();
+      e_.mov_rr32(RSI, RBX);
+      read_word(pc, n);
+      adjust_sp(2);
+      exit_dynamic(RAX, n + 1);
+      return Step::End;
+
+    case 21: { // PUSH
+      materialize_flags();
+      stack_slot_below_sp();
+      e_.mov_rr32(RDX, rd);
+      WriteCheck w = write_word(pc, n);
+      e_.bind(w.written);
+      adjust_sp(static_cast<uint32_t>(-2));
+      exit_static(next, n + 1);
+      e_.bind(w.ok);
+      adjust_sp(static_cast<uint32_t>(-2));
+      return Step::Continue;
+    }
+
+    case 22: // POP
+      materialize_flags();
+      e_.mov_rr32(RSI, RBX);
+      read_word(pc, n);
+      e_.mov_rr32(rd, RAX);
+      adjust_sp(2);
+      return Step::Continue;
+
+    default:
+      return Step::End;
+    }
+  }
+
+private:
+  struct WriteCheck {
+    size_t ok;      // Store done, no compiled code touched
+    size_t written; // Store done, compiled code invalidated
+  };
+
+  Emitter &e_;
+  const uint8_t *exit_;
+  bool flags_pending_ = false;
+  bool pending_overflow_ = true;
+
+  void compile_alu(const JitInstruction &in, uint16_t pc, uint16_t next,
+                   uint32_t n) {
+    // Register-form opcode and group-1 digit per guest opcode ADD..CMP
+    static const uint8_t rr_opcode[] = {0x01, 0x29, 0x21, 0x09, 0x31, 0x39};
+    static const uint8_t ri_digit[] = {0, 5, 4, 1, 6, 7};
+    size_t k = in.opcode - 5;
+    uint8_t rd = guest_reg(in.rd);
+
+    if (in.mode == 0) {
+      e_.alu_rr16(rr_opcode[k], rd, guest_reg(in.rs));
+    } else if (in.mode == 1) {
+      e_.alu_ri16(ri_digit[k], rd, in.extra_word);
+    } else {
+      read_operand(in, pc, next, n);
+      e_.alu_rr16(rr_opcode[k], rd, RAX);
+    }
+    // Host ADD/SUB/CMP flags match the guest ALU; logic ops clear C and V
+    flags_pending_ = true;
+    pending_overflow_ = true;
+  }
+
+  // Effective address into esi. Clobbers host flags.
+  void effective_address(const JitInstruction &in, uint16_t next) {
+    switch (in.mode) {
+    case 2: // DIRECT
+      e_.mov_ri32(RSI, in.extra_word);
+      break;
+    case 3: // REGISTER_INDIRECT
+      e_.mov_rr32(RSI, guest_reg(in.rs));
+      break;
+    case 4: // REGISTER_OFFSET
+      e_.mov_rr32(RSI, guest_reg(in.rs));
+      e_.add_ri32(RSI, in.extra_word);
+      e_.movzx_r32_r16(RSI, RSI);
+      break;
+    default: // PC_RELATIVE
+      e_.mov_ri32(RSI, static_cast<uint16_t>(
+                           next + static_cast<int16_t>(in.extra_word)));
+      break;
+    }
+  }
+
+  // Exit to a JMP/Jcc/CALL target, static when known at compile time
+  void exit_to_target(const JitInstruction &in, uint16_t next,
+                      uint32_t executed) {
+    if (in.mode == 2) {
+      exit_static(in.extra_word, executed);
+    } else if (in.mode == 5) {
+      exit_static(static_cast<uint16_t>(
+                      next + static_cast<int16_t>(in.extra_word)),
+                  executed);
+    } else {
+      effective_address(in, next);
+      exit_dynamic(RSI, executed);
+    }
+  }
+
+  // Load the memory operand at the instruction's effective address into eax
+  void read_operand(const JitInstruction &in, uint16_t pc, uint16_t next,
+                    uint32_t n) {
+    materialize_flags();
+    effective_address(in, next);
+    read_word(pc, n);
+  }
+
+  // eax = word at esi; bail out before this instruction on MMIO
+  void read_word(uint16_t pc, uint32_t n) {
+    e_.call(reinterpret_cast<const void *>(&jit_read_word));
+    e_.bytes({0xA9}); // test eax, imm32
+    e_.imm32(JIT_BAIL);
+    size_t ok = e_.jcc32(CC_Z);
+    exit_static(pc, n);
+    e_.bind(ok);
+  }
+
+  // Store edx to the word at esi; bail out before this instruction on MMIO
+  WriteCheck write_word(uint16_t pc, uint32_t n) {
+    e_.call(reinterpret_cast<const void *>(&jit_write_word));
+    e_.test_rr32(RAX);
+    size_t ok = e_.jcc32(CC_Z);
+    e_.bytes({0xA9}); // test eax, imm32
+    e_.imm32(JIT_BAIL);
+    size_t written = e_.jcc32(CC_Z);
+    exit_static(pc, n);
+    return {ok, written};
+  }
+
+  void stack_slot_below_sp() {
+    e_.mov_rr32(RSI, RBX);
+    e_.add_ri32(RSI, static_cast<uint32_t>(-2));
+    e_.movzx_r32_r16(RSI, RSI);
+  }
+
+  void adjust_sp(uint32_t delta) {
+    e_.add_ri32(RBX, delta);
+    e_.movzx_r32_r16(RBX, RBX);
+  }
+};
+
+#endif // SOFTWARE_CPU_JIT_X86_64
+
+} // namespace
+
+Jit::Jit(Memory &memory)
+    : ctx_(), code_(nullptr), code_used_(0), stubs_size_(0), entry_(nullptr),
+      exit_(nullptr), blocks_(SLOTS), page_blocks_(PAGES, 0),
+      page_invalidations_(PAGES, 0) {
+  ctx_.memory = &memory;
+#if SOFTWARE_CPU_JIT_X86_64
+  void *mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem != MAP_FAILED) {
+    code_ = static_cast<uint8_t *>(mem);
+    emit_stubs();
+  }
+#endif
+}
+
+Jit::~Jit() {
+#if SOFTWARE_CPU_JIT_X86_64
+  if (code_)
+    munmap(code_, CODE_SIZE);
+#endif
+}
+
+void Jit::emit_stubs() {
+#if SOFTWARE_CPU_JIT_X86_64
+  // entry(ctx = rdi, block = rsi): save callee-saved registers, keep the
+  // context pointer at [rsp] (stack stays 16-byte aligned for helper
+  // calls), load pinned guest registers and jump into the block.
+  Emitter e(code_);
+  e.bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+  e.bytes({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+  e.store_context();
+  for (uint8_t r = 0; r < 4; ++r)
+    e.load16_ctx(guest_reg(r), static_cast<uint8_t>(CTX_GPR + 2 * r));
+  e.load16_ctx(RBX, CTX_SP);
+  e.load8_ctx(RBP, CTX_FLAGS);
+  e.bytes({0xFF, 0xE6}); // jmp rsi
+
+  // exit: write pinned registers back and return to the caller
+  size_t exit_offset = e.size();
+  e.load_context();
+  for (uint8_t r = 0; r < 4; ++r)
+    e.store16_ctx(guest_reg(r), static_cast<uint8_t>(CTX_GPR + 2 * r));
+  e.store16_ctx(RBX, CTX_SP);
+  e.store8_ctx(RBP, CTX_FLAGS);
+  e.bytes({0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+  e.bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});
+
+  std::memcpy(code_, e.code().data(), e.size());
+  entry_ = code_;
+  exit_ = code_ + exit_offset;
+  stubs_size_ = e.size();
+  code_used_ = stubs_size_;
+#endif
+}
+
+const JitBlock *Jit::lookup(uint16_t pc, const Decoder &decode) {
+  if (!available() || (pc & 1) != 0 || pc < Memory::PROGRAM_START ||
+      pc > Memory::PROGRAM_END - 3)
+    return nullptr;
+  if (page_invalidations_[pc >> 8] >= MAX_PAGE_INVALIDATIONS)
+    return nullptr;
+
+  JitBlock &block = blocks_[(pc - Memory::PROGRAM_START) >> 1];
+  if (block.state == JitBlock::State::Empty) {
+    if (!compile(pc, decode, block)) {
+      block.state = JitBlock::State::Interpret;
+      block.start = pc;
+      block.end = static_cast<uint16_t>(pc + 2);
+      block.instructions = 0;
+    }
+    track_block(block, 1);
+  }
+  return block.state == JitBlock::State::Compiled ? &block : nullptr;
+}
+
+bool Jit::compile(uint16_t pc, const Decoder &decode, JitBlock &block) {
+#if SOFTWARE_CPU_JIT_X86_64
+  if (code_used_ + MAX_BLOCK_BYTES > CODE_SIZE)
+    flush();
+
+  Emitter e(code_ + code_used_);
+  BlockBuilder builder(e, exit_);
+  uint16_t at = pc;
+  uint8_t count = 0;
+
+  for (;;) {
+    JitInstruction in;
+    bool room = count < MAX_BLOCK_INSTRUCTIONS && e.size() < MAX_BLOCK_BYTES / 2;
+    if (!room || !decode(at, in) || !is_compilable(in)) {
+      if (count == 0)
+        return false;
+      builder.materialize_flags();
+      builder.exit_static(at, count);
+      break;
+    }
+    BlockBuilder::Step step = builder.compile(in, at, count);
+    at = static_cast<uint16_t>(at + in.length);
+    ++count;
+    if (step == BlockBuilder::Step::End)
+      break;
+  }
+
+  std::memcpy(code_ + code_used_, e.code().data(), e.size());
+  block.code = code_ + code_used_;
+  block.start = pc;
+  block.end = at;
+  block.instructions = count;
+  block.state = JitBlock::State::Compiled;
+  code_used_ += e.size();
+  return true;
+#else
+  (void)pc;
+  (void)decode;
+  (void)block;
+  return false;
+#endif
+}
+
+void Jit::enter(const JitBlock &block) {
+  using EntryFn = void (*)(JitContext *, const uint8_t *);
+  ctx_.executed = 0;
+  reinterpret_cast<EntryFn>(const_cast<uint8_t *>(entry_))(&ctx_, block.code);
+}
+
+void Jit::invalidate(uint16_t address) {
+  if (page_blocks_[address >> 8] == 0)
+    return;
+
+  // Blocks are at most MAX_BLOCK_INSTRUCTIONS * 4 bytes long, so only
+  // entries starting shortly before the written byte can cover it.
+  size_t span = MAX_BLOCK_INSTRUCTIONS * 4;
+  uint32_t first = address >= Memory::PROGRAM_START + span
+                       ? address - span
+                       : Memory::PROGRAM_START;
+  for (uint32_t start = first & ~1u; start <= address; start += 2) {
+    if (start > Memory::PROGRAM_END)
+      break;
+    JitBlock &block = blocks_[(start - Memory::PROGRAM_START) >> 1];
+    if (block.state == JitBlock::State::Empty || address >= block.end)
+      continue;
+    track_block(block, -1);
+    block.state = JitBlock::State::Empty;
+    ctx_.code_written = 1;
+    if (page_invalidations_[address >> 8] < MAX_PAGE_INVALIDATIONS)
+      ++page_invalidations_[address >> 8];
+  }
+}
+
+void Jit::invalidate_range(uint16_t start, uint32_t end) {
+  size_t span = MAX_BLOCK_INSTRUCTIONS * 4;
+  uint32_t first = start >= Memory::PROGRAM_START + span
+                       ? start - span
+                       : Memory::PROGRAM_START;
+  uint32_t last = std::min<uint32_t>(end, Memory::PROGRAM_END + 1u);
+  for (uint32_t pc = first & ~1u; pc < last; pc += 2) {
+    JitBlock &block = blocks_[(pc - Memory::PROGRAM_START) >> 1];
+    if (block.state == JitBlock::State::Empty || block.end <= start)
+      continue;
+    track_block(block, -1);
+    block.state = JitBlock::State::Empty;
+  }
+}
+
+void Jit::flush() {
+  for (auto &block : blocks_)
+    block = JitBlock();
+  std::fill(page_blocks_.begin(), page_blocks_.end(), 0);
+  std::fill(page_invalidations_.begin(), page_invalidations_.end(), 0);
+  code_used_ = stubs_size_;
+}
+
+void Jit::track_block(const JitBlock &block, int delta) {
+  for (size_t page = block.start >> 8; page <= (block.end - 1u) >> 8u; ++page)
+    page_blocks_[page] = static_cast<uint16_t>(page_blocks_[page] + delta);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "memory.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Guest state shared with generated code. Field offsets are baked into the
+// emitted instructions, so this must stay a standard-layout struct.
+struct JitContext {
+  uint16_t gpr[4];       // R0-R3
+  uint16_t pc;           // Next guest PC after a block exits
+  uint16_t sp;           // Stack Pointer
+  uint8_t flags;         // FLAGS (Z, N, C, V)
+  uint8_t halted;        // Set by a compiled HALT
+  uint8_t code_written;  // Set when a store invalidated compiled code
+  uint8_t reserved;
+  uint32_t executed;     // Instructions retired by the last block
+  Memory *memory;
+};
+
+// One decoded guest instruction as seen by the block compiler
+struct JitInstruction {
+  uint8_t opcode;
+  uint8_t mode;
+  uint8_t rd;
+  uint8_t rs;
+  uint16_t extra_word;
+  uint8_t length; // 2 or 4 bytes
+};
+
+// Block cache entry for one word-aligned program address
+struct JitBlock {
+  enum class State : uint8_t {
+    Empty,     // Not compiled yet
+    Compiled,  // Host code available
+    Interpret  // First instruction is not compilable; use the interpreter
+  };
+  const uint8_t *code = nullptr;
+  uint16_t start = 0;
+  uint16_t end = 0; // One past the last guest byte covered
+  uint8_t instructions = 0;
+  State state = State::Empty;
+};
+
+// Basic-block JIT from the 16-bit ISA to x86-64.
+//
+// Blocks run from their entry PC up to and including the first JMP, Jcc,
+// CALL, RET or HALT. R0-R3 are pinned to r12-r15, SP to rbx and FLAGS to
+// rbp for the duration of a block. Memory accesses go through helpers that
+// bail out to the interpreter before touching the MMIO range, and stores
+// that overwrite compiled code end the block so it can be recompiled. IN and
+// OUT are never compiled. On hosts other than x86-64 Linux, available()
+// returns false and callers should interpret instead.
+class Jit {
+public:
+  // Decodes the instruction at pc; returns false if it cannot be cached
+  using Decoder = std::function<bool(uint16_t pc, JitInstruction &out)>;
+
+  explicit Jit(Memory &memory);
+  ~Jit();
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  bool available() const { return code_ != nullptr; }
+  JitContext &context() { return ctx_; }
+
+  // Returns the compiled block starting at pc, compiling it on first use,
+  // or nullptr when the interpreter should execute the instruction at pc.
+  const JitBlock *lookup(uint16_t pc, const Decoder &decode);
+
+  // Run one compiled block against context()
+  void enter(const JitBlock &block);
+
+  // Invalidation hooks, driven by Memory's code write callback
+  void invalidate(uint16_t address);
+  // Drop blocks overlapping [start, end) without counting it as
+  // self-modifying code (used when memory is restored from a snapshot)
+  void invalidate_range(uint16_t start, uint32_t end);
+  void flush();
+
+private:
+  static constexpr size_t CODE_SIZE = 1 << 20;
+  static constexpr size_t MAX_BLOCK_BYTES = 4096;
+  static constexpr uint8_t MAX_BLOCK_INSTRUCTIONS = 32;
+  static constexpr size_t SLOTS =
+      (Memory::PROGRAM_END - Memory::PROGRAM_START + 1) / 2;
+  static constexpr size_t PAGES = 256;
+  // Pages invalidated this often stop being compiled (self-modifying code)
+  static constexpr uint16_t MAX_PAGE_INVALIDATIONS = 16;
+
+  JitContext ctx_;
+  uint8_t *code_;
+  size_t code_used_;
+  size_t stubs_size_;
+  const uint8_t *entry_;
+  const uint8_t *exit_;
+
+  std::vector<JitBlock> blocks_;
+  std::vector<uint16_t> page_blocks_;        // Live blocks touching each page
+  std::vector<uint16_t> page_invalidations_; // Code writes seen per page
+
+  bool compile(uint16_t pc, const Decoder &decode, JitBlock &block);
+  void emit_stubs();
+  void track_block(const JitBlock &block, int delta);
+};
@@ -0,0 +1,861 @@
+#include "lockstep.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+// Per-lane kernels. Every instruction's lane loop is written once as a
+// generic lambda over a lane type: VectorLanes processes VECTOR_LANES slots
+// per iteration with GCC/Clang vector extensions (SSE2 or NEON on the
+// baseline targets, wider where the compiler is told so), ScalarLanes the
+// remainder, or all of them without the extensions. Comparisons yield bool
+// for scalars and all-ones lane masks for vectors; keep_if() and select()
+// hide the difference.
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LOCKSTEP_NO_VECTOR)
+#define LOCKSTEP_VECTOR 1
+#else
+#define LOCKSTEP_VECTOR 0
+#endif
+
+namespace {
+
+// Flag bits as laid out in the FLAGS register
+constexpr uint16_t F_Z = 1 << Registers::FLAG_Z;
+constexpr uint16_t F_N = 1 << Registers::FLAG_N;
+constexpr uint16_t F_C = 1 << Registers::FLAG_C;
+constexpr uint16_t F_V = 1 << Registers::FLAG_V;
+
+struct ScalarLanes {
+  using T = uint16_t;
+  static T load(const uint16_t *p) { return *p; }
+  static void store(uint16_t *p, T value) { *p = value; }
+  static T splat(uint16_t value) { return value; }
+};
+
+inline uint16_t keep_if(bool condition, uint16_t value) {
+  return condition ? value : 0;
+}
+inline uint16_t select(bool condition, uint16_t a, uint16_t b) {
+  return condition ? a : b;
+}
+
+#if LOCKSTEP_VECTOR
+typedef uint16_t Vec __attribute__((vector_size(16)));
+typedef int16_t VecMask __attribute__((vector_size(16)));
+constexpr size_t VECTOR_LANES = sizeof(Vec) / sizeof(uint16_t);
+
+struct VectorLanes {
+  using T = Vec;
+  static T load(const uint16_t *p) {
+    T value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  static void store(uint16_t *p, T value) {
+    std::memcpy(p, &value, sizeof(value));
+  }
+  static T splat(uint16_t value) { return T{} + value; }
+};
+
+// Vector casts reinterpret the lanes, as between same-sized vector types
+inline Vec keep_if(VecMask condition, Vec value) {
+  return (Vec)condition & value;
+}
+inline Vec keep_if(VecMask condition, uint16_t value) {
+  return (Vec)condition & value;
+}
+inline Vec select(VecMask condition, Vec a, Vec b) {
+  return ((Vec)condition & a) | (~(Vec)condition & b);
+}
+#endif
+
+// Runs body(lanes, i) over slots 0..n-1, a vector of slots at a time
+template <class Body> inline void for_lanes(size_t n, Body body) {
+  size_t i = 0;
+#if LOCKSTEP_VECTOR
+  for (; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+    body(VectorLanes(), i);
+#endif
+  for (; i < n; ++i)
+    body(ScalarLanes(), i);
+}
+
+bool all_equal(const uint16_t *values, size_t n) {
+  uint16_t first = values[0];
+  uint16_t diff = 0;
+  size_t i = 0;
+#if LOCKSTEP_VECTOR
+  Vec acc = {};
+  for (; i + VECTOR_LANES <= n; i += VECTOR_LANES)
+    acc |= VectorLanes::load(values + i) ^ first;
+  for (size_t k = 0; k < VECTOR_LANES; ++k)
+    diff |= acc[k];
+#endif
+  for (; i < n; ++i)
+    diff |= values[i] ^ first;
+  return diff == 0;
+}
+
+// ALU operations with the same results and flags as ALU::execute
+template <class T> T zn_flags(T result) {
+  return T(keep_if(result == 0, F_Z) | T(T(result >> 15) << 1));
+}
+
+template <class T> T lane_add(T a, T b, T &flags) {
+  T result = T(a + b);
+  flags = T(zn_flags(result) | keep_if(result < a, F_C) |
+            T(T(T(~(a ^ b) & (a ^ result)) >> 15) << 3));
+  return result;
+}
+
+template <class T> T lane_sub(T a, T b, T &flags) {
+  T result = T(a - b);
+  flags = T(zn_flags(result) | keep_if(a < b, F_C) |
+            T(T(T((a ^ b) & (a ^ result)) >> 15) << 3));
+  return result;
+}
+
+template <class T> T lane_logic(T result, T &flags) {
+  flags = zn_flags(result);
+  return result;
+}
+
+// Shift counts of 16 and up clear the value; the carry is the last bit
+// shifted out for counts 1..16
+template <class T> T lane_shl(T a, T b, T &flags) {
+  T result = keep_if(b < 16, T(a << T(b & 15)));
+  T out = T(T(a >> T(T(16 - b) & 15)) & 1);
+  flags = T(zn_flags(result) | keep_if(T(b - 1) < 16, T(out << 2)));
+  return result;
+}
+
+template <class T> T lane_shr(T a, T b, T &flags) {
+  T result = keep_if(b < 16, T(a >> T(b & 15)));
+  T out = T(T(a >> T(T(b - 1) & 15)) & 1);
+  flags = T(zn_flags(result) | keep_if(T(b - 1) < 16, T(out << 2)));
+  return result;
+}
+
+static_assert(F_C == 1 << 2 && F_V == 1 << 3 && F_N == 1 << 1,
+              "lane kernels shift flag bits into place");
+
+// Source operand of a value instruction
+struct LaneSource {
+  const uint16_t *values;
+  template <class L> typename L::T get(L, size_t i) const {
+    return L::load(values + i);
+  }
+};
+struct UniformSource {
+  uint16_t value;
+  template <class L> typename L::T get(L, size_t) const {
+    return L::splat(value);
+  }
+};
+
+template <bool StoreResult, class Source, class Op>
+void alu_lanes(uint16_t *rd, uint16_t *flags, Source b, size_t n, Op op) {
+  for_lanes(n, [&](auto lanes, size_t i) {
+    using T = typename decltype(lanes)::T;
+    T f;
+    T result = op(lanes.load(rd + i), b.get(lanes, i), f);
+    if (StoreResult)
+      lanes.store(rd + i, result);
+    lanes.store(flags + i, f);
+  });
+}
+
+template <class Source>
+void value_op(CPU::Opcode op, uint16_t *rd, uint16_t *flags, Source b,
+              size_t n) {
+  switch (op) {
+  case CPU::Opcode::MOV:
+    for_lanes(n, [&](auto lanes, size_t i) {
+      lanes.store(rd + i, b.get(lanes, i));
+    });
+    break;
+  case CPU::Opcode::ADD:
+    alu_lanes<true>(rd, flags, b, n,
+                    [](auto x, auto y, auto &f) { return lane_add(x, y, f); });
+    break;
+  case CPU::Opcode::SUB:
+    alu_lanes<true>(rd, flags, b, n,
+                    [](auto x, auto y, auto &f) { return lane_sub(x, y, f); });
+    break;
+  case CPU::Opcode::CMP:
+    alu_lanes<false>(rd, flags, b, n,
+                     [](auto x, auto y, auto &f) { return lane_sub(x, y, f); });
+    break;
+  case CPU::Opcode::AND:
+    alu_lanes<true>(rd, flags, b, n, [](auto x, auto y, auto &f) {
+      return lane_logic(decltype(x)(x & y), f);
+    });
+    break;
+  case CPU::Opcode::OR:
+    alu_lanes<true>(rd, flags, b, n, [](auto x, auto y, auto &f) {
+      return lane_logic(decltype(x)(x | y), f);
+    });
+    break;
+  case CPU::Opcode::XOR:
+    alu_lanes<true>(rd, flags, b, n, [](auto x, auto y, auto &f) {
+      return lane_logic(decltype(x)(x ^ y), f);
+    });
+    break;
+  case CPU::Opcode::SHL:
+    alu_lanes<true>(rd, flags, b, n,
+                    [](auto x, auto y, auto &f) { return lane_shl(x, y, f); });
+    break;
+  case CPU::Opcode::SHR:
+    alu_lanes<true>(rd, flags, b, n,
+                    [](auto x, auto y, auto &f) { return lane_shr(x, y, f); });
+    break;
+  default:
+    break;
+  }
+}
+
+// Next PC of every lane for a conditional branch to `target`
+template <class Cond>
+void branch_lanes(const uint16_t *flags, const uint16_t *target,
+                  uint16_t fall_through, uint16_t *next, size_t n,
+                  Cond taken) {
+  for_lanes(n, [&](auto lanes, size_t i) {
+    lanes.store(next + i, select(taken(lanes.load(flags + i)),
+                                 lanes.load(target + i),
+                                 lanes.splat(fall_through)));
+  });
+}
+
+uint16_t load_word(const uint8_t *memory, uint16_t address) {
+  return static_cast<uint16_t>(
+      memory[address] | (memory[static_cast<uint16_t>(address + 1)] << 8));
+}
+
+void store_word(uint8_t *memory, uint16_t address, uint16_t value) {
+  memory[address] = static_cast<uint8_t>(value & 0xFF);
+  memory[static_cast<uint16_t>(address + 1)] = static_cast<uint8_t>(value >> 8);
+}
+
+// Word accesses with a byte on the IO page go to devices, and writes into
+// the program region would have to redecode code every lane shares
+bool read_unmodelled(uint16_t address) {
+  return static_cast<uint16_t>(address - (Memory::IO_START - 1)) <=
+         Memory::IO_END - (Memory::IO_START - 1);
+}
+
+bool write_unmodelled(uint16_t address) {
+  return static_cast<uint16_t>(address - (Memory::PROGRAM_START - 1)) <=
+         Memory::IO_END - (Memory::PROGRAM_START - 1);
+}
+
+// IN and OUT are modelled for the console ports only
+constexpr uint16_t CONSOLE_LAST_PORT = Console::STATUS - Memory::IO_START;
+
+void program_bytes(const BatchJob &job, const uint8_t *&data, size_t &size) {
+  if (job.image) {
+    data = job.image->data();
+    size = job.image->size();
+  } else {
+    data = job.program.data();
+    size = job.program.size();
+  }
+}
+
+} // namespace
+
+void LockstepEngine::Slots::resize(size_t count) {
+  for (auto &reg : r)
+    reg.resize(count);
+  sp.resize(count);
+  flags.resize(count);
+  lane.resize(count);
+}
+
+LockstepEngine::LockstepEngine(CPU::Engine engine) : engine_(engine) {}
+
+bool LockstepEngine::same_program(const BatchJob &a, const BatchJob &b) {
+  if (a.image && a.image == b.image)
+    return true;
+  const uint8_t *a_data, *b_data;
+  size_t a_size, b_size;
+  program_bytes(a, a_data, a_size);
+  program_bytes(b, b_data, b_size);
+  return a_size == b_size &&
+         (a_size == 0 || std::memcmp(a_data, b_data, a_size) == 0);
+}
+
+std::vector<BatchResult>
+LockstepEngine::run(const std::vector<const BatchJob *> &jobs) {
+  std::vector<BatchResult> results(jobs.size());
+  stats_ = Stats();
+  if (jobs.empty())
+    return results;
+
+  const uint8_t *program;
+  size_t size;
+  program_bytes(*jobs[0], program, size);
+  if (size > Memory::MEMORY_SIZE - Memory::PROGRAM_START)
+    throw std::runtime_error("Program too large for memory");
+  for (const BatchJob *job : jobs) {
+    if (!same_program(*job, *jobs[0]))
+      throw std::runtime_error("Lockstep jobs must all run the same program");
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t count = jobs.size();
+  memory_.reset(new HostPages(count * Memory::MEMORY_SIZE));
+  slots_.resize(count);
+  spare_.resize(count);
+  ea_.assign(count, 0);
+  next_.assign(count, 0);
+  operand_.assign(count, 0);
+  leave_.assign(count, 0);
+  lanes_.resize(count);
+  code_.assign((Memory::PROGRAM_END - Memory::PROGRAM_START + 1) / 2, Code{});
+
+  // Every lane starts as a freshly reset CPU that loaded the program
+  const Registers initial;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (size > 0)
+      std::memcpy(memory_of(i) + Memory::PROGRAM_START, program, size);
+    for (uint8_t reg = 0; reg < 4; ++reg)
+      slots_.r[reg][i] = initial.get_gpr(reg);
+    slots_.sp[i] = initial.get_sp();
+    slots_.flags[i] = initial.get_flags();
+    slots_.lane[i] = i;
+    results[i].name = jobs[i]->name;
+    lanes_[i] = Lane{jobs[i], &results[i], 0, 0};
+  }
+  groups_.assign(1, Group{Memory::PROGRAM_START, 0,
+                          static_cast<uint32_t>(count)});
+
+  while (!groups_.empty()) {
+    Group group = groups_.back();
+    groups_.pop_back();
+    run_group(group);
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (BatchResult &result : results)
+    result.seconds = seconds;
+  memory_.reset();
+  return results;
+}
+
+const CPU::DecodedInstruction *LockstepEngine::instruction_at(uint16_t pc) {
+  // Same coverage as the CPU's decode cache
+  if ((pc & 1) != 0 || pc < Memory::PROGRAM_START ||
+      pc > Memory::PROGRAM_END - 3)
+    return nullptr;
+  Code &code = code_[(pc - Memory::PROGRAM_START) >> 1];
+  if (!code.valid) {
+    const uint8_t *memory = memory_of(0);
+    code.instr = CPU::decode_word(load_word(memory, pc));
+    if (code.instr.has_extra_word)
+      code.instr.extra_word = load_word(memory, static_cast<uint16_t>(pc + 2));
+    code.valid = true;
+  }
+  return &code.instr;
+}
+
+void LockstepEngine::run_group(Group group) {
+  // Waiting groups all have higher PCs; reaching the lowest of them means
+  // joining it or letting it run first
+  uint32_t stop = groups_.empty() ? 0x10000u : groups_.back().pc;
+  uint64_t executed = 0;
+  uint64_t budget = settle(group, 0);
+  while (group.size() > 0) {
+    if (executed == budget) {
+      budget = settle(group, executed);
+      executed = 0;
+      continue;
+    }
+
+    const CPU::DecodedInstruction *instr = instruction_at(group.pc);
+    if (!instr) {
+      hand_over_all(group, executed);
+      return;
+    }
+    switch (execute(group, *instr, executed)) {
+    case Outcome::Next:
+      ++stats_.dispatches;
+      ++executed;
+      if (group.pc >= stop) {
+        settle(group, executed);
+        if (group.size() > 0) {
+          insert(group);
+          join_duplicates();
+        }
+        return;
+      }
+      break;
+    case Outcome::Diverged: {
+      ++stats_.dispatches;
+      ++stats_.splits;
+      settle(group, executed + 1);
+      uint32_t begin = group.begin;
+      while (begin < group.end) {
+        uint16_t pc = next_[begin];
+        uint32_t end = begin;
+        for (uint32_t i = begin; i < group.end; ++i) {
+          if (next_[i] == pc)
+            swap_slots(i, end++);
+        }
+        insert(Group{pc, begin, end});
+        begin = end;
+      }
+      join_duplicates();
+      return;
+    }
+    case Outcome::Halted:
+      ++stats_.dispatches;
+      for (uint32_t slot = group.begin; slot < group.end; ++slot)
+        finish(slot, lanes_[slots_.lane[slot]].cycles + executed + 1, true);
+      return;
+    case Outcome::Empty:
+      return;
+    }
+  }
+}
+
+LockstepEngine::Outcome
+LockstepEngine::execute(Group &group, const CPU::DecodedInstruction &instr,
+                        uint64_t executed) {
+  using Opcode = CPU::Opcode;
+  using Mode = CPU::AddressingMode;
+  const uint16_t pc = group.pc;
+  const uint16_t next = static_cast<uint16_t>(pc + (instr.has_extra_word ? 4 : 2));
+  const bool value_mode = instr.mode <= Mode::PC_RELATIVE;
+  const bool address_mode =
+      instr.mode >= Mode::DIRECT && instr.mode <= Mode::PC_RELATIVE;
+  // Register errors and invalid modes are the reference core's to report
+  if (instr.rd > 3 || instr.rs > 3) {
+    hand_over_all(group, executed);
+    return Outcome::Empty;
+  }
+
+  // Slot pointers are taken after any hand-over, which reorders slots
+  const uint32_t b = group.begin;
+  auto gpr = [&](uint8_t reg) { return slots_.r[reg].data() + b; };
+
+  switch (instr.opcode) {
+  case Opcode::NOP:
+    group.pc = next;
+    return Outcome::Next;
+
+  case Opcode::HALT:
+    return Outcome::Halted;
+
+  case Opcode::MOV:
+  case Opcode::ADD:
+  case Opcode::SUB:
+  case Opcode::AND:
+  case Opcode::OR:
+  case Opcode::XOR:
+  case Opcode::CMP:
+  case Opcode::SHL:
+  case Opcode::SHR: {
+    if (!value_mode)
+      break;
+    if (instr.mode >= Mode::DIRECT) {
+      effective_addresses(group, instr, next);
+      if (!hand_over_unmodelled(group, false, pc, executed))
+        return Outcome::Empty;
+      load_operands(group);
+    }
+    uint16_t *rd = gpr(instr.rd);
+    uint16_t *flags = slots_.flags.data() + b;
+    size_t n = group.size();
+    if (instr.mode == Mode::REGISTER)
+      value_op(instr.opcode, rd, flags, LaneSource{gpr(instr.rs)}, n);
+    else if (instr.mode == Mode::IMMEDIATE)
+      value_op(instr.opcode, rd, flags, UniformSource{instr.extra_word}, n);
+    else
+      value_op(instr.opcode, rd, flags, LaneSource{operand_.data() + b}, n);
+    group.pc = next;
+    return Outcome::Next;
+  }
+
+  case Opcode::LOAD:
+  case Opcode::STORE: {
+    if (!address_mode)
+      break;
+    bool store = instr.opcode == Opcode::STORE;
+    effective_addresses(group, instr, next);
+    if (!hand_over_unmodelled(group, store, pc, executed))
+      return Outcome::Empty;
+    uint16_t *rd = gpr(instr.rd);
+    for (uint32_t i = 0; i < group.size(); ++i) {
+      uint8_t *memory = memory_of(slots_.lane[b + i]);
+      if (store)
+        store_word(memory, ea_[b + i], rd[i]);
+      else
+        rd[i] = load_word(memory, ea_[b + i]);
+    }
+    group.pc = next;
+    return Outcome::Next;
+  }
+
+  case Opcode::JMP:
+    if (!address_mode)
+      break;
+    effective_addresses(group, instr, next);
+    std::copy(ea_.begin() + b, ea_.begin() + group.end, next_.begin() + b);
+    return branch(group);
+
+  case Opcode::JZ:
+  case Opcode::JNZ:
+  case Opcode::JC:
+  case Opcode::JNC:
+  case Opcode::JN: {
+    if (!address_mode)
+      break;
+    effective_addresses(group, instr, next);
+    const uint16_t *flags = slots_.flags.data() + b;
+    const uint16_t *target = ea_.data() + b;
+    uint16_t *out = next_.data() + b;
+    size_t n = group.size();
+    switch (instr.opcode) {
+    case Opcode::JZ:
+      branch_lanes(flags, target, next, out, n,
+                   [](auto f) { return (f & F_Z) != 0; });
+      break;
+    case Opcode::JNZ:
+      branch_lanes(flags, target, next, out, n,
+                   [](auto f) { return (f & F_Z) == 0; });
+      break;
+    case Opcode::JC:
+      branch_lanes(flags, target, next, out, n,
+                   [](auto f) { return (f & F_C) != 0; });
+      break;
+    case Opcode::JNC:
+      branch_lanes(flags, target, next, out, n,
+                   [](auto f) { return (f & F_C) == 0; });
+      break;
+    default:
+      branch_lanes(flags, target, next, out, n,
+                   [](auto f) { return (f & F_N) != 0; });
+      break;
+    }
+    return branch(group);
+  }
+
+  case Opcode::CALL: {
+    if (!address_mode)
+      break;
+    effective_addresses(group, instr, next);
+    std::copy(ea_.begin() + b, ea_.begin() + group.end, next_.begin() + b);
+    for (uint32_t i = b; i < group.end; ++i)
+      ea_[i] = static_cast<uint16_t>(slots_.sp[i] - 2);
+    if (!hand_over_unmodelled(group, true, pc, executed))
+      return Outcome::Empty;
+    for (uint32_t i = b; i < group.end; ++i) {
+      store_word(memory_of(slots_.lane[i]), ea_[i], next);
+      slots_.sp[i] = ea_[i];
+    }
+    return branch(group);
+  }
+
+  case Opcode::RET:
+    std::copy(slots_.sp.begin() + b, slots_.sp.begin() + group.end,
+              ea_.begin() + b);
+    if (!hand_over_unmodelled(group, false, pc, executed))
+      return Outcome::Empty;
+    for (uint32_t i = b; i < group.end; ++i) {
+      next_[i] = load_word(memory_of(slots_.lane[i]), ea_[i]);
+      slots_.sp[i] = static_cast<uint16_t>(ea_[i] + 2);
+    }
+    return branch(group);
+
+  case Opcode::PUSH:
+  case Opcode::POP: {
+    bool push = instr.opcode == Opcode::PUSH;
+    for (uint32_t i = b; i < group.end; ++i)
+      ea_[i] = static_cast<uint16_t>(slots_.sp[i] - (push ? 2 : 0));
+    if (!hand_over_unmodelled(group, push, pc, executed))
+      return Outcome::Empty;
+    uint16_t *rd = gpr(instr.rd);
+    for (uint32_t i = b; i < group.end; ++i) {
+      uint8_t *memory = memory_of(slots_.lane[i]);
+      if (push) {
+        store_word(memory, ea_[i], rd[i - b]);
+        slots_.sp[i] = ea_[i];
+      } else {
+        rd[i - b] = load_word(memory, ea_[i]);
+        slots_.sp[i] = static_cast<uint16_t>(ea_[i] + 2);
+      }
+    }
+    group.pc = next;
+    return Outcome::Next;
+  }
+
+  case Opcode::IN:
+  case Opcode::OUT: {
+    if (!value_mode)
+      break;
+    // Port numbers into operand_, then hand over lanes using other ports
+    if (instr.mode >= Mode::DIRECT) {
+      effective_addresses(group, instr, next);
+      if (!hand_over_unmodelled(group, false, pc, executed))
+        return Outcome::Empty;
+      load_operands(group);
+    } else if (instr.mode == Mode::REGISTER) {
+      std::copy(slots_.r[instr.rs].begin() + b,
+                slots_.r[instr.rs].begin() + group.end, operand_.begin() + b);
+    } else {
+      std::fill(operand_.begin() + b, operand_.begin() + group.end,
+                instr.extra_word);
+    }
+    uint32_t end = group.end;
+    bool other = false;
+    for (uint32_t i = b; i < end; ++i) {
+      leave_[i] = (operand_[i] & 0xFF) > CONSOLE_LAST_PORT;
+      other = other || leave_[i];
+    }
+    if (other) {
+      for (uint32_t slot = retire(group); slot < end; ++slot)
+        hand_over(slot, pc, lanes_[slots_.lane[slot]].cycles + executed);
+      if (group.size() == 0)
+        return Outcome::Empty;
+    }
+    uint16_t *rd = gpr(instr.rd);
+    for (uint32_t i = b; i < group.end; ++i) {
+      Lane &lane = lanes_[slots_.lane[i]];
+      uint16_t port = static_cast<uint16_t>(Memory::IO_START +
+                                            (operand_[i] & 0xFF));
+      if (instr.opcode == Opcode::OUT) {
+        if (port == Console::DATA_OUT)
+          lane.result->output.push_back(static_cast<char>(rd[i - b] & 0xFF));
+        continue;
+      }
+      // Console::read on a string source
+      const std::string &input = lane.job->input;
+      bool ready = lane.input_pos < input.size();
+      if (port == Console::DATA_IN)
+        rd[i - b] = ready ? static_cast<uint8_t>(input[lane.input_pos++]) : 0;
+      else if (port == Console::STATUS)
+        rd[i - b] = ready ? Console::STATUS_INPUT_READY
+                          : Console::STATUS_INPUT_EOF;
+      else
+        rd[i - b] = 0;
+    }
+    group.pc = next;
+    return Outcome::Next;
+  }
+
+  default:
+    break;
+  }
+  hand_over_all(group, executed);
+  return Outcome::Empty;
+}
+
+LockstepEngine::Outcome LockstepEngine::branch(Group &group) {
+  if (all_equal(next_.data() + group.begin, group.size())) {
+    group.pc = next_[group.begin];
+    return Outcome::Next;
+  }
+  return Outcome::Diverged;
+}
+
+void LockstepEngine::effective_addresses(const Group &group,
+                                         const CPU::DecodedInstruction &instr,
+                                         uint16_t next) {
+  uint16_t *ea = ea_.data() + group.begin;
+  const uint16_t *rs = slots_.r[instr.rs].data() + group.begin;
+  const uint16_t extra = instr.extra_word;
+  size_t n = group.size();
+  switch (instr.mode) {
+  case CPU::AddressingMode::DIRECT:
+    std::fill(ea, ea + n, extra);
+    break;
+  case CPU::AddressingMode::REGISTER_INDIRECT:
+    std::copy(rs, rs + n, ea);
+    break;
+  case CPU::AddressingMode::REGISTER_OFFSET:
+    for_lanes(n, [&](auto lanes, size_t i) {
+      lanes.store(ea + i, decltype(lanes.load(rs))(lanes.load(rs + i) + extra));
+    });
+    break;
+  default: // PC_RELATIVE
+    std::fill(ea, ea + n,
+              static_cast<uint16_t>(next + static_cast<int16_t>(extra)));
+    break;
+  }
+}
+
+bool LockstepEngine::hand_over_unmodelled(Group &group, bool write,
+                                          uint16_t pc, uint64_t executed) {
+  uint32_t end = group.end;
+  bool any = false;
+  for (uint32_t i = group.begin; i < end; ++i) {
+    leave_[i] = write ? write_unmodelled(ea_[i]) : read_unmodelled(ea_[i]);
+    any = any || leave_[i];
+  }
+  if (!any)
+    return true;
+  for (uint32_t slot = retire(group); slot < end; ++slot)
+    hand_over(slot, pc, lanes_[slots_.lane[slot]].cycles + executed);
+  return group.size() > 0;
+}
+
+void LockstepEngine::hand_over_all(Group &group, uint64_t executed) {
+  for (uint32_t slot = group.begin; slot < group.end; ++slot)
+    hand_over(slot, group.pc, lanes_[slots_.lane[slot]].cycles + executed);
+  group.end = group.begin;
+}
+
+void LockstepEngine::load_operands(const Group &group) {
+  for (uint32_t i = group.begin; i < group.end; ++i)
+    operand_[i] = load_word(memory_of(slots_.lane[i]), ea_[i]);
+}
+
+uint32_t LockstepEngine::retire(Group &group) {
+  uint32_t keep = group.begin;
+  for (uint32_t i = group.begin; i < group.end; ++i) {
+    if (!leave_[i])
+      swap_slots(i, keep++);
+  }
+  group.end = keep;
+  return keep;
+}
+
+void LockstepEngine::swap_slots(uint32_t a, uint32_t b) {
+  if (a == b)
+    return;
+  for (auto &reg : slots_.r)
+    std::swap(reg[a], reg[b]);
+  std::swap(slots_.sp[a], slots_.sp[b]);
+  std::swap(slots_.flags[a], slots_.flags[b]);
+  std::swap(slots_.lane[a], slots_.lane[b]);
+  std::swap(ea_[a], ea_[b]);
+  std::swap(next_[a], next_[b]);
+  std::swap(operand_[a], operand_[b]);
+  std::swap(leave_[a], leave_[b]);
+}
+
+void LockstepEngine::finish(uint32_t slot, uint64_t cycles, bool halted) {
+  BatchResult &result = *lanes_[slots_.lane[slot]].result;
+  result.halted = halted;
+  result.cycles = cycles;
+  for (uint8_t reg = 0; reg < 4; ++reg)
+    result.gpr[reg] = slots_.r[reg][slot];
+  stats_.instructions += cycles;
+}
+
+void LockstepEngine::hand_over(uint32_t slot, uint16_t pc, uint64_t cycles) {
+  Lane &lane = lanes_[slots_.lane[slot]];
+  BatchResult &result = *lane.result;
+  stats_.instructions += cycles;
+  ++stats_.handovers;
+
+  CPU cpu;
+  cpu.set_engine(engine_);
+  cpu.set_output_callback([&result](uint8_t value) {
+    result.output.push_back(static_cast<char>(value));
+  });
+  cpu.get_memory().console().set_input(lane.job->input.substr(lane.input_pos));
+
+  // The lane's memory and registers, as a CPU that ran it so far holds them
+  // (devices other than the console are untouched, so still reset)
+  auto memory = std::make_shared<Memory::Snapshot>();
+  const uint8_t *bytes = memory_of(slots_.lane[slot]);
+  for (uint32_t page = 0; page < Memory::PAGE_COUNT; ++page) {
+    auto copy = std::make_shared<Memory::Snapshot::Page>();
+    std::memcpy(copy->data(), bytes + page * Memory::PAGE_SIZE,
+                Memory::PAGE_SIZE);
+    memory->pages[page] = std::move(copy);
+  }
+  CPU::Snapshot state;
+  state.memory = std::move(memory);
+  for (uint8_t reg = 0; reg < 4; ++reg)
+    state.registers.set_gpr(reg, slots_.r[reg][slot]);
+  state.registers.set_pc(pc);
+  state.registers.set_sp(slots_.sp[slot]);
+  state.registers.set_flags(static_cast<uint8_t>(slots_.flags[slot]));
+  state.cycle_count = cycles;
+  cpu.restore(state);
+
+  if (cycles < lane.job->max_cycles)
+    cpu.run(lane.job->max_cycles - cycles);
+  result.error = cpu.get_last_error();
+  result.halted = cpu.is_halted();
+  result.cycles = cpu.get_cycle_count();
+  for (uint8_t reg = 0; reg < 4; ++reg)
+    result.gpr[reg] = cpu.get_registers().get_gpr(reg);
+}
+
+uint64_t LockstepEngine::settle(Group &group, uint64_t executed) {
+  uint32_t end = group.end;
+  bool any = false;
+  for (uint32_t i = group.begin; i < end; ++i) {
+    Lane &lane = lanes_[slots_.lane[i]];
+    lane.cycles += executed;
+    leave_[i] = lane.cycles >= lane.job->max_cycles;
+    any = any || leave_[i];
+  }
+  if (any) {
+    for (uint32_t slot = retire(group); slot < end; ++slot)
+      finish(slot, lanes_[slots_.lane[slot]].cycles, false);
+  }
+  uint64_t budget = UINT64_MAX;
+  for (uint32_t i = group.begin; i < group.end; ++i) {
+    const Lane &lane = lanes_[slots_.lane[i]];
+    budget = std::min(budget, lane.job->max_cycles - lane.cycles);
+  }
+  return budget;
+}
+
+void LockstepEngine::insert(const Group &group) {
+  auto at = std::lower_bound(
+      groups_.begin(), groups_.end(), group.pc,
+      [](const Group &g, uint16_t pc) { return g.pc > pc; });
+  groups_.insert(at, group);
+}
+
+void LockstepEngine::join_duplicates() {
+  bool scattered = false;
+  for (size_t i = 0; i + 1 < groups_.size();) {
+    Group &a = groups_[i];
+    Group &b = groups_[i + 1];
+    if (a.pc != b.pc) {
+      ++i;
+    } else if (a.end == b.begin || b.end == a.begin) {
+      a.begin = std::min(a.begin, b.begin);
+      a.end = std::max(a.end, b.end);
+      groups_.erase(groups_.begin() + static_cast<ptrdiff_t>(i) + 1);
+    } else {
+      scattered = true;
+      ++i;
+    }
+  }
+  if (scattered)
+    relayout();
+}
+
+void LockstepEngine::relayout() {
+  std::vector<Group> joined;
+  uint32_t out = 0;
+  for (const Group &group : groups_) {
+    uint32_t begin = out;
+    for (int reg = 0; reg < 4; ++reg)
+      std::copy(slots_.r[reg].begin() + group.begin,
+                slots_.r[reg].begin() + group.end, spare_.r[reg].begin() + out);
+    std::copy(slots_.sp.begin() + group.begin, slots_.sp.begin() + group.end,
+              spare_.sp.begin() + out);
+    std::copy(slots_.flags.begin() + group.begin,
+              slots_.flags.begin() + group.end, spare_.flags.begin() + out);
+    std::copy(slots_.lane.begin() + group.begin,
+              slots_.lane.begin() + group.end, spare_.lane.begin() + out);
+    out += group.end - group.begin;
+    if (!joined.empty() && joined.back().pc == group.pc)
+      joined.back().end = out;
+    else
+      joined.push_back(Group{group.pc, begin, out});
+  }
+  std::swap(slots_, spare_);
+  groups_ = std::move(joined);
+}
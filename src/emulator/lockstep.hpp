@@ -0,0 +1,155 @@
+#pragma once
+
+#include "batch_runner.hpp"
+#include "cpu.hpp"
+#include "host_pages.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Lockstep execution of many guests running the same program, such as an
+// input sweep. The programmer-visible registers are kept as structure of
+// arrays, one array per register with a slot per guest (lane), and lanes at
+// the same PC form a group that executes each instruction once for all of
+// its slots: the instruction is decoded once and the per-lane work is a
+// loop over contiguous arrays, done 8 lanes at a time with vector
+// arithmetic where the compiler supports it. A conditional branch that goes
+// both ways splits its group by target; groups that reach the same PC are
+// joined again. The group with the lowest PC always runs next, so lanes
+// that leave a loop early wait at its exit for the others.
+//
+// Every lane has its own 64 KiB of memory and its own console input and
+// output. Anything else the engine does not model (the timer, DMA and other
+// IO ports, writes into the program region, code outside it, invalid
+// instructions) hands the lane over to a scalar CPU restored from its
+// state, which finishes the run, so results always match running each job
+// on its own CPU.
+class LockstepEngine {
+public:
+  // Lanes per batch BatchRunner uses unless told otherwise
+  static constexpr size_t DEFAULT_LANES = 256;
+
+  struct Stats {
+    uint64_t instructions = 0; // Lane instructions retired in lockstep
+    uint64_t dispatches = 0;   // Group instructions, each for every lane
+    uint64_t splits = 0;       // Groups split by a divergent branch
+    uint64_t handovers = 0;    // Lanes finished on a scalar CPU
+  };
+
+  // `engine` runs the lanes handed over to a scalar CPU
+  explicit LockstepEngine(CPU::Engine engine = CPU::Engine::Reference);
+
+  // Runs one lane per job and returns their results in job order. Every job
+  // must load the same program (see same_program()), which must fit in
+  // memory above PROGRAM_START; throws std::runtime_error otherwise. Lanes
+  // run together, so each result's `seconds` is the time of the whole run.
+  std::vector<BatchResult> run(const std::vector<const BatchJob *> &jobs);
+
+  // Counters of the last run()
+  const Stats &stats() const { return stats_; }
+
+  // True if both jobs load the same bytes
+  static bool same_program(const BatchJob &a, const BatchJob &b);
+
+private:
+  // A run of slots [begin, end) whose lanes are all at `pc`
+  struct Group {
+    uint16_t pc;
+    uint32_t begin;
+    uint32_t end;
+    size_t size() const { return end - begin; }
+  };
+
+  // Per-slot state, moved along when slots are reordered
+  struct Slots {
+    std::vector<uint16_t> r[4];
+    std::vector<uint16_t> sp;
+    std::vector<uint16_t> flags;
+    std::vector<uint32_t> lane;
+    void resize(size_t count);
+  };
+
+  // Per-lane state, indexed by lane
+  struct Lane {
+    const BatchJob *job;
+    BatchResult *result;
+    uint64_t cycles; // Retired before the running group's current stretch
+    size_t input_pos;
+  };
+
+  // Decoded program, one entry per word-aligned address of the program
+  // region. Lanes never write the region (see hand_over), so one decode
+  // serves all of them.
+  struct Code {
+    CPU::DecodedInstruction instr;
+    bool valid;
+  };
+
+  // How an instruction left the group it ran for
+  enum class Outcome {
+    Next,     // Every lane went on to the group's new PC
+    Diverged, // Lanes went to different PCs, one per slot in next_
+    Halted,   // Every lane halted
+    Empty,    // Every lane was handed over
+  };
+
+  CPU::Engine engine_;
+  Stats stats_;
+
+  Slots slots_;
+  Slots spare_;               // Target of relayout()
+  std::vector<uint16_t> ea_;  // Per-slot effective address
+  std::vector<uint16_t> next_; // Per-slot next PC after a divergent branch
+  std::vector<uint16_t> operand_; // Per-slot memory source operand
+  std::vector<uint8_t> leave_;    // Per-slot predicate for retire()
+  std::vector<Lane> lanes_;
+  std::unique_ptr<HostPages> memory_; // 64 KiB per lane
+  std::vector<Code> code_;
+  // Groups sorted by descending PC, one per PC: the next to run is last
+  std::vector<Group> groups_;
+
+  uint8_t *memory_of(uint32_t lane) const {
+    return memory_->data() + (static_cast<size_t>(lane) << 16);
+  }
+  const CPU::DecodedInstruction *instruction_at(uint16_t pc);
+
+  // Runs the lowest group until it reaches another group's PC, diverges or
+  // has no lanes left
+  void run_group(Group group);
+  Outcome execute(Group &group, const CPU::DecodedInstruction &instr,
+                  uint64_t executed);
+  Outcome branch(Group &group);
+
+  // Effective address of a memory operand into ea_ for every slot
+  void effective_addresses(const Group &group,
+                           const CPU::DecodedInstruction &instr, uint16_t next);
+  // Hands over the lanes whose access at ea_ the engine does not model;
+  // false if no lanes are left
+  bool hand_over_unmodelled(Group &group, bool write, uint16_t pc,
+                            uint64_t executed);
+  // Memory source operand at ea_ into operand_
+  void load_operands(const Group &group);
+
+  // Moves the slots with leave_ set to the end of the group, shrinks it to
+  // the others and returns the first slot moved out
+  uint32_t retire(Group &group);
+  void swap_slots(uint32_t a, uint32_t b);
+  // Result of a lane leaving lockstep after `cycles` instructions
+  void finish(uint32_t slot, uint64_t cycles, bool halted);
+  // Finishes the lane on a scalar CPU from `pc`
+  void hand_over(uint32_t slot, uint16_t pc, uint64_t cycles);
+  void hand_over_all(Group &group, uint64_t executed);
+  // Adds `executed` to the lanes of `group` and returns how many more
+  // instructions they all have before the first reaches its limit; lanes
+  // already at their limit are finished
+  uint64_t settle(Group &group, uint64_t executed);
+
+  // Group bookkeeping: insert() keeps groups_ sorted, join_duplicates()
+  // then joins groups that share a PC. Those not next to each other in the
+  // slot arrays are brought together by relayout(), which copies every
+  // group into spare_ in order.
+  void insert(const Group &group);
+  void join_duplicates();
+  void relayout();
+};
@@ -1,62 +1,282 @@
 #include "memory.hpp"
+#include <bitset>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <stdexcept>
 
-Memory::Memory() : memory_(MEMORY_SIZE, 0) {
-  // Initialize memory to zero
-  // Set default I/O callbacks
-  output_callback_ = [](uint8_t value) {
-    std::cout << static_cast<char>(value) << std::flush;
-  };
+Memory::Memory()
+    : storage_(MEMORY_SIZE), memory_(storage_.data()), timer_(scheduler_),
+      dma_(*this) {
+  // storage_ starts out as zero pages
+  dirty_.fill(~uint64_t(0));
+  // Classify each page once so word accesses need a single table lookup
+  for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+    uint32_t base = page * PAGE_SIZE;
+    if (base <= RAM_END)
+      page_attributes_[page] = PAGE_RAM;
+    else if (base <= PROGRAM_END)
+      page_attributes_[page] = PAGE_PROGRAM;
+    else if (base <= IO_END)
+      page_attributes_[page] = PAGE_IO;
+    else
+      page_attributes_[page] = PAGE_RESERVED;
+  }
 
-  input_callback_ = []() -> uint8_t {
-    char c;
-    std::cin >> c;
-    return static_cast<uint8_t>(c);
-  };
+  attach_device(&console_, Console::DATA_OUT, Console::STATUS);
+  attach_device(&timer_, Timer::COUNTER, Timer::CONTROL);
+  attach_device(&dma_, Dma::BASE, Dma::LAST);
 }
 
 uint8_t Memory::read_byte(uint16_t address) {
-  if (is_io_address(address)) {
-    return handle_io_read(address);
+  if (perf_counters_)
+    perf_counters_->count_read(address);
+  return load_byte(address);
+}
+
+void Memory::write_byte(uint16_t address, uint8_t value) {
+  if (perf_counters_)
+    perf_counters_->count_write(address);
+  store_byte(address, value);
+}
+
+uint8_t Memory::load_byte(uint16_t address) {
+  uint8_t attributes = page_attributes(address);
+  if (attributes & (PAGE_IO | PAGE_WATCHED)) {
+    if (attributes & PAGE_WATCHED)
+      watch_access(address, false);
+    if (attributes & PAGE_IO)
+      return handle_io_read(address);
   }
   return memory_[address];
 }
 
-void Memory::write_byte(uint16_t address, uint8_t value) {
-  if (is_io_address(address)) {
-    handle_io_write(address, value);
-    return;
+void Memory::store_byte(uint16_t address, uint8_t value) {
+  mark_dirty(address);
+  uint8_t attributes = page_attributes(address);
+  if (attributes & (PAGE_IO | PAGE_WATCHED)) {
+    if (attributes & PAGE_WATCHED)
+      watch_access(address, true);
+    if (attributes & PAGE_IO) {
+      handle_io_write(address, value);
+      return;
+    }
   }
   uint8_t old = memory_[address];
   memory_[address] = value;
+  if (code_write_callback_ && (page_attributes(address) & PAGE_PROGRAM))
+    code_write_callback_(address);
   // trace callback
   if (trace_callback_) trace_callback_(address, old, value);
 }
 
-uint16_t Memory::read_word(uint16_t address) {
+uint16_t Memory::read_word_slow(uint16_t address) {
   // Little-endian: low byte at lower address
-  uint8_t low = read_byte(address);
-  uint8_t high = read_byte(address + 1);
+  if (perf_counters_)
+    perf_counters_->count_read(address);
+  uint8_t low = load_byte(address);
+  uint8_t high = load_byte(address + 1);
   return static_cast<uint16_t>(low) | (static_cast<uint16_t>(high) << 8);
 }
 
-void Memory::write_word(uint16_t address, uint16_t value) {
+void Memory::write_word_slow(uint16_t address, uint16_t value) {
   // Little-endian: low byte at lower address
-  write_byte(address, static_cast<uint8_t>(value & 0xFF));
-  write_byte(address + 1, static_cast<uint8_t>((value >> 8) & 0xFF));
+  if (perf_counters_)
+    perf_counters_->count_write(address);
+  store_byte(address, static_cast<uint8_t>(value & 0xFF));
+  store_byte(address + 1, static_cast<uint8_t>((value >> 8) & 0xFF));
+}
+
+void Memory::copy_block(uint16_t dst, uint16_t src, uint16_t length) {
+  if (!watchpoints_.empty())
+    watch_block(src, length, false);
+  if (trace_callback_) {
+    // Byte stores so the trace sees every old/new pair
+    std::vector<uint8_t> data(memory_ + src, memory_ + src + length);
+    for (uint16_t i = 0; i < length; ++i)
+      store_byte(static_cast<uint16_t>(dst + i), data[i]);
+    return;
+  }
+  if (!watchpoints_.empty())
+    watch_block(dst, length, true);
+  std::memmove(&memory_[dst], &memory_[src], length);
+  block_written(dst, length);
+}
+
+void Memory::fill_block(uint16_t dst, uint8_t value, uint16_t length) {
+  if (trace_callback_) {
+    for (uint16_t i = 0; i < length; ++i)
+      store_byte(static_cast<uint16_t>(dst + i), value);
+    return;
+  }
+  if (!watchpoints_.empty())
+    watch_block(dst, length, true);
+  std::memset(&memory_[dst], value, length);
+  block_written(dst, length);
+}
+
+void Memory::block_written(uint16_t dst, uint16_t length) {
+  if (length == 0)
+    return;
+  uint16_t last = static_cast<uint16_t>(dst + length - 1);
+  mark_range_dirty(dst, static_cast<uint32_t>(dst) + length);
+  if (code_write_callback_ && (page_attributes(dst) & PAGE_PROGRAM)) {
+    for (uint32_t address = dst; address <= last; ++address)
+      code_write_callback_(static_cast<uint16_t>(address));
+  }
+}
+
+void Memory::set_perf_counters(PerfCounters *counters) {
+  perf_counters_ = counters;
+  for (uint8_t &attributes : page_attributes_) {
+    if (counters)
+      attributes |= PAGE_COUNTED;
+    else
+      attributes &= static_cast<uint8_t>(~PAGE_COUNTED);
+  }
+}
+
+void Memory::poke(uint16_t address, uint8_t value) {
+  mark_dirty(address);
+  memory_[address] = value;
+  if (code_write_callback_ && (page_attributes(address) & PAGE_PROGRAM))
+    code_write_callback_(address);
+}
+
+void Memory::add_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+  if (first > last || (kind & ~WATCH_ACCESS) != 0 || kind == 0)
+    throw std::runtime_error("Invalid watchpoint");
+  for (Watchpoint &watch : watchpoints_) {
+    if (watch.first == first && watch.last == last) {
+      watch.kind |= kind;
+      return;
+    }
+  }
+  watchpoints_.push_back(Watchpoint{first, last, kind});
+  update_watched_pages();
+}
+
+bool Memory::remove_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+  for (size_t i = 0; i < watchpoints_.size(); ++i) {
+    Watchpoint &watch = watchpoints_[i];
+    if (watch.first != first || watch.last != last || !(watch.kind & kind))
+      continue;
+    watch.kind &= static_cast<uint8_t>(~kind);
+    if (watch.kind == 0) {
+      watchpoints_.erase(watchpoints_.begin() + i);
+      update_watched_pages();
+    }
+    return true;
+  }
+  return false;
+}
+
+void Memory::set_watch_callback(std::function<void(uint16_t, bool)> callback) {
+  watch_callback_ = std::move(callback);
+}
+
+void Memory::update_watched_pages() {
+  for (uint8_t &attributes : page_attributes_)
+    attributes &= static_cast<uint8_t>(~PAGE_WATCHED);
+  for (const Watchpoint &watch : watchpoints_) {
+    for (uint32_t page = watch.first >> 8; page <= (watch.last >> 8u); ++page)
+      page_attributes_[page] |= PAGE_WATCHED;
+  }
+}
+
+void Memory::watch_access(uint16_t address, bool write) {
+  uint8_t kind = write ? WATCH_WRITE : WATCH_READ;
+  for (const Watchpoint &watch : watchpoints_) {
+    if ((watch.kind & kind) && address >= watch.first &&
+        address <= watch.last) {
+      if (watch_callback_)
+        watch_callback_(address, write);
+      return;
+    }
+  }
+}
+
+void Memory::watch_block(uint16_t start, uint16_t length, bool write) {
+  uint32_t end = static_cast<uint32_t>(start) + length;
+  for (uint32_t address = start; address < end; ++address) {
+    if (page_attributes(static_cast<uint16_t>(address)) & PAGE_WATCHED)
+      watch_access(static_cast<uint16_t>(address), write);
+  }
+}
+
+void Memory::mark_range_dirty(uint32_t start, uint32_t end) {
+  for (uint32_t page = start >> 8; page < (end + PAGE_SIZE - 1) >> 8; ++page)
+    mark_dirty(static_cast<uint16_t>(page << 8));
 }
 
-void Memory::load_program(const std::vector<uint8_t> &program,
+void Memory::load_program(const uint8_t *program, size_t size,
                           uint16_t start_address) {
-  if (start_address + program.size() > MEMORY_SIZE) {
+  if (start_address + size > MEMORY_SIZE) {
     throw std::runtime_error("Program too large for memory");
   }
+  if (size == 0)
+    return;
+  std::memcpy(memory_ + start_address, program, size);
+  mark_range_dirty(start_address, static_cast<uint32_t>(start_address + size));
+}
+
+bool Memory::load_program(const ProgramImage &image, uint16_t start_address,
+                          bool share_pages) {
+  size_t host_page = HostPages::host_page_size();
+  size_t mapped_end = start_address + (image.size() + host_page - 1) /
+                                          host_page * host_page;
+  // The mapping must stay clear of the IO page, whose bytes back unassigned
+  // ports
+  if (share_pages && start_address >= PROGRAM_START &&
+      mapped_end <= static_cast<size_t>(PROGRAM_END) + 1 &&
+      storage_.map_file(start_address, image.fd(), image.size())) {
+    mark_range_dirty(start_address, static_cast<uint32_t>(mapped_end));
+    return true;
+  }
+  load_program(image.data(), image.size(), start_address);
+  return false;
+}
 
-  for (size_t i = 0; i < program.size(); ++i) {
-    memory_[start_address + i] = program[i];
+std::shared_ptr<const Memory::Snapshot> Memory::snapshot() {
+  auto snap = std::make_shared<Snapshot>();
+  for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+    if (base_ && !is_page_dirty(static_cast<uint8_t>(page))) {
+      snap->pages[page] = base_->pages[page];
+    } else {
+      auto copy = std::make_shared<Snapshot::Page>();
+      std::memcpy(copy->data(), &memory_[page * PAGE_SIZE], PAGE_SIZE);
+      snap->pages[page] = std::move(copy);
+    }
   }
+  snap->timer_counter = timer_.counter();
+  snap->timer_running = timer_.running();
+  snap->dma = dma_.state();
+  base_ = snap;
+  dirty_.fill(0);
+  return snap;
+}
+
+void Memory::restore(const std::shared_ptr<const Snapshot> &snapshot) {
+  for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+    const auto &source = snapshot->pages[page];
+    if (base_ && !is_page_dirty(static_cast<uint8_t>(page)) &&
+        base_->pages[page] == source)
+      continue;
+    std::memcpy(&memory_[page * PAGE_SIZE], source->data(), PAGE_SIZE);
+    if (page_restore_callback_ && (page_attributes_[page] & PAGE_PROGRAM))
+      page_restore_callback_(static_cast<uint8_t>(page));
+  }
+  timer_.set_state(snapshot->timer_counter, snapshot->timer_running);
+  dma_.set_state(snapshot->dma);
+  base_ = snapshot;
+  dirty_.fill(0);
+}
+
+size_t Memory::dirty_page_count() const {
+  size_t count = 0;
+  for (uint64_t word : dirty_)
+    count += std::bitset<64>(word).count();
+  return count;
 }
 
 void Memory::dump_memory(uint16_t start, uint16_t length) {
@@ -77,61 +297,54 @@ void Memory::dump_memory(uint16_t start, uint16_t length) {
   std::cout << std::dec; // Reset to decimal
 }
 
-void Memory::set_output_callback(std::function<void(uint8_t)> callback) {
-  output_callback_ = callback;
+void Memory::set_trace_callback(std::function<void(uint16_t,uint8_t,uint8_t)> callback) {
+  trace_callback_ = callback;
 }
 
-void Memory::set_input_callback(std::function<uint8_t()> callback) {
-  input_callback_ = callback;
+void Memory::set_code_write_callback(std::function<void(uint16_t)> callback) {
+  code_write_callback_ = callback;
 }
 
-void Memory::set_trace_callback(std::function<void(uint16_t,uint8_t,uint8_t)> callback) {
-  trace_callback_ = callback;
+void Memory::set_page_restore_callback(std::function<void(uint8_t)> callback) {
+  page_restore_callback_ = callback;
+}
+
+void Memory::attach_device(Device *device, uint16_t first, uint16_t last) {
+  if (first < IO_START || last > IO_END || first > last)
+    throw std::runtime_error("Device ports must lie within the I/O range");
+  for (uint32_t port = first; port <= last; ++port)
+    io_devices_[port - IO_START] = device;
+}
+
+void Memory::flush_devices() {
+  Device *previous = nullptr;
+  for (Device *device : io_devices_) {
+    if (device && device != previous)
+      device->flush();
+    previous = device;
+  }
 }
 
 bool Memory::is_io_address(uint16_t address) const {
-  return address >= IO_START && address <= IO_END;
+  return (page_attributes(address) & PAGE_IO) != 0;
 }
 
 void Memory::handle_io_write(uint16_t address, uint8_t value) {
-  switch (address) {
-  case IO_OUTPUT_DATA:
-    if (output_callback_) {
-      output_callback_(value);
-    }
-    break;
-  case IO_TIMER_BASE + 1: // Timer control (0xF011)
-    timer_running_ = (value != 0);
-    if (!timer_running_) {
-      timer_counter_ = 0; // Reset counter when stopped
-    }
-    break;
-  default:
-    // For other I/O addresses, just store in memory for now
-    memory_[address] = value;
-    break;
+  if (perf_counters_)
+    ++perf_counters_->mmio_writes[address - IO_START];
+  if (Device *device = io_devices_[address - IO_START]) {
+    device->write(address, value);
+    return;
   }
+  // Unassigned ports behave as plain storage
+  memory_[address] = value;
 }
 
 uint8_t Memory::handle_io_read(uint16_t address) {
-  switch (address) {
-  case IO_INPUT_DATA:
-    if (input_callback_) {
-      return input_callback_();
-    }
-    return 0;
-  case IO_TIMER_BASE: // Timer counter low byte (0xF010)
-    return static_cast<uint8_t>(timer_counter_ & 0xFF);
-  case IO_TIMER_BASE + 1: // Timer control/counter high byte (0xF011)
-    return static_cast<uint8_t>((timer_counter_ >> 8) & 0xFF);
-  default:
-    // For other I/O addresses, just read from memory
-    return memory_[address];
-  }
+  if (perf_counters_)
+    ++perf_counters_->mmio_reads[address - IO_START];
+  if (Device *device = io_devices_[address - IO_START])
+    return device->read(address);
+  // Unassigned ports behave as plain storage
+  return memory_[address];
 }
-
-void Memory::tick() {
-  if (timer_running_) {
-    timer_counter_++;
-  }
-}
\ No newline at end of file
@@ -1,8 +1,18 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <vector>
+#include "console.hpp"
+#include "device.hpp"
+#include "dma.hpp"
+#include "host_pages.hpp"
+#include "perf_counters.hpp"
+#include "program_image.hpp"
+#include "timer.hpp"
 
 class Memory {
 public:
@@ -22,45 +32,240 @@ public:
   static constexpr uint16_t IO_INPUT_DATA = 0xF001;
   static constexpr uint16_t IO_TIMER_BASE = 0xF010;
 
+  // Page attributes, one entry per 256-byte page
+  static constexpr uint32_t PAGE_SIZE = 0x100;
+  static constexpr uint32_t PAGE_COUNT = MEMORY_SIZE / PAGE_SIZE;
+  static constexpr uint8_t PAGE_RAM = 1 << 0;
+  static constexpr uint8_t PAGE_PROGRAM = 1 << 1;
+  static constexpr uint8_t PAGE_IO = 1 << 2;
+  static constexpr uint8_t PAGE_RESERVED = 1 << 3;
+  // Set on every page while perf counters are attached, which sends all
+  // accesses through the counting byte path
+  static constexpr uint8_t PAGE_COUNTED = 1 << 4;
+  // Set on pages holding part of a watchpoint, which sends data accesses to
+  // them through the byte path where the ranges are checked
+  static constexpr uint8_t PAGE_WATCHED = 1 << 5;
+
+  // Watchpoint kinds
+  static constexpr uint8_t WATCH_READ = 1 << 0;
+  static constexpr uint8_t WATCH_WRITE = 1 << 1;
+  static constexpr uint8_t WATCH_ACCESS = WATCH_READ | WATCH_WRITE;
+  struct Watchpoint {
+    uint16_t first;
+    uint16_t last; // Inclusive
+    uint8_t kind;
+  };
+
+  // Copy-on-write image of memory and timer state. Pages are immutable and
+  // shared by every snapshot (and restored Memory) that has not modified
+  // them since, so taking and restoring snapshots costs time proportional to
+  // the pages touched in between.
+  struct Snapshot {
+    using Page = std::array<uint8_t, PAGE_SIZE>;
+    std::array<std::shared_ptr<const Page>, PAGE_COUNT> pages;
+    uint16_t timer_counter = 0;
+    bool timer_running = false;
+    Dma::State dma;
+  };
+
   Memory();
+  // Devices hold pointers back into the scheduler and port table
+  Memory(const Memory &) = delete;
+  Memory &operator=(const Memory &) = delete;
 
   // Basic memory operations
   uint8_t read_byte(uint16_t address);
   void write_byte(uint16_t address, uint8_t value);
 
-  // Word operations (little-endian)
-  uint16_t read_word(uint16_t address);
-  void write_word(uint16_t address, uint16_t value);
+  // Word operations (little-endian). Words outside the IO page are a single
+  // host load/store; IO words, counted or watched accesses and traced writes
+  // go byte by byte.
+  uint16_t read_word(uint16_t address) {
+    if (!is_fast_word(address, PAGE_IO | PAGE_COUNTED | PAGE_WATCHED))
+      return read_word_slow(address);
+    uint16_t value;
+    std::memcpy(&value, &memory_[address], sizeof(value));
+    return host_to_little(value);
+  }
 
-  // Program loading
-  void load_program(const std::vector<uint8_t> &program,
+  // Instruction fetch: read_word that perf counters never see (the CPU
+  // counts fetches itself, including those served by its decode cache)
+  uint16_t fetch_word(uint16_t address) {
+    if (!is_fast_word(address, PAGE_IO))
+      return static_cast<uint16_t>(load_byte(address) |
+                                   (load_byte(address + 1) << 8));
+    uint16_t value;
+    std::memcpy(&value, &memory_[address], sizeof(value));
+    return host_to_little(value);
+  }
+
+  void write_word(uint16_t address, uint16_t value) {
+    if (!is_fast_word(address, PAGE_IO | PAGE_COUNTED | PAGE_WATCHED) ||
+        trace_callback_) {
+      write_word_slow(address, value);
+      return;
+    }
+    uint16_t stored = host_to_little(value);
+    std::memcpy(&memory_[address], &stored, sizeof(stored));
+    mark_dirty(address);
+    mark_dirty(address + 1);
+    if (code_write_callback_) {
+      if (page_attributes(address) & PAGE_PROGRAM)
+        code_write_callback_(address);
+      if (page_attributes(address + 1) & PAGE_PROGRAM)
+        code_write_callback_(address + 1);
+    }
+  }
+
+  uint8_t page_attributes(uint16_t address) const {
+    return page_attributes_[address >> 8];
+  }
+
+  // Debugger access: the stored byte, bypassing devices, counters,
+  // watchpoints and the trace. poke() still invalidates decoded code.
+  uint8_t peek(uint16_t address) const { return memory_[address]; }
+  void poke(uint16_t address, uint8_t value);
+
+  // Bulk transfers for the DMA device. The ranges must not wrap or touch
+  // IO; copies behave like memmove. Dirty, code-write and trace tracking
+  // match the equivalent byte stores.
+  void copy_block(uint16_t dst, uint16_t src, uint16_t length);
+  void fill_block(uint16_t dst, uint8_t value, uint16_t length);
+
+  // Program loading: one block copy into guest memory. With `share_pages`
+  // an image backed by a file is instead mapped copy-on-write over the
+  // program region, so every Memory loading the same image shares its
+  // physical pages until it writes to them; the rest of the last host page
+  // reads as zero. Sharing needs a host-page-aligned start address and a
+  // file-backed image; otherwise the image is copied. Returns true if the
+  // pages were shared.
+  void load_program(const uint8_t *program, size_t size,
                     uint16_t start_address = PROGRAM_START);
+  void load_program(const std::vector<uint8_t> &program,
+                    uint16_t start_address = PROGRAM_START) {
+    load_program(program.data(), program.size(), start_address);
+  }
+  bool load_program(const ProgramImage &image,
+                    uint16_t start_address = PROGRAM_START,
+                    bool share_pages = false);
 
   // Memory dump for debugging
   void dump_memory(uint16_t start, uint16_t length);
 
-  // I/O callbacks
-  void set_output_callback(std::function<void(uint8_t)> callback);
-  void set_input_callback(std::function<uint8_t()> callback);
+  // I/O callbacks, forwarded to the console
+  void set_output_callback(std::function<void(uint8_t)> callback) {
+    console_.set_output_callback(std::move(callback));
+  }
+  void set_input_callback(std::function<uint8_t()> callback) {
+    console_.set_input_callback(std::move(callback));
+  }
   // Trace callback for memory writes (byte-level)
   void set_trace_callback(std::function<void(uint16_t,uint8_t,uint8_t)> callback);
+  // Code write callback, fired for every byte written inside the program
+  // region so predecoded instructions can be invalidated (self-modifying code)
+  void set_code_write_callback(std::function<void(uint16_t)> callback);
+  // Count data accesses into `counters` (nullptr detaches)
+  void set_perf_counters(PerfCounters *counters);
+
+  // Watchpoints on data accesses (CPU operands, DMA transfers); instruction
+  // fetches are not watched. The callback gets the address and whether it
+  // was written, once per watched byte accessed. Adding a range that is
+  // already watched merges the kinds; removing clears the given kinds and
+  // returns false if the range was not watched.
+  void add_watchpoint(uint16_t first, uint16_t last, uint8_t kind);
+  bool remove_watchpoint(uint16_t first, uint16_t last, uint8_t kind);
+  const std::vector<Watchpoint> &watchpoints() const { return watchpoints_; }
+  void set_watch_callback(std::function<void(uint16_t, bool)> callback);
+
+  // Snapshots. snapshot() shares every page left clean since the previous
+  // snapshot()/restore(); restore() copies only pages that were written or
+  // differ from the target, firing the page restore callback for each
+  // restored program page so decoded code can be dropped.
+  std::shared_ptr<const Snapshot> snapshot();
+  void restore(const std::shared_ptr<const Snapshot> &snapshot);
+  void set_page_restore_callback(std::function<void(uint8_t)> callback);
 
-  // Timer support
-  void tick(); // Increment timer if running
-  uint16_t get_timer_counter() const { return timer_counter_; }
-  bool is_timer_running() const { return timer_running_; }
+  // Dirty tracking at page granularity, relative to the last snapshot or
+  // restore (everything is dirty before the first one)
+  bool is_page_dirty(uint8_t page) const {
+    return (dirty_[page >> 6] >> (page & 63)) & 1;
+  }
+  size_t dirty_page_count() const;
+
+  // Devices. attach_device() routes byte accesses to IO ports first..last
+  // to `device` (not owned; it must outlive this Memory or be detached by
+  // attaching nullptr). The console (0xF000-0xF002), timer (0xF010-0xF011)
+  // and DMA engine (0xF020-0xF02F) are attached by default.
+  void attach_device(Device *device, uint16_t first, uint16_t last);
+  void flush_devices();
+  Console &console() { return console_; }
+  Dma &dma() { return dma_; }
+  DeviceScheduler &scheduler() { return scheduler_; }
+  const DeviceScheduler &scheduler() const { return scheduler_; }
+
+  // Device clock: one tick per retired instruction. Batched callers (JIT
+  // blocks, fast-forwarding) must stay within cycles_until_event() so device
+  // events fire at the same instruction boundary as single-stepping.
+  void tick() { scheduler_.advance(1); }
+  void tick(uint64_t cycles) { scheduler_.advance(cycles); }
+  uint64_t cycles_until_event() const { return scheduler_.cycles_until_event(); }
+
+  uint16_t get_timer_counter() const { return timer_.counter(); }
+  bool is_timer_running() const { return timer_.running(); }
+  // False once another device has been attached over the timer's ports
+  bool has_builtin_timer() const {
+    return io_devices_[Timer::COUNTER - IO_START] == &timer_ &&
+           io_devices_[Timer::CONTROL - IO_START] == &timer_;
+  }
 
 private:
-  std::vector<uint8_t> memory_;
-  std::function<void(uint8_t)> output_callback_;
-  std::function<uint8_t()> input_callback_;
+  HostPages storage_;
+  uint8_t *memory_; // storage_.data()
+  std::array<uint8_t, PAGE_COUNT> page_attributes_;
   std::function<void(uint16_t,uint8_t,uint8_t)> trace_callback_;
+  std::function<void(uint16_t)> code_write_callback_;
+  std::function<void(uint8_t)> page_restore_callback_;
+  PerfCounters *perf_counters_ = nullptr;
+  std::vector<Watchpoint> watchpoints_;
+  std::function<void(uint16_t, bool)> watch_callback_;
+  void watch_access(uint16_t address, bool write);
+  void watch_block(uint16_t start, uint16_t length, bool write);
+  void update_watched_pages();
+
+  // Snapshot this memory last matched, plus pages written since
+  std::shared_ptr<const Snapshot> base_;
+  std::array<uint64_t, PAGE_COUNT / 64> dirty_;
+  void mark_dirty(uint16_t address) {
+    dirty_[address >> 14] |= uint64_t(1) << ((address >> 8) & 63);
+  }
+  void block_written(uint16_t dst, uint16_t length);
+  void mark_range_dirty(uint32_t start, uint32_t end);
 
-  // Timer state
-  uint16_t timer_counter_ = 0;
-  bool timer_running_ = false;
+  DeviceScheduler scheduler_;
+  Console console_;
+  Timer timer_;
+  Dma dma_;
+  std::array<Device *, IO_END - IO_START + 1> io_devices_{};
 
   bool is_io_address(uint16_t address) const;
+  // Neither byte on a page with any of the `slow` attributes, and not
+  // wrapping past 0xFFFF
+  bool is_fast_word(uint16_t address, uint8_t slow) const {
+    return address != 0xFFFF &&
+           !((page_attributes(address) | page_attributes(address + 1)) & slow);
+  }
+  static uint16_t host_to_little(uint16_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return static_cast<uint16_t>((value >> 8) | (value << 8));
+#else
+    return value;
+#endif
+  }
+  uint16_t read_word_slow(uint16_t address);
+  void write_word_slow(uint16_t address, uint16_t value);
+  // Byte access without counting
+  uint8_t load_byte(uint16_t address);
+  void store_byte(uint16_t address, uint8_t value);
   void handle_io_write(uint16_t address, uint8_t value);
   uint8_t handle_io_read(uint16_t address);
 };
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "perf_counters.hpp"
+#include <cstdio>
+
+namespace {
+
+const char *const OPCODE_NAMES[] = {
+    "NOP", "HALT", "MOV", "LOAD", "STORE", "ADD",  "SUB", "AND", "OR",
+    "XOR", "CMP",  "SHL", "SHR",  "JMP",   "JZ",   "JNZ", "JC",  "JNC",
+    "JN",  "CALL", "RET", "PUSH", "POP",   "IN",   "OUT"};
+constexpr size_t NAMED_OPCODES = sizeof(OPCODE_NAMES) / sizeof(OPCODE_NAMES[0]);
+
+const char *const MODE_NAMES[] = {"REG", "IMM", "DIR", "IND",
+                                  "OFF", "REL", "MODE6", "MODE7"};
+const char *const REGION_NAMES[] = {"ram", "program", "io", "reserved"};
+
+std::string opcode_name(size_t opcode) {
+  if (opcode < NAMED_OPCODES)
+    return OPCODE_NAMES[opcode];
+  return "OP" + std::to_string(opcode);
+}
+
+std::string u64(uint64_t value) {
+  return std::to_string(static_cast<unsigned long long>(value));
+}
+
+} // namespace
+
+uint64_t PerfCounters::instructions() const {
+  uint64_t total = 0;
+  for (uint64_t n : by_opcode)
+    total += n;
+  return total;
+}
+
+void PerfCounters::reset(uint16_t sp) {
+  *this = PerfCounters{};
+  stack_base = sp;
+}
+
+std::string PerfCounters::format() const {
+  std::string out = "=== Performance Counters ===\n";
+  char buf[128];
+  uint64_t total = instructions();
+  out += "Instructions retired: " + u64(total) + "\n";
+
+  out += "By opcode:\n";
+  for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+    if (!by_opcode[op])
+      continue;
+    std::snprintf(buf, sizeof(buf), "  %-6s %12llu %6.2f%%\n",
+                  opcode_name(op).c_str(),
+                  static_cast<unsigned long long>(by_opcode[op]),
+                  100.0 * static_cast<double>(by_opcode[op]) /
+                      static_cast<double>(total));
+    out += buf;
+  }
+  out += "By addressing mode:\n";
+  for (size_t mode = 0; mode < MODE_COUNT; ++mode) {
+    if (!by_mode[mode])
+      continue;
+    std::snprintf(buf, sizeof(buf), "  %-6s %12llu\n", MODE_NAMES[mode],
+                  static_cast<unsigned long long>(by_mode[mode]));
+    out += buf;
+  }
+
+  bool any_branch = false;
+  for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+    if (!branches_taken[op] && !branches_not_taken[op])
+      continue;
+    if (!any_branch)
+      out += "Conditional branches (taken / not taken):\n";
+    any_branch = true;
+    std::snprintf(buf, sizeof(buf), "  %-6s %12llu %12llu\n",
+                  opcode_name(op).c_str(),
+                  static_cast<unsigned long long>(branches_taken[op]),
+                  static_cast<unsigned long long>(branches_not_taken[op]));
+    out += buf;
+  }
+
+  out += "Memory accesses (reads / writes):\n";
+  for (size_t r = 0; r < REGION_COUNT; ++r) {
+    std::snprintf(buf, sizeof(buf), "  %-8s %12llu %12llu\n", REGION_NAMES[r],
+                  static_cast<unsigned long long>(reads[r]),
+                  static_cast<unsigned long long>(writes[r]));
+    out += buf;
+  }
+
+  bool any_port = false;
+  for (size_t port = 0; port < IO_PORT_COUNT; ++port) {
+    if (!mmio_reads[port] && !mmio_writes[port])
+      continue;
+    if (!any_port)
+      out += "MMIO ports (reads / writes):\n";
+    any_port = true;
+    std::snprintf(buf, sizeof(buf), "  0x%04zX   %12llu %12llu\n",
+                  0xF000 + port, static_cast<unsigned long long>(mmio_reads[port]),
+                  static_cast<unsigned long long>(mmio_writes[port]));
+    out += buf;
+  }
+
+  out += "Stack high-water mark: " + std::to_string(stack_high_water) +
+         " bytes\n";
+  return out;
+}
+
+std::string PerfCounters::to_json() const {
+  std::string out = "{\n  \"instructions\": " + u64(instructions()) + ",\n";
+
+  out += "  \"by_opcode\": {";
+  bool first = true;
+  for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+    if (!by_opcode[op])
+      continue;
+    out += (first ? "\"" : ", \"") + opcode_name(op) + "\": " +
+           u64(by_opcode[op]);
+    first = false;
+  }
+  out += "},\n  \"by_mode\": {";
+  first = true;
+  for (size_t mode = 0; mode < MODE_COUNT; ++mode) {
+    if (!by_mode[mode])
+      continue;
+    out += std::string(first ? "\"" : ", \"") + MODE_NAMES[mode] + "\": " +
+           u64(by_mode[mode]);
+    first = false;
+  }
+  out += "},\n  \"branches\": {";
+  first = true;
+  for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+    if (!branches_taken[op] && !branches_not_taken[op])
+      continue;
+    out += (first ? "\"" : ", \"") + opcode_name(op) + "\": {\"taken\": " +
+           u64(branches_taken[op]) + ", \"not_taken\": " +
+           u64(branches_not_taken[op]) + "}";
+    first = false;
+  }
+  out += "},\n  \"memory\": {";
+  for (size_t r = 0; r < REGION_COUNT; ++r) {
+    out += std::string(r ? ", \"" : "\"") + REGION_NAMES[r] +
+           "\": {\"reads\": " + u64(reads[r]) + ", \"writes\": " +
+           u64(writes[r]) + "}";
+  }
+  out += "},\n  \"mmio\": {";
+  first = true;
+  char port_name[8];
+  for (size_t port = 0; port < IO_PORT_COUNT; ++port) {
+    if (!mmio_reads[port] && !mmio_writes[port])
+      continue;
+    std::snprintf(port_name, sizeof(port_name), "0x%04zX", 0xF000 + port);
+    out += std::string(first ? "\"" : ", \"") + port_name +
+           "\": {\"reads\": " + u64(mmio_reads[port]) + ", \"writes\": " +
+           u64(mmio_writes[port]) + "}";
+    first = false;
+  }
+  out += "},\n  \"stack_high_water_bytes\": " +
+         std::to_string(stack_high_water) + "\n}\n";
+  return out;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Hardware-counter-style statistics for one CPU. Counting is off unless
+// CPU::set_perf_counters_enabled(true) is called; the reference core is
+// instantiated separately for the counted and uncounted cases, so an
+// uninstrumented run executes no counting code at all.
+//
+// Memory accesses are counted per access (a word is one access), by the
+// region of the address. Instruction fetches count as reads of the region
+// the PC is in, one per instruction word, whether or not the decode cache
+// served them.
+struct PerfCounters {
+  enum Region { RAM, PROGRAM, IO, RESERVED, REGION_COUNT };
+  static constexpr size_t OPCODE_COUNT = 32;
+  static constexpr size_t MODE_COUNT = 8;
+  static constexpr size_t IO_PORT_COUNT = 256;
+
+  // Retired instructions by opcode and by addressing mode
+  std::array<uint64_t, OPCODE_COUNT> by_opcode{};
+  std::array<uint64_t, MODE_COUNT> by_mode{};
+  // Conditional branches (JZ..JN) by opcode
+  std::array<uint64_t, OPCODE_COUNT> branches_taken{};
+  std::array<uint64_t, OPCODE_COUNT> branches_not_taken{};
+  // Memory traffic by region
+  std::array<uint64_t, REGION_COUNT> reads{};
+  std::array<uint64_t, REGION_COUNT> writes{};
+  // Byte accesses per IO port (offset from Memory::IO_START)
+  std::array<uint64_t, IO_PORT_COUNT> mmio_reads{};
+  std::array<uint64_t, IO_PORT_COUNT> mmio_writes{};
+  // Deepest stack seen, in bytes below stack_base
+  uint16_t stack_base = 0x7FFF;
+  uint16_t stack_high_water = 0;
+
+  static Region region_of(uint16_t address) {
+    if (address <= 0x7FFF)
+      return RAM;
+    if (address <= 0xEFFF)
+      return PROGRAM;
+    if (address <= 0xF0FF)
+      return IO;
+    return RESERVED;
+  }
+
+  void count_read(uint16_t address) { ++reads[region_of(address)]; }
+  void count_write(uint16_t address) { ++writes[region_of(address)]; }
+  void observe_sp(uint16_t sp) {
+    if (sp < stack_base && stack_base - sp > stack_high_water)
+      stack_high_water = static_cast<uint16_t>(stack_base - sp);
+  }
+
+  uint64_t instructions() const;
+  void reset(uint16_t sp);
+
+  // Human-readable report (only non-zero rows) and a JSON object for
+  // monitoring
+  std::string format() const;
+  std::string to_json() const;
+};
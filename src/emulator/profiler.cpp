@@ -0,0 +1,132 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <map>
+#include <unordered_set>
+
+Profiler::Profiler() { reset(); }
+
+void Profiler::reset() {
+  pc_counts_.assign(0x10000, 0);
+  nodes_.assign(1, Node{0, 0, 0, 0, 0});
+  children_.clear();
+  current_ = 0;
+  overflow_ = 0;
+}
+
+void Profiler::on_call(uint16_t target) {
+  Node &node = nodes_[current_];
+  if (node.depth + 1 >= MAX_DEPTH) {
+    ++overflow_; // Stay in the deepest frame until the matching RET
+    return;
+  }
+  uint64_t key = static_cast<uint64_t>(current_) << 16 | target;
+  auto it = children_.find(key);
+  if (it == children_.end()) {
+    uint32_t child = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(Node{target, current_, node.depth + 1, 0, 0});
+    it = children_.emplace(key, child).first;
+  }
+  current_ = it->second;
+  ++nodes_[current_].calls;
+}
+
+void Profiler::on_return() {
+  if (overflow_ > 0) {
+    --overflow_;
+    return;
+  }
+  // A RET in the root frame (guest returned past its entry) keeps the root
+  if (current_ != 0)
+    current_ = nodes_[current_].parent;
+}
+
+uint64_t Profiler::total_instructions() const {
+  uint64_t total = 0;
+  for (const Node &node : nodes_)
+    total += node.self;
+  return total;
+}
+
+std::vector<uint32_t> Profiler::path(uint32_t node) const {
+  std::vector<uint32_t> out;
+  for (;;) {
+    out.push_back(node);
+    if (node == 0)
+      break;
+    node = nodes_[node].parent;
+  }
+  std::reverse(out.begin(), out.end());
+  return out;
+}
+
+std::vector<Profiler::Edge> Profiler::call_edges() const {
+  std::map<std::pair<uint16_t, uint16_t>, uint64_t> totals;
+  for (size_t i = 1; i < nodes_.size(); ++i) {
+    const Node &node = nodes_[i];
+    totals[{nodes_[node.parent].function, node.function}] += node.calls;
+  }
+  std::vector<Edge> edges;
+  for (const auto &t : totals)
+    edges.push_back(Edge{t.first.first, t.first.second, t.second});
+  std::stable_sort(edges.begin(), edges.end(),
+                   [](const Edge &a, const Edge &b) { return a.calls > b.calls; });
+  return edges;
+}
+
+std::vector<Profiler::FunctionStats> Profiler::functions() const {
+  std::map<uint16_t, FunctionStats> stats;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    const Node &node = nodes_[i];
+    FunctionStats &own = stats[node.function];
+    own.entry = node.function;
+    own.self += node.self;
+    own.calls += node.calls;
+    if (node.self == 0)
+      continue;
+    std::unordered_set<uint16_t> seen;
+    for (uint32_t frame : path(static_cast<uint32_t>(i))) {
+      uint16_t function = nodes_[frame].function;
+      if (seen.insert(function).second) {
+        FunctionStats &s = stats[function];
+        s.entry = function;
+        s.inclusive += node.self;
+      }
+    }
+  }
+  std::vector<FunctionStats> out;
+  for (const auto &s : stats)
+    out.push_back(s.second);
+  std::stable_sort(out.begin(), out.end(),
+                   [](const FunctionStats &a, const FunctionStats &b) {
+                     return a.inclusive > b.inclusive;
+                   });
+  return out;
+}
+
+std::string Profiler::collapsed_stacks(const Symbolizer &name) const {
+  std::unordered_map<uint16_t, std::string> names;
+  auto symbol = [&](uint16_t entry) -> const std::string & {
+    auto it = names.find(entry);
+    if (it == names.end())
+      it = names.emplace(entry, name(entry)).first;
+    return it->second;
+  };
+
+  std::map<std::string, uint64_t> stacks;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i].self == 0)
+      continue;
+    std::string stack;
+    for (uint32_t frame : path(static_cast<uint32_t>(i))) {
+      if (!stack.empty())
+        stack += ';';
+      stack += symbol(nodes_[frame].function);
+    }
+    stacks[stack] += nodes_[i].self;
+  }
+
+  std::string out;
+  for (const auto &s : stacks)
+    out += s.first + " " + std::to_string(s.second) + "\n";
+  return out;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Guest-level profiler. The CPU calls on_instruction() once per retired
+// instruction and on_call()/on_return() for CALL and RET, so the per-cycle
+// cost is two counter increments: one in a flat 64K-entry per-PC array and
+// one in the current node of a call tree keyed by function entry address.
+// Symbol resolution happens only when a report is produced.
+class Profiler {
+public:
+  // Deeper call chains (e.g. runaway recursion) are folded into the
+  // deepest node instead of growing the tree without bound
+  static constexpr size_t MAX_DEPTH = 512;
+
+  Profiler();
+
+  void on_instruction(uint16_t pc) {
+    if (nodes_.size() == 1 && nodes_[0].self == 0)
+      nodes_[0].function = pc; // First instruction names the root frame
+    ++pc_counts_[pc];
+    ++nodes_[current_].self;
+  }
+  void on_call(uint16_t target);
+  void on_return();
+
+  void reset();
+
+  uint64_t count(uint16_t pc) const { return pc_counts_[pc]; }
+  const std::vector<uint64_t> &pc_counts() const { return pc_counts_; }
+  uint64_t total_instructions() const;
+
+  struct Edge {
+    uint16_t caller; // Entry address of the calling function
+    uint16_t callee; // CALL target
+    uint64_t calls;
+  };
+  // Caller/callee pairs with call counts, most frequent first
+  std::vector<Edge> call_edges() const;
+
+  struct FunctionStats {
+    uint16_t entry;
+    uint64_t self;      // Instructions executed in the function itself
+    uint64_t inclusive; // Including callees; recursion is counted once
+    uint64_t calls;
+  };
+  // Per-function totals, highest inclusive count first
+  std::vector<FunctionStats> functions() const;
+
+  // Brendan Gregg's collapsed-stack format, one "root;caller;callee count"
+  // line per distinct stack, ready for flamegraph.pl or speedscope
+  using Symbolizer = std::function<std::string(uint16_t entry)>;
+  std::string collapsed_stacks(const Symbolizer &name) const;
+
+private:
+  struct Node {
+    uint16_t function;
+    uint32_t parent;
+    uint32_t depth;
+    uint64_t self;
+    uint64_t calls;
+  };
+
+  std::vector<uint64_t> pc_counts_;
+  std::vector<Node> nodes_; // nodes_[0] is the root frame
+  // (parent node << 16 | call target) -> child node
+  std::unordered_map<uint64_t, uint32_t> children_;
+  uint32_t current_ = 0;
+  uint64_t overflow_ = 0; // Calls made past MAX_DEPTH not yet returned
+
+  std::vector<uint32_t> path(uint32_t node) const;
+};
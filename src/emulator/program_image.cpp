@@ -0,0 +1,69 @@
+#include "program_image.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<const ProgramImage>
+ProgramImage::open(const std::string &path, bool keep_descriptor) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open program file: " + path + ": " +
+                             std::strerror(errno));
+
+  std::shared_ptr<ProgramImage> image(new ProgramImage());
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                   MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      image->mapping_ = p;
+      image->data_ = static_cast<const uint8_t *>(p);
+      image->size_ = static_cast<size_t>(st.st_size);
+      if (keep_descriptor)
+        image->fd_ = fd;
+      else
+        ::close(fd); // The mapping stays valid without it
+      return image;
+    }
+  }
+
+  // Not mappable: read it the ordinary way
+  uint8_t buffer[4096];
+  for (;;) {
+    ssize_t n = ::read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot read program file: " + path + ": " +
+                               std::strerror(errno));
+    }
+    if (n == 0)
+      break;
+    image->owned_.insert(image->owned_.end(), buffer, buffer + n);
+  }
+  ::close(fd);
+  image->data_ = image->owned_.data();
+  image->size_ = image->owned_.size();
+  return image;
+}
+
+std::shared_ptr<const ProgramImage>
+ProgramImage::from_bytes(std::vector<uint8_t> bytes) {
+  std::shared_ptr<ProgramImage> image(new ProgramImage());
+  image->owned_ = std::move(bytes);
+  image->data_ = image->owned_.data();
+  image->size_ = image->owned_.size();
+  return image;
+}
+
+ProgramImage::~ProgramImage() {
+  if (mapping_)
+    munmap(mapping_, size_);
+  if (fd_ >= 0)
+    ::close(fd_);
+}
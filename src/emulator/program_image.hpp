@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A program binary ready to be loaded into guest memory. Images opened from
+// a file are mapped read-only instead of being read into a buffer, and are
+// immutable, so one image can be shared by any number of CPUs (e.g. every
+// job of a batch that runs the same program).
+class ProgramImage {
+public:
+  // Maps `path`; files that cannot be mapped (pipes, devices) are read
+  // instead. Throws std::runtime_error if the file cannot be opened or read.
+  // The descriptor is closed once the file is mapped unless
+  // keep_descriptor is set, which shared program pages need (see fd()) at
+  // the cost of one open file per image.
+  static std::shared_ptr<const ProgramImage>
+  open(const std::string &path, bool keep_descriptor = false);
+  // Wraps bytes already in memory (assembler output, tests)
+  static std::shared_ptr<const ProgramImage> from_bytes(std::vector<uint8_t> bytes);
+
+  ~ProgramImage();
+  ProgramImage(const ProgramImage &) = delete;
+  ProgramImage &operator=(const ProgramImage &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  std::vector<uint8_t> bytes() const {
+    return std::vector<uint8_t>(data_, data_ + size_);
+  }
+  // Descriptor of the mapped file if opened with keep_descriptor, else -1.
+  // Memory maps it directly when loading with shared program pages and
+  // copies the image without one.
+  int fd() const { return fd_; }
+
+private:
+  ProgramImage() = default;
+
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  int fd_ = -1;
+  void *mapping_ = nullptr;
+  std::vector<uint8_t> owned_;
+};
@@ -17,6 +17,10 @@ void Registers::reset() {
     pc_ = 0x8000;    // Start at program area as per memory map
     sp_ = 0x7FFF;    // Stack starts at top of RAM, grows downward
     flags_ = 0;      // All flags cleared
+    flag_op_ = FlagOp::NONE;
+    flag_a_ = 0;
+    flag_b_ = 0;
+    flag_result_ = 0;
     
     // Initialize internal registers
     ir_ = 0;
@@ -42,6 +46,7 @@ bool Registers::get_flag(uint8_t flag_bit) const {
     if (flag_bit > 3) {
         throw std::runtime_error("Invalid flag bit: " + std::to_string(flag_bit));
     }
+    materialize_flags();
     return (flags_ & (1 << flag_bit)) != 0;
 }
 
@@ -50,6 +55,7 @@ void Registers::set_flag(uint8_t flag_bit, bool value) {
         throw std::runtime_error("Invalid flag bit: " + std::to_string(flag_bit));
     }
     
+    materialize_flags();
     if (value) {
         flags_ |= (1 << flag_bit);   // Set bit
     } else {
@@ -57,6 +63,37 @@ void Registers::set_flag(uint8_t flag_bit, bool value) {
     }
 }
 
+void Registers::compute_flags() const {
+    // Same rules as ALU::update_flags_arithmetic/logical/shift
+    uint16_t a = flag_a_, b = flag_b_, result = flag_result_;
+    bool carry = false;
+    bool overflow = false;
+    switch (flag_op_) {
+    case FlagOp::ADD:
+        carry = static_cast<uint32_t>(a) + b > 0xFFFF;
+        overflow = (~(a ^ b) & (a ^ result) & 0x8000) != 0;
+        break;
+    case FlagOp::SUB:
+        carry = a < b;
+        overflow = ((a ^ b) & (a ^ result) & 0x8000) != 0;
+        break;
+    case FlagOp::SHL:
+        carry = b > 0 && b <= 16 && (a & (1 << (16 - b))) != 0;
+        break;
+    case FlagOp::SHR:
+        carry = b > 0 && b <= 16 && (a & (1 << (b - 1))) != 0;
+        break;
+    case FlagOp::LOGIC:
+    case FlagOp::NONE:
+        break;
+    }
+    flags_ = static_cast<uint8_t>((result == 0 ? 1 << FLAG_Z : 0) |
+                                  ((result & 0x8000) ? 1 << FLAG_N : 0) |
+                                  (carry ? 1 << FLAG_C : 0) |
+                                  (overflow ? 1 << FLAG_V : 0));
+    flag_op_ = FlagOp::NONE;
+}
+
 void Registers::dump_registers() const {
     std::cout << "=== CPU Registers ===" << std::endl;
     std::cout << "GPRs:" << std::endl;
@@ -71,7 +108,7 @@ void Registers::dump_registers() const {
     std::cout << "  SP:    0x" << std::hex << std::setw(4) << std::setfill('0') 
               << sp_ << std::dec << std::endl;
     std::cout << "  FLAGS: 0x" << std::hex << std::setw(2) << std::setfill('0') 
-              << static_cast<int>(flags_) << " (" << flags_to_string() << ")" << std::dec << std::endl;
+              << static_cast<int>(get_flags()) << " (" << flags_to_string() << ")" << std::dec << std::endl;
     
     std::cout << "Internal:" << std::endl;
     std::cout << "  IR:  0x" << std::hex << std::setw(4) << std::setfill('0') 
@@ -35,17 +35,45 @@ public:
     void pop_sp() { sp_ += 2; }   // Post-increment for pop
     
     // Flags Register (8-bit, only lower 4 bits used)
-    uint8_t get_flags() const { return flags_; }
-    void set_flags(uint8_t value) { flags_ = value & 0x0F; }  // Mask upper 4 bits
+    uint8_t get_flags() const { materialize_flags(); return flags_; }
+    void set_flags(uint8_t value) {
+        flag_op_ = FlagOp::NONE;
+        flags_ = value & 0x0F;  // Mask upper 4 bits
+    }
+    
+    // Lazy flags. ALU operations record what they computed instead of the
+    // flag bits; the bits are derived on the first read and most results
+    // are overwritten by the next operation before anything looks.
+    enum class FlagOp : uint8_t {
+        NONE,   // flags_ holds the current bits
+        ADD,    // Z, N, C, V of a + b
+        SUB,    // Z, N, C, V of a - b (SUB and CMP)
+        LOGIC,  // Z, N of result; C and V cleared
+        SHL,    // Z, N of result; C is the last bit shifted out of a by b
+        SHR
+    };
+    void defer_flags(FlagOp op, uint16_t a, uint16_t b, uint16_t result) {
+        flag_op_ = op;
+        flag_a_ = a;
+        flag_b_ = b;
+        flag_result_ = result;
+    }
     
     // Individual flag access
     bool get_flag(uint8_t flag_bit) const;
     void set_flag(uint8_t flag_bit, bool value);
-    void clear_flags() { flags_ = 0; }
+    void clear_flags() { set_flags(0); }
     
-    // Convenience flag getters
-    bool is_zero() const { return get_flag(FLAG_Z); }
-    bool is_negative() const { return get_flag(FLAG_N); }
+    // Convenience flag getters. Z and N only depend on the result, so they
+    // are read without materializing the other two.
+    bool is_zero() const {
+        return flag_op_ != FlagOp::NONE ? flag_result_ == 0
+                                        : (flags_ & (1 << FLAG_Z)) != 0;
+    }
+    bool is_negative() const {
+        return flag_op_ != FlagOp::NONE ? (flag_result_ & 0x8000) != 0
+                                        : (flags_ & (1 << FLAG_N)) != 0;
+    }
     bool is_carry() const { return get_flag(FLAG_C); }
     bool is_overflow() const { return get_flag(FLAG_V); }
     
@@ -67,11 +95,23 @@ public:
     std::string flags_to_string() const;
 
 private:
+    void materialize_flags() const {
+        if (flag_op_ != FlagOp::NONE)
+            compute_flags();
+    }
+    void compute_flags() const;
+    
     // Programmer-visible registers
     uint16_t gpr_[4];     // R0-R3 General Purpose Registers
     uint16_t pc_;         // Program Counter
     uint16_t sp_;         // Stack Pointer
-    uint8_t flags_;       // Flags Register (Z, N, C, V)
+    mutable uint8_t flags_;  // Flags Register (Z, N, C, V)
+    
+    // Pending flag computation, see defer_flags()
+    mutable FlagOp flag_op_;
+    uint16_t flag_a_;
+    uint16_t flag_b_;
+    uint16_t flag_result_;
     
     // Internal registers
     uint16_t ir_;         // Instruction Register
@@ -0,0 +1,230 @@
+#include "replay_debugger.hpp"
+#include <algorithm>
+
+uint8_t ReplayDebugger::ConsoleTap::read(uint16_t address) {
+  return owner_.console_read(address);
+}
+
+void ReplayDebugger::ConsoleTap::write(uint16_t address, uint8_t value) {
+  // The engines do not keep the cycle count current inside a run, so
+  // replayed output is recognised by the chunk being run, not the cycle
+  if (!owner_.replaying_)
+    owner_.cpu_.get_memory().console().write(address, value);
+}
+
+void ReplayDebugger::ConsoleTap::flush() {
+  owner_.cpu_.get_memory().console().flush();
+}
+
+ReplayDebugger::ReplayDebugger(CPU &cpu, uint64_t checkpoint_interval,
+                               size_t memory_budget)
+    : cpu_(cpu), tap_(*this),
+      interval_(std::max<uint64_t>(checkpoint_interval, 1)),
+      budget_(memory_budget), live_cycle_(cpu.get_cycle_count()) {
+  cpu_.attach_device(&tap_, Console::DATA_OUT, Console::STATUS);
+  cpu_.set_stops_enabled(false);
+  take_checkpoint();
+}
+
+ReplayDebugger::~ReplayDebugger() {
+  cpu_.set_stops_enabled(true);
+  cpu_.attach_device(&cpu_.get_memory().console(), Console::DATA_OUT,
+                     Console::STATUS);
+}
+
+uint8_t ReplayDebugger::console_read(uint16_t address) {
+  Console &console = cpu_.get_memory().console();
+  if (address != Console::DATA_IN && address != Console::STATUS)
+    return console.read(address);
+
+  if (read_next_ < reads_) {
+    while (run_hint_ + 1 < input_.size() &&
+           input_[run_hint_ + 1].first <= read_next_)
+      ++run_hint_;
+    ++read_next_;
+    return input_[run_hint_].value;
+  }
+
+  // Polling loops read the same status byte many times; runs keep the
+  // log small
+  uint8_t value = console.read(address);
+  if (input_.empty() || input_.back().value != value)
+    input_.push_back(InputRun{reads_, value});
+  run_hint_ = input_.size() - 1;
+  read_next_ = ++reads_;
+  return value;
+}
+
+bool ReplayDebugger::step() {
+  replaying_ = cycle() < live_cycle_;
+  bool running = cpu_.step();
+  replaying_ = false;
+  after_forward();
+  return running;
+}
+
+bool ReplayDebugger::continue_forward(uint64_t max_cycles) {
+  uint64_t start = cycle();
+  uint64_t limit = max_cycles > CPU::UNLIMITED_CYCLES - start
+                       ? CPU::UNLIMITED_CYCLES
+                       : start + max_cycles;
+  stop_ = CPU::StopInfo();
+  run_to(limit, true);
+  return stop_.reason != CPU::StopReason::None;
+}
+
+bool ReplayDebugger::reverse_step() {
+  if (cycle() <= first_cycle())
+    return false;
+  return goto_cycle(cycle() - 1);
+}
+
+bool ReplayDebugger::reverse_continue() {
+  uint64_t end = cycle();
+  if (end <= first_cycle())
+    return false;
+  stop_ = CPU::StopInfo();
+  if (cpu_.breakpoints().empty() && cpu_.get_memory().watchpoints().empty()) {
+    goto_cycle(first_cycle());
+    return false;
+  }
+
+  // Scan one checkpoint interval at a time, latest first, for the last
+  // stop before `end`. A stop at `end` itself is where we already are.
+  size_t k = checkpoint_index(end - 1);
+  for (;;) {
+    uint64_t from = checkpoints_[k].cpu.cycle_count;
+    restore_before(from);
+    uint64_t found = CPU::UNLIMITED_CYCLES;
+    CPU::StopInfo found_stop;
+    if (cpu_.at_breakpoint()) {
+      found = from;
+      found_stop.reason = CPU::StopReason::Breakpoint;
+      found_stop.address = cpu_.get_registers().get_pc();
+    }
+    for (;;) {
+      run_to(end, true);
+      if (stop_.reason == CPU::StopReason::None || cycle() >= end)
+        break;
+      found = cycle();
+      found_stop = stop_;
+    }
+    if (found != CPU::UNLIMITED_CYCLES) {
+      goto_cycle(found);
+      stop_ = found_stop;
+      return true;
+    }
+    if (k == 0) {
+      goto_cycle(first_cycle());
+      return false;
+    }
+    end = from;
+    --k;
+  }
+}
+
+bool ReplayDebugger::goto_cycle(uint64_t target) {
+  target = std::max(target, first_cycle());
+  if (target < cycle())
+    restore_before(target);
+  run_to(target);
+  return cycle() == target;
+}
+
+size_t ReplayDebugger::memory_used() const {
+  size_t total = input_.size() * sizeof(InputRun);
+  for (const Checkpoint &checkpoint : checkpoints_)
+    total += checkpoint.bytes;
+  return total;
+}
+
+void ReplayDebugger::run_to(uint64_t target, bool stops) {
+  uint64_t start = cycle();
+  stop_ = CPU::StopInfo();
+  cpu_.set_stops_enabled(stops);
+  while (!cpu_.is_halted() && cycle() < target) {
+    uint64_t now = cycle();
+    // Each chunk resumes past a breakpoint at its first instruction
+    if (stops && now != start && cpu_.at_breakpoint()) {
+      stop_.reason = CPU::StopReason::Breakpoint;
+      stop_.address = cpu_.get_registers().get_pc();
+      break;
+    }
+    uint64_t end = target;
+    const Checkpoint &last = checkpoints_.back();
+    if (now >= last.cpu.cycle_count)
+      end = std::min(end, last.cpu.cycle_count + interval_);
+    // Replayed and live cycles run as separate chunks
+    replaying_ = now < live_cycle_;
+    if (replaying_)
+      end = std::min(end, live_cycle_);
+    cpu_.run_for(end - now);
+    replaying_ = false;
+    after_forward();
+    if (stops && cpu_.get_stop().reason != CPU::StopReason::None) {
+      stop_ = cpu_.get_stop();
+      break;
+    }
+  }
+  cpu_.set_stops_enabled(false);
+}
+
+void ReplayDebugger::after_forward() {
+  live_cycle_ = std::max(live_cycle_, cycle());
+  if (!cpu_.is_halted() &&
+      cycle() >= checkpoints_.back().cpu.cycle_count + interval_)
+    take_checkpoint();
+}
+
+void ReplayDebugger::take_checkpoint() {
+  Checkpoint checkpoint{cpu_.snapshot(), read_next_, 0};
+  checkpoint.bytes = unshared_bytes(
+      checkpoint, checkpoints_.empty() ? nullptr : &checkpoints_.back());
+  checkpoints_.push_back(std::move(checkpoint));
+  enforce_budget();
+}
+
+void ReplayDebugger::enforce_budget() {
+  while (memory_used() > budget_ && checkpoints_.size() > 2) {
+    // Keep the first and the latest, and every other one in between
+    std::vector<Checkpoint> kept;
+    for (size_t i = 0; i < checkpoints_.size(); ++i) {
+      if (i % 2 == 0 || i + 1 == checkpoints_.size())
+        kept.push_back(std::move(checkpoints_[i]));
+    }
+    for (size_t i = 1; i < kept.size(); ++i)
+      kept[i].bytes = unshared_bytes(kept[i], &kept[i - 1]);
+    checkpoints_ = std::move(kept);
+    interval_ *= 2;
+  }
+}
+
+size_t ReplayDebugger::unshared_bytes(const Checkpoint &checkpoint,
+                                      const Checkpoint *previous) const {
+  size_t pages = 0;
+  for (uint32_t page = 0; page < Memory::PAGE_COUNT; ++page) {
+    if (!previous || previous->cpu.memory->pages[page] !=
+                         checkpoint.cpu.memory->pages[page])
+      ++pages;
+  }
+  return sizeof(Checkpoint) + sizeof(Memory::Snapshot) +
+         pages * Memory::PAGE_SIZE;
+}
+
+void ReplayDebugger::restore_before(uint64_t cycle) {
+  const Checkpoint &checkpoint = checkpoints_[checkpoint_index(cycle)];
+  cpu_.restore(checkpoint.cpu);
+  read_next_ = checkpoint.read_index;
+  auto run = std::upper_bound(
+      input_.begin(), input_.end(), read_next_,
+      [](uint64_t index, const InputRun &r) { return index < r.first; });
+  run_hint_ = run == input_.begin() ? 0 : (run - input_.begin()) - 1;
+}
+
+size_t ReplayDebugger::checkpoint_index(uint64_t cycle) const {
+  auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), cycle,
+                             [](uint64_t c, const Checkpoint &checkpoint) {
+                               return c < checkpoint.cpu.cycle_count;
+                             });
+  return it == checkpoints_.begin() ? 0 : (it - checkpoints_.begin()) - 1;
+}
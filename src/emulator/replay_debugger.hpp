@@ -0,0 +1,137 @@
+#pragma once
+
+#include "cpu.hpp"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Reverse execution for the interactive debugger. While the guest moves
+// forward, a CPU::Snapshot is kept every checkpoint interval and every byte
+// the guest reads from the console (IN or a LOAD from 0xF001/0xF002) is
+// logged. An earlier cycle is reached by restoring the nearest checkpoint
+// before it and re-executing: the logged input is replayed instead of
+// reading the host again, and console output the guest already produced is
+// not written a second time, so the re-execution is deterministic.
+//
+// Checkpoints share unchanged memory pages copy-on-write, so each costs
+// roughly the pages written since the previous one. When the total passes
+// the memory budget every other checkpoint is dropped and the interval
+// doubles; the first checkpoint (where recording began) is always kept.
+//
+// Breakpoints and watchpoints are the CPU's own (see CPU::add_breakpoint),
+// so continuing runs at engine speed. They only stop continue_forward()
+// and reverse_continue(): single steps and re-execution run past them.
+class ReplayDebugger {
+public:
+  static constexpr uint64_t DEFAULT_CHECKPOINT_INTERVAL = 10000;
+  static constexpr size_t DEFAULT_MEMORY_BUDGET = 64u << 20;
+
+  // Takes the first checkpoint at the CPU's current state and routes its
+  // console ports through the input log; `cpu` must outlive the debugger.
+  explicit ReplayDebugger(CPU &cpu,
+                          uint64_t checkpoint_interval =
+                              DEFAULT_CHECKPOINT_INTERVAL,
+                          size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+  ~ReplayDebugger();
+  ReplayDebugger(const ReplayDebugger &) = delete;
+  ReplayDebugger &operator=(const ReplayDebugger &) = delete;
+
+  CPU &cpu() { return cpu_; }
+  uint64_t cycle() const { return cpu_.get_cycle_count(); }
+  // Earliest cycle that can be returned to
+  uint64_t first_cycle() const { return checkpoints_.front().cpu.cycle_count; }
+
+  // Execute one instruction; false if the CPU is halted
+  bool step();
+  // Run until a breakpoint or watchpoint stops the CPU (a breakpoint after
+  // at least one instruction), the CPU halts or max_cycles have retired;
+  // true if stopped, with the reason in last_stop()
+  bool continue_forward(uint64_t max_cycles = CPU::UNLIMITED_CYCLES);
+  // Back to the previous cycle; false if already at first_cycle()
+  bool reverse_step();
+  // Back to the latest earlier cycle where continuing forward would have
+  // stopped, or to first_cycle() if there is none; true if stopped there
+  bool reverse_continue();
+  // Move to `target` in either direction. Targets before first_cycle() stop
+  // there, and a HALT on the way stops forward moves; returns true if
+  // `target` was reached.
+  bool goto_cycle(uint64_t target);
+
+  void add_breakpoint(uint16_t pc,
+                      const CPU::BreakCondition &condition = {}) {
+    cpu_.add_breakpoint(pc, condition);
+  }
+  bool remove_breakpoint(uint16_t pc) { return cpu_.remove_breakpoint(pc); }
+  const std::map<uint16_t, CPU::BreakCondition> &breakpoints() const {
+    return cpu_.breakpoints();
+  }
+  void add_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    cpu_.add_watchpoint(first, last, kind);
+  }
+  bool remove_watchpoint(uint16_t first, uint16_t last, uint8_t kind) {
+    return cpu_.remove_watchpoint(first, last, kind);
+  }
+  // Why the last continue_forward() or reverse_continue() stopped
+  const CPU::StopInfo &last_stop() const { return stop_; }
+
+  size_t checkpoint_count() const { return checkpoints_.size(); }
+  uint64_t checkpoint_interval() const { return interval_; }
+  // Checkpoint pages not shared with the previous checkpoint plus the
+  // input log; kept under the memory budget where possible
+  size_t memory_used() const;
+  size_t input_log_reads() const { return static_cast<size_t>(reads_); }
+
+private:
+  struct Checkpoint {
+    CPU::Snapshot cpu;
+    uint64_t read_index; // Console reads made before the checkpoint
+    size_t bytes;        // Pages not shared with the previous checkpoint
+  };
+  // Reads from first onwards returned value, up to the next run
+  struct InputRun {
+    uint64_t first;
+    uint8_t value;
+  };
+
+  // Console ports as seen by the guest: live reads are forwarded to the
+  // console and logged, reads behind the log's end are answered from it,
+  // and output is dropped while re-executing cycles already run live
+  class ConsoleTap : public Device {
+  public:
+    explicit ConsoleTap(ReplayDebugger &owner) : owner_(owner) {}
+    uint8_t read(uint16_t address) override;
+    void write(uint16_t address, uint8_t value) override;
+    void flush() override;
+
+  private:
+    ReplayDebugger &owner_;
+  };
+
+  CPU &cpu_;
+  ConsoleTap tap_;
+  uint64_t interval_;
+  size_t budget_;
+  std::vector<Checkpoint> checkpoints_;
+  CPU::StopInfo stop_;
+
+  std::vector<InputRun> input_;
+  uint64_t reads_ = 0;     // Length of the input log
+  uint64_t read_next_ = 0; // Index of the guest's next console read
+  size_t run_hint_ = 0;    // Run holding read_next_ while replaying
+  uint64_t live_cycle_;    // Cycles below this have run live
+  bool replaying_ = false; // Re-executing cycles below live_cycle_
+
+  uint8_t console_read(uint16_t address);
+
+  // Forward execution to `target` (or HALT) in checkpoint-sized chunks;
+  // with `stops`, also until the CPU stops, recorded in stop_
+  void run_to(uint64_t target, bool stops = false);
+  void after_forward();
+  void take_checkpoint();
+  void enforce_budget();
+  size_t unshared_bytes(const Checkpoint &checkpoint,
+                        const Checkpoint *previous) const;
+  // Restore the last checkpoint at or before `cycle`
+  void restore_before(uint64_t cycle);
+  size_t checkpoint_index(uint64_t cycle) const;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free single-producer/single-consumer ring. One thread may
+// call try_push() and another try_pop() concurrently; neither ever blocks.
+template <typename T> class SpscQueue {
+public:
+  // Capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  size_t capacity() const { return slots_.size(); }
+
+  bool try_push(const T &value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == slots_.size()) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == slots_.size())
+        return false;
+    }
+    slots_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &out) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_)
+        return false;
+    }
+    out = slots_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called concurrently with the other side
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::vector<T> slots_;
+  size_t mask_ = 0;
+  // Producer and consumer indices live on separate cache lines, each with
+  // a cached copy of the other side's index to avoid cross-core traffic.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0; // Consumer's view of tail_
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0; // Producer's view of head_
+};
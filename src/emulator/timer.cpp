@@ -0,0 +1,21 @@
+#include "timer.hpp"
+
+uint8_t Timer::read(uint16_t address) {
+  uint16_t value = counter();
+  return static_cast<uint8_t>(address == COUNTER ? value & 0xFF : value >> 8);
+}
+
+void Timer::write(uint16_t address, uint8_t value) {
+  if (address != CONTROL)
+    return;
+  if (value == 0)
+    set_state(0, false); // Reset counter when stopped
+  else if (!running_)
+    set_state(base_, true);
+}
+
+void Timer::set_state(uint16_t counter, bool running) {
+  base_ = counter;
+  started_ = clock_.now();
+  running_ = running;
+}
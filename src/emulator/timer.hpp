@@ -0,0 +1,38 @@
+#pragma once
+
+#include "device.hpp"
+
+// The 16-bit instruction timer at 0xF010/0xF011. While running it counts
+// one per retired instruction, which is exactly the scheduler clock, so the
+// count is derived from the clock on demand and the timer never needs an
+// event: ticking it is free.
+//
+//   0xF010 read:  counter low byte
+//   0xF011 read:  counter high byte
+//   0xF011 write: non-zero starts the timer, zero stops and clears it
+class Timer : public Device {
+public:
+  static constexpr uint16_t COUNTER = 0xF010;
+  static constexpr uint16_t CONTROL = 0xF011;
+
+  explicit Timer(const DeviceScheduler &clock) : clock_(clock) {}
+
+  uint8_t read(uint16_t address) override;
+  void write(uint16_t address, uint8_t value) override;
+
+  uint16_t counter() const {
+    if (!running_)
+      return base_;
+    return static_cast<uint16_t>(base_ + (clock_.now() - started_));
+  }
+  bool running() const { return running_; }
+
+  // Loads saved state (snapshot restore), counting on from the current cycle
+  void set_state(uint16_t counter, bool running);
+
+private:
+  const DeviceScheduler &clock_;
+  uint16_t base_ = 0;    // Count at cycle started_
+  uint64_t started_ = 0;
+  bool running_ = false;
+};
@@ -0,0 +1,147 @@
+#include "trace_index.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+uint64_t read_u64(const uint8_t *in) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i)
+    value = (value << 8) | in[i];
+  return value;
+}
+
+void apply_writes(const TraceEntry &entry, std::vector<uint8_t> &memory) {
+  for (uint32_t i = 0; i < entry.stored_mem_events(); ++i) {
+    const MemWriteEvent &ev = entry.mem_event(i);
+    memory[ev.address] = ev.new_value;
+  }
+}
+
+} // namespace
+
+TraceIndex::TraceIndex(const std::string &trace_path)
+    : trace_(trace_path, std::ios::binary),
+      range_(trace_path, std::ios::binary) {
+  if (!trace_ || !range_)
+    throw std::runtime_error("Failed to open trace file: " + trace_path);
+  trace_format::read_header(trace_, trace_path);
+
+  std::string index_path = trace_format::index_path(trace_path);
+  index_.open(index_path, std::ios::binary);
+  if (!index_)
+    throw std::runtime_error("No trace index: " + index_path +
+                             " (record with run-trace --format=binary"
+                             " --keyframes)");
+  uint8_t header[trace_format::INDEX_HEADER_SIZE];
+  if (!index_.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      !std::equal(trace_format::INDEX_MAGIC, trace_format::INDEX_MAGIC + 8,
+                  reinterpret_cast<const char *>(header)))
+    throw std::runtime_error("Not a trace index: " + index_path);
+  if ((header[8] | (header[9] << 8)) != trace_format::INDEX_VERSION)
+    throw std::runtime_error("Unsupported trace index version");
+  interval_ = static_cast<uint64_t>(header[12]) | (header[13] << 8) |
+              (header[14] << 16) | (static_cast<uint64_t>(header[15]) << 24);
+
+  // A trailing partial keyframe (recording cut short) is ignored
+  index_.seekg(0, std::ios::end);
+  uint64_t size = static_cast<uint64_t>(index_.tellg());
+  uint64_t count = (size - trace_format::INDEX_HEADER_SIZE) /
+                   trace_format::KEYFRAME_SIZE;
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t at = trace_format::INDEX_HEADER_SIZE +
+                  i * trace_format::KEYFRAME_SIZE;
+    uint8_t frame[trace_format::KEYFRAME_HEADER_SIZE];
+    seek(index_, at);
+    if (!index_.read(reinterpret_cast<char *>(frame), sizeof(frame)))
+      throw std::runtime_error("Truncated trace index");
+    Keyframe keyframe{read_u64(frame), read_u64(frame + 8),
+                      at + trace_format::KEYFRAME_HEADER_SIZE};
+    if (!keyframes_.empty() && keyframe.cycle <= keyframes_.back().cycle)
+      throw std::runtime_error("Corrupt trace index");
+    keyframes_.push_back(keyframe);
+  }
+  if (keyframes_.empty())
+    throw std::runtime_error("Trace index has no keyframes: " + index_path);
+
+  load_keyframe(keyframes_.front(), initial_);
+  first_cycle_ = keyframes_.front().cycle;
+
+  // The records after the last keyframe give the end of the trace
+  seek(range_, keyframes_.back().record_offset);
+  TraceEntry entry;
+  if (!trace_format::read_record(range_, entry) ||
+      entry.cycle != keyframes_.back().cycle)
+    throw std::runtime_error("Trace index does not match the trace");
+  last_cycle_ = entry.cycle;
+  while (trace_format::read_record(range_, entry))
+    last_cycle_ = entry.cycle;
+  range_.clear();
+}
+
+const TraceIndex::State &TraceIndex::state_at(uint64_t cycle) {
+  if (cycle < first_cycle_ || cycle > last_cycle_)
+    throw std::runtime_error("Cycle " + std::to_string(cycle) +
+                             " is outside the trace");
+
+  const Keyframe &keyframe = keyframe_for(cycle);
+  if (!cursor_valid_ || state_.entry.cycle > cycle ||
+      state_.entry.cycle < keyframe.cycle) {
+    cursor_valid_ = false;
+    load_keyframe(keyframe, state_.memory);
+    seek(trace_, keyframe.record_offset);
+    if (!trace_format::read_record(trace_, state_.entry))
+      throw std::runtime_error("Truncated trace");
+    apply_writes(state_.entry, state_.memory);
+    cursor_valid_ = true;
+  }
+  while (state_.entry.cycle < cycle) {
+    cursor_valid_ = false;
+    if (!trace_format::read_record(trace_, state_.entry))
+      throw std::runtime_error("Truncated trace");
+    apply_writes(state_.entry, state_.memory);
+    cursor_valid_ = true;
+  }
+  return state_;
+}
+
+std::vector<TraceEntry> TraceIndex::records(uint64_t first, uint64_t last,
+                                            size_t limit) {
+  std::vector<TraceEntry> out;
+  first = std::max(first, first_cycle_);
+  last = std::min(last, last_cycle_);
+  if (first > last)
+    return out;
+
+  range_.clear();
+  seek(range_, keyframe_for(first).record_offset);
+  TraceEntry entry;
+  while (out.size() < limit && trace_format::read_record(range_, entry) &&
+         entry.cycle <= last) {
+    if (entry.cycle >= first)
+      out.push_back(entry);
+  }
+  range_.clear();
+  return out;
+}
+
+const TraceIndex::Keyframe &TraceIndex::keyframe_for(uint64_t cycle) const {
+  // Last keyframe at or before `cycle`; callers keep cycle >= first_cycle_
+  auto it = std::upper_bound(
+      keyframes_.begin(), keyframes_.end(), cycle,
+      [](uint64_t c, const Keyframe &k) { return c < k.cycle; });
+  return *(it - 1);
+}
+
+void TraceIndex::load_keyframe(const Keyframe &keyframe,
+                               std::vector<uint8_t> &memory) {
+  memory.resize(Memory::MEMORY_SIZE);
+  seek(index_, keyframe.memory_offset);
+  if (!index_.read(reinterpret_cast<char *>(memory.data()), memory.size()))
+    throw std::runtime_error("Truncated trace index");
+}
+
+void TraceIndex::seek(std::ifstream &in, uint64_t offset) {
+  in.clear();
+  in.seekg(static_cast<std::streamoff>(offset));
+}
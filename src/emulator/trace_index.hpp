@@ -0,0 +1,70 @@
+#pragma once
+
+#include "trace_recorder.hpp"
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Random access into a binary trace recorded with keyframes (see
+// TraceRecorder::set_keyframe_interval). The state at any cycle is rebuilt
+// from the nearest keyframe at or before it plus the write events of the
+// records in between, so a lookup reads at most one keyframe interval of
+// the trace. Records hold every write of their cycle, DMA bursts included,
+// so the rebuilt memory is exact. Consecutive lookups moving forward
+// continue from the previous one instead of going back to the keyframe.
+class TraceIndex {
+public:
+  // Record of one cycle plus memory after its writes were applied; the
+  // registers are those the record holds (as the cycle began)
+  struct State {
+    TraceEntry entry;
+    std::vector<uint8_t> memory;
+  };
+
+  // Opens the trace and its index; throws std::runtime_error if either is
+  // missing or malformed
+  explicit TraceIndex(const std::string &trace_path);
+
+  uint64_t first_cycle() const { return first_cycle_; }
+  uint64_t last_cycle() const { return last_cycle_; }
+  uint64_t cycle_count() const { return last_cycle_ - first_cycle_ + 1; }
+  uint64_t keyframe_interval() const { return interval_; }
+  size_t keyframe_count() const { return keyframes_.size(); }
+
+  // State at `cycle`; throws std::runtime_error outside the trace
+  const State &state_at(uint64_t cycle);
+
+  // Records of cycles first..last (inclusive, clamped to the trace), at
+  // most `limit` of them. The keyframe image is not attached.
+  std::vector<TraceEntry> records(uint64_t first, uint64_t last,
+                                  size_t limit);
+
+  // Memory before the first recorded cycle
+  const std::vector<uint8_t> &initial_memory() const { return initial_; }
+
+private:
+  struct Keyframe {
+    uint64_t cycle;
+    uint64_t record_offset;
+    uint64_t memory_offset; // Of the image in the index file
+  };
+
+  std::ifstream trace_; // Replay cursor for state_at()
+  std::ifstream range_; // Reader for records()
+  std::ifstream index_;
+  std::vector<Keyframe> keyframes_;
+  uint64_t interval_ = 0;
+  uint64_t first_cycle_ = 0;
+  uint64_t last_cycle_ = 0;
+  std::vector<uint8_t> initial_;
+
+  // Replay cursor: state_ is valid for `cursor_valid_`, and trace_ is
+  // positioned at the record after it
+  State state_;
+  bool cursor_valid_ = false;
+
+  const Keyframe &keyframe_for(uint64_t cycle) const;
+  void load_keyframe(const Keyframe &keyframe, std::vector<uint8_t> &memory);
+  static void seek(std::ifstream &in, uint64_t offset);
+};
@@ -1,8 +1,222 @@
 #include "trace_recorder.hpp"
 // #include <filesystem>
-#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = static_cast<uint8_t>(value & 0xFF);
+  out[1] = static_cast<uint8_t>(value >> 8);
+}
+
+void put_u32(uint8_t *out, uint32_t value) {
+  put_u16(out, static_cast<uint16_t>(value & 0xFFFF));
+  put_u16(out + 2, static_cast<uint16_t>(value >> 16));
+}
+
+void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, static_cast<uint32_t>(value & 0xFFFFFFFF));
+  put_u32(out + 4, static_cast<uint32_t>(value >> 32));
+}
+
+uint16_t get_u16(const uint8_t *in) {
+  return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+uint32_t get_u32(const uint8_t *in) {
+  return static_cast<uint32_t>(get_u16(in)) |
+         (static_cast<uint32_t>(get_u16(in + 2)) << 16);
+}
+
+uint64_t get_u64(const uint8_t *in) {
+  return static_cast<uint64_t>(get_u32(in)) |
+         (static_cast<uint64_t>(get_u32(in + 4)) << 32);
+}
+
+// Decode the fixed part of a record; write events are read separately
+void decode_record(const uint8_t *in, TraceEntry &entry) {
+  entry.cycle = get_u64(in);
+  entry.pc = get_u16(in + 8);
+  for (int i = 0; i < 4; ++i)
+    entry.gpr[i] = get_u16(in + 10 + 2 * i);
+  entry.sp = get_u16(in + 18);
+  entry.ir = get_u16(in + 20);
+  entry.mar = get_u16(in + 22);
+  entry.mdr = get_u16(in + 24);
+  entry.flags = in[26];
+  entry.instr.opcode = in[27];
+  entry.instr.mode = in[28];
+  entry.instr.rd = in[29];
+  entry.instr.rs = in[30];
+  uint8_t bits = in[31];
+  entry.has_registers = (bits & trace_format::BIT_REGISTERS) != 0;
+  entry.has_instr = (bits & trace_format::BIT_INSTR) != 0;
+  entry.instr.has_extra_word = (bits & trace_format::BIT_EXTRA) != 0;
+  entry.instr.extra_word = get_u16(in + 32);
+}
+
+const char JSON_OPEN[] = "[\n";
+const char JSON_CLOSE[] = "\n]\n";
+const char JSON_SEPARATOR[] = ",\n";
+
+} // namespace
+
+size_t trace_format::encode(const TraceEntry &entry, uint8_t *out) {
+  uint32_t count = entry.stored_mem_events();
+  put_u64(out, entry.cycle);
+  put_u16(out + 8, entry.pc);
+  for (int i = 0; i < 4; ++i)
+    put_u16(out + 10 + 2 * i, entry.gpr[i]);
+  put_u16(out + 18, entry.sp);
+  put_u16(out + 20, entry.ir);
+  put_u16(out + 22, entry.mar);
+  put_u16(out + 24, entry.mdr);
+  out[26] = entry.flags;
+  out[27] = entry.instr.opcode;
+  out[28] = entry.instr.mode;
+  out[29] = entry.instr.rd;
+  out[30] = entry.instr.rs;
+  out[31] = static_cast<uint8_t>(
+      (entry.has_registers ? BIT_REGISTERS : 0) |
+      (entry.has_instr ? BIT_INSTR : 0) |
+      (entry.instr.has_extra_word ? BIT_EXTRA : 0));
+  put_u16(out + 32, entry.instr.extra_word);
+  put_u32(out + 34, count);
+
+  uint8_t *p = out + RECORD_SIZE;
+  for (uint32_t i = 0; i < count; ++i) {
+    const MemWriteEvent &ev = entry.mem_event(i);
+    put_u16(p, ev.address);
+    p[2] = ev.old_value;
+    p[3] = ev.new_value;
+    p += MEM_WRITE_SIZE;
+  }
+  return static_cast<size_t>(p - out);
+}
+
+size_t trace_format::format_json(const TraceEntry &entry, char *out,
+                                 size_t capacity) {
+  size_t n = 0;
+  auto put = [&](const char *fmt, auto... args) {
+    int w = std::snprintf(out + n, capacity - n, fmt, args...);
+    if (w > 0)
+      n = std::min(capacity - 1, n + static_cast<size_t>(w));
+  };
+
+  put("{\n  \"cycle\": %llu,\n  \"pc\": \"0x%04x\",\n",
+      static_cast<unsigned long long>(entry.cycle),
+      static_cast<unsigned>(entry.pc));
+
+  if (entry.has_registers) {
+    put("  \"registers\": {\n");
+    for (int i = 0; i < 4; ++i)
+      put("    \"r%d\": \"0x%04x\"%s", i, static_cast<unsigned>(entry.gpr[i]),
+          i < 3 ? ",\n" : "\n");
+    put("  },\n");
+  }
+
+  put("  \"flags\": \"0x%02x\",\n", static_cast<unsigned>(entry.flags));
+  put("  \"sp\": \"0x%04x\",\n", static_cast<unsigned>(entry.sp));
+  put("  \"ir\": \"0x%04x\",\n", static_cast<unsigned>(entry.ir));
+  put("  \"mar\": \"0x%04x\",\n", static_cast<unsigned>(entry.mar));
+  put("  \"mdr\": \"0x%04x\",\n", static_cast<unsigned>(entry.mdr));
+
+  if (entry.has_instr) {
+    put("  \"instr\": {\n");
+    put("    \"opcode\": %d,\n", static_cast<int>(entry.instr.opcode));
+    put("    \"mode\": %d,\n", static_cast<int>(entry.instr.mode));
+    put("    \"rd\": %d,\n", static_cast<int>(entry.instr.rd));
+    put("    \"rs\": %d,\n", static_cast<int>(entry.instr.rs));
+    put("    \"has_extra\": %s,\n",
+        entry.instr.has_extra_word ? "true" : "false");
+    put("    \"extra\": %u\n", static_cast<unsigned>(entry.instr.extra_word));
+    put("  }");
+  }
+
+  uint32_t count = entry.stored_mem_events();
+  if (count > 0) {
+    put(",\n  \"mem_writes\": [\n");
+    for (uint32_t i = 0; i < count; ++i) {
+      const MemWriteEvent &ev = entry.mem_event(i);
+      put("    { \"addr\": %u, \"old\": %d, \"new\": %d }%s\n",
+          static_cast<unsigned>(ev.address), static_cast<int>(ev.old_value),
+          static_cast<int>(ev.new_value), i < count - 1 ? "," : "");
+    }
+    put("  ]");
+  }
+  put("\n}");
+  return n;
+}
+
+void trace_format::read_header(std::istream &in, const std::string &path) {
+  uint8_t header[HEADER_SIZE];
+  if (!in.read(reinterpret_cast<char *>(header), HEADER_SIZE) ||
+      !std::equal(MAGIC, MAGIC + sizeof(MAGIC),
+                  reinterpret_cast<const char *>(header)))
+    throw std::runtime_error("Not a binary trace file: " + path);
+  if (get_u16(header + 8) != VERSION ||
+      get_u16(header + 10) != RECORD_SIZE)
+    throw std::runtime_error("Unsupported binary trace version");
+}
+
+bool trace_format::read_record(std::istream &in, TraceEntry &entry) {
+  uint8_t record[RECORD_SIZE];
+  if (!in.read(reinterpret_cast<char *>(record), RECORD_SIZE)) {
+    if (in.gcount() != 0)
+      throw std::runtime_error("Truncated trace record");
+    return false;
+  }
+  decode_record(record, entry);
+  // Read in chunks, so a corrupt count fails at the end of the file instead
+  // of allocating for it up front
+  uint32_t count = get_u32(record + 34);
+  entry.clear_mem_events();
+  uint8_t writes[TraceEntry::MEM_EVENT_CAPACITY * MEM_WRITE_SIZE];
+  while (entry.mem_event_count < count) {
+    uint32_t chunk = std::min(count - entry.mem_event_count,
+                              TraceEntry::MEM_EVENT_CAPACITY);
+    if (!in.read(reinterpret_cast<char *>(writes), chunk * MEM_WRITE_SIZE))
+      throw std::runtime_error("Truncated trace record");
+    for (uint32_t i = 0; i < chunk; ++i) {
+      const uint8_t *w = writes + i * MEM_WRITE_SIZE;
+      entry.add_mem_event(MemWriteEvent{get_u16(w), w[2], w[3]});
+    }
+  }
+  return true;
+}
+
+size_t trace_format::export_json(const std::string &binary_path,
+                                 const std::string &json_path) {
+  std::ifstream in(binary_path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("Failed to open trace file: " + binary_path);
+  read_header(in, binary_path);
+
+  TraceWriter out;
+  if (!out.open(json_path))
+    throw std::runtime_error("Failed to open JSON output: " + json_path);
+  out.write(JSON_OPEN, sizeof(JSON_OPEN) - 1);
+
+  TraceEntry entry;
+  std::vector<char> json(JSON_ENTRY_MAX);
+  size_t cycles = 0;
+  while (read_record(in, entry)) {
+    if (cycles > 0)
+      out.write(JSON_SEPARATOR, sizeof(JSON_SEPARATOR) - 1);
+    json.resize(std::max(json.size(), json_size(entry)));
+    out.write(json.data(), format_json(entry, json.data(), json.size()));
+    ++cycles;
+  }
+
+  out.write(JSON_CLOSE, sizeof(JSON_CLOSE) - 1);
+  out.close();
+  return cycles;
+}
 
 TraceRecorder::TraceRecorder() {
   path_ = "build/traces/trace.json";
@@ -11,136 +225,218 @@ TraceRecorder::TraceRecorder() {
 }
 
 TraceRecorder::~TraceRecorder() {
+  on_stop();
+  stop_worker();
   if (out_.is_open()) {
-    out_ << "\n]" << std::endl;
+    if (format_ == Format::Json)
+      out_.write(JSON_CLOSE, sizeof(JSON_CLOSE) - 1);
     out_.close();
   }
+  if (index_.is_open())
+    index_.close();
 }
 
 void TraceRecorder::set_output_path(const std::string &path) { path_ = path; }
 
+void TraceRecorder::set_async(bool enabled, Backpressure policy,
+                              size_t queue_capacity) {
+  if (worker_.joinable())
+    return; // Already tracing; the mode is fixed for this recorder
+  async_ = enabled;
+  policy_ = policy;
+  queue_capacity_ = queue_capacity;
+}
+
 void TraceRecorder::ensure_open() {
   if (out_.is_open())
     return;
-  out_.open(path_, std::ios::out | std::ios::trunc);
-  if (!out_) {
+  if (!out_.open(path_)) {
     std::cerr << "Failed to open trace output: " << path_ << std::endl;
     return;
   }
-  out_ << "[" << std::endl;
+  if (format_ == Format::Json) {
+    out_.write(JSON_OPEN, sizeof(JSON_OPEN) - 1);
+  } else {
+    uint8_t header[trace_format::HEADER_SIZE];
+    std::copy(trace_format::MAGIC, trace_format::MAGIC + 8, header);
+    put_u16(header + 8, trace_format::VERSION);
+    put_u16(header + 10, trace_format::RECORD_SIZE);
+    out_.write(header, sizeof(header));
+    trace_bytes_ = sizeof(header);
+    if (keyframe_interval_ != 0) {
+      std::string index_path = trace_format::index_path(path_);
+      if (index_.open(index_path)) {
+        uint8_t index_header[trace_format::INDEX_HEADER_SIZE];
+        std::copy(trace_format::INDEX_MAGIC, trace_format::INDEX_MAGIC + 8,
+                  index_header);
+        put_u16(index_header + 8, trace_format::INDEX_VERSION);
+        put_u16(index_header + 10, 0);
+        put_u32(index_header + 12, static_cast<uint32_t>(keyframe_interval_));
+        index_.write(index_header, sizeof(index_header));
+      } else {
+        std::cerr << "Failed to open trace index: " << index_path << std::endl;
+      }
+    }
+  }
   first_write_ = true;
+
+  if (async_) {
+    queue_ = std::make_unique<SpscQueue<TraceEntry>>(queue_capacity_);
+    stopping_ = false;
+    worker_ = std::thread(&TraceRecorder::worker_loop, this);
+  }
 }
 
-void TraceRecorder::start_cycle(uint32_t cycle, uint16_t pc) {
-  current_cycle_ = cycle;
-  current_pc_ = pc;
-  mem_events_.clear();
-  has_registers_ = false;
-  has_instr_ = false;
+void TraceRecorder::set_window(size_t cycles) {
+  window_.assign(cycles, TraceEntry{});
+  window_next_ = 0;
+  window_count_ = 0;
 }
 
-void TraceRecorder::record_registers(const Registers &regs) {
-  for (int i = 0; i < 4; ++i)
-    regs_gpr_[i] = regs.get_gpr(i);
-  regs_pc_ = regs.get_pc();
-  regs_sp_ = regs.get_sp();
-  regs_flags_ = regs.get_flags();
-  regs_ir_ = regs.get_ir();
-  regs_mar_ = regs.get_mar();
-  regs_mdr_ = regs.get_mdr();
-  has_registers_ = true;
+void TraceRecorder::on_stop() {
+  if (window_count_ == 0)
+    return;
+  ensure_open();
+  if (out_.is_open()) {
+    size_t first = (window_next_ + window_.size() - window_count_) %
+                   window_.size();
+    for (size_t i = 0; i < window_count_; ++i)
+      emit(window_[(first + i) % window_.size()]);
+  }
+  window_count_ = 0;
+  window_next_ = 0;
 }
 
-void TraceRecorder::record_decoded(const DecodedInstrView &instr) {
-  current_instr_ = instr;
-  has_instr_ = true;
+void TraceRecorder::worker_loop() {
+  TraceEntry entry;
+  for (;;) {
+    if (queue_->try_pop(entry)) {
+      write_entry(entry);
+      continue;
+    }
+    if (stopping_.load(std::memory_order_acquire)) {
+      if (queue_->empty())
+        return;
+      continue;
+    }
+    // Idle: sleep until the producer signals. The timeout bounds the
+    // delay if a notification races with the emptiness check.
+    std::unique_lock<std::mutex> lock(mu_);
+    ready_.wait_for(lock, std::chrono::milliseconds(1), [this] {
+      return !queue_->empty() || stopping_.load(std::memory_order_acquire);
+    });
+  }
 }
 
-void TraceRecorder::record_mem_write(const MemWriteEvent &ev) {
-  mem_events_.push_back(ev);
+void TraceRecorder::stop_worker() {
+  if (!worker_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_.store(true, std::memory_order_release);
+  }
+  ready_.notify_one();
+  worker_.join();
 }
 
-static void write_json_field(std::ostream &o, const std::string &name,
-                             const std::string &val, bool comma = true) {
-  o << "  \"" << name << "\": " << val;
-  if (comma)
-    o << ",";
-  o << "\n";
+void TraceRecorder::start_cycle(uint64_t cycle, uint16_t pc) {
+  current_.cycle = cycle;
+  current_.pc = pc;
+  current_.clear_mem_events();
+  current_.has_registers = false;
+  current_.has_instr = false;
+  current_.keyframe.reset();
+}
+
+void TraceRecorder::record_registers(const Registers &regs) {
+  for (int i = 0; i < 4; ++i)
+    current_.gpr[i] = regs.get_gpr(i);
+  current_.sp = regs.get_sp();
+  current_.flags = regs.get_flags();
+  current_.ir = regs.get_ir();
+  current_.mar = regs.get_mar();
+  current_.mdr = regs.get_mdr();
+  current_.has_registers = true;
+}
+
+void TraceRecorder::record_decoded(const DecodedInstrView &instr) {
+  current_.instr = instr;
+  current_.has_instr = true;
 }
 
 void TraceRecorder::end_cycle() {
-  ensure_open();
-  if (!out_)
+  if (!window_.empty()) {
+    // Flight recorder: overwrite the oldest slot, no I/O until on_stop()
+    window_[window_next_] = current_;
+    window_next_ = (window_next_ + 1) % window_.size();
+    if (window_count_ < window_.size())
+      ++window_count_;
     return;
+  }
 
-  if (!first_write_)
-    out_ << ",\n";
-  first_write_ = false;
+  ensure_open();
+  if (!out_.is_open())
+    return;
+  emit(current_);
+  current_.keyframe.reset(); // The queued copy keeps the image alive
+}
 
-  out_ << "{" << std::endl;
-  write_json_field(out_, "cycle", std::to_string(current_cycle_));
-  {
-    std::ostringstream oss;
-    oss << std::hex << std::setw(4) << std::setfill('0') << current_pc_;
-    write_json_field(out_, "pc", "\"0x" + oss.str() + "\"");
+void TraceRecorder::emit(const TraceEntry &entry) {
+  if (!async_) {
+    write_entry(entry);
+    return;
   }
 
-  if (has_registers_) {
-    out_ << "  \"registers\": {\n";
-    for (int i = 0; i < 4; ++i) {
-      out_ << "    \"r" << i << "\": \"0x" << std::hex << std::setw(4)
-           << std::setfill('0') << regs_gpr_[i] << "\"";
-      out_ << (i < 3 ? ",\n" : "\n");
+  bool was_empty = queue_->empty();
+  while (!queue_->try_push(entry)) {
+    if (policy_ == Backpressure::Drop) {
+      ++dropped_;
+      return;
     }
-    out_ << "  },\n";
-    out_ << std::dec;
-  }
-
-  out_ << "  \"flags\": \"0x" << std::hex << std::setw(2) << std::setfill('0')
-       << static_cast<int>(regs_flags_) << "\",\n"
-       << std::dec;
-
-  out_ << "  \"sp\": \"0x" << std::hex << std::setw(4) << std::setfill('0')
-       << regs_sp_ << "\",\n"
-       << std::dec;
-  out_ << "  \"ir\": \"0x" << std::hex << std::setw(4) << std::setfill('0')
-       << regs_ir_ << "\",\n"
-       << std::dec;
-  out_ << "  \"mar\": \"0x" << std::hex << std::setw(4) << std::setfill('0')
-       << regs_mar_ << "\",\n"
-       << std::dec;
-  out_ << "  \"mdr\": \"0x" << std::hex << std::setw(4) << std::setfill('0')
-       << regs_mdr_ << "\",\n"
-       << std::dec;
-
-  if (has_instr_) {
-    out_ << "  \"instr\": {\n";
-    out_ << "    \"opcode\": " << static_cast<int>(current_instr_.opcode)
-         << ",\n";
-    out_ << "    \"mode\": " << static_cast<int>(current_instr_.mode) << ",\n";
-    out_ << "    \"rd\": " << static_cast<int>(current_instr_.rd) << ",\n";
-    out_ << "    \"rs\": " << static_cast<int>(current_instr_.rs) << ",\n";
-    out_ << "    \"has_extra\": "
-         << (current_instr_.has_extra_word ? "true" : "false") << ",\n";
-    out_ << "    \"extra\": " << current_instr_.extra_word << "\n";
-    out_ << "  }";
-  }
-
-  if (!mem_events_.empty()) {
-    out_ << ",\n  \"mem_writes\": [\n";
-    for (size_t i = 0; i < mem_events_.size(); ++i) {
-      const auto &ev = mem_events_[i];
-      out_ << "    { \"addr\": " << ev.address
-           << ", \"old\": " << static_cast<int>(ev.old_value)
-           << ", \"new\": " << static_cast<int>(ev.new_value) << " }";
-      if (i < mem_events_.size() - 1)
-        out_ << ",";
-      out_ << "\n";
+    std::this_thread::yield();
+  }
+  if (was_empty)
+    ready_.notify_one();
+}
+
+// Runs on the CPU thread in sync mode and on worker_ in async mode
+void TraceRecorder::write_entry(const TraceEntry &entry) {
+  if (format_ == Format::Binary) {
+    if (entry.keyframe && index_.is_open())
+      write_keyframe(entry);
+    uint8_t record[trace_format::RECORD_SIZE +
+                   TraceEntry::MEM_EVENT_CAPACITY * trace_format::MEM_WRITE_SIZE];
+    uint8_t *buffer = record;
+    if (trace_format::encoded_size(entry) > sizeof(record)) {
+      spill_buffer_.resize(trace_format::encoded_size(entry));
+      buffer = spill_buffer_.data();
     }
-    out_ << "  ]";
+    size_t size = trace_format::encode(entry, buffer);
+    out_.write(buffer, size);
+    trace_bytes_ += size;
+    return;
   }
-  out_ << "\n}";
 
-  // flush for real-time viewing
-  out_.flush();
+  // Format into a stack buffer: no heap allocation or flush per cycle
+  // unless a DMA burst overflows it
+  char json[trace_format::JSON_ENTRY_MAX];
+  char *buffer = json;
+  size_t capacity = trace_format::json_size(entry);
+  if (capacity > sizeof(json)) {
+    spill_buffer_.resize(capacity);
+    buffer = reinterpret_cast<char *>(spill_buffer_.data());
+  }
+  if (!first_write_)
+    out_.write(JSON_SEPARATOR, sizeof(JSON_SEPARATOR) - 1);
+  first_write_ = false;
+  out_.write(buffer, trace_format::format_json(entry, buffer, capacity));
+}
+
+void TraceRecorder::write_keyframe(const TraceEntry &entry) {
+  uint8_t header[trace_format::KEYFRAME_HEADER_SIZE];
+  put_u64(header, entry.cycle);
+  put_u64(header + 8, trace_bytes_);
+  index_.write(header, sizeof(header));
+  for (const auto &page : entry.keyframe->pages)
+    index_.write(page->data(), page->size());
 }
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <istream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 #include <mutex>
+#include "memory.hpp"
 #include "registers.hpp"
+#include "spsc_queue.hpp"
+#include "trace_writer.hpp"
 
 class CPU; // forward
 
@@ -24,16 +33,184 @@ struct DecodedInstrView {
     bool has_extra_word;
 };
 
+// State captured for one CPU cycle
+struct TraceEntry {
+    // Write events stored inline; a cycle with more (a DMA burst) spills
+    // the rest to the heap
+    static constexpr uint32_t MEM_EVENT_CAPACITY = 16;
+
+    uint64_t cycle = 0;
+    uint16_t pc = 0;
+    uint16_t gpr[4] = {0, 0, 0, 0};
+    uint16_t sp = 0;
+    uint8_t flags = 0;
+    uint16_t ir = 0;
+    uint16_t mar = 0;
+    uint16_t mdr = 0;
+    DecodedInstrView instr{};
+    bool has_registers = false;
+    bool has_instr = false;
+    // Every write of the cycle in order: the first MEM_EVENT_CAPACITY in
+    // mem_events, the rest in spilled_mem_events
+    std::array<MemWriteEvent, MEM_EVENT_CAPACITY> mem_events;
+    std::vector<MemWriteEvent> spilled_mem_events;
+    uint32_t mem_event_count = 0;
+    // Memory at the start of the cycle, on keyframe cycles only
+    std::shared_ptr<const Memory::Snapshot> keyframe;
+
+    uint32_t stored_mem_events() const { return mem_event_count; }
+    const MemWriteEvent& mem_event(uint32_t i) const {
+        return i < MEM_EVENT_CAPACITY ? mem_events[i]
+                                      : spilled_mem_events[i - MEM_EVENT_CAPACITY];
+    }
+    void add_mem_event(const MemWriteEvent& ev) {
+        if (mem_event_count < MEM_EVENT_CAPACITY)
+            mem_events[mem_event_count] = ev;
+        else
+            spilled_mem_events.push_back(ev);
+        ++mem_event_count;
+    }
+    // Keeps the spill capacity, so later bursts do not allocate again
+    void clear_mem_events() {
+        spilled_mem_events.clear();
+        mem_event_count = 0;
+    }
+};
+
+// Binary trace layout (all fields little-endian):
+//   header: "SCPUTRC1" magic, u16 version, u16 fixed record size
+//   record: u64 cycle, u16 pc, u16 r0-r3, u16 sp, u16 ir, u16 mar, u16 mdr,
+//           u8 flags, u8 opcode, u8 mode, u8 rd, u8 rs, u8 entry bits,
+//           u16 extra word, u32 write count
+//           followed by write count x { u16 addr, u8 old, u8 new }
+//
+// Keyframe index, written next to a binary trace as <trace>.idx:
+//   header:   "SCPUIDX1" magic, u16 version, u16 reserved, u32 interval
+//   keyframe: u64 cycle, u64 offset of that cycle's record in the trace,
+//             64 KiB of memory as it was before the cycle executed
+namespace trace_format {
+constexpr char MAGIC[8] = {'S', 'C', 'P', 'U', 'T', 'R', 'C', '1'};
+constexpr uint16_t VERSION = 3;
+constexpr size_t HEADER_SIZE = 12;
+constexpr size_t RECORD_SIZE = 38;
+constexpr size_t MEM_WRITE_SIZE = 4;
+constexpr uint8_t BIT_REGISTERS = 1 << 0;
+constexpr uint8_t BIT_INSTR = 1 << 1;
+constexpr uint8_t BIT_EXTRA = 1 << 2;
+
+constexpr char INDEX_MAGIC[8] = {'S', 'C', 'P', 'U', 'I', 'D', 'X', '1'};
+constexpr uint16_t INDEX_VERSION = 1;
+constexpr size_t INDEX_HEADER_SIZE = 16;
+constexpr size_t KEYFRAME_HEADER_SIZE = 16;
+constexpr size_t KEYFRAME_SIZE = KEYFRAME_HEADER_SIZE + Memory::MEMORY_SIZE;
+
+inline std::string index_path(const std::string& trace_path) {
+    return trace_path + ".idx";
+}
+
+// Serialize one entry into encoded_size(entry) bytes at out; returns bytes
+// written
+size_t encode(const TraceEntry& entry, uint8_t* out);
+inline size_t encoded_size(const TraceEntry& entry) {
+    return RECORD_SIZE + entry.stored_mem_events() * MEM_WRITE_SIZE;
+}
+// Format one entry exactly as the JSON recorder does; returns length
+size_t format_json(const TraceEntry& entry, char* out, size_t capacity);
+// Upper bound for one formatted JSON entry with at most MEM_EVENT_CAPACITY
+// writes, and for each write past that
+constexpr size_t JSON_ENTRY_MAX = 4096;
+constexpr size_t JSON_MEM_WRITE_MAX = 64;
+inline size_t json_size(const TraceEntry& entry) {
+    uint32_t spilled = static_cast<uint32_t>(entry.spilled_mem_events.size());
+    return JSON_ENTRY_MAX + spilled * JSON_MEM_WRITE_MAX;
+}
+
+// Check the header of a binary trace; throws std::runtime_error naming
+// `path` if it is not one
+void read_header(std::istream& in, const std::string& path);
+// Read the next record, write events included. Returns false at the end of
+// the trace; throws std::runtime_error on a truncated or corrupt record.
+bool read_record(std::istream& in, TraceEntry& entry);
+
+// Convert a binary trace to the JSON array read by trace_viewer/viewer.js.
+// Returns the number of cycles exported; throws std::runtime_error on
+// unreadable or malformed input.
+size_t export_json(const std::string& binary_path,
+                   const std::string& json_path);
+} // namespace trace_format
+
 class TraceRecorder {
 public:
+    enum class Format { Json, Binary };
+    // What end_cycle() does when the async queue is full
+    enum class Backpressure {
+        Block, // Wait for the writer thread to make room
+        Drop   // Discard the cycle and count it in dropped_cycles()
+    };
+    static constexpr size_t DEFAULT_QUEUE_CAPACITY = 4096;
+
     TraceRecorder();
     ~TraceRecorder();
 
     // Set output path (defaults to build/traces/trace.json)
     void set_output_path(const std::string& path);
+    // Select the output format before the first cycle (defaults to JSON)
+    void set_format(Format format) { format_ = format; }
+    Format get_format() const { return format_; }
+
+    // Hand completed cycles to a background thread through a bounded SPSC
+    // queue so serialization and file I/O stay off the CPU thread. Must be
+    // chosen before the first cycle; the queue is drained on destruction.
+    void set_async(bool enabled, Backpressure policy = Backpressure::Block,
+                   size_t queue_capacity = DEFAULT_QUEUE_CAPACITY);
+    bool is_async() const { return async_; }
+    uint64_t dropped_cycles() const { return dropped_; }
+
+    // Flight recorder: keep only the last `cycles` entries in memory and
+    // write them out from on_stop(). 0 records every cycle as it ends.
+    // The window is allocated up front, so callers taking it from the user
+    // should hold it to MAX_WINDOW.
+    static constexpr size_t MAX_WINDOW = size_t{1} << 20;
+    void set_window(size_t cycles);
+    // Record only one cycle in every `interval` (1 records every cycle)
+    void set_sampling(uint32_t interval) {
+        sample_interval_ = interval == 0 ? 1 : interval;
+    }
+
+    // Keyframes for random access (binary format only): the first cycle
+    // and then every `cycles`-th one gets a full memory image in the index
+    // next to the trace (see trace_format::index_path). Ignored with a
+    // window or sampling, whose records do not hold every write. 0 disables.
+    static constexpr uint64_t DEFAULT_KEYFRAME_INTERVAL = 16384;
+    void set_keyframe_interval(uint64_t cycles) { keyframe_interval_ = cycles; }
+    uint64_t get_keyframe_interval() const { return keyframe_interval_; }
+
+    // Asked by the CPU after start_cycle(); when true it passes the memory
+    // image of this cycle to record_keyframe()
+    bool wants_keyframe(uint64_t cycle) const {
+        return keyframe_interval_ != 0 && format_ == Format::Binary &&
+               window_.empty() && sample_interval_ == 1 &&
+               (!keyframe_taken_ || cycle % keyframe_interval_ == 0);
+    }
+    void record_keyframe(std::shared_ptr<const Memory::Snapshot> memory) {
+        current_.keyframe = std::move(memory);
+        keyframe_taken_ = true;
+    }
+
+    // Asked by the CPU once per cycle; false means skip start_cycle() through
+    // end_cycle() for this cycle, so unsampled cycles cost one counter check.
+    bool should_record() {
+        if (sample_interval_ == 1)
+            return true;
+        return sample_phase_++ % sample_interval_ == 0;
+    }
+
+    // Execution stopped (HALT, CPU error or cycle limit): dump the
+    // flight-recorder window, oldest cycle first
+    void on_stop();
 
     // Called at start of each CPU cycle
-    void start_cycle(uint32_t cycle, uint16_t pc);
+    void start_cycle(uint64_t cycle, uint16_t pc);
 
     // Record a snapshot of registers
     void record_registers(const Registers& regs);
@@ -41,32 +218,55 @@ public:
     // Record decoded instruction
     void record_decoded(const DecodedInstrView& instr);
 
-    // Memory write events (called from Memory)
-    void record_mem_write(const MemWriteEvent& ev);
+    // Memory write events (called from Memory). Every write is kept; past
+    // MEM_EVENT_CAPACITY in a cycle they spill to the heap.
+    void record_mem_write(const MemWriteEvent& ev) { current_.add_mem_event(ev); }
 
-    // End cycle and flush entry to file
+    // End cycle and append the entry to the buffered output
     void end_cycle();
 
+    static constexpr uint32_t MEM_EVENT_CAPACITY = TraceEntry::MEM_EVENT_CAPACITY;
+
 private:
-    std::ofstream out_;
+    TraceWriter out_;
     std::string path_;
     std::mutex mu_;
+    Format format_ = Format::Json;
 
     // Per-cycle buffer
-    uint32_t current_cycle_ = 0;
-    uint16_t current_pc_ = 0;
-    uint16_t regs_gpr_[4];
-    uint16_t regs_pc_;
-    uint16_t regs_sp_;
-    uint8_t regs_flags_;
-    uint16_t regs_ir_;
-    uint16_t regs_mar_;
-    uint16_t regs_mdr_;
-    DecodedInstrView current_instr_;
-    std::vector<MemWriteEvent> mem_events_;
-    bool has_registers_ = false;
-    bool has_instr_ = false;
+    TraceEntry current_;
     bool first_write_ = true;
+    // Output of write_entry() for cycles too large for its stack buffer
+    std::vector<uint8_t> spill_buffer_;
+
+    // Keyframe index, written alongside out_
+    TraceWriter index_;
+    uint64_t keyframe_interval_ = 0;
+    bool keyframe_taken_ = false;
+    uint64_t trace_bytes_ = 0; // Offset of the next record in out_
+
+    // Flight recorder ring and sampling state
+    std::vector<TraceEntry> window_;
+    size_t window_next_ = 0;
+    size_t window_count_ = 0;
+    uint32_t sample_interval_ = 1;
+    uint32_t sample_phase_ = 0;
+
+    // Async mode: the CPU thread produces, worker_ consumes
+    bool async_ = false;
+    Backpressure policy_ = Backpressure::Block;
+    size_t queue_capacity_ = DEFAULT_QUEUE_CAPACITY;
+    std::unique_ptr<SpscQueue<TraceEntry>> queue_;
+    std::thread worker_;
+    std::atomic<bool> stopping_{false};
+    std::condition_variable ready_; // Wakes an idle worker, guarded by mu_
+    uint64_t dropped_ = 0;
+
     void ensure_open();
+    void emit(const TraceEntry& entry);
+    void write_entry(const TraceEntry& entry);
+    void write_keyframe(const TraceEntry& entry);
+    void worker_loop();
+    void stop_worker();
     std::string escape(const std::string& s) const;
 };
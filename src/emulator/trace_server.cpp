@@ -0,0 +1,328 @@
+#include "trace_server.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+using Query = std::map<std::string, std::string>;
+
+Query parse_query(const std::string &query) {
+  Query params;
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos)
+      end = query.size();
+    std::string pair = query.substr(pos, end - pos);
+    size_t eq = pair.find('=');
+    if (eq == std::string::npos)
+      params[pair] = "";
+    else
+      params[pair.substr(0, eq)] = pair.substr(eq + 1);
+    pos = end + 1;
+  }
+  return params;
+}
+
+// Unsigned decimal parameter; false if present but malformed
+bool get_number(const Query &params, const std::string &name,
+                uint64_t &value) {
+  auto it = params.find(name);
+  if (it == params.end())
+    return true;
+  const std::string &text = it->second;
+  if (text.empty() || text.size() > 19 ||
+      !std::all_of(text.begin(), text.end(),
+                   [](unsigned char c) { return std::isdigit(c) != 0; }))
+    return false;
+  value = std::stoull(text);
+  return true;
+}
+
+std::string json_string(const std::string &text) {
+  std::string out = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    if (static_cast<unsigned char>(c) >= 0x20)
+      out += c;
+  }
+  return out + "\"";
+}
+
+TraceServer::Response error(int status, const std::string &message) {
+  TraceServer::Response response;
+  response.status = status;
+  response.body = "{\"error\": " + json_string(message) + "}";
+  return response;
+}
+
+void append_entry(std::string &out, const TraceEntry &entry) {
+  char json[trace_format::JSON_ENTRY_MAX];
+  if (trace_format::json_size(entry) <= sizeof(json)) {
+    out.append(json, trace_format::format_json(entry, json, sizeof(json)));
+    return;
+  }
+  std::vector<char> burst(trace_format::json_size(entry));
+  out.append(burst.data(),
+             trace_format::format_json(entry, burst.data(), burst.size()));
+}
+
+const char *content_type_for(const std::string &path) {
+  static const std::pair<const char *, const char *> types[] = {
+      {".html", "text/html; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".json", "application/json"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+  };
+  for (const auto &type : types) {
+    size_t n = std::strlen(type.first);
+    if (path.size() >= n && path.compare(path.size() - n, n, type.first) == 0)
+      return type.second;
+  }
+  return "application/octet-stream";
+}
+
+const char *status_text(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+void send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = ::send(fd, data.data() + sent, data.size() - sent,
+                       MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return; // Client went away
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+} // namespace
+
+TraceServer::TraceServer(const std::string &trace_path, std::string viewer_dir,
+                         std::string map_path)
+    : index_(trace_path), viewer_dir_(std::move(viewer_dir)),
+      map_path_(std::move(map_path)) {}
+
+TraceServer::Response TraceServer::handle(const std::string &target) {
+  size_t mark = target.find('?');
+  std::string path = target.substr(0, mark);
+  std::string query = mark == std::string::npos ? "" : target.substr(mark + 1);
+
+  try {
+    if (path == "/api/info")
+      return info();
+    if (path == "/api/cycles")
+      return cycles(query);
+    if (path == "/api/state")
+      return state(query);
+    if (path == "/api/map")
+      return source_map();
+    if (path.rfind("/api/", 0) == 0)
+      return error(404, "Unknown endpoint: " + path);
+    return static_file(path);
+  } catch (const std::exception &ex) {
+    return error(500, ex.what());
+  }
+}
+
+TraceServer::Response TraceServer::info() const {
+  Response response;
+  response.body =
+      "{\"first_cycle\": " + std::to_string(index_.first_cycle()) +
+      ", \"last_cycle\": " + std::to_string(index_.last_cycle()) +
+      ", \"cycles\": " + std::to_string(index_.cycle_count()) +
+      ", \"keyframe_interval\": " + std::to_string(index_.keyframe_interval()) +
+      ", \"keyframes\": " + std::to_string(index_.keyframe_count()) + "}";
+  return response;
+}
+
+TraceServer::Response TraceServer::cycles(const std::string &query) {
+  Query params = parse_query(query);
+  uint64_t from = index_.first_cycle();
+  if (!get_number(params, "from", from))
+    return error(400, "Invalid from");
+  uint64_t to = from + MAX_RANGE - 1;
+  if (!get_number(params, "to", to) || to < from)
+    return error(400, "Invalid to");
+
+  Response response;
+  response.body = "[";
+  bool first = true;
+  for (const TraceEntry &entry : index_.records(from, to, MAX_RANGE)) {
+    response.body += first ? "\n" : ",\n";
+    first = false;
+    append_entry(response.body, entry);
+  }
+  response.body += "\n]";
+  return response;
+}
+
+TraceServer::Response TraceServer::state(const std::string &query) {
+  Query params = parse_query(query);
+  uint64_t cycle = 0;
+  if (params.count("cycle") == 0 || !get_number(params, "cycle", cycle))
+    return error(400, "Missing or invalid cycle");
+  uint64_t start = 0;
+  uint64_t length = 0;
+  if (!get_number(params, "start", start) ||
+      !get_number(params, "length", length) || start >= Memory::MEMORY_SIZE)
+    return error(400, "Invalid memory range");
+  length = std::min<uint64_t>({length, MAX_MEMORY,
+                               Memory::MEMORY_SIZE - start});
+  if (cycle < index_.first_cycle() || cycle > index_.last_cycle())
+    return error(404, "Cycle " + std::to_string(cycle) +
+                          " is outside the trace");
+
+  const TraceIndex::State &at = index_.state_at(cycle);
+  const std::vector<uint8_t> &initial = index_.initial_memory();
+
+  Response response;
+  response.body = "{\"entry\": ";
+  append_entry(response.body, at.entry);
+  response.body += ",\n\"changed\": [";
+  size_t changed = 0;
+  for (size_t addr = 0; addr < at.memory.size(); ++addr) {
+    if (at.memory[addr] == initial[addr])
+      continue;
+    if (changed < MAX_CHANGED) {
+      if (changed > 0)
+        response.body += ", ";
+      response.body += "[" + std::to_string(addr) + ", " +
+                       std::to_string(at.memory[addr]) + "]";
+    }
+    ++changed;
+  }
+  response.body += "],\n\"changed_total\": " + std::to_string(changed) +
+                   ",\n\"memory\": {\"start\": " + std::to_string(start) +
+                   ", \"bytes\": [";
+  for (uint64_t i = 0; i < length; ++i) {
+    if (i > 0)
+      response.body += ",";
+    response.body += std::to_string(at.memory[start + i]);
+  }
+  response.body += "]}}";
+  return response;
+}
+
+TraceServer::Response TraceServer::source_map() const {
+  Response response;
+  response.body = "[]";
+  if (map_path_.empty())
+    return response;
+  std::ifstream in(map_path_, std::ios::binary);
+  if (!in)
+    return error(404, "Cannot read source map: " + map_path_);
+  response.body.assign(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  return response;
+}
+
+TraceServer::Response TraceServer::static_file(const std::string &path) const {
+  std::string relative = path == "/" ? "/index.html" : path;
+  if (relative.find("..") != std::string::npos ||
+      relative.find('\\') != std::string::npos)
+    return error(400, "Invalid path");
+  std::ifstream in(viewer_dir_ + relative, std::ios::binary);
+  if (!in)
+    return error(404, "Not found: " + path);
+  Response response;
+  response.content_type = content_type_for(relative);
+  response.body.assign(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  return response;
+}
+
+void TraceServer::serve(uint16_t port) {
+  int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+    throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+  int yes = 1;
+  ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+          0 ||
+      ::listen(listener, 16) < 0) {
+    std::string reason = std::strerror(errno);
+    ::close(listener);
+    throw std::runtime_error("Cannot listen on 127.0.0.1:" +
+                             std::to_string(port) + ": " + reason);
+  }
+
+  for (;;) {
+    int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    // Only the request line matters; headers are read and ignored
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < 16384) {
+      ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+      if (n <= 0)
+        break;
+      request.append(buffer, static_cast<size_t>(n));
+    }
+
+    Response response;
+    size_t line_end = request.find("\r\n");
+    size_t space = request.find(' ');
+    size_t second = space == std::string::npos
+                        ? std::string::npos
+                        : request.find(' ', space + 1);
+    if (line_end == std::string::npos || second == std::string::npos ||
+        second > line_end)
+      response = error(400, "Malformed request");
+    else if (request.compare(0, space, "GET") != 0)
+      response = error(405, "Only GET is supported");
+    else
+      response = handle(request.substr(space + 1, second - space - 1));
+
+    send_all(client, "HTTP/1.1 " + std::to_string(response.status) + " " +
+                         status_text(response.status) +
+                         "\r\nContent-Type: " + response.content_type +
+                         "\r\nContent-Length: " +
+                         std::to_string(response.body.size()) +
+                         "\r\nCache-Control: no-store"
+                         "\r\nConnection: close\r\n\r\n" +
+                         response.body);
+    ::close(client);
+  }
+  ::close(listener);
+  throw std::runtime_error(std::string("accept: ") + std::strerror(errno));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "trace_index.hpp"
+#include <cstdint>
+#include <string>
+
+// Read-only HTTP front end over a TraceIndex for trace_viewer/viewer.js.
+// Single-threaded and bound to 127.0.0.1; one request per connection.
+//
+//   GET /api/info                        cycle range and keyframe interval
+//   GET /api/cycles?from=X&to=Y          records of cycles X..Y (at most
+//                                        MAX_RANGE of them)
+//   GET /api/state?cycle=X[&start=A&length=L]
+//                                        record of cycle X, the bytes that
+//                                        differ from the initial memory
+//                                        after it, and memory A..A+L-1
+//   GET /api/map                         source map given to the server
+//   GET /<file>                          static file from the viewer directory
+class TraceServer {
+public:
+  static constexpr size_t MAX_RANGE = 1000;
+  static constexpr size_t MAX_CHANGED = 1024;
+  static constexpr size_t MAX_MEMORY = 4096;
+
+  struct Response {
+    int status = 200;
+    std::string content_type = "application/json";
+    std::string body;
+  };
+
+  // Throws std::runtime_error if the trace or its index cannot be opened.
+  // An empty map_path serves an empty source map.
+  TraceServer(const std::string &trace_path, std::string viewer_dir,
+              std::string map_path = "");
+
+  // Answer one request target (path plus query string)
+  Response handle(const std::string &target);
+
+  // Accept connections on 127.0.0.1:port until the process is stopped;
+  // throws std::runtime_error if the port cannot be bound
+  void serve(uint16_t port);
+
+private:
+  TraceIndex index_;
+  std::string viewer_dir_;
+  std::string map_path_;
+
+  Response info() const;
+  Response cycles(const std::string &query);
+  Response state(const std::string &query);
+  Response source_map() const;
+  Response static_file(const std::string &path) const;
+};
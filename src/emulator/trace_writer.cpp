@@ -0,0 +1,42 @@
+#include "trace_writer.hpp"
+#include <cstring>
+
+TraceWriter::TraceWriter(size_t buffer_size) : buffer_(buffer_size) {}
+
+TraceWriter::~TraceWriter() { close(); }
+
+bool TraceWriter::open(const std::string &path) {
+  close();
+  out_.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+  used_ = 0;
+  return out_.is_open();
+}
+
+void TraceWriter::write(const void *data, size_t size) {
+  if (used_ + size > buffer_.size()) {
+    flush();
+    // Larger than the whole buffer: hand it to the stream directly
+    if (size > buffer_.size()) {
+      out_.write(static_cast<const char *>(data),
+                 static_cast<std::streamsize>(size));
+      return;
+    }
+  }
+  std::memcpy(buffer_.data() + used_, data, size);
+  used_ += size;
+}
+
+void TraceWriter::flush() {
+  if (used_ > 0 && out_.is_open())
+    out_.write(buffer_.data(), static_cast<std::streamsize>(used_));
+  used_ = 0;
+  if (out_.is_open())
+    out_.flush();
+}
+
+void TraceWriter::close() {
+  if (!out_.is_open())
+    return;
+  flush();
+  out_.close();
+}
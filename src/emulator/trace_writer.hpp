@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Buffered file writer for trace output. Data accumulates in a large
+// in-memory buffer and reaches the file only when the buffer fills or on
+// flush()/close(), so tracing does not pay a system call per cycle.
+class TraceWriter {
+public:
+  static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20; // 1 MiB
+
+  explicit TraceWriter(size_t buffer_size = DEFAULT_BUFFER_SIZE);
+  ~TraceWriter();
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+
+  bool open(const std::string &path);
+  bool is_open() const { return out_.is_open(); }
+  bool good() const { return out_.good(); }
+
+  void write(const void *data, size_t size);
+  void flush(); // Push buffered bytes to the file
+  void close();
+
+private:
+  std::ofstream out_;
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+};
@@ -1,227 +1,1239 @@
-#include <cstdint>
-#include <fstream>
-#include <iomanip>
-#include <iostream>
-#include <iterator>
-#include <string>
-#include <vector>
-
-
-#include "assembler/assembler.hpp"
-#include "emulator/cpu.hpp"
-#include "emulator/trace_recorder.hpp"
-
-void print_usage(const char *program_name) {
-  std::cout << "Usage:" << std::endl;
-  std::cout << "  " << program_name
-            << " assemble <input.asm> <output.bin> [output.map.json]"
-            << std::endl;
-  std::cout << "  " << program_name << " run <program.bin>" << std::endl;
-  std::cout << "  " << program_name << " run-trace <program.bin> <trace.json>"
-            << std::endl;
-  std::cout << "  " << program_name << " debug <program.bin>" << std::endl;
-  std::cout << "  " << program_name << " test" << std::endl;
-}
-
-void write_source_map(const std::string &path,
-                      const std::vector<SourceMapEntry> &map) {
-  std::ofstream out(path);
-  if (!out) {
-    std::cerr << "Failed to open map output file: " << path << "\n";
-    return;
-  }
-  out << "[\n";
-  for (size_t i = 0; i < map.size(); ++i) {
-    const auto &entry = map[i];
-    out << "  {\n";
-    out << "    \"address\": " << entry.address << ",\n";
-    out << "    \"line\": " << entry.line_number << ",\n";
-
-    out << "    \"source\": \"";
-    for (char c : entry.source_line) {
-      if (c == '"')
-        out << "\\\"";
-      else if (c == '\\')
-        out << "\\\\";
-      else if (c == '\n')
-        out << "\\n";
-      else if (c == '\r')
-        out << "\\r";
-      else if (c == '\t')
-        out << "\\t";
-      else if (static_cast<unsigned char>(c) < 32) {
-      } else
-        out << c;
-    }
-    out << "\",\n";
-
-    out << "    \"bytes\": [";
-    for (size_t j = 0; j < entry.bytes.size(); ++j) {
-      out << (int)entry.bytes[j];
-      if (j < entry.bytes.size() - 1)
-        out << ", ";
-    }
-    out << "]\n";
-    out << "  }";
-    if (i < map.size() - 1)
-      out << ",";
-    out << "\n";
-  }
-  out << "]\n";
-  std::cout << "Wrote source map to " << path << "\n";
-}
-
-int assemble_file(const std::string &input_path, const std::string &output_path,
-                  const std::string &map_path = "") {
-  std::ifstream in(input_path);
-  if (!in) {
-    std::cerr << "Failed to open input file: " << input_path << "\n";
-    return 1;
-  }
-
-  std::string source((std::istreambuf_iterator<char>(in)),
-                     std::istreambuf_iterator<char>());
-
-  std::vector<std::uint8_t> bytes;
-  std::vector<SourceMapEntry> map;
-  try {
-    bytes = assemble(source, map_path.empty() ? nullptr : &map);
-  } catch (const std::exception &ex) {
-    std::cerr << "Assembly error: " << ex.what() << "\n";
-    return 1;
-  }
-
-  std::ofstream out(output_path, std::ios::binary);
-  if (!out) {
-    std::cerr << "Failed to open output file: " << output_path << "\n";
-    return 1;
-  }
-
-  out.write(reinterpret_cast<const char *>(bytes.data()),
-            static_cast<std::streamsize>(bytes.size()));
-  std::cout << "Assembled " << bytes.size() << " bytes to " << output_path
-            << "\n";
-
-  if (!map_path.empty()) {
-    write_source_map(map_path, map);
-  }
-
-  return 0;
-}
-
-int run_program(const std::string &program_path) {
-  std::ifstream in(program_path, std::ios::binary);
-  if (!in) {
-    std::cerr << "Failed to open program file: " << program_path << "\n";
-    return 1;
-  }
-
-  std::vector<uint8_t> program((std::istreambuf_iterator<char>(in)),
-                               std::istreambuf_iterator<char>());
-
-  std::cout << "Loading program (" << program.size() << " bytes)..."
-            << std::endl;
-
-  CPU cpu;
-  cpu.set_debug_mode(true);
-  cpu.load_program(program);
-
-  std::cout << "Running program..." << std::endl;
-  cpu.run();
-
-  std::cout << "Program execution complete." << std::endl;
-  cpu.dump_state();
-
-  return 0;
-}
-
-int run_test() {
-  std::cout << "Running emulator test..." << std::endl;
-
-  CPU cpu;
-  cpu.set_debug_mode(true);
-
-  std::vector<uint8_t> program = {
-      0x00, 0x29,            // ADD R0, #42
-      0x2A, 0x00, 0x00, 0x08 // HALT
-  };
-
-  cpu.load_program(program);
-  cpu.run();
-
-  const Registers &regs = cpu.get_registers();
-  if (regs.get_gpr(0) == 42) {
-    std::cout << "✅ Test passed!" << std::endl;
-    return 0;
-  } else {
-    std::cout << "❌ Test failed! R0 = " << regs.get_gpr(0) << std::endl;
-    return 1;
-  }
-}
-
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    print_usage(argv[0]);
-    return 1;
-  }
-
-  std::string command = argv[1];
-
-  if (command == "assemble") {
-    if (argc == 4) {
-      return assemble_file(argv[2], argv[3]);
-    } else if (argc == 5) {
-      return assemble_file(argv[2], argv[3], argv[4]);
-    } else {
-      print_usage(argv[0]);
-      return 1;
-    }
-  } else if (command == "run" && argc == 3) {
-    return run_program(argv[2]);
-  } else if (command == "run-trace" && argc == 4) {
-    std::string program = argv[2];
-    std::string trace_path = argv[3];
-
-    std::ifstream in(program, std::ios::binary);
-    if (!in) {
-      std::cerr << "Failed to open program file: " << program << "\n";
-      return 1;
-    }
-    std::vector<uint8_t> program_bytes((std::istreambuf_iterator<char>(in)),
-                                       std::istreambuf_iterator<char>());
-
-    CPU cpu;
-    cpu.set_debug_mode(true);
-    auto tracer = std::make_shared<TraceRecorder>();
-    tracer->set_output_path(trace_path);
-    cpu.set_trace_recorder(tracer);
-    cpu.load_program(program_bytes);
-    cpu.run();
-    return 0;
-  } else if (command == "debug" && argc == 3) {
-    std::string program = argv[2];
-    std::ifstream in(program, std::ios::binary);
-    if (!in) {
-      std::cerr << "Failed to open program file: " << program << "\n";
-      return 1;
-    }
-    std::vector<uint8_t> program_bytes((std::istreambuf_iterator<char>(in)),
-                                       std::istreambuf_iterator<char>());
-
-    CPU cpu;
-    cpu.set_debug_mode(true);
-    cpu.load_program(program_bytes);
-    while (!cpu.is_halted()) {
-      std::cout << "Press Enter to step..." << std::endl;
-      std::cin.get();
-      cpu.step();
-      cpu.dump_state();
-    }
-    return 0;
-  } else if (command == "test" && argc == 2) {
-    return run_test();
-  } else {
-    print_usage(argv[0]);
-    return 1;
-  }
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+#include "assembler/assembler.hpp"
+#include "assembler/linker.hpp"
+#include "emulator/batch_runner.hpp"
+#include "emulator/cpu.hpp"
+#include "emulator/gdb_stub.hpp"
+#include "emulator/lockstep.hpp"
+#include "emulator/profiler.hpp"
+#include "emulator/replay_debugger.hpp"
+#include "emulator/trace_recorder.hpp"
+#include "emulator/trace_server.hpp"
+
+void print_usage(const char *program_name) {
+  std::cout << "Usage:" << std::endl;
+  std::cout << "  " << program_name
+            << " assemble <input.asm> <output.bin> [output.map.json]"
+               " [-O] [--object|--watch]"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " link <output.bin> <input.o>... (first object is the entry)"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " run <program.bin> [--engine=reference|fast|jit]"
+               " [--max-cycles=N|unlimited] [--stats[=json]] [--input=FILE]"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " run-trace <program.bin> <trace_file> [--format=json|binary]"
+               " [--async[=block|drop]] [--window=N] [--sample=K]"
+               " [--max-cycles=N|unlimited] [--keyframes[=N]]"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " trace-export <trace.bin> <trace.json>" << std::endl;
+  std::cout << "  " << program_name
+            << " trace-serve <trace.bin> [--port=8080] [--map=FILE]"
+               " [--viewer=DIR]"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " profile <program.bin> [program.map.json]"
+               " [--collapsed=out.folded] [--top=N] [--max-cycles=N|unlimited]"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " batch <jobs.txt> [--threads=N] [--engine=reference|fast|jit]"
+               " [--share-pages] [--lockstep[=LANES]] [--output=results.json]"
+            << std::endl;
+  std::cout << "      jobs.txt: one job per line,"
+               " <program.bin> [input-file|-] [max-cycles|unlimited]"
+            << std::endl;
+  std::cout << "      --share-pages keeps one file open per distinct binary,"
+               " so their number is capped by the open file limit"
+            << std::endl;
+  std::cout << "  " << program_name
+            << " debug <program.bin> [--checkpoint-interval=N]"
+               " [--checkpoint-budget=MB] [--input=FILE] [--gdb=PORT]"
+            << std::endl;
+  std::cout << "  " << program_name << " test" << std::endl;
+}
+
+void write_source_map(const std::string &path,
+                      const std::vector<SourceMapEntry> &map) {
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "Failed to open map output file: " << path << "\n";
+    return;
+  }
+  out << "[\n";
+  for (size_t i = 0; i < map.size(); ++i) {
+    const auto &entry = map[i];
+    out << "  {\n";
+    out << "    \"address\": " << entry.address << ",\n";
+    out << "    \"line\": " << entry.line_number << ",\n";
+
+    out << "    \"source\": \"";
+    for (char c : entry.source_line) {
+      if (c == '"')
+        out << "\\\"";
+      else if (c == '\\')
+        out << "\\\\";
+      else if (c == '\n')
+        out << "\\n";
+      else if (c == '\r')
+        out << "\\r";
+      else if (c == '\t')
+        out << "\\t";
+      else if (static_cast<unsigned char>(c) < 32) {
+      } else
+        out << c;
+    }
+    out << "\",\n";
+
+    out << "    \"bytes\": [";
+    for (size_t j = 0; j < entry.bytes.size(); ++j) {
+      out << (int)entry.bytes[j];
+      if (j < entry.bytes.size() - 1)
+        out << ", ";
+    }
+    out << "]";
+    if (!entry.label.empty())
+      out << ",\n    \"label\": \"" << entry.label << "\"";
+    out << "\n";
+    out << "  }";
+    if (i < map.size() - 1)
+      out << ",";
+    out << "\n";
+  }
+  out << "]\n";
+  std::cout << "Wrote source map to " << path << "\n";
+}
+
+int assemble_file(const std::string &input_path, const std::string &output_path,
+                  const std::string &map_path = "", bool object = false,
+                  bool optimize = false) {
+  std::ifstream in(input_path);
+  if (!in) {
+    std::cerr << "Failed to open input file: " << input_path << "\n";
+    return 1;
+  }
+
+  std::string source((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+
+  std::vector<std::uint8_t> bytes;
+  std::vector<SourceMapEntry> map;
+  PeepholeStats peephole;
+  AssemblerOptions options;
+  options.optimize = optimize;
+  options.stats = &peephole;
+  try {
+    if (object)
+      bytes = write_object(assemble_object(
+          source, map_path.empty() ? nullptr : &map, options));
+    else
+      bytes = assemble(source, map_path.empty() ? nullptr : &map, options);
+  } catch (const std::exception &ex) {
+    std::cerr << "Assembly error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  std::ofstream out(output_path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Failed to open output file: " << output_path << "\n";
+    return 1;
+  }
+
+  out.write(reinterpret_cast<const char *>(bytes.data()),
+            static_cast<std::streamsize>(bytes.size()));
+  std::cout << "Assembled " << (object ? "object, " : "") << bytes.size()
+            << " bytes to " << output_path << "\n";
+  if (optimize)
+    std::cout << "Peephole: " << peephole.removed << " removed, "
+              << peephole.shortened << " shortened, " << peephole.retargeted
+              << " jumps retargeted, " << peephole.bytes_saved
+              << " bytes saved\n";
+
+  if (!map_path.empty()) {
+    write_source_map(map_path, map);
+  }
+
+  return 0;
+}
+
+// Reassembles input_path each time it changes, until interrupted. Builds
+// after the first reuse the previous one (IncrementalAssembler), so only
+// the edited lines and what depends on them are redone.
+int watch_file(const std::string &input_path, const std::string &output_path,
+               const std::string &map_path) {
+  IncrementalAssembler assembler(!map_path.empty());
+  std::filesystem::file_time_type last_stamp;
+  std::uintmax_t last_size = 0;
+  bool built = false;
+  std::cout << "Watching " << input_path << " (Ctrl-C to stop)" << std::endl;
+  for (;; std::this_thread::sleep_for(std::chrono::milliseconds(100))) {
+    std::error_code ec;
+    std::filesystem::file_time_type stamp =
+        std::filesystem::last_write_time(input_path, ec);
+    std::uintmax_t size = std::filesystem::file_size(input_path, ec);
+    if (ec || (built && stamp == last_stamp && size == last_size))
+      continue;
+    std::ifstream in(input_path);
+    if (!in)
+      continue; // Mid-save; try again on the next poll
+    std::string source((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+    last_stamp = stamp;
+    last_size = size;
+    built = true;
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+      const std::vector<std::uint8_t> &bytes = assembler.update(source);
+      double ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+      std::ofstream out(output_path, std::ios::binary);
+      if (!out) {
+        std::cerr << "Failed to open output file: " << output_path << "\n";
+        return 1;
+      }
+      out.write(reinterpret_cast<const char *>(bytes.data()),
+                static_cast<std::streamsize>(bytes.size()));
+      const IncrementalAssembler::Stats &stats = assembler.stats();
+      std::cout << "Assembled " << bytes.size() << " bytes to " << output_path
+                << " in " << std::fixed << std::setprecision(3) << ms
+                << " ms (" << stats.reencoded << " of " << stats.lines
+                << " lines encoded)" << std::defaultfloat << std::endl;
+      if (!map_path.empty())
+        write_source_map(map_path, assembler.source_map());
+    } catch (const std::exception &ex) {
+      std::cerr << "Assembly error: " << ex.what() << std::endl;
+    }
+  }
+}
+
+bool read_binary_file(const std::string &path, std::vector<uint8_t> &out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return false;
+  out.assign(std::istreambuf_iterator<char>(in),
+             std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Links objects written by "assemble --object" into one program image
+int link_files(const std::string &output_path,
+               const std::vector<std::string> &inputs) {
+  std::vector<ObjectFile> objects;
+  for (const std::string &input : inputs) {
+    std::vector<uint8_t> bytes;
+    if (!read_binary_file(input, bytes)) {
+      std::cerr << "Failed to open object file: " << input << "\n";
+      return 1;
+    }
+    try {
+      objects.push_back(read_object(bytes));
+    } catch (const std::exception &ex) {
+      std::cerr << input << ": " << ex.what() << "\n";
+      return 1;
+    }
+  }
+
+  std::vector<uint8_t> image;
+  try {
+    image = link(objects);
+  } catch (const std::exception &ex) {
+    std::cerr << "Link error: " << ex.what() << "\n";
+    return 1;
+  }
+
+  std::ofstream out(output_path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Failed to open output file: " << output_path << "\n";
+    return 1;
+  }
+  out.write(reinterpret_cast<const char *>(image.data()),
+            static_cast<std::streamsize>(image.size()));
+  std::cout << "Linked " << objects.size() << " objects, " << image.size()
+            << " bytes to " << output_path << "\n";
+  return 0;
+}
+
+// Accepts a decimal count of at least `min` and at most `max`. std::stoull
+// alone would wrap "-1" to a huge value, so only digits are accepted.
+// Prints an error naming `option` and returns false otherwise.
+bool parse_count(const std::string &value, const char *option, uint64_t min,
+                 uint64_t max, uint64_t &count) {
+  if (!value.empty() &&
+      std::all_of(value.begin(), value.end(),
+                  [](char c) { return c >= '0' && c <= '9'; })) {
+    try {
+      unsigned long long parsed = std::stoull(value);
+      if (parsed >= min && parsed <= max) {
+        count = parsed;
+        return true;
+      }
+      if (parsed > max) {
+        std::cerr << "Invalid " << option << " value: " << value
+                  << " (at most " << max << ")\n";
+        return false;
+      }
+    } catch (const std::exception &) {
+    }
+  }
+  std::cerr << "Invalid " << option << " value: " << value << "\n";
+  return false;
+}
+
+// Accepts a positive instruction count or "unlimited"
+bool parse_max_cycles(const std::string &value, uint64_t &max_cycles) {
+  if (value == "unlimited") {
+    max_cycles = CPU::UNLIMITED_CYCLES;
+    return true;
+  }
+  return parse_count(value, "--max-cycles", 1, UINT64_MAX, max_cycles);
+}
+
+// Every subcommand loads binaries through ProgramImage, which maps the file
+// instead of reading it
+std::shared_ptr<const ProgramImage> open_program(const std::string &path) {
+  try {
+    return ProgramImage::open(path);
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << "\n"; // Names the file and the reason
+    return nullptr;
+  }
+}
+
+// stats: "" for none, "text" or "json" to print PerfCounters after the run
+int run_program(const std::string &program_path,
+                CPU::Engine engine = CPU::Engine::Reference,
+                uint64_t max_cycles = CPU::DEFAULT_MAX_CYCLES,
+                const std::string &stats = "",
+                const std::string &input_path = "") {
+  auto program = open_program(program_path);
+  if (!program)
+    return 1;
+
+  std::cout << "Loading program (" << program->size() << " bytes)..."
+            << std::endl;
+
+  CPU cpu;
+  // Per-instruction debug output needs the reference core, so the fast
+  // engine runs quietly and only prints the final state.
+  cpu.set_engine(engine);
+  cpu.set_debug_mode(engine == CPU::Engine::Reference);
+  cpu.set_perf_counters_enabled(!stats.empty());
+  if (!input_path.empty()) {
+    try {
+      cpu.get_memory().console().open_input(input_path);
+    } catch (const std::exception &ex) {
+      std::cerr << ex.what() << "\n";
+      return 1;
+    }
+  }
+  cpu.load_program(*program);
+
+  std::cout << "Running program..." << std::endl;
+  cpu.run(max_cycles);
+
+  std::cout << "Program execution complete." << std::endl;
+  cpu.dump_state();
+  if (const PerfCounters *counters = cpu.get_perf_counters())
+    std::cout << "\n"
+              << (stats == "json" ? counters->to_json() : counters->format());
+
+  return 0;
+}
+
+// Parse a batch job list; blank lines and lines starting with '#' are skipped.
+// share_pages keeps each image's descriptor open for the runner to map.
+bool load_batch_jobs(const std::string &path, std::vector<BatchJob> &jobs,
+                     bool share_pages) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to open job list: " << path << "\n";
+    return false;
+  }
+  // Jobs naming the same binary share one mapped image
+  std::map<std::string, std::shared_ptr<const ProgramImage>> images;
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    std::istringstream fields(line);
+    std::string program, input = "-", cycles;
+    if (!(fields >> program) || program[0] == '#')
+      continue;
+    fields >> input >> cycles;
+
+    BatchJob job;
+    job.name = program;
+    auto &image = images[program];
+    if (!image) {
+      try {
+        image = ProgramImage::open(program, share_pages);
+      } catch (const std::exception &ex) {
+        std::cerr << path << ":" << line_number << ": " << ex.what() << "\n";
+        return false;
+      }
+    }
+    job.image = image;
+    if (input != "-") {
+      std::vector<uint8_t> bytes;
+      if (!read_binary_file(input, bytes)) {
+        std::cerr << path << ":" << line_number
+                  << ": failed to open input file: " << input << "\n";
+        return false;
+      }
+      job.input.assign(bytes.begin(), bytes.end());
+      job.name += " < " + input;
+    }
+    if (!cycles.empty() && !parse_max_cycles(cycles, job.max_cycles))
+      return false;
+    jobs.push_back(std::move(job));
+  }
+  return true;
+}
+
+int run_batch(int argc, char **argv) {
+  unsigned threads = 0;
+  CPU::Engine engine = CPU::Engine::Reference;
+  std::string output_path;
+  bool share_pages = false;
+  size_t lockstep_lanes = 0;
+  for (int i = 3; i < argc; ++i) {
+    std::string option = argv[i];
+    if (option.rfind("--threads=", 0) == 0) {
+      try {
+        threads = static_cast<unsigned>(std::stoul(option.substr(10)));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid --threads value: " << option.substr(10) << "\n";
+        return 1;
+      }
+    } else if (option == "--engine=reference") {
+      engine = CPU::Engine::Reference;
+    } else if (option == "--engine=fast") {
+      engine = CPU::Engine::Fast;
+    } else if (option == "--engine=jit") {
+      engine = CPU::Engine::Jit;
+    } else if (option == "--share-pages") {
+      share_pages = true;
+    } else if (option == "--lockstep") {
+      lockstep_lanes = LockstepEngine::DEFAULT_LANES;
+    } else if (option.rfind("--lockstep=", 0) == 0) {
+      try {
+        lockstep_lanes = std::stoul(option.substr(11));
+      } catch (const std::exception &) {
+        lockstep_lanes = 0;
+      }
+      if (lockstep_lanes == 0) {
+        std::cerr << "Invalid --lockstep value: " << option.substr(11) << "\n";
+        return 1;
+      }
+    } else if (option.rfind("--output=", 0) == 0) {
+      output_path = option.substr(9);
+    } else {
+      std::cerr << "Unknown batch option: " << option << "\n";
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<BatchJob> jobs;
+  if (!load_batch_jobs(argv[2], jobs, share_pages))
+    return 1;
+
+  BatchRunner runner(threads, engine);
+  runner.set_share_program_pages(share_pages);
+  runner.set_lockstep_lanes(lockstep_lanes);
+  BatchSummary summary = runner.run(jobs);
+  std::string json = BatchRunner::to_json(summary);
+  if (output_path.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream out(output_path);
+    if (!out) {
+      std::cerr << "Failed to open batch output: " << output_path << "\n";
+      return 1;
+    }
+    out << json;
+    std::cout << "Ran " << summary.results.size() << " jobs on "
+              << summary.threads << " threads: "
+              << summary.total_instructions << " instructions, "
+              << static_cast<uint64_t>(summary.instructions_per_second)
+              << " instructions/s. Results in " << output_path << "\n";
+  }
+  return 0;
+}
+
+// Read a source map written by write_source_map(). Only the fields the
+// profiler needs (address, line, source, label) are kept.
+bool load_source_map(const std::string &path,
+                     std::vector<SourceMapEntry> &map) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to open source map: " << path << "\n";
+    return false;
+  }
+  std::string text((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+
+  size_t pos = 0;
+  auto read_string = [&](std::string &out) {
+    out.clear();
+    for (++pos; pos < text.size() && text[pos] != '"'; ++pos) {
+      char c = text[pos];
+      if (c == '\\' && pos + 1 < text.size()) {
+        c = text[++pos];
+        if (c == 'n')
+          c = '\n';
+        else if (c == 't')
+          c = '\t';
+        else if (c == 'r')
+          c = '\r';
+      }
+      out += c;
+    }
+    ++pos; // Closing quote
+  };
+
+  int depth = 0;
+  std::string key, value;
+  SourceMapEntry entry{};
+  while (pos < text.size()) {
+    char c = text[pos];
+    if (c == '{') {
+      if (++depth == 1)
+        entry = SourceMapEntry{};
+      ++pos;
+    } else if (c == '}') {
+      if (--depth == 0)
+        map.push_back(entry);
+      ++pos;
+    } else if (c == '"') {
+      read_string(key);
+      while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+        ++pos;
+      if (pos >= text.size() || text[pos] != ':')
+        continue; // A string value inside an array
+      ++pos;
+      while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+        ++pos;
+      if (pos < text.size() && text[pos] == '"') {
+        read_string(value);
+        if (key == "source")
+          entry.source_line = value;
+        else if (key == "label")
+          entry.label = value;
+      } else if (key == "address" || key == "line") {
+        size_t used = 0;
+        long number = std::strtol(text.c_str() + pos, nullptr, 10);
+        while (pos + used < text.size() &&
+               std::isdigit(static_cast<unsigned char>(text[pos + used])))
+          ++used;
+        pos += used;
+        if (key == "address")
+          entry.address = static_cast<uint16_t>(number);
+        else
+          entry.line_number = static_cast<int>(number);
+      }
+    } else {
+      ++pos;
+    }
+  }
+  return true;
+}
+
+std::string trim_source(const std::string &line) {
+  size_t begin = line.find_first_not_of(" \t");
+  size_t end = line.find_last_not_of(" \t\r\n");
+  return begin == std::string::npos ? "" : line.substr(begin, end - begin + 1);
+}
+
+int run_profile(int argc, char **argv) {
+  std::string program_path = argv[2];
+  std::string map_path;
+  std::string collapsed_path;
+  size_t top = 10;
+  uint64_t max_cycles = CPU::DEFAULT_MAX_CYCLES;
+  for (int i = 3; i < argc; ++i) {
+    std::string option = argv[i];
+    if (option.rfind("--", 0) != 0 && map_path.empty() && i == 3) {
+      map_path = option;
+    } else if (option.rfind("--collapsed=", 0) == 0) {
+      collapsed_path = option.substr(12);
+    } else if (option.rfind("--top=", 0) == 0) {
+      try {
+        top = std::stoul(option.substr(6));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid --top value: " << option.substr(6) << "\n";
+        return 1;
+      }
+    } else if (option.rfind("--max-cycles=", 0) == 0) {
+      if (!parse_max_cycles(option.substr(13), max_cycles))
+        return 1;
+    } else {
+      std::cerr << "Unknown profile option: " << option << "\n";
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (collapsed_path.empty()) {
+    size_t dot = program_path.find_last_of('.');
+    size_t slash = program_path.find_last_of('/');
+    bool has_ext = dot != std::string::npos &&
+                   (slash == std::string::npos || dot > slash);
+    collapsed_path =
+        (has_ext ? program_path.substr(0, dot) : program_path) + ".folded";
+  }
+
+  auto program = open_program(program_path);
+  if (!program)
+    return 1;
+  std::vector<SourceMapEntry> map;
+  if (!map_path.empty() && !load_source_map(map_path, map))
+    return 1;
+  std::sort(map.begin(), map.end(),
+            [](const SourceMapEntry &a, const SourceMapEntry &b) {
+              return a.address < b.address;
+            });
+
+  CPU cpu;
+  auto profiler = std::make_shared<Profiler>();
+  cpu.set_profiler(profiler);
+  cpu.load_program(*program);
+  cpu.run(max_cycles);
+
+  // Entry covering an address (the instruction containing it), or nullptr
+  auto entry_at = [&map](uint16_t address) -> const SourceMapEntry * {
+    auto it = std::upper_bound(map.begin(), map.end(), address,
+                               [](uint16_t a, const SourceMapEntry &e) {
+                                 return a < e.address;
+                               });
+    if (it == map.begin())
+      return nullptr;
+    --it;
+    return address < it->address + it->bytes.size() || it->bytes.empty()
+               ? &*it
+               : nullptr;
+  };
+  // Nearest label at or before the address, as "label" or "label+0x6"
+  auto symbol = [&map](uint16_t address) -> std::string {
+    const SourceMapEntry *labelled = nullptr;
+    for (const SourceMapEntry &e : map) {
+      if (e.address > address)
+        break;
+      if (!e.label.empty())
+        labelled = &e;
+    }
+    char buf[64];
+    if (!labelled) {
+      std::snprintf(buf, sizeof(buf), "0x%04X", address);
+      return buf;
+    }
+    if (labelled->address == address)
+      return labelled->label;
+    std::snprintf(buf, sizeof(buf), "+0x%X", address - labelled->address);
+    return labelled->label + buf;
+  };
+
+  uint64_t total = profiler->total_instructions();
+  auto percent = [total](uint64_t n) {
+    return total ? 100.0 * static_cast<double>(n) / static_cast<double>(total)
+                 : 0.0;
+  };
+  char buf[256];
+
+  std::cout << "\n=== Profile: " << total << " instructions";
+  if (!cpu.get_last_error().empty())
+    std::cout << " (stopped by error: " << cpu.get_last_error() << ")";
+  else if (!cpu.is_halted())
+    std::cout << " (stopped at cycle limit)";
+  std::cout << " ===\n\nHot spots:\n";
+  std::cout << "     count      %    addr  line  location / source\n";
+  std::vector<uint16_t> pcs;
+  for (uint32_t pc = 0; pc < 0x10000; ++pc)
+    if (profiler->count(static_cast<uint16_t>(pc)))
+      pcs.push_back(static_cast<uint16_t>(pc));
+  std::stable_sort(pcs.begin(), pcs.end(), [&](uint16_t a, uint16_t b) {
+    return profiler->count(a) > profiler->count(b);
+  });
+  for (size_t i = 0; i < pcs.size() && i < top; ++i) {
+    uint16_t pc = pcs[i];
+    const SourceMapEntry *e = entry_at(pc);
+    std::snprintf(buf, sizeof(buf), "%10llu %6.2f  0x%04X %5d  ",
+                  static_cast<unsigned long long>(profiler->count(pc)),
+                  percent(profiler->count(pc)), pc, e ? e->line_number : 0);
+    std::cout << buf << symbol(pc);
+    if (e)
+      std::cout << ": " << trim_source(e->source_line);
+    std::cout << "\n";
+  }
+
+  std::cout << "\nFunctions:\n";
+  std::cout << " inclusive      %       self    calls  function\n";
+  std::vector<Profiler::FunctionStats> functions = profiler->functions();
+  for (size_t i = 0; i < functions.size() && i < top; ++i) {
+    const Profiler::FunctionStats &f = functions[i];
+    std::snprintf(buf, sizeof(buf), "%10llu %6.2f %10llu %8llu  ",
+                  static_cast<unsigned long long>(f.inclusive),
+                  percent(f.inclusive),
+                  static_cast<unsigned long long>(f.self),
+                  static_cast<unsigned long long>(f.calls));
+    std::cout << buf << symbol(f.entry) << "\n";
+  }
+
+  std::vector<Profiler::Edge> edges = profiler->call_edges();
+  if (!edges.empty()) {
+    std::cout << "\nCall edges:\n";
+    for (size_t i = 0; i < edges.size() && i < top; ++i) {
+      std::snprintf(buf, sizeof(buf), "%10llu  ",
+                    static_cast<unsigned long long>(edges[i].calls));
+      std::cout << buf << symbol(edges[i].caller) << " -> "
+                << symbol(edges[i].callee) << "\n";
+    }
+  }
+
+  std::ofstream folded(collapsed_path);
+  if (!folded) {
+    std::cerr << "Failed to open collapsed-stack output: " << collapsed_path
+              << "\n";
+    return 1;
+  }
+  folded << profiler->collapsed_stacks(symbol);
+  std::cout << "\nWrote collapsed stacks to " << collapsed_path
+            << " (flamegraph.pl " << collapsed_path << " > profile.svg)\n";
+  return 0;
+}
+
+// Address or cycle argument: decimal, or hex with a 0x prefix
+bool parse_number(const std::string &text, uint64_t &value) {
+  try {
+    size_t used = 0;
+    value = std::stoull(text, &used, 0);
+    return used == text.size();
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+// Breakpoint condition: REG OP VALUE with REG one of r0-r3, sp, pc, flags
+// or a flag z, n, c, v, and OP one of == != < <= > >=; a flag alone means
+// it is set and !flag that it is clear
+bool parse_condition(std::string text, CPU::BreakCondition &condition) {
+  using Operand = CPU::BreakCondition::Operand;
+  using Compare = CPU::BreakCondition::Compare;
+  text.erase(std::remove(text.begin(), text.end(), ' '), text.end());
+  std::transform(text.begin(), text.end(), text.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  bool negated = !text.empty() && text[0] == '!';
+  if (negated)
+    text.erase(0, 1);
+  size_t op = text.find_first_of("=!<>");
+  std::string name = text.substr(0, op);
+  static const std::map<std::string, Operand> operands = {
+      {"r0", Operand::R0},       {"r1", Operand::R1},
+      {"r2", Operand::R2},       {"r3", Operand::R3},
+      {"sp", Operand::Sp},       {"pc", Operand::Pc},
+      {"flags", Operand::Flags}, {"z", Operand::FlagZ},
+      {"n", Operand::FlagN},     {"c", Operand::FlagC},
+      {"v", Operand::FlagV}};
+  auto found = operands.find(name);
+  if (found == operands.end())
+    return false;
+  condition.operand = found->second;
+  bool flag = found->second >= Operand::FlagZ;
+  if (op == std::string::npos) {
+    condition.compare = negated ? Compare::Eq : Compare::Ne;
+    condition.value = 0;
+    return flag;
+  }
+  if (negated)
+    return false;
+  static const std::pair<const char *, Compare> compares[] = {
+      {"==", Compare::Eq}, {"!=", Compare::Ne}, {"<=", Compare::Le},
+      {">=", Compare::Ge}, {"<", Compare::Lt},  {">", Compare::Gt}};
+  for (const auto &compare : compares) {
+    size_t length = std::strlen(compare.first);
+    uint64_t value = 0;
+    if (text.compare(op, length, compare.first) == 0) {
+      condition.compare = compare.second;
+      if (!parse_number(text.substr(op + length), value) || value > 0xFFFF)
+        return false;
+      condition.value = static_cast<uint16_t>(value);
+      return true;
+    }
+  }
+  return false;
+}
+
+// ADDR or FIRST-LAST
+bool parse_range(const std::string &text, uint16_t &first, uint16_t &last) {
+  size_t dash = text.find('-');
+  uint64_t a = 0, b = 0;
+  if (!parse_number(text.substr(0, dash), a) ||
+      (dash != std::string::npos && !parse_number(text.substr(dash + 1), b)))
+    return false;
+  if (dash == std::string::npos)
+    b = a;
+  if (a > b || b > 0xFFFF)
+    return false;
+  first = static_cast<uint16_t>(a);
+  last = static_cast<uint16_t>(b);
+  return true;
+}
+
+void print_stop(const CPU::StopInfo &stop) {
+  std::cout << std::hex;
+  if (stop.reason == CPU::StopReason::Breakpoint)
+    std::cout << "Breakpoint at 0x" << stop.address << "\n";
+  else if (stop.reason == CPU::StopReason::Watchpoint)
+    std::cout << "Watchpoint: " << (stop.write ? "write to" : "read of")
+              << " 0x" << stop.address << "\n";
+  std::cout << std::dec;
+}
+
+void print_debug_help() {
+  std::cout << "Commands:\n"
+               "  <Enter>, s, step        execute one instruction\n"
+               "  c, continue             run to a breakpoint, watchpoint or "
+               "HALT\n"
+               "  rs, reverse-step        go back one instruction\n"
+               "  rc, reverse-continue    go back to the previous stop\n"
+               "  goto N, goto-cycle N    go to cycle N\n"
+               "  b ADDR [if COND]        stop when PC reaches ADDR (and COND "
+               "holds,\n"
+               "                          e.g. r0 == 5, sp < 0x7000, z, !c)\n"
+               "  d ADDR, delete ADDR     remove a breakpoint\n"
+               "  w RANGE [read|access]   stop after an instruction writes "
+               "(reads)\n"
+               "                          RANGE, ADDR or FIRST-LAST\n"
+               "  dw RANGE                remove a watchpoint\n"
+               "  info                    stops, checkpoints and replay "
+               "memory\n"
+               "  q, quit\n";
+}
+
+int run_debug(int argc, char **argv) {
+  uint64_t interval = ReplayDebugger::DEFAULT_CHECKPOINT_INTERVAL;
+  uint64_t budget_mb = ReplayDebugger::DEFAULT_MEMORY_BUDGET >> 20;
+  std::string input_path;
+  uint64_t gdb_port = 0;
+  for (int i = 3; i < argc; ++i) {
+    std::string option = argv[i];
+    if (option.rfind("--gdb=", 0) == 0) {
+      if (!parse_number(option.substr(6), gdb_port) || gdb_port == 0 ||
+          gdb_port > 65535) {
+        std::cerr << "Invalid value for --gdb\n";
+        return 1;
+      }
+    } else if (option.rfind("--checkpoint-interval=", 0) == 0) {
+      if (!parse_number(option.substr(22), interval) || interval == 0) {
+        std::cerr << "Invalid value for --checkpoint-interval\n";
+        return 1;
+      }
+    } else if (option.rfind("--checkpoint-budget=", 0) == 0) {
+      if (!parse_number(option.substr(20), budget_mb) || budget_mb == 0) {
+        std::cerr << "Invalid value for --checkpoint-budget\n";
+        return 1;
+      }
+    } else if (option.rfind("--input=", 0) == 0) {
+      input_path = option.substr(8);
+    } else {
+      std::cerr << "Unknown debug option: " << option << "\n";
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  auto image = open_program(argv[2]);
+  if (!image)
+    return 1;
+
+  // Replays and continues run on the fast engine; the reference core
+  // still executes single steps
+  CPU cpu;
+  cpu.set_engine(CPU::Engine::Fast);
+  cpu.get_memory().console().set_buffered(false);
+  if (!input_path.empty()) {
+    try {
+      cpu.get_memory().console().open_input(input_path);
+    } catch (const std::exception &ex) {
+      std::cerr << ex.what() << "\n";
+      return 1;
+    }
+  }
+  cpu.load_program(*image);
+  ReplayDebugger debugger(cpu, interval, static_cast<size_t>(budget_mb) << 20);
+
+  if (gdb_port != 0) {
+    GdbStub stub(debugger);
+    std::cout << "Waiting for GDB on 127.0.0.1:" << gdb_port
+              << " (target remote localhost:" << gdb_port << ")" << std::endl;
+    try {
+      stub.serve(static_cast<uint16_t>(gdb_port));
+    } catch (const std::exception &ex) {
+      std::cerr << ex.what() << "\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  print_debug_help();
+  std::string line;
+  for (;;) {
+    std::cout << "(cycle " << debugger.cycle()
+              << (cpu.is_halted() ? ", halted" : "") << ") " << std::flush;
+    if (!std::getline(std::cin, line))
+      break;
+    std::istringstream words(line);
+    std::string command, argument, rest;
+    words >> command >> argument;
+    std::getline(words, rest);
+
+    uint64_t value = 0;
+    bool needs_value = command == "goto" || command == "goto-cycle" ||
+                       command == "b" || command == "break" ||
+                       command == "d" || command == "delete";
+    if (needs_value && !parse_number(argument, value)) {
+      std::cout << "Expected a number after " << command << "\n";
+      continue;
+    }
+    uint16_t first = 0, last = 0;
+    bool needs_range = command == "w" || command == "watch" ||
+                       command == "dw" || command == "unwatch";
+    if (needs_range && !parse_range(argument, first, last)) {
+      std::cout << "Expected ADDR or FIRST-LAST after " << command << "\n";
+      continue;
+    }
+
+    if (command.empty() || command == "s" || command == "step") {
+      if (cpu.is_halted())
+        std::cout << "Program halted; reverse-step or goto to go back\n";
+      else
+        debugger.step();
+    } else if (command == "c" || command == "continue") {
+      if (debugger.continue_forward())
+        print_stop(debugger.last_stop());
+    } else if (command == "rs" || command == "reverse-step") {
+      if (!debugger.reverse_step())
+        std::cout << "At the start of recording\n";
+    } else if (command == "rc" || command == "reverse-continue") {
+      if (debugger.reverse_continue())
+        print_stop(debugger.last_stop());
+      else
+        std::cout << "At the start of recording\n";
+    } else if (command == "goto" || command == "goto-cycle") {
+      if (!debugger.goto_cycle(value))
+        std::cout << "Stopped at cycle " << debugger.cycle() << "\n";
+    } else if (command == "b" || command == "break") {
+      std::istringstream tail(rest);
+      std::string keyword, condition_text;
+      tail >> keyword;
+      std::getline(tail, condition_text);
+      CPU::BreakCondition condition;
+      if (!keyword.empty() &&
+          (keyword != "if" || !parse_condition(condition_text, condition))) {
+        std::cout << "Expected: b ADDR [if COND]\n";
+        continue;
+      }
+      debugger.add_breakpoint(static_cast<uint16_t>(value), condition);
+      continue;
+    } else if (command == "d" || command == "delete") {
+      if (!debugger.remove_breakpoint(static_cast<uint16_t>(value)))
+        std::cout << "No breakpoint at " << argument << "\n";
+      continue;
+    } else if (command == "w" || command == "watch") {
+      std::string kind = rest;
+      kind.erase(std::remove(kind.begin(), kind.end(), ' '), kind.end());
+      if (!kind.empty() && kind != "read" && kind != "write" &&
+          kind != "access") {
+        std::cout << "Expected: w RANGE [read|write|access]\n";
+        continue;
+      }
+      debugger.add_watchpoint(first, last,
+                              kind == "read"     ? Memory::WATCH_READ
+                              : kind == "access" ? Memory::WATCH_ACCESS
+                                                 : Memory::WATCH_WRITE);
+      continue;
+    } else if (command == "dw" || command == "unwatch") {
+      if (!debugger.remove_watchpoint(first, last, Memory::WATCH_ACCESS))
+        std::cout << "No watchpoint on " << argument << "\n";
+      continue;
+    } else if (command == "info") {
+      std::cout << std::hex;
+      for (const auto &breakpoint : debugger.breakpoints())
+        std::cout << "Breakpoint at 0x" << breakpoint.first
+                  << (breakpoint.second.operand ==
+                              CPU::BreakCondition::Operand::Always
+                          ? "\n"
+                          : " (conditional)\n");
+      for (const Memory::Watchpoint &watch :
+           cpu.get_memory().watchpoints())
+        std::cout << "Watchpoint on 0x" << watch.first << "-0x" << watch.last
+                  << (watch.kind == Memory::WATCH_READ    ? " (read)\n"
+                      : watch.kind == Memory::WATCH_WRITE ? " (write)\n"
+                                                          : " (access)\n");
+      std::cout << std::dec;
+      std::cout << debugger.checkpoint_count() << " checkpoints every "
+                << debugger.checkpoint_interval() << " cycles, "
+                << debugger.input_log_reads() << " console reads logged, "
+                << (debugger.memory_used() >> 10) << " KiB of "
+                << budget_mb << " MiB\n";
+      continue;
+    } else if (command == "q" || command == "quit") {
+      break;
+    } else {
+      print_debug_help();
+      continue;
+    }
+    cpu.dump_state();
+  }
+  return 0;
+}
+
+int run_test() {
+  std::cout << "Running emulator test..." << std::endl;
+
+  CPU cpu;
+  cpu.set_debug_mode(true);
+
+  std::vector<uint8_t> program = {
+      0x00, 0x29,            // ADD R0, #42
+      0x2A, 0x00, 0x00, 0x08 // HALT
+  };
+
+  cpu.load_program(program);
+  cpu.run();
+
+  const Registers &regs = cpu.get_registers();
+  if (regs.get_gpr(0) == 42) {
+    std::cout << "✅ Test passed!" << std::endl;
+    return 0;
+  } else {
+    std::cout << "❌ Test failed! R0 = " << regs.get_gpr(0) << std::endl;
+    return 1;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  std::string command = argv[1];
+
+  if (command == "assemble") {
+    std::vector<std::string> args;
+    bool object = false;
+    bool watch = false;
+    bool optimize = false;
+    for (int i = 2; i < argc; ++i) {
+      if (std::string(argv[i]) == "--object")
+        object = true;
+      else if (std::string(argv[i]) == "--watch")
+        watch = true;
+      else if (std::string(argv[i]) == "-O")
+        optimize = true;
+      else
+        args.push_back(argv[i]);
+    }
+    // The incremental assembler has no peephole pass
+    if (watch && !object && !optimize &&
+        (args.size() == 2 || args.size() == 3)) {
+      return watch_file(args[0], args[1], args.size() == 3 ? args[2] : "");
+    } else if (watch) {
+      print_usage(argv[0]);
+      return 1;
+    } else if (args.size() == 2) {
+      return assemble_file(args[0], args[1], "", object, optimize);
+    } else if (args.size() == 3) {
+      return assemble_file(args[0], args[1], args[2], object, optimize);
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  } else if (command == "link" && argc >= 4) {
+    return link_files(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+  } else if (command == "run" && argc >= 3) {
+    CPU::Engine engine = CPU::Engine::Reference;
+    uint64_t max_cycles = CPU::DEFAULT_MAX_CYCLES;
+    std::string stats;
+    std::string input_path;
+    for (int i = 3; i < argc; ++i) {
+      std::string option = argv[i];
+      if (option.rfind("--input=", 0) == 0) {
+        input_path = option.substr(8);
+      } else if (option == "--stats") {
+        stats = "text";
+      } else if (option == "--stats=json") {
+        stats = "json";
+      } else if (option == "--engine=reference") {
+        engine = CPU::Engine::Reference;
+      } else if (option == "--engine=fast") {
+        engine = CPU::Engine::Fast;
+      } else if (option == "--engine=jit") {
+        engine = CPU::Engine::Jit;
+      } else if (option.rfind("--max-cycles=", 0) == 0) {
+        if (!parse_max_cycles(option.substr(13), max_cycles))
+          return 1;
+      } else {
+        std::cerr << "Unknown run option: " << option << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+    return run_program(argv[2], engine, max_cycles, stats, input_path);
+  } else if (command == "run-trace" && argc >= 4) {
+    std::string program = argv[2];
+    std::string trace_path = argv[3];
+    TraceRecorder::Format format = TraceRecorder::Format::Json;
+    bool async = false;
+    TraceRecorder::Backpressure policy = TraceRecorder::Backpressure::Block;
+    size_t window = 0;
+    uint32_t sample = 1;
+    uint64_t keyframes = 0;
+    uint64_t max_cycles = CPU::DEFAULT_MAX_CYCLES;
+    for (int i = 4; i < argc; ++i) {
+      std::string option = argv[i];
+      if (option == "--format=binary") {
+        format = TraceRecorder::Format::Binary;
+      } else if (option == "--format=json") {
+        format = TraceRecorder::Format::Json;
+      } else if (option == "--async" || option == "--async=block") {
+        async = true;
+        policy = TraceRecorder::Backpressure::Block;
+      } else if (option == "--async=drop") {
+        async = true;
+        policy = TraceRecorder::Backpressure::Drop;
+      } else if (option.rfind("--max-cycles=", 0) == 0) {
+        if (!parse_max_cycles(option.substr(13), max_cycles))
+          return 1;
+      } else if (option == "--keyframes") {
+        keyframes = TraceRecorder::DEFAULT_KEYFRAME_INTERVAL;
+      } else if (option.rfind("--keyframes=", 0) == 0) {
+        if (!parse_count(option.substr(12), "--keyframes", 1, UINT32_MAX,
+                         keyframes))
+          return 1;
+      } else if (option.rfind("--window=", 0) == 0) {
+        uint64_t count = 0;
+        if (!parse_count(option.substr(9), "--window", 0,
+                         TraceRecorder::MAX_WINDOW, count))
+          return 1;
+        window = static_cast<size_t>(count);
+      } else if (option.rfind("--sample=", 0) == 0) {
+        uint64_t count = 0;
+        if (!parse_count(option.substr(9), "--sample", 1, UINT32_MAX, count))
+          return 1;
+        sample = static_cast<uint32_t>(count);
+      } else {
+        std::cerr << "Unknown run-trace option: " << option << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+
+    bool lossy = window != 0 || sample != 1 ||
+                 (async && policy == TraceRecorder::Backpressure::Drop);
+    if (keyframes != 0 && (format != TraceRecorder::Format::Binary || lossy)) {
+      std::cerr << "--keyframes needs --format=binary and every cycle"
+                   " (no --window, --sample or --async=drop)\n";
+      return 1;
+    }
+
+    auto image = open_program(program);
+    if (!image)
+      return 1;
+
+    CPU cpu;
+    cpu.set_debug_mode(true);
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(trace_path);
+    tracer->set_format(format);
+    tracer->set_async(async, policy);
+    tracer->set_window(window);
+    tracer->set_sampling(sample);
+    tracer->set_keyframe_interval(keyframes);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(*image);
+    cpu.run(max_cycles);
+    if (tracer->dropped_cycles() > 0)
+      std::cerr << "Trace: dropped " << tracer->dropped_cycles()
+                << " cycles (writer queue full)\n";
+    return 0;
+  } else if (command == "profile" && argc >= 3) {
+    return run_profile(argc, argv);
+  } else if (command == "batch" && argc >= 3) {
+    return run_batch(argc, argv);
+  } else if (command == "trace-export" && argc == 4) {
+    try {
+      size_t cycles = trace_format::export_json(argv[2], argv[3]);
+      std::cout << "Exported " << cycles << " cycles to " << argv[3] << "\n";
+    } catch (const std::exception &ex) {
+      std::cerr << "Trace export error: " << ex.what() << "\n";
+      return 1;
+    }
+    return 0;
+  } else if (command == "trace-serve" && argc >= 3) {
+    uint16_t port = 8080;
+    std::string map_path;
+    std::string viewer_dir = "trace_viewer";
+    for (int i = 3; i < argc; ++i) {
+      std::string option = argv[i];
+      if (option.rfind("--port=", 0) == 0) {
+        unsigned long value = 0;
+        try {
+          value = std::stoul(option.substr(7));
+        } catch (const std::exception &) {
+        }
+        if (value == 0 || value > 65535) {
+          std::cerr << "Invalid value for --port\n";
+          return 1;
+        }
+        port = static_cast<uint16_t>(value);
+      } else if (option.rfind("--map=", 0) == 0) {
+        map_path = option.substr(6);
+      } else if (option.rfind("--viewer=", 0) == 0) {
+        viewer_dir = option.substr(9);
+      } else {
+        std::cerr << "Unknown trace-serve option: " << option << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+    try {
+      TraceServer server(argv[2], viewer_dir, map_path);
+      std::cout << "Serving " << argv[2] << " on http://127.0.0.1:" << port
+                << "/ (Ctrl+C to stop)" << std::endl;
+      server.serve(port);
+    } catch (const std::exception &ex) {
+      std::cerr << "Trace server error: " << ex.what() << "\n";
+      return 1;
+    }
+    return 0;
+  } else if (command == "debug" && argc >= 3) {
+    return run_debug(argc, argv);
+  } else if (command == "test" && argc == 2) {
+    return run_test();
+  } else {
+    print_usage(argv[0]);
+    return 1;
+  }
 }
\ No newline at end of file
@@ -0,0 +1,22 @@
+; Copies console input to the output until the input ends. The loop polls
+; the status port, so the emulator never blocks waiting for input.
+;   software-cpu run console_echo.bin --engine=fast --input=notes.txt
+.org 0x8000
+start:
+    MOV R1, #0xF002      ; Console status
+    MOV R2, #0xF001      ; Console input data
+    MOV R3, #0xF000      ; Console output data
+
+poll:
+    LOAD R0, [R1]
+    AND R0, #1           ; Input ready?
+    JNZ echo
+    LOAD R0, [R1]
+    AND R0, #2           ; End of input?
+    JZ poll
+    HALT
+
+echo:
+    LOAD R0, [R2]        ; Next input byte
+    STORE R0, [R3]
+    JMP poll
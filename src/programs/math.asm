@@ -55,6 +55,8 @@
 ; Space Complexity: O(1) - constant stack space
 ; ------------------------------------------------------------------------------
 
+    .global multiply        ; Linkable: assemble --object math.asm math.o
+
 multiply:
     ; -------------------------------------------------------------------------
     ; Function Prologue
@@ -150,6 +150,57 @@ void test_flag_updates() {
               "Flags: Overflow flag set on signed overflow");
 }
 
+void test_lazy_flags() {
+  ALU alu;
+  Registers lazy;
+  Registers eager;
+
+  // Deferred flags read back exactly as the eager flag helpers set them
+  const uint16_t values[] = {0,      1,      2,      15,     16,
+                            17,     0x7FFF, 0x8000, 0x8001, 0xFFFF};
+  bool same = true;
+  for (uint16_t a : values) {
+    for (uint16_t b : values) {
+      uint16_t sum = alu.execute(ALU::Operation::ADD, a, b, lazy);
+      alu.update_flags_arithmetic(sum, a, b, false, eager);
+      same = same && lazy.get_flags() == eager.get_flags();
+      uint16_t diff = alu.execute(ALU::Operation::SUB, a, b, lazy);
+      alu.update_flags_arithmetic(diff, a, b, true, eager);
+      same = same && lazy.get_flags() == eager.get_flags();
+      uint16_t both = alu.execute(ALU::Operation::XOR, a, b, lazy);
+      alu.update_flags_logical(both, eager);
+      same = same && lazy.get_flags() == eager.get_flags();
+      uint16_t left = alu.execute(ALU::Operation::SHL, a, b, lazy);
+      alu.update_flags_shift(left, b > 0 && b <= 16 && (a & (1 << (16 - b))),
+                             eager);
+      same = same && lazy.get_flags() == eager.get_flags();
+      uint16_t right = alu.execute(ALU::Operation::SHR, a, b, lazy);
+      alu.update_flags_shift(right, b > 0 && b <= 16 && (a & (1 << (b - 1))),
+                             eager);
+      same = same && lazy.get_flags() == eager.get_flags() &&
+             lazy.is_zero() == eager.is_zero() &&
+             lazy.is_negative() == eager.is_negative();
+    }
+  }
+  test_assert(same, "Lazy flags: Materialized flags match eager updates");
+
+  // Writing one flag keeps the others computed by the pending operation
+  alu.execute(ALU::Operation::ADD, 0xFFFF, 1, lazy);
+  lazy.set_flag(Registers::FLAG_V, true);
+  test_assert(lazy.get_flags() == ((1 << Registers::FLAG_Z) |
+                                   (1 << Registers::FLAG_C) |
+                                   (1 << Registers::FLAG_V)),
+              "Lazy flags: set_flag() applies on top of pending flags");
+
+  // Copies carry the pending operation, and set_flags() replaces it
+  alu.execute(ALU::Operation::CMP, 1, 2, lazy);
+  Registers copy = lazy;
+  lazy.set_flags(0);
+  test_assert(copy.is_carry() && copy.is_negative() && !copy.is_zero() &&
+                  lazy.get_flags() == 0,
+              "Lazy flags: Copied registers keep their own flags");
+}
+
 int main() {
   std::cout << "=== ALU Unit Tests ===" << std::endl << std::endl;
 
@@ -159,6 +210,7 @@ int main() {
   test_logical_operations();
   test_shift_operations();
   test_flag_updates();
+  test_lazy_flags();
 
   std::cout << std::endl << "=== All ALU Tests Passed! ===" << std::endl;
   return 0;
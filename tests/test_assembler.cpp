@@ -1,5 +1,7 @@
 #include "../src/assembler/assembler.hpp"
+#include "../src/assembler/linker.hpp"
 #include <cassert>
+#include <functional>
 #include <iostream>
 #include <sstream>
 
@@ -229,6 +231,305 @@ void test_error_handling() {
   test_assert(caught_error, "Error: Undefined label throws error");
 }
 
+void test_strict_literals() {
+  auto throws = [](const char *source) {
+    try {
+      assemble(source);
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+  test_assert(throws("MOV R0, #12ab\nHALT\n"),
+              "Literals: Trailing garbage after a decimal is rejected");
+  test_assert(throws("MOV R0, #0x1G\nHALT\n"),
+              "Literals: Non-hex digit is rejected");
+  test_assert(throws("MOV R0, #0b10000000000000000\nHALT\n"),
+              "Literals: Binary literal over 16 bits is rejected");
+  test_assert(throws("MOV R0, #70000\nHALT\n"),
+              "Literals: Decimal literal over 16 bits is rejected");
+
+  // Mnemonics, registers and labels are case-insensitive
+  std::vector<uint8_t> upper = assemble("LOOP: MOV R0, #0xFFFF\nJMP LOOP\n");
+  std::vector<uint8_t> lower = assemble("loop: mov r0, #0xffff\njmp Loop\n");
+  test_assert(upper == lower, "Literals: Case-insensitive names");
+}
+
+void test_source_map_labels() {
+  std::string source = R"(
+        .org 0x8000
+    start:
+        MOV R0, #1
+        CALL helper
+        HALT
+    helper:
+        RET
+    )";
+
+  std::vector<SourceMapEntry> map;
+  assemble(source, &map);
+  test_assert(map.size() == 4 && !map[0].label.empty() &&
+                  map[1].label.empty() && map[3].address == 0x800A &&
+                  !map[3].label.empty(),
+              "Source map: Labels recorded at their addresses");
+}
+
+void test_dma_macros() {
+  std::string macro = R"(
+        .org 0x8000
+    start:
+        DMACOPY R0, R1, R2
+    wait:
+        DMAWAIT R3
+        HALT
+    )";
+  std::string expanded = R"(
+        .org 0x8000
+        STORE R1, [#0xF020]
+        STORE R0, [#0xF022]
+        STORE R2, [#0xF024]
+        PUSH R2
+        MOV R2, #1
+        STORE R2, [#0xF026]
+        POP R2
+    poll:
+        LOAD R3, [#0xF026]
+        AND R3, #1
+        JNZ poll
+        HALT
+    )";
+  test_assert(assemble(macro) == assemble(expanded),
+              "Macros: DMACOPY and DMAWAIT expand to plain instructions");
+
+  std::vector<SourceMapEntry> map;
+  assemble(macro, &map);
+  test_assert(map.size() == 11 && map[0].label == "START" &&
+                  map[7].label == "WAIT" && map[8].label.empty() &&
+                  map[7].line_number == map[9].line_number,
+              "Macros: Source map keeps user labels and macro lines");
+
+  std::string fill = R"(
+        DMAFILL R0, R1, R2
+    )";
+  std::vector<uint8_t> bin = assemble(fill);
+  // STORE R1, [#0xF028]: opcode 4, direct mode, rd R1
+  test_assert(bin.size() == 24 && bin[0] == 0x20 && bin[1] == 0x22 &&
+                  bin[2] == 0x28 && bin[3] == 0xF0 && bin[16] == 2,
+              "Macros: DMAFILL stores the fill byte and fill command");
+
+  bool threw = false;
+  try {
+    assemble("DMACOPY R0, #1, R2\n");
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  test_assert(threw, "Macros: Non-register operands are rejected");
+}
+
+void test_object_files() {
+  std::string main_source = R"(
+    start:
+        MOV R0, #6
+        MOV R1, #7
+        CALL multiply
+        STORE R0, [result]
+        LOAD R1, [table]
+        JZ 0x8000
+        HALT
+    result:
+        .word 0
+    )";
+  std::string lib_source = R"(
+        .global multiply, table
+    multiply:
+        MOV R2, #0
+    loop:
+        CMP R1, #0
+        JZ done
+        ADD R2, R0
+        SUB R1, #1
+        JMP loop
+    done:
+        MOV R0, R2
+        RET
+    table:
+        .word multiply
+        .word done
+    )";
+
+  ObjectFile main_obj = assemble_object(main_source);
+  ObjectFile lib_obj = assemble_object(lib_source);
+  test_assert(main_obj.symbols.empty() && lib_obj.symbols.size() == 2 &&
+                  lib_obj.symbols[0].name == "MULTIPLY",
+              "Objects: Only .global labels are exported");
+  // Flat assembly of the concatenated sources is the reference layout
+  std::vector<uint8_t> flat = assemble(main_source + lib_source);
+  test_assert(link({main_obj, lib_obj}) == flat,
+              "Objects: Linking matches assembling everything at once");
+
+  ObjectFile reread = read_object(write_object(lib_obj));
+  test_assert(reread.code == lib_obj.code &&
+                  reread.relocations.size() == lib_obj.relocations.size() &&
+                  link({main_obj, reread}) == flat,
+              "Objects: Serialized objects round-trip");
+
+  std::vector<LinkedSymbol> symbols;
+  link({main_obj, lib_obj}, 0x8000, &symbols);
+  test_assert(symbols.size() == 2 && symbols[0].name == "MULTIPLY" &&
+                  symbols[0].address == 0x8000 + main_obj.code.size(),
+              "Objects: Linker reports symbol addresses");
+
+  auto throws = [](const std::function<void()> &fn) {
+    try {
+      fn();
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+  test_assert(throws([&] { link({main_obj}); }),
+              "Objects: Undefined symbol is a link error");
+  test_assert(throws([&] { link({main_obj, lib_obj, lib_obj}); }),
+              "Objects: Duplicate symbol is a link error");
+  test_assert(throws([] { assemble_object(".org 0x8000\nHALT\n"); }),
+              "Objects: .org is rejected in objects");
+  test_assert(throws([] { assemble_object(".global missing\nHALT\n"); }),
+              "Objects: Exporting an undefined label is an error");
+  std::vector<uint8_t> truncated = write_object(lib_obj);
+  truncated.pop_back();
+  test_assert(throws([&] { read_object(truncated); }),
+              "Objects: Truncated object is rejected");
+}
+
+void test_incremental_assembler() {
+  std::string source = R"(
+start:
+    MOV R0, #0
+    MOV R1, #10
+loop:
+    ADD R0, R1
+    SUB R1, #1
+    JNZ loop
+    STORE R0, [result]
+    CALL done
+    HALT
+done:
+    RET
+result:
+    .word 0
+)";
+  auto matches = [](IncrementalAssembler &inc, const std::string &src) {
+    std::vector<SourceMapEntry> map;
+    std::vector<uint8_t> expected = assemble(src, &map);
+    const std::vector<SourceMapEntry> &got = inc.source_map();
+    bool same = inc.update(src) == expected && got.size() == map.size();
+    for (size_t i = 0; same && i < map.size(); ++i)
+      same = got[i].address == map[i].address &&
+             got[i].line_number == map[i].line_number &&
+             got[i].source_line == map[i].source_line &&
+             got[i].bytes == map[i].bytes && got[i].label == map[i].label;
+    return same;
+  };
+
+  IncrementalAssembler inc(true);
+  test_assert(matches(inc, source) && inc.stats().full,
+              "Incremental: First update is a full build");
+
+  // Same-size edit: only the edited line is encoded again
+  std::string edited = source;
+  edited.replace(edited.find("#10"), 3, "#12");
+  test_assert(matches(inc, edited) && !inc.stats().full &&
+                  inc.stats().reparsed == 1 && inc.stats().reencoded == 1,
+              "Incremental: One-line edit re-encodes one line");
+
+  // Inserting code moves later labels: the jumps and references to them
+  // are encoded again, lines and addresses shift in the source map
+  edited.replace(edited.find("    HALT"), 0, "    NOP\n    NOP\n");
+  test_assert(matches(inc, edited) && inc.stats().reparsed == 2 &&
+                  inc.stats().reencoded < inc.stats().lines,
+              "Incremental: Insertion re-encodes dependent lines only");
+
+  edited.erase(edited.find("    SUB R1, #1\n"), 15);
+  test_assert(matches(inc, edited), "Incremental: Deleting a line");
+
+  // Errors match assemble(); the next update rebuilds
+  std::string broken = edited + "    JMP nowhere\n";
+  std::string expected, message;
+  try {
+    assemble(broken);
+  } catch (const std::runtime_error &e) {
+    expected = e.what();
+  }
+  try {
+    inc.update(broken);
+  } catch (const std::runtime_error &e) {
+    message = e.what();
+  }
+  test_assert(!message.empty() && message == expected,
+              "Incremental: Errors are reported like assemble()");
+  test_assert(matches(inc, edited) && inc.stats().full,
+              "Incremental: Recovers after an error");
+
+  IncrementalAssembler no_map;
+  no_map.update(source);
+  test_assert(no_map.update(edited) == assemble(edited) &&
+                  no_map.source_map().empty(),
+              "Incremental: Works without a source map");
+}
+
+void test_peephole() {
+  AssemblerOptions options;
+  options.optimize = true;
+  auto optimize = [&](const std::string &src) {
+    return assemble(src, nullptr, options);
+  };
+
+  test_assert(optimize("MOV R1, R1\nPUSH R2\nPOP R2\nHALT\n") ==
+                  assemble("HALT\n"),
+              "Peephole: MOV Rx, Rx and PUSH/POP Rx are removed");
+  test_assert(optimize("PUSH R0\nPOP R1\nHALT\n") ==
+                  assemble("MOV R1, R0\nHALT\n"),
+              "Peephole: PUSH Rx / POP Ry becomes MOV Ry, Rx");
+  // The flags of ADD R0, #0 are overwritten by CMP: dead, so removed
+  test_assert(optimize("ADD R0, #0\nCMP R1, #5\nJZ out\nNOP\nout: HALT\n") ==
+                  assemble("CMP R1, #5\nJZ out\nNOP\nout: HALT\n"),
+              "Peephole: Identity with dead flags is removed");
+  // ... but JZ reads them here, so only the register form is used
+  test_assert(optimize("CMP R0, #0\nJZ out\nNOP\nout: HALT\n") ==
+                  assemble("OR R0, R0\nJZ out\nNOP\nout: HALT\n"),
+              "Peephole: Identity with live flags uses the register form");
+  test_assert(optimize("MOV R0, #0\nADD R1, #2\nHALT\n") ==
+                  assemble("XOR R0, R0\nADD R1, #2\nHALT\n"),
+              "Peephole: MOV Rx, #0 becomes XOR Rx, Rx when flags are dead");
+  test_assert(optimize("JMP next\nnext: JNZ far\nfar: HALT\n") ==
+                  assemble("HALT\n"),
+              "Peephole: Jumps to the next instruction are removed");
+  test_assert(optimize("JZ a\nNOP\na: JMP b\nNOP\nb: HALT\n") ==
+                  assemble("JZ b\nNOP\na: JMP b\nNOP\nb: HALT\n"),
+              "Peephole: Jump chains are retargeted");
+  test_assert(optimize("CALL f\nHALT\nf: JMP r\nNOP\nr: RET\n") ==
+                  assemble("CALL r\nHALT\nf: RET\nNOP\nr: RET\n"),
+              "Peephole: JMP to RET becomes RET");
+
+  // A numeric address into the code pins the layout
+  std::string pinned = "JMP 0x8006\nMOV R0, R0\nHALT\n";
+  test_assert(optimize(pinned) == assemble(pinned),
+              "Peephole: Numeric code references disable the pass");
+
+  // The source map describes the optimized code
+  PeepholeStats stats;
+  options.stats = &stats;
+  std::vector<SourceMapEntry> map;
+  assemble("MOV R0, R0\nstart: ADD R1, #0\nJZ start\nHALT\n", &map, options);
+  test_assert(map.size() == 3 && map[0].line_number == 2 &&
+                  map[0].address == 0x8000 && map[0].bytes.size() == 2 &&
+                  map[0].label == "START" && map[1].address == 0x8002,
+              "Peephole: Source map follows the new layout");
+  test_assert(stats.removed == 1 && stats.shortened == 1 &&
+                  stats.bytes_saved == 4,
+              "Peephole: Statistics are reported");
+}
+
 int main() {
   std::cout << "=== Assembler Unit Tests ===" << std::endl << std::endl;
 
@@ -244,6 +545,12 @@ int main() {
   test_escape_sequences();
   test_all_jump_types();
   test_error_handling();
+  test_strict_literals();
+  test_source_map_labels();
+  test_dma_macros();
+  test_object_files();
+  test_incremental_assembler();
+  test_peephole();
 
   std::cout << std::endl << "=== All Assembler Tests Passed! ===" << std::endl;
   return 0;
@@ -1,6 +1,18 @@
+#include "../src/emulator/batch_runner.hpp"
 #include "../src/emulator/cpu.hpp"
+#include "../src/emulator/profiler.hpp"
+#include "../src/emulator/gdb_stub.hpp"
+#include "../src/emulator/lockstep.hpp"
+#include "../src/emulator/replay_debugger.hpp"
+#include "../src/emulator/trace_index.hpp"
+#include "../src/emulator/trace_recorder.hpp"
+#include "../src/emulator/trace_server.hpp"
 #include <cassert>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <vector>
 
 // Test helper
@@ -246,6 +258,1450 @@ void test_load_store() {
               "LOAD/STORE: Value preserved through memory");
 }
 
+// Loop that patches its own MOV immediate on the second pass
+std::vector<uint8_t> make_self_modifying_program() {
+  std::vector<uint8_t> program;
+
+  // 0x8000: MOV R1, #0
+  add_word(program, make_instruction(2, 1, 1, 0));
+  add_word(program, 0);
+  // 0x8004: MOV R0, #5 (immediate word at 0x8006 gets patched)
+  add_word(program, make_instruction(2, 1, 0, 0));
+  add_word(program, 5);
+  // 0x8008: ADD R1, #1
+  add_word(program, make_instruction(5, 1, 1, 0));
+  add_word(program, 1);
+  // 0x800C: CMP R1, #2
+  add_word(program, make_instruction(10, 1, 1, 0));
+  add_word(program, 2);
+  // 0x8010: JZ done (+12)
+  add_word(program, make_instruction(14, 5, 0, 0));
+  add_word(program, 12);
+  // 0x8014: MOV R2, #7
+  add_word(program, make_instruction(2, 1, 2, 0));
+  add_word(program, 7);
+  // 0x8018: STORE R2, [0x8006]
+  add_word(program, make_instruction(4, 2, 2, 0));
+  add_word(program, 0x8006);
+  // 0x801C: JMP 0x8004 (-28)
+  add_word(program, make_instruction(13, 5, 0, 0));
+  add_word(program, static_cast<uint16_t>(-28));
+  // 0x8020: done: HALT
+  add_word(program, make_instruction(1, 0, 0, 0));
+  return program;
+}
+
+void test_self_modifying_code() {
+  CPU cpu;
+  cpu.load_program(make_self_modifying_program(), 0x8000);
+  cpu.run();
+
+  test_assert(cpu.get_registers().get_gpr(0) == 7,
+              "Decode cache: Patched immediate observed after re-execution");
+}
+
+// Build a loop exercising ALU, memory, stack and call paths
+std::vector<uint8_t> make_engine_workload() {
+  std::vector<uint8_t> program;
+  // 0x8000: MOV R0, #0
+  add_word(program, make_instruction(2, 1, 0, 0));
+  add_word(program, 0);
+  // 0x8004: MOV R1, #50   (loop counter)
+  add_word(program, make_instruction(2, 1, 1, 0));
+  add_word(program, 50);
+  // 0x8008: MOV R3, #0x1000
+  add_word(program, make_instruction(2, 1, 3, 0));
+  add_word(program, 0x1000);
+  // 0x800C: loop: CALL body (+20 -> 0x8024)
+  add_word(program, make_instruction(19, 5, 0, 0));
+  add_word(program, 20);
+  // 0x8010: SUB R1, #1
+  add_word(program, make_instruction(6, 1, 1, 0));
+  add_word(program, 1);
+  // 0x8014: JNZ loop (-12)
+  add_word(program, make_instruction(15, 5, 0, 0));
+  add_word(program, static_cast<uint16_t>(-12));
+  // 0x8018: LOAD R2, [R3]
+  add_word(program, make_instruction(3, 3, 2, 3));
+  // 0x801A: XOR R2, #0x5A5A
+  add_word(program, make_instruction(9, 1, 2, 0));
+  add_word(program, 0x5A5A);
+  // 0x801E: SHR R2, #3
+  add_word(program, make_instruction(12, 1, 2, 0));
+  add_word(program, 3);
+  // 0x8022: HALT
+  add_word(program, make_instruction(1, 0, 0, 0));
+  // 0x8024: body: PUSH R1
+  add_word(program, make_instruction(21, 0, 1, 0));
+  // 0x8026: ADD R0, R1
+  add_word(program, make_instruction(5, 0, 0, 1));
+  // 0x8028: SHL R1, #9
+  add_word(program, make_instruction(11, 1, 1, 0));
+  add_word(program, 9);
+  // 0x802C: OR R0, R1
+  add_word(program, make_instruction(8, 0, 0, 1));
+  // 0x802E: STORE R0, [R3]
+  add_word(program, make_instruction(4, 3, 0, 3));
+  // 0x8030: CMP R0, #0x8000
+  add_word(program, make_instruction(10, 1, 0, 0));
+  add_word(program, 0x8000);
+  // 0x8034: POP R1
+  add_word(program, make_instruction(22, 0, 1, 0));
+  // 0x8036: RET
+  add_word(program, make_instruction(20, 0, 0, 0));
+  return program;
+}
+
+bool same_architectural_state(const CPU &a_cpu, const CPU &b_cpu) {
+  const Registers &a = a_cpu.get_registers();
+  const Registers &b = b_cpu.get_registers();
+  bool same = a.get_pc() == b.get_pc() && a.get_sp() == b.get_sp() &&
+              a.get_flags() == b.get_flags();
+  for (uint8_t i = 0; i < 4; ++i)
+    same = same && a.get_gpr(i) == b.get_gpr(i);
+  return same;
+}
+
+void test_fast_engine_matches_reference() {
+  std::vector<uint8_t> program = make_engine_workload();
+
+  CPU reference;
+  reference.load_program(program, 0x8000);
+  reference.run();
+
+  CPU fast;
+  fast.set_engine(CPU::Engine::Fast);
+  fast.load_program(program, 0x8000);
+  fast.run();
+
+  test_assert(reference.is_halted() && fast.is_halted(),
+              "Fast engine: Both engines halt");
+  test_assert(same_architectural_state(reference, fast),
+              "Fast engine: Architectural state matches reference");
+}
+
+// Fusable pairs (PUSH/PUSH, POP/POP, SUB+JNZ, CMP+JNZ), then the loop's
+// JNZ is patched into a JZ and the loop entered between SUB and branch
+std::vector<uint8_t> make_fusion_program() {
+  std::vector<uint8_t> program;
+  // 0x8000: MOV R0, #5
+  add_word(program, make_instruction(2, 1, 0, 0));
+  add_word(program, 5);
+  // 0x8004: MOV R1, #0
+  add_word(program, make_instruction(2, 1, 1, 0));
+  add_word(program, 0);
+  // 0x8008: loop: PUSH R0; PUSH R1; POP R1; POP R0
+  add_word(program, make_instruction(21, 0, 0, 0));
+  add_word(program, make_instruction(21, 0, 1, 0));
+  add_word(program, make_instruction(22, 0, 1, 0));
+  add_word(program, make_instruction(22, 0, 0, 0));
+  // 0x8010: ADD R1, R0
+  add_word(program, make_instruction(5, 0, 1, 0));
+  // 0x8012: SUB R0, #1
+  add_word(program, make_instruction(6, 1, 0, 0));
+  add_word(program, 1);
+  // 0x8016: JNZ loop
+  add_word(program, make_instruction(15, 2, 0, 0));
+  add_word(program, 0x8008);
+  // 0x801A: CMP R3, #0
+  add_word(program, make_instruction(10, 1, 3, 0));
+  add_word(program, 0);
+  // 0x801E: JNZ done (+16)
+  add_word(program, make_instruction(15, 5, 0, 0));
+  add_word(program, 16);
+  // 0x8022: MOV R3, <JZ direct>
+  add_word(program, make_instruction(2, 1, 3, 0));
+  add_word(program, make_instruction(14, 2, 0, 0));
+  // 0x8026: STORE R3, [0x8016]
+  add_word(program, make_instruction(4, 2, 3, 0));
+  add_word(program, 0x8016);
+  // 0x802A: MOV R0, #1
+  add_word(program, make_instruction(2, 1, 0, 0));
+  add_word(program, 1);
+  // 0x802E: JMP 0x8012
+  add_word(program, make_instruction(13, 2, 0, 0));
+  add_word(program, 0x8012);
+  // 0x8032: done: HALT
+  add_word(program, make_instruction(1, 0, 0, 0));
+  return program;
+}
+
+void test_fused_pairs() {
+  std::vector<uint8_t> program = make_fusion_program();
+
+  CPU reference;
+  reference.load_program(program, 0x8000);
+  reference.run();
+  test_assert(reference.is_halted() &&
+                  reference.get_registers().get_gpr(1) == 15 &&
+                  reference.get_registers().get_gpr(0) == 0xFFFF,
+              "Fused pairs: Reference runs the patched branch");
+
+  CPU fast;
+  fast.set_engine(CPU::Engine::Fast);
+  fast.load_program(program, 0x8000);
+  fast.run();
+  test_assert(fast.is_halted() && same_architectural_state(reference, fast) &&
+                  fast.get_cycle_count() == reference.get_cycle_count(),
+              "Fused pairs: Fast engine matches reference, patch included");
+
+  // Budgets ending between the two halves of a pair
+  CPU split;
+  split.set_engine(CPU::Engine::Fast);
+  split.load_program(program, 0x8000);
+  bool counted = true;
+  while (!split.is_halted() && counted)
+    counted = split.run_for(3) == 3 || split.is_halted();
+  test_assert(counted && split.is_halted() &&
+                  same_architectural_state(reference, split) &&
+                  split.get_cycle_count() == reference.get_cycle_count(),
+              "Fused pairs: Odd budgets split pairs without losing cycles");
+}
+
+void test_jit_engine_matches_reference() {
+  std::vector<uint8_t> program = make_engine_workload();
+
+  CPU reference;
+  reference.load_program(program, 0x8000);
+  reference.run();
+
+  CPU jit;
+  jit.set_engine(CPU::Engine::Jit);
+  jit.load_program(program, 0x8000);
+  jit.run();
+
+  test_assert(reference.is_halted() && jit.is_halted(),
+              "JIT engine: Both engines halt");
+  test_assert(same_architectural_state(reference, jit),
+              "JIT engine: Architectural state matches reference");
+
+  // Stores into compiled code must invalidate the affected block
+  CPU patched;
+  patched.set_engine(CPU::Engine::Jit);
+  patched.load_program(make_self_modifying_program(), 0x8000);
+  patched.run();
+  test_assert(patched.get_registers().get_gpr(0) == 7,
+              "JIT engine: Patched immediate observed after re-execution");
+}
+
+void test_traced_memory_writes() {
+  const char *path = "build/test_cpu_trace.json";
+  {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(path);
+    cpu.set_trace_recorder(tracer);
+
+    std::vector<uint8_t> program;
+    // MOV R0, #0x1234
+    add_word(program, make_instruction(2, 1, 0, 0));
+    add_word(program, 0x1234);
+    // STORE R0, [0x1000]
+    add_word(program, make_instruction(4, 2, 0, 0));
+    add_word(program, 0x1000);
+    // PUSH R0
+    add_word(program, make_instruction(21, 0, 0, 0));
+    // HALT
+    add_word(program, make_instruction(1, 0, 0, 0));
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  std::string trace = contents.str();
+  test_assert(trace.find("{ \"addr\": 4096, \"old\": 0, \"new\": 52 }") !=
+                  std::string::npos,
+              "Trace: STORE low byte recorded");
+  test_assert(trace.find("{ \"addr\": 4097, \"old\": 0, \"new\": 18 }") !=
+                  std::string::npos,
+              "Trace: STORE high byte recorded");
+  // Events are per cycle: the PUSH entry must not repeat the STORE writes
+  size_t push_entry = trace.find("\"pc\": \"0x8008\"");
+  test_assert(push_entry != std::string::npos &&
+                  trace.find("\"addr\": 4096", push_entry) == std::string::npos,
+              "Trace: Write events reset each cycle");
+}
+
+std::string read_file(const char *path) {
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+size_t count_cycles(const std::string &trace) {
+  size_t total = 0;
+  for (size_t pos = 0;
+       (pos = trace.find("\"cycle\":", pos)) != std::string::npos; ++pos)
+    ++total;
+  return total;
+}
+
+void test_binary_trace_export() {
+  const char *json_path = "build/test_cpu_trace_direct.json";
+  const char *binary_path = "build/test_cpu_trace.bin";
+  const char *export_path = "build/test_cpu_trace_export.json";
+  std::vector<uint8_t> program = make_engine_workload();
+
+  for (TraceRecorder::Format format :
+       {TraceRecorder::Format::Json, TraceRecorder::Format::Binary}) {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(format == TraceRecorder::Format::Json ? json_path
+                                                                  : binary_path);
+    tracer->set_format(format);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+
+  size_t cycles = trace_format::export_json(binary_path, export_path);
+  std::string direct = read_file(json_path);
+  test_assert(cycles > 0 && read_file(binary_path).size() < direct.size() / 4,
+              "Binary trace: Smaller than the JSON trace");
+  test_assert(read_file(export_path) == direct,
+              "Binary trace: Export matches direct JSON output");
+
+  bool rejected = false;
+  try {
+    trace_format::export_json(json_path, export_path);
+  } catch (const std::runtime_error &) {
+    rejected = true;
+  }
+  test_assert(rejected, "Binary trace: Export rejects non-binary input");
+}
+
+void test_trace_index() {
+  const char *path = "build/test_cpu_trace_keyframes.bin";
+  std::vector<uint8_t> program = make_engine_workload();
+  {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(path);
+    tracer->set_format(TraceRecorder::Format::Binary);
+    tracer->set_keyframe_interval(8);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+
+  // Reference: memory below MMIO after every step of an untraced run
+  std::vector<std::vector<uint8_t>> expected;
+  std::vector<uint16_t> expected_pc;
+  {
+    CPU cpu;
+    cpu.load_program(program, 0x8000);
+    while (!cpu.is_halted()) {
+      expected_pc.push_back(cpu.get_registers().get_pc());
+      cpu.step();
+      std::vector<uint8_t> memory(0xF000);
+      for (uint32_t addr = 0; addr < memory.size(); ++addr)
+        memory[addr] = cpu.get_memory().read_byte(static_cast<uint16_t>(addr));
+      expected.push_back(memory);
+    }
+  }
+
+  TraceIndex index(path);
+  test_assert(index.first_cycle() == 0 &&
+                  index.cycle_count() == expected.size() &&
+                  index.keyframe_count() == (expected.size() + 7) / 8,
+              "Trace index: One keyframe per interval over the whole trace");
+
+  // Forward, backward and jumping lookups all rebuild the same state
+  std::vector<uint64_t> order;
+  for (uint64_t c = 0; c < expected.size(); ++c)
+    order.push_back(c);
+  for (uint64_t c = expected.size(); c-- > 0;)
+    order.push_back(c);
+  for (uint64_t c = 0; c < expected.size(); c += 5)
+    order.push_back((c * 7) % expected.size());
+  bool states_ok = true;
+  for (uint64_t cycle : order) {
+    const TraceIndex::State &state = index.state_at(cycle);
+    states_ok = states_ok && state.entry.cycle == cycle &&
+                state.entry.pc == expected_pc[cycle] &&
+                std::equal(expected[cycle].begin(), expected[cycle].end(),
+                           state.memory.begin());
+  }
+  test_assert(states_ok, "Trace index: State at any cycle matches a replay");
+
+  std::vector<TraceEntry> range = index.records(10, 19, 5);
+  test_assert(range.size() == 5 && range.front().cycle == 10 &&
+                  range.back().cycle == 14 &&
+                  index.records(expected.size() - 2, expected.size() + 10, 100)
+                          .size() == 2,
+              "Trace index: Range reads are clamped and limited");
+
+  bool out_of_range = false;
+  try {
+    index.state_at(expected.size());
+  } catch (const std::runtime_error &) {
+    out_of_range = true;
+  }
+  bool unindexed = false;
+  try {
+    TraceIndex missing("build/test_cpu_trace.bin");
+  } catch (const std::runtime_error &) {
+    unindexed = true;
+  }
+  test_assert(out_of_range && unindexed,
+              "Trace index: Rejects cycles outside the trace and missing indexes");
+
+  TraceServer server(path, "trace_viewer");
+  TraceServer::Response info = server.handle("/api/info");
+  test_assert(info.status == 200 &&
+                  info.body.find("\"cycles\": " +
+                                 std::to_string(expected.size())) !=
+                      std::string::npos,
+              "Trace server: Info reports the cycle range");
+  TraceServer::Response cycles = server.handle("/api/cycles?from=2&to=4");
+  test_assert(cycles.status == 200 && count_cycles(cycles.body) == 3,
+              "Trace server: Cycles endpoint returns the requested range");
+  std::string last = std::to_string(expected.size() - 1);
+  TraceServer::Response state =
+      server.handle("/api/state?cycle=" + last + "&start=32760&length=8");
+  std::string bytes;
+  for (size_t i = 32760; i < 32768; ++i)
+    bytes += (bytes.empty() ? "" : ",") + std::to_string(expected.back()[i]);
+  test_assert(state.status == 200 &&
+                  state.body.find("\"cycle\": " + last + ",") !=
+                      std::string::npos &&
+                  state.body.find("\"bytes\": [" + bytes + "]") !=
+                      std::string::npos,
+              "Trace server: State endpoint returns registers and memory");
+  test_assert(server.handle("/api/state?cycle=" +
+                            std::to_string(expected.size()))
+                          .status == 404 &&
+                  server.handle("/api/state?cycle=x").status == 400 &&
+                  server.handle("/../Makefile").status == 400 &&
+                  server.handle("/index.html").content_type.find(
+                      "text/html") == 0,
+              "Trace server: Bad requests rejected, viewer files served");
+}
+
+void test_async_trace_writer() {
+  const char *sync_path = "build/test_cpu_trace_sync.json";
+  const char *async_path = "build/test_cpu_trace_async.json";
+  std::vector<uint8_t> program = make_engine_workload();
+
+  for (bool async : {false, true}) {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(async ? async_path : sync_path);
+    tracer->set_async(async);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+  test_assert(read_file(async_path) == read_file(sync_path),
+              "Async trace: Blocking queue drains everything on destruction");
+
+  // Tiny queue in drop mode: every cycle is either written or counted
+  const char *drop_path = "build/test_cpu_trace_drop.bin";
+  uint64_t dropped = 0;
+  {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(drop_path);
+    tracer->set_format(TraceRecorder::Format::Binary);
+    tracer->set_async(true, TraceRecorder::Backpressure::Drop, 2);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+    cpu.set_trace_recorder(nullptr);
+    dropped = tracer->dropped_cycles();
+  }
+  size_t total = count_cycles(read_file(sync_path));
+  size_t written =
+      trace_format::export_json(drop_path, "build/test_cpu_trace_drop.json");
+  test_assert(written + dropped == total,
+              "Async trace: Dropped cycles are counted");
+}
+
+void test_windowed_and_sampled_tracing() {
+  const char *json_path = "build/test_cpu_trace_window.json";
+  std::vector<uint8_t> program = make_engine_workload();
+  size_t total = count_cycles(read_file("build/test_cpu_trace_sync.json"));
+
+  {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(json_path);
+    tracer->set_window(5);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+  std::string window = read_file(json_path);
+  test_assert(count_cycles(window) == 5,
+              "Flight recorder: Keeps only the last N cycles");
+  size_t last = window.rfind("\"opcode\":");
+  test_assert(last != std::string::npos &&
+                  window.find("\"opcode\": 1,", last) == last,
+              "Flight recorder: Dump ends with the HALT cycle");
+
+  {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(json_path);
+    tracer->set_sampling(10);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+  }
+  test_assert(count_cycles(read_file(json_path)) == (total + 9) / 10,
+              "Sampling: Records one cycle in K");
+}
+
+// JMP to itself: never halts
+std::vector<uint8_t> make_spin_program() {
+  std::vector<uint8_t> program;
+  add_word(program, make_instruction(13, 5, 0, 0));
+  add_word(program, static_cast<uint16_t>(-4));
+  return program;
+}
+
+void test_cycle_budget() {
+  for (CPU::Engine engine :
+       {CPU::Engine::Reference, CPU::Engine::Fast, CPU::Engine::Jit}) {
+    CPU cpu;
+    cpu.set_engine(engine);
+    cpu.load_program(make_spin_program(), 0x8000);
+    cpu.run(250000);
+    test_assert(!cpu.is_halted() && cpu.get_cycle_count() == 250000,
+                "Cycle budget: run(max) retires exactly max instructions");
+    test_assert(cpu.run_for(7) == 7 && cpu.get_cycle_count() == 250007,
+                "Cycle budget: run_for(n) continues for n instructions");
+  }
+
+  // Counters are per instance and include the HALT instruction
+  CPU a;
+  CPU b;
+  a.load_program(make_engine_workload(), 0x8000);
+  b.load_program(make_engine_workload(), 0x8000);
+  a.run();
+  uint64_t cycles = a.get_cycle_count();
+  b.set_engine(CPU::Engine::Fast);
+  b.run(CPU::UNLIMITED_CYCLES);
+  test_assert(cycles > 0 && b.get_cycle_count() == cycles,
+              "Cycle counter: Independent per CPU and equal across engines");
+  test_assert(a.run_for(10) == 0,
+              "Cycle counter: run_for() retires nothing once halted");
+  a.reset();
+  test_assert(a.get_cycle_count() == 0, "Cycle counter: reset() clears it");
+}
+
+// Copies the input port to the output port until it reads 0
+std::vector<uint8_t> make_echo_program() {
+  std::vector<uint8_t> program;
+  // 0x8000: loop: IN R0, #1
+  add_word(program, make_instruction(23, 1, 0, 0));
+  add_word(program, 1);
+  // 0x8004: CMP R0, #0
+  add_word(program, make_instruction(10, 1, 0, 0));
+  add_word(program, 0);
+  // 0x8008: JZ done (+8)
+  add_word(program, make_instruction(14, 5, 0, 0));
+  add_word(program, 8);
+  // 0x800C: OUT R0, #0
+  add_word(program, make_instruction(24, 1, 0, 0));
+  add_word(program, 0);
+  // 0x8010: JMP loop (-20)
+  add_word(program, make_instruction(13, 5, 0, 0));
+  add_word(program, static_cast<uint16_t>(-20));
+  // 0x8014: done: HALT
+  add_word(program, make_instruction(1, 0, 0, 0));
+  return program;
+}
+
+void test_batch_runner() {
+  CPU single;
+  single.load_program(make_engine_workload(), 0x8000);
+  single.run();
+
+  std::vector<BatchJob> jobs;
+  for (int i = 0; i < 24; ++i) {
+    BatchJob job;
+    job.name = "job" + std::to_string(i);
+    if (i % 2 == 0) {
+      job.program = make_engine_workload();
+    } else {
+      job.program = make_echo_program();
+      job.input = "input-" + std::to_string(i);
+    }
+    jobs.push_back(job);
+  }
+  BatchJob spin;
+  spin.name = "spin";
+  spin.program = make_spin_program();
+  spin.max_cycles = 1234;
+  jobs.push_back(spin);
+
+  BatchSummary summary = BatchRunner(4).run(jobs);
+  bool ordered = summary.results.size() == jobs.size();
+  bool workload_ok = true, echo_ok = true;
+  for (size_t i = 0; ordered && i + 1 < jobs.size(); ++i) {
+    const BatchResult &r = summary.results[i];
+    ordered = ordered && r.name == jobs[i].name;
+    if (i % 2 == 0)
+      workload_ok = workload_ok && r.halted &&
+                    r.cycles == single.get_cycle_count() &&
+                    r.gpr[0] == single.get_registers().get_gpr(0);
+    else
+      echo_ok = echo_ok && r.halted && r.output == jobs[i].input;
+  }
+  test_assert(ordered, "Batch: Results follow job order");
+  test_assert(workload_ok, "Batch: Each job matches a standalone run");
+  test_assert(echo_ok, "Batch: Output captured per job from its own input");
+  const BatchResult &limited = summary.results.back();
+  test_assert(!limited.halted && limited.cycles == 1234,
+              "Batch: Per-job cycle budget honoured");
+
+  uint64_t total = 0;
+  for (const auto &r : summary.results)
+    total += r.cycles;
+  test_assert(summary.total_instructions == total &&
+                  BatchRunner::to_json(summary).find(
+                      "\"total_instructions\": " + std::to_string(total)) !=
+                      std::string::npos,
+              "Batch: Aggregate instruction count reported in JSON");
+}
+
+void test_shared_program_images() {
+  CPU single;
+  single.load_program(make_engine_workload(), 0x8000);
+  single.run();
+
+  const char *path = "/tmp/test_cpu_image.bin";
+  {
+    std::vector<uint8_t> bytes = make_engine_workload();
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(bytes.data()),
+              static_cast<std::streamsize>(bytes.size()));
+  }
+  auto image = ProgramImage::open(path, true);
+
+  bool engines_ok = true, reload_ok = true;
+  for (CPU::Engine engine :
+       {CPU::Engine::Reference, CPU::Engine::Fast, CPU::Engine::Jit}) {
+    CPU cpu;
+    cpu.set_engine(engine);
+    cpu.load_program(*image, 0x8000, true);
+    cpu.run();
+    engines_ok = engines_ok && cpu.is_halted() &&
+                 cpu.get_cycle_count() == single.get_cycle_count() &&
+                 cpu.get_registers().get_gpr(0) == single.get_registers().get_gpr(0);
+    // Reloading over decoded code must not replay the old instructions
+    cpu.reset();
+    cpu.load_program(make_spin_program());
+    cpu.run(100);
+    reload_ok = reload_ok && !cpu.is_halted() && cpu.get_cycle_count() == 100;
+  }
+  test_assert(engines_ok, "Image: Shared pages run identically on every engine");
+  test_assert(reload_ok, "Image: Loading a program drops stale decoded code");
+
+  std::vector<BatchJob> jobs(16);
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    jobs[i].name = "shared" + std::to_string(i);
+    jobs[i].image = image;
+  }
+  BatchRunner runner(4, CPU::Engine::Fast);
+  runner.set_share_program_pages(true);
+  BatchSummary summary = runner.run(jobs);
+  bool batch_ok = summary.results.size() == jobs.size();
+  for (const BatchResult &r : summary.results)
+    batch_ok = batch_ok && r.halted && r.cycles == single.get_cycle_count() &&
+               r.gpr[0] == single.get_registers().get_gpr(0);
+  test_assert(batch_ok, "Image: Batch jobs share one mapped image");
+  std::remove(path);
+}
+
+void test_snapshot_and_fork() {
+  CPU cpu;
+  cpu.load_program(make_engine_workload(), 0x8000);
+  CPU::Snapshot loaded = cpu.snapshot();
+  cpu.run();
+  uint16_t result = cpu.get_registers().get_gpr(0);
+  uint64_t cycles = cpu.get_cycle_count();
+
+  cpu.restore(loaded);
+  test_assert(!cpu.is_halted() && cpu.get_cycle_count() == 0 &&
+                  cpu.get_registers().get_pc() == 0x8000,
+              "Snapshot: Restore rewinds registers and counters");
+  cpu.run();
+  test_assert(cpu.get_registers().get_gpr(0) == result &&
+                  cpu.get_cycle_count() == cycles,
+              "Snapshot: Re-run after restore repeats the result");
+
+  cpu.restore(loaded);
+  std::unique_ptr<CPU> child = cpu.fork();
+  child->run();
+  test_assert(child->is_halted() && child->get_registers().get_gpr(0) == result &&
+                  !cpu.is_halted() && cpu.get_registers().get_pc() == 0x8000,
+              "Fork: Child runs independently of the parent");
+
+  // Restoring code pages must drop stale decoded and compiled code
+  CPU jit;
+  jit.set_engine(CPU::Engine::Jit);
+  jit.load_program(make_self_modifying_program(), 0x8000);
+  CPU::Snapshot fresh = jit.snapshot();
+  jit.run();
+  jit.restore(fresh);
+  jit.run();
+  test_assert(jit.get_registers().get_gpr(0) == 7 &&
+                  jit.get_memory().page_attributes(0x8006) ==
+                      Memory::PAGE_PROGRAM,
+              "Snapshot: Restored code is re-decoded after restore");
+}
+
+void test_profiler() {
+  // main: CALL f; CALL f; HALT    f: ADD R0, #1; RET
+  std::vector<uint8_t> program;
+  add_word(program, make_instruction(19, 2, 0, 0)); // 0x8000 CALL 0x800C
+  add_word(program, 0x800C);
+  add_word(program, make_instruction(19, 2, 0, 0)); // 0x8004 CALL 0x800C
+  add_word(program, 0x800C);
+  add_word(program, make_instruction(1, 0, 0, 0));  // 0x8008 HALT
+  add_word(program, make_instruction(0, 0, 0, 0));  // 0x800A NOP
+  add_word(program, make_instruction(5, 1, 0, 0));  // 0x800C ADD R0, #1
+  add_word(program, 1);
+  add_word(program, make_instruction(20, 0, 0, 0)); // 0x8010 RET
+
+  CPU cpu;
+  cpu.set_engine(CPU::Engine::Jit); // Profiling keeps the reference core
+  auto profiler = std::make_shared<Profiler>();
+  cpu.set_profiler(profiler);
+  cpu.load_program(program, 0x8000);
+  cpu.run();
+
+  test_assert(cpu.get_registers().get_gpr(0) == 2 &&
+                  profiler->total_instructions() == cpu.get_cycle_count() &&
+                  cpu.get_cycle_count() == 7,
+              "Profiler: Counts every retired instruction");
+  test_assert(profiler->count(0x800C) == 2 && profiler->count(0x8008) == 1 &&
+                  profiler->count(0x800A) == 0,
+              "Profiler: Per-PC execution counts");
+
+  std::vector<Profiler::Edge> edges = profiler->call_edges();
+  test_assert(edges.size() == 1 && edges[0].caller == 0x8000 &&
+                  edges[0].callee == 0x800C && edges[0].calls == 2,
+              "Profiler: Call edge from CALL/RET");
+
+  std::vector<Profiler::FunctionStats> functions = profiler->functions();
+  test_assert(functions.size() == 2 && functions[0].entry == 0x8000 &&
+                  functions[0].inclusive == 7 && functions[0].self == 3 &&
+                  functions[1].self == 4 && functions[1].calls == 2,
+              "Profiler: Self and inclusive function totals");
+
+  std::string folded = profiler->collapsed_stacks([](uint16_t entry) {
+    return entry == 0x8000 ? std::string("main") : std::string("f");
+  });
+  test_assert(folded == "main 3\nmain;f 4\n",
+              "Profiler: Collapsed-stack output");
+}
+
+void test_perf_counters() {
+  std::vector<uint8_t> program;
+  add_word(program, make_instruction(2, 1, 1, 0));  // MOV R1, #0x0100
+  add_word(program, 0x0100);
+  add_word(program, make_instruction(4, 3, 0, 1));  // STORE R0, [R1]
+  add_word(program, make_instruction(3, 3, 2, 1));  // LOAD R2, [R1]
+  add_word(program, make_instruction(21, 0, 0, 0)); // PUSH R0
+  add_word(program, make_instruction(22, 0, 3, 0)); // POP R3
+  add_word(program, make_instruction(10, 1, 0, 0)); // CMP R0, #0
+  add_word(program, 0);
+  add_word(program, make_instruction(14, 5, 0, 0)); // JZ +0 (taken)
+  add_word(program, 0);
+  add_word(program, make_instruction(15, 5, 0, 0)); // JNZ +0 (not taken)
+  add_word(program, 0);
+  add_word(program, make_instruction(24, 1, 0, 0)); // OUT R0, #0
+  add_word(program, 0);
+  add_word(program, make_instruction(1, 0, 0, 0));  // HALT
+
+  CPU cpu;
+  test_assert(cpu.get_perf_counters() == nullptr,
+              "Perf counters: Disabled by default");
+  cpu.set_engine(CPU::Engine::Fast); // Counting keeps the reference core
+  cpu.set_perf_counters_enabled(true);
+  cpu.set_output_callback([](uint8_t) {});
+  cpu.load_program(program, 0x8000);
+  cpu.run();
+
+  const PerfCounters &c = *cpu.get_perf_counters();
+  test_assert(c.instructions() == 10 && c.instructions() == cpu.get_cycle_count() &&
+                  c.by_opcode[4] == 1 && c.by_opcode[24] == 1 &&
+                  c.by_mode[5] == 2 && c.by_mode[3] == 2,
+              "Perf counters: Retired instructions by opcode and mode");
+  test_assert(c.branches_taken[14] == 1 && c.branches_not_taken[14] == 0 &&
+                  c.branches_taken[15] == 0 && c.branches_not_taken[15] == 1,
+              "Perf counters: Taken and not-taken branches per Jcc");
+  test_assert(c.reads[PerfCounters::RAM] == 2 &&
+                  c.writes[PerfCounters::RAM] == 2 &&
+                  c.reads[PerfCounters::PROGRAM] == 15 &&
+                  c.writes[PerfCounters::IO] == 1 && c.mmio_writes[0] == 1,
+              "Perf counters: Memory accesses by region and MMIO port");
+  test_assert(c.stack_high_water == 2,
+              "Perf counters: Stack high-water mark");
+
+  cpu.reset();
+  test_assert(cpu.get_perf_counters()->instructions() == 0,
+              "Perf counters: Cleared by reset()");
+}
+
+// Starts (or leaves stopped) the timer, then spins on
+//   wait: LOAD R3, [R0]; CMP R3, #limit; JC wait
+std::vector<uint8_t> make_timer_spin_program(bool start_timer, uint16_t limit) {
+  std::vector<uint8_t> program;
+  add_word(program, make_instruction(2, 1, 0, 0)); // MOV R0, #0xF010
+  add_word(program, 0xF010);
+  add_word(program, make_instruction(2, 1, 1, 0)); // MOV R1, #0xF011
+  add_word(program, 0xF011);
+  add_word(program, make_instruction(2, 1, 2, 0)); // MOV R2, #start
+  add_word(program, start_timer ? 1 : 0);
+  add_word(program, make_instruction(4, 3, 2, 1)); // STORE R2, [R1]
+  add_word(program, make_instruction(3, 3, 3, 0)); // 0x800E LOAD R3, [R0]
+  add_word(program, make_instruction(10, 1, 3, 0)); // CMP R3, #limit
+  add_word(program, limit);
+  add_word(program, make_instruction(16, 5, 0, 0)); // JC wait
+  add_word(program, static_cast<uint16_t>(-10));
+  add_word(program, make_instruction(1, 0, 0, 0)); // HALT
+  return program;
+}
+
+void test_timer_spin_fast_forward() {
+  const CPU::Engine engines[] = {CPU::Engine::Fast, CPU::Engine::Jit};
+  // Exit through the loop, and budgets that stop part-way through it
+  const uint64_t budgets[] = {CPU::UNLIMITED_CYCLES, 1000, 1001, 1002};
+  bool all_match = true;
+  for (uint64_t budget : budgets) {
+    CPU reference;
+    reference.load_program(make_timer_spin_program(true, 40000), 0x8000);
+    reference.run(budget);
+    for (CPU::Engine engine : engines) {
+      CPU cpu;
+      cpu.set_engine(engine);
+      cpu.load_program(make_timer_spin_program(true, 40000), 0x8000);
+      cpu.run(budget);
+      all_match = all_match && same_architectural_state(reference, cpu) &&
+                  cpu.get_cycle_count() == reference.get_cycle_count() &&
+                  cpu.is_halted() == reference.is_halted() &&
+                  cpu.get_memory().get_timer_counter() ==
+                      reference.get_memory().get_timer_counter();
+    }
+  }
+  test_assert(all_match,
+              "Spin fast-forward: Timer, registers and cycles match reference");
+
+  // A stopped timer never satisfies the exit test: the whole budget is
+  // skipped instead of spinning through a billion instructions
+  CPU idle;
+  idle.set_engine(CPU::Engine::Fast);
+  idle.load_program(make_timer_spin_program(false, 1), 0x8000);
+  idle.run(1000000000);
+  test_assert(!idle.is_halted() && idle.get_cycle_count() == 1000000000 &&
+                  idle.get_registers().get_pc() == 0x800E,
+              "Spin fast-forward: Endless spin skips to the cycle budget");
+}
+
+// Posts an event every `period` cycles once started by a write; each event
+// stores the running event count to RAM at 0x0100
+class TickingDevice : public Device {
+public:
+  TickingDevice(Memory &memory, uint64_t period)
+      : memory_(memory), period_(period) {}
+  uint8_t read(uint16_t) override { return 0; }
+  void write(uint16_t, uint8_t) override {
+    memory_.scheduler().schedule(this, memory_.scheduler().now() + period_);
+  }
+  void on_event(uint64_t cycle) override {
+    memory_.write_word(0x0100, static_cast<uint16_t>(++events_));
+    memory_.scheduler().schedule(this, cycle + period_);
+  }
+
+private:
+  Memory &memory_;
+  uint64_t period_;
+  uint64_t events_ = 0;
+};
+
+void test_device_events_across_engines() {
+  // JIT-compilable loop that samples the device's RAM word every iteration
+  std::vector<uint8_t> program;
+  add_word(program, make_instruction(2, 1, 1, 0)); // MOV R1, #0xF030
+  add_word(program, 0xF030);
+  add_word(program, make_instruction(2, 1, 0, 0)); // MOV R0, #1
+  add_word(program, 1);
+  add_word(program, make_instruction(4, 3, 0, 1)); // STORE R0, [R1]
+  add_word(program, make_instruction(2, 1, 1, 0)); // MOV R1, #0x0100
+  add_word(program, 0x0100);
+  add_word(program, make_instruction(2, 1, 0, 0)); // MOV R0, #200
+  add_word(program, 200);
+  add_word(program, make_instruction(5, 1, 2, 0)); // loop: ADD R2, #3
+  add_word(program, 3);
+  add_word(program, make_instruction(9, 1, 2, 0)); // XOR R2, #0x55
+  add_word(program, 0x55);
+  add_word(program, make_instruction(5, 0, 2, 2)); // ADD R2, R2
+  add_word(program, make_instruction(3, 3, 3, 1)); // LOAD R3, [R1]
+  add_word(program, make_instruction(5, 0, 2, 3)); // ADD R2, R3
+  add_word(program, make_instruction(6, 1, 0, 0)); // SUB R0, #1
+  add_word(program, 1);
+  add_word(program, make_instruction(15, 5, 0, 0)); // JNZ loop
+  add_word(program, static_cast<uint16_t>(-22));
+  add_word(program, make_instruction(1, 0, 0, 0)); // HALT
+
+  CPU reference;
+  TickingDevice reference_device(reference.get_memory(), 5);
+  reference.attach_device(&reference_device, 0xF030, 0xF030);
+  reference.load_program(program, 0x8000);
+  reference.run();
+
+  bool all_match = reference.is_halted();
+  for (CPU::Engine engine : {CPU::Engine::Fast, CPU::Engine::Jit}) {
+    CPU cpu;
+    TickingDevice device(cpu.get_memory(), 5);
+    cpu.attach_device(&device, 0xF030, 0xF030);
+    cpu.set_engine(engine);
+    cpu.load_program(program, 0x8000);
+    cpu.run();
+    all_match = all_match && same_architectural_state(reference, cpu) &&
+                cpu.get_cycle_count() == reference.get_cycle_count();
+  }
+  test_assert(all_match,
+              "Devices: Events land on the same instruction in every engine");
+}
+
+// DMA-copies the MOV at 0x8032 over the one at 0x802C, waits for the
+// engine, then runs the patched instruction (R1 = 2 instead of 1)
+std::vector<uint8_t> make_dma_patch_program() {
+  std::vector<uint8_t> program;
+  auto emit = [&](uint16_t word, int extra = -1) {
+    add_word(program, word);
+    if (extra >= 0)
+      add_word(program, static_cast<uint16_t>(extra));
+  };
+  emit(make_instruction(2, 1, 0, 0), 0x8032); // MOV R0, #template
+  emit(make_instruction(2, 1, 1, 0), 0x802C); // MOV R1, #patch
+  emit(make_instruction(2, 1, 2, 0), 4);      // MOV R2, #4
+  emit(make_instruction(4, 2, 0, 0), 0xF020); // STORE R0, [#SRC]
+  emit(make_instruction(4, 2, 1, 0), 0xF022); // STORE R1, [#DST]
+  emit(make_instruction(4, 2, 2, 0), 0xF024); // STORE R2, [#LEN]
+  emit(make_instruction(2, 1, 3, 0), 1);      // MOV R3, #COPY
+  emit(make_instruction(4, 2, 3, 0), 0xF026); // STORE R3, [#CONTROL]
+  emit(make_instruction(3, 2, 3, 0), 0xF026); // 0x8020 LOAD R3, [#STATUS]
+  emit(make_instruction(7, 1, 3, 0), 1);      // AND R3, #BUSY
+  emit(make_instruction(15, 5, 0, 0), static_cast<uint16_t>(-12)); // JNZ
+  emit(make_instruction(2, 1, 1, 0), 1);      // 0x802C MOV R1, #1
+  emit(make_instruction(1, 0, 0, 0));         // HALT
+  emit(make_instruction(2, 1, 1, 0), 2);      // 0x8032 MOV R1, #2
+  return program;
+}
+
+void test_dma_across_engines() {
+  bool all_match = true;
+  for (uint32_t cost : {0u, 5u}) {
+    CPU reference;
+    reference.get_memory().dma().set_cycles_per_word(cost);
+    reference.load_program(make_dma_patch_program(), 0x8000);
+    reference.run();
+    all_match = all_match && reference.is_halted() &&
+                reference.get_registers().get_gpr(1) == 2;
+    for (CPU::Engine engine : {CPU::Engine::Fast, CPU::Engine::Jit}) {
+      CPU cpu;
+      cpu.set_engine(engine);
+      cpu.get_memory().dma().set_cycles_per_word(cost);
+      cpu.load_program(make_dma_patch_program(), 0x8000);
+      cpu.run();
+      all_match = all_match && same_architectural_state(reference, cpu) &&
+                  cpu.get_cycle_count() == reference.get_cycle_count();
+    }
+  }
+  test_assert(all_match,
+              "DMA: Copy over live code matches reference in every engine");
+}
+
+// DMA-fills 200 bytes at 0x2000 with 0xAB in one cycle, then halts
+std::vector<uint8_t> make_dma_fill_program() {
+  std::vector<uint8_t> program;
+  auto emit = [&](uint16_t word, int extra = -1) {
+    add_word(program, word);
+    if (extra >= 0)
+      add_word(program, static_cast<uint16_t>(extra));
+  };
+  emit(make_instruction(2, 1, 0, 0), 0x2000); // MOV R0, #0x2000
+  emit(make_instruction(4, 2, 0, 0), 0xF022); // STORE R0, [#DST]
+  emit(make_instruction(2, 1, 0, 0), 200);    // MOV R0, #200
+  emit(make_instruction(4, 2, 0, 0), 0xF024); // STORE R0, [#LEN]
+  emit(make_instruction(2, 1, 0, 0), 0xAB);   // MOV R0, #0xAB
+  emit(make_instruction(4, 2, 0, 0), 0xF028); // STORE R0, [#FILL]
+  emit(make_instruction(2, 1, 0, 0), 2);      // MOV R0, #FILL
+  emit(make_instruction(4, 2, 0, 0), 0xF026); // STORE R0, [#CONTROL]
+  emit(make_instruction(1, 0, 0, 0));         // HALT
+  return program;
+}
+
+void test_traced_dma_burst() {
+  const char *json_path = "build/test_cpu_trace_dma.json";
+  const char *binary_path = "build/test_cpu_trace_dma.bin";
+  const char *export_path = "build/test_cpu_trace_dma_export.json";
+  for (TraceRecorder::Format format :
+       {TraceRecorder::Format::Json, TraceRecorder::Format::Binary}) {
+    CPU cpu;
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(format == TraceRecorder::Format::Json ? json_path
+                                                                  : binary_path);
+    tracer->set_format(format);
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(make_dma_fill_program(), 0x8000);
+    cpu.run();
+  }
+  trace_format::export_json(binary_path, export_path);
+
+  bool all_kept = true;
+  for (const char *path : {json_path, export_path}) {
+    std::string trace = read_file(path);
+    size_t fills = 0;
+    for (size_t pos = 0;
+         (pos = trace.find("\"old\": 0, \"new\": 171 }", pos)) !=
+         std::string::npos;
+         ++pos)
+      ++fills;
+    all_kept = all_kept && fills == 200 &&
+               trace.find("{ \"addr\": 8192, \"old\": 0, \"new\": 171 }") !=
+                   std::string::npos &&
+               trace.find("{ \"addr\": 8391, \"old\": 0, \"new\": 171 }") !=
+                   std::string::npos;
+  }
+  test_assert(all_kept,
+              "Trace: DMA burst past the inline capacity keeps every write");
+
+  std::ifstream in(binary_path, std::ios::binary);
+  trace_format::read_header(in, binary_path);
+  TraceEntry entry;
+  uint32_t largest = 0;
+  while (trace_format::read_record(in, entry))
+    largest = std::max(largest, entry.stored_mem_events());
+  test_assert(largest >= 200, "Trace: Binary records carry oversized cycles");
+}
+
+void test_trace_index_after_dma_burst() {
+  const char *path = "build/test_cpu_trace_dma_keyframes.bin";
+  CPU cpu;
+  {
+    auto tracer = std::make_shared<TraceRecorder>();
+    tracer->set_output_path(path);
+    tracer->set_format(TraceRecorder::Format::Binary);
+    tracer->set_keyframe_interval(1000); // Replay from the first keyframe
+    cpu.set_trace_recorder(tracer);
+    cpu.load_program(make_dma_fill_program(), 0x8000);
+    cpu.run();
+    cpu.set_trace_recorder(nullptr);
+  }
+
+  TraceIndex index(path);
+  const TraceIndex::State &state = index.state_at(index.last_cycle());
+  bool filled = true;
+  for (uint16_t addr = 0x2000; addr < 0x2000 + 200; ++addr)
+    filled = filled && state.memory[addr] == 0xAB &&
+             cpu.get_memory().read_byte(addr) == 0xAB;
+  test_assert(index.keyframe_count() == 1 && filled &&
+                  state.memory[0x2000 + 200] == 0,
+              "Trace index: Replay keeps every write of a DMA burst");
+}
+
+// Sums 1..n for an input byte n, one CALL per step that also spills to
+// memory, then writes the sum to port 0 or, when bit 4 of it is set, to
+// port 0x10 (the timer), which the lockstep engine does not model
+std::vector<uint8_t> make_sweep_program() {
+  std::vector<uint8_t> program;
+  auto emit = [&](uint16_t word) { add_word(program, word); };
+  emit(make_instruction(23, 1, 0, 0)); // 0x8000 IN R0, #1
+  emit(1);
+  emit(make_instruction(2, 1, 1, 0)); // 0x8004 MOV R1, #0
+  emit(0);
+  emit(make_instruction(10, 1, 0, 0)); // 0x8008 loop: CMP R0, #0
+  emit(0);
+  emit(make_instruction(14, 5, 0, 0)); // 0x800C JZ done (+12)
+  emit(12);
+  emit(make_instruction(19, 2, 0, 0)); // 0x8010 CALL accumulate
+  emit(0x8034);
+  emit(make_instruction(6, 1, 0, 0)); // 0x8014 SUB R0, #1
+  emit(1);
+  emit(make_instruction(13, 5, 0, 0)); // 0x8018 JMP loop (-20)
+  emit(static_cast<uint16_t>(-20));
+  emit(make_instruction(2, 0, 2, 1)); // 0x801C done: MOV R2, R1
+  emit(make_instruction(7, 1, 2, 0)); // 0x801E AND R2, #0x10
+  emit(0x10);
+  emit(make_instruction(24, 0, 1, 2)); // 0x8022 OUT R1, R2
+  emit(make_instruction(4, 2, 1, 0));  // 0x8024 STORE R1, [0x1000]
+  emit(0x1000);
+  emit(make_instruction(3, 2, 2, 0)); // 0x8028 LOAD R2, [0x1000]
+  emit(0x1000);
+  emit(make_instruction(1, 0, 0, 0)); // 0x802C HALT
+  emit(0);                            // 0x802E padding
+  emit(0);
+  emit(0);
+  emit(make_instruction(21, 0, 0, 0)); // 0x8034 accumulate: PUSH R0
+  emit(make_instruction(5, 0, 1, 0));  // 0x8036 ADD R1, R0
+  emit(make_instruction(2, 0, 3, 0));  // 0x8038 MOV R3, R0
+  emit(make_instruction(11, 1, 3, 0)); // 0x803A SHL R3, #1
+  emit(1);
+  emit(make_instruction(4, 4, 3, 3)); // 0x803E STORE R3, [R3 + 0x2000]
+  emit(0x2000);
+  emit(make_instruction(22, 0, 2, 0)); // 0x8042 POP R2
+  emit(make_instruction(20, 0, 0, 0)); // 0x8044 RET
+  return program;
+}
+
+bool same_results(const std::vector<BatchResult> &a,
+                  const std::vector<BatchResult> &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    bool same = a[i].name == b[i].name && a[i].halted == b[i].halted &&
+                a[i].error == b[i].error && a[i].cycles == b[i].cycles &&
+                a[i].output == b[i].output;
+    for (int r = 0; r < 4; ++r)
+      same = same && a[i].gpr[r] == b[i].gpr[r];
+    if (!same)
+      return false;
+  }
+  return true;
+}
+
+void test_lockstep_engine() {
+  std::vector<BatchJob> jobs;
+  for (int n = 0; n < 40; ++n) {
+    BatchJob job;
+    job.name = "sweep" + std::to_string(n);
+    job.program = make_sweep_program();
+    job.input = std::string(1, static_cast<char>(n));
+    jobs.push_back(job);
+  }
+  jobs[30].max_cycles = 50; // Stops inside the loop
+  std::vector<const BatchJob *> lanes;
+  for (const auto &job : jobs)
+    lanes.push_back(&job);
+
+  std::vector<BatchResult> expected = BatchRunner(1).run(jobs).results;
+  LockstepEngine engine;
+  std::vector<BatchResult> results = engine.run(lanes);
+  test_assert(same_results(results, expected),
+              "Lockstep: Divergent sweep matches one CPU per job");
+  const LockstepEngine::Stats &stats = engine.stats();
+  test_assert(stats.splits > 0 && stats.dispatches * 4 < stats.instructions,
+              "Lockstep: Lanes share dispatches across divergent loops");
+  test_assert(stats.handovers > 0 && stats.handovers < jobs.size() &&
+                  !results[30].halted && results[30].cycles == 50,
+              "Lockstep: Unmodelled IO handed over, cycle limits honoured");
+
+  std::vector<BatchJob> echoes;
+  for (const char *input : {"", "a", "lockstep", "lock", "lockstep lanes"}) {
+    BatchJob job;
+    job.name = input;
+    job.program = make_echo_program();
+    job.input = input;
+    echoes.push_back(job);
+  }
+  lanes.clear();
+  for (const auto &job : echoes)
+    lanes.push_back(&job);
+  test_assert(same_results(LockstepEngine(CPU::Engine::Fast).run(lanes),
+                           BatchRunner(1).run(echoes).results),
+              "Lockstep: Console input and output per lane");
+
+  // Invalid opcode 31: every lane goes to the scalar CPU, which reports it
+  BatchJob invalid;
+  invalid.name = "invalid";
+  add_word(invalid.program, make_instruction(31, 0, 0, 0));
+  std::vector<BatchResult> faulted = LockstepEngine().run({&invalid, &invalid});
+  test_assert(faulted.size() == 2 && !faulted[0].error.empty() &&
+                  same_results(faulted, BatchRunner(1)
+                                            .run({invalid, invalid})
+                                            .results),
+              "Lockstep: Invalid instructions fault as on one CPU");
+
+  bool rejected = false;
+  try {
+    LockstepEngine().run({&jobs[0], &echoes[0]});
+  } catch (const std::runtime_error &) {
+    rejected = true;
+  }
+  test_assert(rejected, "Lockstep: Jobs with different programs rejected");
+
+  // BatchRunner groups jobs by program and batches each group
+  std::vector<BatchJob> mixed = jobs;
+  mixed.insert(mixed.begin() + 7, echoes.begin(), echoes.end());
+  BatchJob spin;
+  spin.name = "spin";
+  spin.program = make_spin_program();
+  spin.max_cycles = 1234;
+  mixed.push_back(spin);
+  BatchRunner runner(3);
+  runner.set_lockstep_lanes(16);
+  BatchSummary summary = runner.run(mixed);
+  test_assert(same_results(summary.results, BatchRunner(2).run(mixed).results),
+              "Lockstep: BatchRunner batches match one CPU per job");
+}
+
+void test_replay_debugger() {
+  const std::string input = "time travel";
+  std::vector<uint8_t> program = make_echo_program();
+
+  // Reference states, one per cycle, from a plain forward run
+  std::vector<Registers> expected;
+  {
+    CPU cpu;
+    cpu.get_memory().console().set_input(input);
+    cpu.set_output_callback([](uint8_t) {});
+    cpu.load_program(program, 0x8000);
+    do
+      expected.push_back(cpu.get_registers());
+    while (cpu.step());
+    expected.push_back(cpu.get_registers()); // After HALT
+  }
+  uint64_t halt_cycle = expected.size() - 1;
+  auto matches = [&](const CPU &cpu) {
+    const Registers &want = expected[cpu.get_cycle_count()];
+    const Registers &got = cpu.get_registers();
+    bool same = got.get_pc() == want.get_pc() && got.get_sp() == want.get_sp() &&
+                got.get_flags() == want.get_flags();
+    for (int i = 0; i < 4; ++i)
+      same = same && got.get_gpr(i) == want.get_gpr(i);
+    return same;
+  };
+
+  CPU cpu;
+  cpu.set_engine(CPU::Engine::Fast);
+  cpu.get_memory().console().set_input(input);
+  std::string output;
+  cpu.set_output_callback([&](uint8_t c) { output += static_cast<char>(c); });
+  cpu.load_program(program, 0x8000);
+  ReplayDebugger debugger(cpu, 8);
+  debugger.continue_forward();
+  test_assert(cpu.is_halted() && debugger.cycle() == halt_cycle &&
+                  debugger.checkpoint_count() > 2,
+              "Replay: Forward run takes periodic checkpoints");
+
+  bool states_ok = true;
+  for (uint64_t target : {uint64_t(5), uint64_t(40), uint64_t(1), halt_cycle,
+                          uint64_t(17), uint64_t(0), halt_cycle - 3})
+    states_ok = states_ok && debugger.goto_cycle(target) &&
+                debugger.cycle() == target && matches(cpu);
+  for (int i = 0; i < 10; ++i)
+    states_ok = states_ok && debugger.reverse_step() && matches(cpu);
+  test_assert(states_ok, "Replay: goto-cycle and reverse-step match a plain run");
+  test_assert(output == input,
+              "Replay: Console input replayed, output written once");
+
+  // OUT R0 at 0x800C: the last echo is the last time it is reached
+  uint64_t last_out = 0;
+  for (uint64_t c = 0; c < expected.size(); ++c)
+    if (expected[c].get_pc() == 0x800C)
+      last_out = c;
+  debugger.goto_cycle(halt_cycle);
+  debugger.add_breakpoint(0x800C);
+  bool hit = debugger.reverse_continue();
+  bool back_twice = debugger.reverse_continue() &&
+                    cpu.get_registers().get_pc() == 0x800C;
+  test_assert(hit && back_twice && debugger.cycle() < last_out &&
+                  debugger.continue_forward() &&
+                  debugger.cycle() == last_out,
+              "Replay: reverse-continue stops at earlier breakpoint hits");
+  debugger.remove_breakpoint(0x800C);
+  test_assert(!debugger.reverse_continue() && debugger.cycle() == 0,
+              "Replay: reverse-continue without breakpoints rewinds fully");
+
+  // A budget too small for any checkpoint keeps the count bounded by
+  // thinning them out; states stay exact
+  CPU small;
+  small.get_memory().console().set_input(input);
+  small.set_output_callback([](uint8_t) {});
+  small.load_program(program, 0x8000);
+  ReplayDebugger thin(small, 2, 1);
+  thin.continue_forward();
+  test_assert(thin.checkpoint_count() <= 2 && thin.checkpoint_interval() > 2 &&
+                  thin.goto_cycle(halt_cycle / 2) && matches(small),
+              "Replay: Memory budget thins checkpoints");
+}
+
+void test_breakpoints_and_watchpoints() {
+  std::vector<uint8_t> program = make_engine_workload();
+  CPU plain;
+  plain.load_program(program, 0x8000);
+  std::vector<uint64_t> branch_cycles; // PC at 0x8014, the JNZ fused to SUB
+  std::vector<uint64_t> store_cycles;  // After each STORE at 0x802E
+  while (!plain.is_halted()) {
+    uint16_t pc = plain.get_registers().get_pc();
+    if (pc == 0x8014)
+      branch_cycles.push_back(plain.get_cycle_count());
+    plain.step();
+    if (pc == 0x802E)
+      store_cycles.push_back(plain.get_cycle_count());
+  }
+
+  // Stops at every hit; resuming continues past the breakpoint
+  auto collect = [](CPU &cpu, CPU::StopReason reason, uint16_t address) {
+    std::vector<uint64_t> cycles;
+    while (!cpu.is_halted()) {
+      cpu.run(CPU::UNLIMITED_CYCLES);
+      const CPU::StopInfo &stop = cpu.get_stop();
+      if (stop.reason == CPU::StopReason::None)
+        break;
+      if (stop.reason != reason || stop.address != address)
+        return std::vector<uint64_t>();
+      cycles.push_back(cpu.get_cycle_count());
+    }
+    return cycles;
+  };
+
+  bool breaks_ok = true, watches_ok = true, conditions_ok = true;
+  for (CPU::Engine engine :
+       {CPU::Engine::Reference, CPU::Engine::Fast, CPU::Engine::Jit}) {
+    CPU cpu;
+    cpu.set_engine(engine);
+    cpu.load_program(program, 0x8000);
+    cpu.run_for(30); // Decoded and fused before the breakpoint is set
+    cpu.add_breakpoint(0x8014);
+    std::vector<uint64_t> hits =
+        collect(cpu, CPU::StopReason::Breakpoint, 0x8014);
+    std::vector<uint64_t> expected;
+    for (uint64_t c : branch_cycles)
+      if (c > 30)
+        expected.push_back(c);
+    breaks_ok = breaks_ok && hits == expected &&
+                same_architectural_state(plain, cpu) &&
+                cpu.get_cycle_count() == plain.get_cycle_count();
+
+    CPU watched;
+    watched.set_engine(engine);
+    watched.load_program(program, 0x8000);
+    watched.add_watchpoint(0x1001, 0x1001, Memory::WATCH_WRITE);
+    hits = collect(watched, CPU::StopReason::Watchpoint, 0x1001);
+    watches_ok = watches_ok && hits == store_cycles &&
+                 same_architectural_state(plain, watched);
+    // The LOAD after the loop is the only read
+    watched.reset();
+    watched.load_program(program, 0x8000);
+    watched.remove_watchpoint(0x1001, 0x1001, Memory::WATCH_WRITE);
+    watched.add_watchpoint(0x0F00, 0x10FF, Memory::WATCH_READ);
+    watched.run(CPU::UNLIMITED_CYCLES);
+    watches_ok = watches_ok &&
+                 watched.get_stop().reason == CPU::StopReason::Watchpoint &&
+                 !watched.get_stop().write &&
+                 watched.get_stop().address == 0x1000 &&
+                 watched.get_registers().get_pc() == 0x801A;
+
+    CPU::BreakCondition condition;
+    condition.operand = CPU::BreakCondition::Operand::R1;
+    condition.compare = CPU::BreakCondition::Compare::Eq;
+    condition.value = 7;
+    CPU conditional;
+    conditional.set_engine(engine);
+    conditional.load_program(program, 0x8000);
+    conditional.add_breakpoint(0x8014, condition);
+    conditional.run(CPU::UNLIMITED_CYCLES);
+    bool stopped = !conditional.is_halted() &&
+                   conditional.get_registers().get_gpr(1) == 7;
+    conditional.remove_breakpoint(0x8014);
+    conditional.run(CPU::UNLIMITED_CYCLES);
+    conditions_ok = conditions_ok && stopped && conditional.is_halted() &&
+                    same_architectural_state(plain, conditional);
+  }
+  test_assert(breaks_ok, "Stops: Breakpoint hits match stepping in every "
+                         "engine, fused pairs included");
+  test_assert(watches_ok, "Stops: Watchpoints stop after the accessing "
+                          "instruction in every engine");
+  test_assert(conditions_ok,
+              "Stops: Conditional breakpoints stop only when they hold");
+
+  CPU disabled;
+  disabled.set_engine(CPU::Engine::Fast);
+  disabled.load_program(program, 0x8000);
+  disabled.add_breakpoint(0x8014);
+  disabled.add_watchpoint(0x1000, 0x1001, Memory::WATCH_ACCESS);
+  disabled.set_stops_enabled(false);
+  disabled.run(CPU::UNLIMITED_CYCLES);
+  test_assert(disabled.is_halted() && same_architectural_state(plain, disabled),
+              "Stops: Disabled stops never interrupt a run");
+}
+
+void test_gdb_stub() {
+  CPU cpu;
+  cpu.set_engine(CPU::Engine::Fast);
+  cpu.load_program(make_engine_workload(), 0x8000);
+  ReplayDebugger debugger(cpu, 64);
+  GdbStub stub(debugger);
+
+  test_assert(GdbStub::frame("OK") == "$OK#9a" &&
+                  stub.handle_packet("qSupported:swbreak+").find(
+                      "ReverseContinue+") != std::string::npos &&
+                  stub.handle_packet("qXfer:features:read:target.xml:0,20")
+                          .rfind("m<?xml", 0) == 0 &&
+                  stub.handle_packet("vMustReplyEmpty").empty(),
+              "GDB: Framing, features and unsupported packets");
+  test_assert(stub.handle_packet("?") == "S05" &&
+                  stub.handle_packet("g").size() == 28 &&
+                  stub.handle_packet("g").substr(20, 4) == "0080" &&
+                  stub.handle_packet("p5") == "0080",
+              "GDB: Registers in target byte order");
+
+  bool breaks = stub.handle_packet("Z0,8014,2") == "OK" &&
+                stub.handle_packet("c") == "S05" &&
+                cpu.get_registers().get_pc() == 0x8014;
+  uint64_t first_hit = debugger.cycle();
+  breaks = breaks && stub.handle_packet("c") == "S05" &&
+           debugger.cycle() > first_hit &&
+           stub.handle_packet("bc") == "S05" && debugger.cycle() == first_hit;
+  test_assert(breaks && stub.handle_packet("z0,8014,2") == "OK" &&
+                  cpu.breakpoints().empty(),
+              "GDB: Breakpoints, continue and reverse continue");
+
+  bool watch = stub.handle_packet("Z2,1000,2") == "OK" &&
+               stub.handle_packet("c") == "T05watch:1000;" &&
+               stub.handle_packet("m1000,2") ==
+                   [&]() {
+                     uint16_t value = cpu.get_registers().get_gpr(0);
+                     char hex[5];
+                     std::snprintf(hex, sizeof(hex), "%02x%02x", value & 0xFF,
+                                   value >> 8);
+                     return std::string(hex);
+                   }() &&
+               stub.handle_packet("z2,1000,2") == "OK";
+  test_assert(watch, "GDB: Write watchpoints report the watched address");
+
+  uint64_t before = debugger.cycle();
+  test_assert(stub.handle_packet("s") == "S05" &&
+                  debugger.cycle() == before + 1 &&
+                  stub.handle_packet("bs") == "S05" &&
+                  debugger.cycle() == before,
+              "GDB: Step and reverse step");
+
+  test_assert(stub.handle_packet("M2000,2:3412") == "OK" &&
+                  cpu.get_memory().peek(0x2000) == 0x34 &&
+                  stub.handle_packet("P1=cdab") == "OK" &&
+                  cpu.get_registers().get_gpr(1) == 0xABCD &&
+                  stub.handle_packet("p1") == "cdab" &&
+                  stub.handle_packet("mzz,2") == "E01",
+              "GDB: Memory and register writes");
+
+  stub.handle_packet("P1=0000");
+  test_assert(stub.handle_packet("c") == "W00" && cpu.is_halted(),
+              "GDB: Continue to HALT reports the exit");
+
+  CPU spin;
+  spin.set_engine(CPU::Engine::Fast);
+  spin.load_program(make_spin_program(), 0x8000);
+  ReplayDebugger spin_debugger(spin);
+  GdbStub spin_stub(spin_debugger);
+  spin_stub.set_interrupt_check([]() { return true; });
+  test_assert(spin_stub.handle_packet("c") == "S02" &&
+                  spin_debugger.cycle() == GdbStub::POLL_CYCLES &&
+                  spin_stub.handle_packet("D") == "OK" && spin_stub.finished(),
+              "GDB: Interrupt stops a running target");
+}
+
 int main() {
   std::cout << "=== CPU Instruction Tests ===" << std::endl << std::endl;
 
@@ -259,6 +1715,30 @@ int main() {
   test_push_pop();
   test_call_ret();
   test_load_store();
+  test_self_modifying_code();
+  test_fast_engine_matches_reference();
+  test_fused_pairs();
+  test_jit_engine_matches_reference();
+  test_traced_memory_writes();
+  test_binary_trace_export();
+  test_trace_index();
+  test_async_trace_writer();
+  test_windowed_and_sampled_tracing();
+  test_cycle_budget();
+  test_batch_runner();
+  test_shared_program_images();
+  test_snapshot_and_fork();
+  test_replay_debugger();
+  test_breakpoints_and_watchpoints();
+  test_gdb_stub();
+  test_profiler();
+  test_perf_counters();
+  test_timer_spin_fast_forward();
+  test_device_events_across_engines();
+  test_dma_across_engines();
+  test_traced_dma_burst();
+  test_trace_index_after_dma_burst();
+  test_lockstep_engine();
 
   std::cout << std::endl << "=== All CPU Tests Passed! ===" << std::endl;
   return 0;
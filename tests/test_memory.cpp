@@ -1,6 +1,10 @@
 #include "../src/emulator/memory.hpp"
 #include <cassert>
+#include <cstdio>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
 #include <vector>
 
 // Test helper
@@ -63,6 +67,75 @@ void test_program_loading() {
   test_assert(mem.read_byte(0x8004) == 0x05, "Program: Byte 4 loaded");
 }
 
+void test_program_image() {
+  char path[] = "/tmp/program_image_XXXXXX";
+  int fd = mkstemp(path);
+  std::vector<uint8_t> bytes(300);
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytes[i] = static_cast<uint8_t>(i * 7 + 1);
+  test_assert(fd >= 0 && write(fd, bytes.data(), bytes.size()) ==
+                             static_cast<ssize_t>(bytes.size()),
+              "Image: Program file written");
+  close(fd);
+
+  auto image = ProgramImage::open(path, true);
+  test_assert(image->size() == bytes.size() && image->fd() >= 0 &&
+                  image->bytes() == bytes,
+              "Image: File is mapped with its contents");
+  auto closed = ProgramImage::open(path);
+  test_assert(closed->fd() < 0 && closed->bytes() == bytes,
+              "Image: Descriptor closed unless kept for sharing");
+
+  Memory a, b;
+  b.write_byte(0x8000 + 400, 0x55);
+  bool aligned = 0x8000 % HostPages::host_page_size() == 0;
+  bool shared_a = a.load_program(*image, 0x8000, true);
+  bool shared_b = b.load_program(*image, 0x8000, true);
+  test_assert(shared_a == aligned && shared_b == aligned,
+              "Image: Pages are shared when the start is host-page aligned");
+  bool same = true;
+  for (size_t i = 0; i < bytes.size(); ++i)
+    same = same && a.read_byte(static_cast<uint16_t>(0x8000 + i)) == bytes[i] &&
+           b.read_byte(static_cast<uint16_t>(0x8000 + i)) == bytes[i];
+  test_assert(same, "Image: Both memories see the program");
+  test_assert(!aligned || b.read_byte(0x8000 + 400) == 0,
+              "Image: Rest of the last shared page reads as zero");
+  test_assert(a.is_page_dirty(0x80) && a.is_page_dirty(0x81),
+              "Image: Loaded pages are dirty");
+
+  a.write_byte(0x8001, 0xEE);
+  test_assert(a.read_byte(0x8001) == 0xEE && b.read_byte(0x8001) == bytes[1] &&
+                  image->data()[1] == bytes[1],
+              "Image: Writes to a shared page stay private");
+
+  auto snap = a.snapshot();
+  a.write_word(0x8010, 0x1234);
+  a.restore(snap);
+  test_assert(a.read_byte(0x8010) == bytes[0x10] && a.read_byte(0x8001) == 0xEE,
+              "Image: Snapshots work on shared pages");
+
+  Memory c;
+  test_assert(!c.load_program(*image, 0x8002, true) &&
+                  c.read_byte(0x8002) == bytes[0] &&
+                  c.read_byte(0x8002 + 299) == bytes[299],
+              "Image: Unaligned start falls back to a copy");
+
+  auto in_memory = ProgramImage::from_bytes({0x01, 0x02});
+  Memory d;
+  test_assert(in_memory->fd() < 0 && !d.load_program(*in_memory, 0x8000, true) &&
+                  d.read_word(0x8000) == 0x0201,
+              "Image: In-memory images are copied");
+  std::remove(path);
+
+  bool threw = false;
+  try {
+    ProgramImage::open("/nonexistent/program.bin");
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  test_assert(threw, "Image: Missing file throws");
+}
+
 // test_io_addresses removed as is_io_address is private
 // I/O functionality is tested via read/write operations in other tests
 
@@ -114,6 +187,137 @@ void test_output_callback() {
   test_assert(output_buffer[1] == 'i', "Output: Second character is 'i'");
 }
 
+void test_console() {
+  Memory mem;
+
+  // Default sink: buffered until flushed (no newline in the output)
+  std::ostringstream captured;
+  std::streambuf *saved = std::cout.rdbuf(captured.rdbuf());
+  mem.write_byte(0xF000, 'o');
+  mem.write_byte(0xF000, 'k');
+  bool held = captured.str().empty();
+  mem.flush_devices();
+  std::cout.rdbuf(saved);
+  test_assert(held && captured.str() == "ok",
+              "Console: Output is buffered until flushed");
+
+  // Pre-read input: bytes in order, then EOF; reads never block
+  mem.console().set_input("hi");
+  test_assert(mem.read_byte(0xF002) == Console::STATUS_INPUT_READY &&
+                  mem.read_byte(0xF001) == 'h' && mem.read_byte(0xF001) == 'i',
+              "Console: Pre-read input is returned byte by byte");
+  test_assert(mem.read_byte(0xF002) == Console::STATUS_INPUT_EOF &&
+                  mem.read_byte(0xF001) == 0,
+              "Console: Exhausted input reports EOF");
+
+  // Pipe source: not ready until the writer sends, EOF once it closes
+  int fds[2];
+  test_assert(pipe(fds) == 0, "Console: Pipe created");
+  mem.console().set_input_fd(fds[0]);
+  bool idle = mem.read_byte(0xF002) == 0 && mem.read_byte(0xF001) == 0;
+  test_assert(write(fds[1], "x", 1) == 1, "Console: Pipe written");
+  bool ready = mem.read_byte(0xF002) == Console::STATUS_INPUT_READY &&
+               mem.read_byte(0xF001) == 'x';
+  close(fds[1]);
+  bool eof = mem.read_byte(0xF002) == Console::STATUS_INPUT_EOF;
+  close(fds[0]);
+  test_assert(idle && ready && eof,
+              "Console: Pipe input is polled without blocking");
+
+  // File source
+  char path[] = "/tmp/console_input_XXXXXX";
+  int fd = mkstemp(path);
+  test_assert(fd >= 0 && write(fd, "42", 2) == 2, "Console: Input file written");
+  close(fd);
+  mem.console().open_input(path);
+  test_assert(mem.read_byte(0xF001) == '4' && mem.read_byte(0xF001) == '2' &&
+                  mem.read_byte(0xF002) == Console::STATUS_INPUT_EOF,
+              "Console: File input is read to EOF");
+  std::remove(path);
+}
+
+// Programs the DMA registers with word stores, as a guest would
+void dma_start(Memory &mem, uint16_t src, uint16_t dst, uint16_t len,
+               uint8_t command) {
+  mem.write_word(Dma::SRC, src);
+  mem.write_word(Dma::DST, dst);
+  mem.write_word(Dma::LEN, len);
+  mem.write_word(Dma::CONTROL, command);
+}
+
+void test_dma() {
+  Memory mem;
+  for (uint16_t i = 0; i < 300; ++i)
+    mem.write_byte(static_cast<uint16_t>(0x1000 + i), static_cast<uint8_t>(i));
+
+  dma_start(mem, 0x1000, 0x3000, 300, Dma::COMMAND_COPY);
+  bool copied = mem.read_byte(Dma::CONTROL) == 0;
+  for (uint16_t i = 0; i < 300; ++i)
+    copied = copied && mem.read_byte(static_cast<uint16_t>(0x3000 + i)) ==
+                           static_cast<uint8_t>(i);
+  test_assert(copied && mem.read_byte(0x312C) == 0,
+              "DMA: Copy moves exactly LEN bytes");
+
+  // Overlapping copy forward by one byte behaves like memmove
+  dma_start(mem, 0x1000, 0x1001, 4, Dma::COMMAND_COPY);
+  test_assert(mem.read_byte(0x1001) == 0 && mem.read_byte(0x1004) == 3,
+              "DMA: Overlapping copy has memmove semantics");
+
+  mem.write_byte(Dma::FILL, 0xAB);
+  dma_start(mem, 0, 0x5000, 16, Dma::COMMAND_FILL);
+  test_assert(mem.read_word(0x5000) == 0xABAB && mem.read_byte(0x500F) == 0xAB &&
+                  mem.read_byte(0x5010) == 0,
+              "DMA: Fill writes the fill byte");
+
+  // Ranges crossing a region boundary or into IO are refused untouched
+  dma_start(mem, 0x1000, 0x7FF0, 0x20, Dma::COMMAND_COPY);
+  bool refused = mem.read_byte(Dma::CONTROL) == Dma::STATUS_ERROR &&
+                 mem.read_byte(0x7FF1) == 0;
+  dma_start(mem, 0xEFF0, 0x2000, 0x40, Dma::COMMAND_COPY);
+  refused = refused && mem.read_byte(Dma::CONTROL) == Dma::STATUS_ERROR;
+  dma_start(mem, 0x1000, 0xFFF0, 0x20, Dma::COMMAND_FILL);
+  test_assert(refused && mem.read_byte(Dma::CONTROL) == Dma::STATUS_ERROR,
+              "DMA: Transfers outside one RAM/program region fail");
+
+  // Program-region writes are reported for decode invalidation, and
+  // traced writes are reported byte by byte
+  std::vector<uint16_t> code_writes;
+  mem.set_code_write_callback(
+      [&code_writes](uint16_t addr) { code_writes.push_back(addr); });
+  int traced = 0;
+  mem.set_trace_callback([&traced](uint16_t, uint8_t, uint8_t) { ++traced; });
+  dma_start(mem, 0x1000, 0x9000, 8, Dma::COMMAND_COPY);
+  test_assert(code_writes.size() == 8 && code_writes[7] == 0x9007 &&
+                  traced == 8,
+              "DMA: Code-write and trace callbacks see every byte");
+  mem.set_trace_callback(nullptr);
+
+  // Modeled cost: busy until the completion event, then the data lands
+  mem.dma().set_cycles_per_word(2);
+  dma_start(mem, 0x1000, 0x6000, 10, Dma::COMMAND_COPY); // 5 words, 10 cycles
+  bool busy = mem.read_byte(Dma::CONTROL) == Dma::STATUS_BUSY &&
+              mem.read_byte(0x6001) == 0 && mem.cycles_until_event() == 10;
+  auto in_flight = mem.snapshot();
+  mem.write_word(Dma::CONTROL, Dma::COMMAND_FILL);
+  bool rejected = mem.read_byte(Dma::CONTROL) ==
+                  (Dma::STATUS_BUSY | Dma::STATUS_ERROR);
+  mem.tick(9);
+  bool still_busy = mem.read_byte(0x6001) == 0;
+  mem.tick();
+  test_assert(busy && rejected && still_busy &&
+                  mem.read_byte(0x6001) == 0 && mem.read_byte(0x6002) == 1 &&
+                  !(mem.read_byte(Dma::CONTROL) & Dma::STATUS_BUSY),
+              "DMA: Cycle cost delays completion on the scheduler");
+
+  // A snapshot taken mid-transfer resumes the transfer after restore
+  mem.restore(in_flight);
+  test_assert(mem.read_byte(0x6002) == 0 && mem.cycles_until_event() == 10,
+              "DMA: Snapshot keeps the transfer in flight");
+  mem.tick(10);
+  test_assert(mem.read_byte(0x6002) == 1,
+              "DMA: Restored transfer completes");
+}
+
 void test_memory_boundaries() {
   Memory mem;
 
@@ -128,16 +332,180 @@ void test_memory_boundaries() {
   test_assert(mem.read_byte(0xFFFF) == 0xBB, "Boundary: Write at 0xFFFF");
 }
 
+void test_word_fast_path() {
+  Memory mem;
+
+  test_assert(mem.page_attributes(0x7FFF) == Memory::PAGE_RAM &&
+                  mem.page_attributes(0x8000) == Memory::PAGE_PROGRAM &&
+                  mem.page_attributes(0xF0FF) == Memory::PAGE_IO &&
+                  mem.page_attributes(0xF100) == Memory::PAGE_RESERVED,
+              "Fast path: Page attributes follow the memory map");
+
+  // Unaligned word spanning RAM and program pages
+  mem.write_word(0x7FFF, 0xBEEF);
+  test_assert(mem.read_byte(0x7FFF) == 0xEF && mem.read_byte(0x8000) == 0xBE,
+              "Fast path: Unaligned word stored little-endian");
+  test_assert(mem.read_word(0x7FFF) == 0xBEEF,
+              "Fast path: Unaligned word read back");
+
+  // A word ending in the IO page must still reach the device
+  std::vector<uint8_t> output_buffer;
+  mem.set_output_callback(
+      [&output_buffer](uint8_t value) { output_buffer.push_back(value); });
+  mem.write_word(0xEFFF, 0x4100);
+  test_assert(output_buffer.size() == 1 && output_buffer[0] == 'A',
+              "Fast path: Word straddling IO page hits output port");
+
+  // Code writes are reported for both bytes; trace only when installed
+  std::vector<uint16_t> code_writes;
+  mem.set_code_write_callback(
+      [&code_writes](uint16_t addr) { code_writes.push_back(addr); });
+  mem.write_word(0x9000, 0x1234);
+  mem.write_word(0x1000, 0x1234);
+  test_assert(code_writes.size() == 2 && code_writes[0] == 0x9000 &&
+                  code_writes[1] == 0x9001,
+              "Fast path: Code write callback fired per program byte");
+
+  int traced = 0;
+  mem.set_trace_callback(
+      [&traced](uint16_t, uint8_t, uint8_t) { ++traced; });
+  mem.write_word(0x2000, 0x5678);
+  test_assert(traced == 2 && mem.read_word(0x2000) == 0x5678,
+              "Fast path: Traced writes still report each byte");
+
+  // Word at 0xFFFF wraps to address 0
+  mem.write_word(0xFFFF, 0xA55A);
+  test_assert(mem.read_byte(0xFFFF) == 0x5A && mem.read_byte(0x0000) == 0xA5,
+              "Fast path: Word at 0xFFFF wraps to 0x0000");
+}
+
+void test_snapshot_restore() {
+  Memory mem;
+  mem.write_word(0x1000, 0x1111);
+  auto base = mem.snapshot();
+  test_assert(mem.dirty_page_count() == 0,
+              "Snapshot: No dirty pages right after a snapshot");
+
+  mem.write_word(0x1000, 0x2222);
+  mem.write_byte(0x20FF, 0x33);
+  test_assert(mem.dirty_page_count() == 2 && mem.is_page_dirty(0x10) &&
+                  mem.is_page_dirty(0x20),
+              "Snapshot: Writes mark their 256-byte page dirty");
+
+  auto next = mem.snapshot();
+  test_assert(next->pages[0x30] == base->pages[0x30] &&
+                  next->pages[0x10] != base->pages[0x10],
+              "Snapshot: Clean pages are shared, dirty pages copied");
+
+  mem.restore(base);
+  test_assert(mem.read_word(0x1000) == 0x1111 && mem.read_byte(0x20FF) == 0,
+              "Snapshot: Restore brings back the earlier contents");
+  mem.restore(next);
+  test_assert(mem.read_word(0x1000) == 0x2222 && mem.read_byte(0x20FF) == 0x33,
+              "Snapshot: Restore can move forward to a later snapshot");
+
+  // Timer state is part of the snapshot
+  mem.write_byte(0xF011, 1);
+  mem.tick(5);
+  auto running = mem.snapshot();
+  mem.tick(100);
+  mem.restore(running);
+  test_assert(mem.is_timer_running() && mem.get_timer_counter() == 5,
+              "Snapshot: Timer state restored");
+
+  Memory other;
+  other.restore(next);
+  test_assert(other.read_word(0x1000) == 0x2222,
+              "Snapshot: Restore into a fresh Memory copies everything");
+}
+
+// Counts its events and reschedules itself every `period` cycles
+class PeriodicDevice : public Device {
+public:
+  PeriodicDevice(DeviceScheduler &scheduler, uint64_t period)
+      : scheduler_(scheduler), period_(period) {}
+
+  uint8_t read(uint16_t) override { return static_cast<uint8_t>(events); }
+  void write(uint16_t, uint8_t value) override {
+    if (value)
+      scheduler_.schedule(this, scheduler_.now() + period_);
+    else
+      scheduler_.cancel(this);
+  }
+  void on_event(uint64_t cycle) override {
+    ++events;
+    fired_at.push_back(cycle);
+    scheduler_.schedule(this, cycle + period_);
+  }
+
+  uint64_t events = 0;
+  std::vector<uint64_t> fired_at;
+
+private:
+  DeviceScheduler &scheduler_;
+  uint64_t period_;
+};
+
+void test_device_scheduler() {
+  Memory mem;
+  PeriodicDevice fast(mem.scheduler(), 3), slow(mem.scheduler(), 5);
+  mem.attach_device(&fast, 0xF030, 0xF030);
+  mem.attach_device(&slow, 0xF031, 0xF031);
+
+  test_assert(mem.cycles_until_event() == DeviceScheduler::NO_EVENT,
+              "Scheduler: No pending event by default");
+  mem.write_byte(0xF030, 1);
+  mem.write_byte(0xF031, 1);
+  test_assert(mem.cycles_until_event() == 3,
+              "Scheduler: Next event is the earliest posted");
+
+  for (int i = 0; i < 14; ++i)
+    mem.tick();
+  test_assert(fast.fired_at == std::vector<uint64_t>({3, 6, 9, 12}) &&
+                  slow.fired_at == std::vector<uint64_t>({5, 10}),
+              "Scheduler: Events fire on their cycle, in order");
+  test_assert(mem.read_byte(0xF030) == 4 && mem.read_byte(0xF031) == 2,
+              "Scheduler: Ports route to attached devices");
+
+  // A batched advance dispatches everything that came due, in cycle order
+  mem.tick(10);
+  test_assert(fast.fired_at.back() == 24 && slow.fired_at.back() == 20 &&
+                  mem.cycles_until_event() == 1,
+              "Scheduler: Batched advance catches up on due events");
+
+  mem.write_byte(0xF030, 0);
+  mem.tick(20);
+  test_assert(fast.events == 8 && slow.events == 8,
+              "Scheduler: Cancelled device stops receiving events");
+
+  // The timer reads off the same clock without posting events
+  mem.write_byte(0xF031, 0);
+  mem.write_byte(0xF011, 1);
+  mem.tick(300);
+  test_assert(mem.get_timer_counter() == 300 &&
+                  mem.cycles_until_event() == DeviceScheduler::NO_EVENT,
+              "Scheduler: Timer counts from the clock without events");
+  mem.attach_device(&fast, 0xF010, 0xF011);
+  test_assert(!mem.has_builtin_timer() && mem.read_byte(0xF010) == 8,
+              "Scheduler: A device can replace the timer ports");
+}
+
 int main() {
   std::cout << "=== Memory Unit Tests ===" << std::endl << std::endl;
 
   test_byte_operations();
   test_word_operations();
   test_program_loading();
+  test_program_image();
   // test_io_addresses(); // Removed
   test_timer_functionality();
+  test_device_scheduler();
   test_output_callback();
+  test_console();
+  test_dma();
   test_memory_boundaries();
+  test_word_fast_path();
+  test_snapshot_restore();
 
   std::cout << std::endl << "=== All Memory Tests Passed! ===" << std::endl;
   return 0;
@@ -5,9 +5,21 @@ let isPlaying = false;
 let playInterval = null;
 let playSpeed = 1000; // milliseconds between cycles
 
+// Server mode (software-cpu trace-serve): the trace stays on the server and
+// only the displayed cycles are fetched
+const WINDOW_CYCLES = 512;      // Records fetched per /api/cycles request
+const STACK_WINDOW_START = 0x7001; // Memory fetched for the stack view
+const STACK_WINDOW_LENGTH = 0x1000;
+let server = null;              // /api/info answer, null in file mode
+let windowStart = 0;            // Cycle of windowEntries[0]
+let windowEntries = [];
+let windowRequested = -1;       // Start of the window being fetched
+let stateInFlight = false;
+let wantedCycle = -1;           // Latest cycle whose state is wanted
+
 // Initialize application
 document.addEventListener('DOMContentLoaded', () => {
-  loadTraceList();
+  detectServer();
 
   // Setup Back Button
   document.getElementById('back-btn').addEventListener('click', () => {
@@ -94,14 +106,63 @@ document.addEventListener('DOMContentLoaded', () => {
     }
   });
 
-  // Check URL params for direct link
-  const params = new URLSearchParams(window.location.search);
-  const traceFile = params.get('trace');
-  if (traceFile) {
-    loadTrace(traceFile);
-  }
 });
 
+// Use the trace server if the page came from one, else the file manifest
+function detectServer() {
+  fetch('api/info')
+    .then(response => {
+      if (!response.ok) throw new Error('No trace server');
+      return response.json();
+    })
+    .then(info => loadServerTrace(info))
+    .catch(() => {
+      loadTraceList();
+
+      // Check URL params for direct link
+      const params = new URLSearchParams(window.location.search);
+      const traceFile = params.get('trace');
+      if (traceFile) {
+        loadTrace(traceFile, traceFile.replace('.json', ''));
+      }
+    });
+}
+
+function totalCycles() {
+  return server ? server.cycles : trace.length;
+}
+
+function showViewer(displayName) {
+  currentCycle = 0;
+  document.getElementById('trace-selection').classList.add('hidden');
+  document.getElementById('viewer-container').classList.remove('hidden');
+  document.getElementById('current-trace-name').textContent = displayName;
+
+  // Setup Slider
+  const maxCycle = Math.max(0, totalCycles() - 1);
+  document.getElementById('slider').max = maxCycle;
+  document.getElementById('slider').value = 0;
+
+  // Update stats
+  document.getElementById('total-cycles').textContent = `Total Cycles: ${totalCycles()}`;
+  updateProgress();
+}
+
+function loadServerTrace(info) {
+  server = info;
+  showViewer('Trace Server');
+  document.getElementById('back-btn').classList.add('hidden');
+
+  fetch('api/map')
+    .then(r => (r.ok ? r.json() : []))
+    .catch(() => [])
+    .then(map => {
+      sourceMap = map;
+      renderCodeView();
+      render(0);
+    });
+}
+
 // Fetch and display list of available traces
 function loadTraceList() {
   const listContainer = document.getElementById('trace-list');
@@ -155,27 +216,13 @@ function loadTrace(filename, baseName) {
     })
     .then(data => {
       trace = data;
-      currentCycle = 0;
-
-      // Update UI
-      document.getElementById('trace-selection').classList.add('hidden');
-      document.getElementById('viewer-container').classList.remove('hidden');
 
       // Use the base name for consistent display
       const displayName = baseName.replace(/_/g, ' ')
         .split(' ')
         .map(word => word.charAt(0).toUpperCase() + word.slice(1))
         .join(' ');
-      document.getElementById('current-trace-name').textContent = displayName;
-
-      // Setup Slider
-      const maxCycle = Math.max(0, trace.length - 1);
-      document.getElementById('slider').max = maxCycle;
-      document.getElementById('slider').value = 0;
-
-      // Update stats
-      document.getElementById('total-cycles').textContent = `Total Cycles: ${trace.length}`;
-      updateProgress();
+      showViewer(displayName);
 
       // Update URL without reloading
       const newUrl = new URL(window.location);
@@ -266,7 +313,7 @@ function startPlayback() {
     // Max speed - use requestAnimationFrame
     const runMaxSpeed = () => {
       if (!isPlaying) return;
-      if (currentCycle < trace.length - 1) {
+      if (currentCycle < totalCycles() - 1) {
         goToNext();
         requestAnimationFrame(runMaxSpeed);
       } else {
@@ -277,7 +324,7 @@ function startPlayback() {
   } else {
     // Normal speed with interval
     playInterval = setInterval(() => {
-      if (currentCycle < trace.length - 1) {
+      if (currentCycle < totalCycles() - 1) {
         goToNext();
       } else {
         stopPlayback();
@@ -312,7 +359,7 @@ function goToPrevious() {
 }
 
 function goToNext() {
-  if (currentCycle < trace.length - 1) {
+  if (currentCycle < totalCycles() - 1) {
     currentCycle++;
     document.getElementById('slider').value = currentCycle;
     render(currentCycle);
@@ -320,14 +367,14 @@ function goToNext() {
 }
 
 function goToLast() {
-  currentCycle = trace.length - 1;
+  currentCycle = Math.max(0, totalCycles() - 1);
   document.getElementById('slider').value = currentCycle;
   render(currentCycle);
 }
 
 function updateProgress() {
-  if (trace.length === 0) return;
-  const percent = ((currentCycle / (trace.length - 1)) * 100).toFixed(1);
+  if (totalCycles() === 0) return;
+  const percent = ((currentCycle / Math.max(1, totalCycles() - 1)) * 100).toFixed(1);
   document.getElementById('progress-percent').textContent = `Progress: ${percent}%`;
 }
 
@@ -342,11 +389,90 @@ const MODE_NAMES = [
 ];
 
 function render(idx) {
+  if (server) {
+    renderFromServer(idx);
+    return;
+  }
   if (!trace || !trace[idx]) return;
-  const c = trace[idx];
+  const writes = getAllMemoryWrites(idx);
+  renderCycle(trace[idx], {
+    cumulative: writes,
+    cumulativeTotal: writes.size,
+    readByte: addr => writes.get(addr) || 0
+  });
+}
+
+// Server mode: registers and the instruction come from the cached window
+// of records, memory from /api/state once it answers
+function renderFromServer(idx) {
+  const cycle = server.first_cycle + idx;
+  const entry = windowEntry(cycle);
+  if (entry) renderCycle(entry, null);
+  requestState(cycle);
+}
+
+function windowEntry(cycle) {
+  const offset = cycle - windowStart;
+  if (offset >= 0 && offset < windowEntries.length) return windowEntries[offset];
+
+  // Keep some cycles before the current one for stepping backwards
+  const start = Math.max(server.first_cycle, cycle - WINDOW_CYCLES / 4);
+  if (windowRequested !== start) {
+    windowRequested = start;
+    fetch(`api/cycles?from=${start}&to=${start + WINDOW_CYCLES - 1}`)
+      .then(r => r.json())
+      .then(entries => {
+        if (windowRequested !== start) return; // A newer window was asked for
+        windowStart = start;
+        windowEntries = entries;
+        windowRequested = -1;
+      })
+      .catch(err => {
+        console.error('Error loading cycles:', err);
+        windowRequested = -1;
+      });
+  }
+  return null;
+}
+
+// At most one state request is in flight; answers for cycles the user has
+// already moved past are dropped and the latest cycle is asked for instead
+function requestState(cycle) {
+  wantedCycle = cycle;
+  if (stateInFlight) return;
+  stateInFlight = true;
+  fetch(`api/state?cycle=${cycle}&start=${STACK_WINDOW_START}&length=${STACK_WINDOW_LENGTH}`)
+    .then(r => r.json())
+    .then(state => {
+      stateInFlight = false;
+      if (wantedCycle !== cycle) {
+        requestState(wantedCycle);
+        return;
+      }
+      if (state.error) throw new Error(state.error);
+      const cumulative = new Map(state.changed);
+      const bytes = state.memory.bytes;
+      renderCycle(state.entry, {
+        cumulative,
+        cumulativeTotal: state.changed_total,
+        readByte: addr => {
+          const offset = addr - state.memory.start;
+          if (offset >= 0 && offset < bytes.length) return bytes[offset];
+          return cumulative.get(addr) || 0;
+        }
+      });
+    })
+    .catch(err => {
+      stateInFlight = false;
+      console.error('Error loading state:', err);
+    });
+}
 
+// memory: { cumulative: Map addr -> byte, cumulativeTotal, readByte(addr) },
+// or null to leave the memory panels as they are
+function renderCycle(c, memory) {
   // Update cycle display
-  document.getElementById('cycle').textContent = `Cycle: ${c.cycle} / ${trace.length - 1}`;
+  document.getElementById('cycle').textContent = `Cycle: ${c.cycle} / ${totalCycles() - 1}`;
   updateProgress();
 
   // Registers
@@ -393,35 +519,7 @@ Extra:  ${formatValue(c.instr.extra, 4)}</pre>`;
   // Memory Layout Visualization
   renderMemoryLayout(c);
 
-  // Memory Operations - Show current cycle writes
-  let memHtml = '';
-  if (c.mem_writes && c.mem_writes.length) {
-    memHtml += '<ul>';
-    c.mem_writes.forEach(m => memHtml += `<li>Addr ${formatValue(m.addr, 4)}: ${formatValue(m.old, 2)} → ${formatValue(m.new, 2)}</li>`);
-    memHtml += '</ul>';
-  } else {
-    memHtml += '<p style="color: var(--text-secondary); font-style: italic;">No memory writes this cycle</p>';
-  }
-
-  // Add summary of all memory writes up to this point
-  const allWrites = getAllMemoryWrites(currentCycle);
-  if (allWrites.size > 0) {
-    memHtml += '<div style="margin-top: 15px; padding-top: 15px; border-top: 2px solid var(--border-color);">';
-    memHtml += '<strong>Cumulative Memory State (All Writes):</strong>';
-    memHtml += '<ul style="max-height: 150px; overflow-y: auto;">';
-    const sortedAddrs = Array.from(allWrites.keys()).sort((a, b) => a - b);
-    sortedAddrs.forEach(addr => {
-      const value = allWrites.get(addr);
-      memHtml += `<li>${formatValue(addr, 4)}: ${formatValue(value, 2)}</li>`;
-    });
-    memHtml += '</ul></div>';
-  }
-
-  document.getElementById('mem').innerHTML = memHtml;
-
-  // Stack Memory Visualization
-  renderStackMemory(c);
-
+  if (memory) renderMemory(c, memory);
 
   // Highlight Code
   if (sourceMap.length > 0) {
@@ -457,6 +555,41 @@ Extra:  ${formatValue(c.instr.extra, 4)}</pre>`;
   }
 }
 
+// Memory Operations - Show current cycle writes, then the cumulative state
+function renderMemory(c, memory) {
+  let memHtml = '';
+  if (c.mem_writes && c.mem_writes.length) {
+    memHtml += '<ul>';
+    c.mem_writes.forEach(m => memHtml += `<li>Addr ${formatValue(m.addr, 4)}: ${formatValue(m.old, 2)} → ${formatValue(m.new, 2)}</li>`);
+    memHtml += '</ul>';
+  } else {
+    memHtml += '<p style="color: var(--text-secondary); font-style: italic;">No memory writes this cycle</p>';
+  }
+
+  // Add summary of all memory writes up to this point
+  const allWrites = memory.cumulative;
+  if (allWrites.size > 0) {
+    memHtml += '<div style="margin-top: 15px; padding-top: 15px; border-top: 2px solid var(--border-color);">';
+    memHtml += server ? '<strong>Cumulative Memory State (Changed Bytes):</strong>'
+                      : '<strong>Cumulative Memory State (All Writes):</strong>';
+    if (memory.cumulativeTotal > allWrites.size) {
+      memHtml += ` <small>(first ${allWrites.size} of ${memory.cumulativeTotal})</small>`;
+    }
+    memHtml += '<ul style="max-height: 150px; overflow-y: auto;">';
+    const sortedAddrs = Array.from(allWrites.keys()).sort((a, b) => a - b);
+    sortedAddrs.forEach(addr => {
+      const value = allWrites.get(addr);
+      memHtml += `<li>${formatValue(addr, 4)}: ${formatValue(value, 2)}</li>`;
+    });
+    memHtml += '</ul></div>';
+  }
+
+  document.getElementById('mem').innerHTML = memHtml;
+
+  // Stack Memory Visualization
+  renderStackMemory(c, memory.readByte);
+}
+
 function toHexNumber(v, width = 4) {
   let n = Number(v) & 0xFFFF;
   return '0x' + n.toString(16).padStart(width, '0').toUpperCase();
@@ -597,7 +730,7 @@ function renderMemoryLayout(c) {
 }
 
 // Stack Memory Visualization
-function renderStackMemory(c) {
+function renderStackMemory(c, readByte) {
   const stackView = document.getElementById('stack-view');
   if (!stackView) return;
 
@@ -627,17 +760,14 @@ function renderStackMemory(c) {
       <small style="color: var(--text-secondary);">Stack used: ${stackUsed} bytes</small>
     </div>`;
 
-    // Collect memory writes to build a memory state map
-    const memoryMap = getAllMemoryWrites(currentCycle);
-
     // Display stack entries (word-aligned, 2 bytes per entry)
     html += '<div style="font-family: monospace; font-size: 0.75rem;">';
     let entryCount = 0;
 
     for (let addr = STACK_TOP; addr >= spVal - 10 && entryCount < WINDOW_SIZE; addr -= 2) {
       // Read 16-bit word from memory (big-endian)
-      const highByte = memoryMap.get(addr) || 0;
-      const lowByte = memoryMap.get(addr + 1) || 0;
+      const highByte = readByte(addr);
+      const lowByte = readByte(addr + 1);
       const word = (highByte << 8) | lowByte;
 
       const isSP = (addr === spVal);